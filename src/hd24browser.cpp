@@ -3,6 +3,7 @@
 #include <string>
 #include <cstring>
 #include <sys/stat.h>
+#include <pthread.h>
 
 // Include ncurses first, then undefine conflicting macros
 #include <ncurses.h>
@@ -12,13 +13,15 @@
 // Now include HD24 headers
 #include <hd24fs.h>
 #include <hd24utils.h>
+#include <hd24peaks.h>
 #include <sndfile.h>
+#include <math.h>
 
 using namespace std;
 
+// One row of the song list. Only metadata is kept here; the song
+// itself (with its cache buffers) is opened when it is selected.
 struct SongInfo {
-    hd24project* project;
-    hd24song* song;
     string project_name;
     string song_name;
     __uint32 sample_rate;
@@ -38,6 +41,73 @@ private:
     SongInfo* selected_song_info;
     string export_dir;
     int scroll_offset; // For scrolling in song list
+    hd24peaks* overview; // peaks of the selected song, if any
+
+    // The song list is filled in by a background thread, so that the
+    // first screen shows up right away even on a full drive.
+    // fs_lock serializes all file system access, list_lock guards
+    // songs and the loading state.
+    pthread_t list_thread;
+    pthread_mutex_t fs_lock;
+    pthread_mutex_t list_lock;
+    bool list_thread_started;
+    volatile bool list_loading;
+    volatile bool list_cancel;
+    SongInfo selected_info;
+    hd24project* selected_project;
+    hd24song* selected_song;
+
+    static void overview_progress(__uint64 samplesdone, __uint64 samplestotal) {
+        int percent = (samplestotal > 0) ? (int)((samplesdone * 100) / samplestotal) : 100;
+        mvprintw(2, 0, "Progress: %d%%    ", percent);
+        refresh();
+    }
+
+    void make_overview() {
+        if (overview == NULL) return;
+        clear();
+        mvprintw(0, 0, "Reading song to build track overview...");
+        refresh();
+        pthread_mutex_lock(&fs_lock);
+        if (overview->generate(NULL, overview_progress)) {
+            overview->save();
+        }
+        pthread_mutex_unlock(&fs_lock);
+    }
+
+    void draw_overview(int row, int col, int width, __uint32 tracknum) {
+        /* Draws a track as one character per column, by level. */
+        static const char levelchars[] = " .:-=+*#%@";
+        if ((overview == NULL) || (!overview->valid()) || (width <= 0)) return;
+        __uint32 songlen = selected_song->songlength_in_wamples()
+                         * selected_song->chanmult();
+        __uint32 samplesperchar = (songlen + width - 1) / width;
+        int level = overview->bestlevel(samplesperchar);
+        hd24peak* peaks = overview->trackpeaks(level, tracknum);
+        __uint32 count = overview->count(level);
+        __uint32 perpeak = overview->samplesperpeak(level);
+        if ((peaks == NULL) || (samplesperchar == 0)) return;
+        for (int x = 0; x < width; x++) {
+            __uint32 first = ((__uint32)x * samplesperchar) / perpeak;
+            __uint32 last = (((__uint32)x + 1) * samplesperchar - 1) / perpeak;
+            if (first >= count) break;
+            if (last >= count) last = count - 1;
+            int peak = 0;
+            for (__uint32 i = first; i <= last; i++) {
+                if (-peaks[i].min > peak) peak = -peaks[i].min;
+                if (peaks[i].max > peak) peak = peaks[i].max;
+            }
+            int charnum = 0;
+            if (peak > 0) {
+                // -60..0 dBFS over the remaining characters
+                double db = 20.0 * log10((double)peak / 32768.0);
+                charnum = 1 + (int)((db + 60.0) * 9.0 / 60.0);
+                if (charnum < 1) charnum = (db > -90.0) ? 1 : 0;
+                if (charnum > 9) charnum = 9;
+            }
+            mvaddch(row, col + x, levelchars[charnum]);
+        }
+    }
 
     void ensure_directory_exists(const char* path) {
         struct stat st = {0};
@@ -46,48 +116,120 @@ private:
         }
     }
 
-    void list_all_songs() {
-        songs.clear();
+    static void* list_worker(void* arg) {
+        ((HD24Browser*)arg)->list_all_songs();
+        return NULL;
+    }
 
+    void list_all_songs() {
+        /* Runs on the list thread. Songs are opened one at a time,
+           just long enough to read their metadata. */
+        pthread_mutex_lock(&fs_lock);
         __uint32 projcount = fs->projectcount();
-        for (__uint32 i = 1; i <= projcount; i++) {
+        pthread_mutex_unlock(&fs_lock);
+        for (__uint32 i = 1; (i <= projcount) && (!list_cancel); i++) {
+            pthread_mutex_lock(&fs_lock);
             hd24project* proj = fs->getproject(i);
-            if (proj != NULL) {
-                string* proj_name = proj->projectname();
-                __uint32 songcount = proj->songcount();
-
-                for (__uint32 j = 1; j <= songcount; j++) {
-                    hd24song* song = proj->getsong(j);
-                    if (song != NULL) {
-                        SongInfo info;
-                        info.project = proj;
-                        info.song = song;
-                        info.project_name = *proj_name;
-
-                        string* sname = song->songname();
-                        info.song_name = *sname;
-                        delete sname;
-
-                        info.sample_rate = song->samplerate();
-                        info.channels = song->physical_channels();
-
-                        string* dur = song->display_duration();
-                        info.duration = *dur;
-                        delete dur;
-
-                        info.project_id = i;
-                        info.song_id = j;
-
-                        songs.push_back(info);
-                    }
+            if (proj == NULL) {
+                pthread_mutex_unlock(&fs_lock);
+                continue;
+            }
+            string* proj_name = proj->projectname();
+            __uint32 songcount = proj->songcount();
+            pthread_mutex_unlock(&fs_lock);
+
+            for (__uint32 j = 1; (j <= songcount) && (!list_cancel); j++) {
+                pthread_mutex_lock(&fs_lock);
+                hd24song* song = proj->getsong(j);
+                if (song == NULL) {
+                    pthread_mutex_unlock(&fs_lock);
+                    continue;
                 }
-                delete proj_name;
+                SongInfo info;
+                info.project_name = *proj_name;
+
+                string* sname = song->songname();
+                info.song_name = *sname;
+                delete sname;
+
+                info.sample_rate = song->samplerate();
+                info.channels = song->physical_channels();
+
+                char dur[DURATIONSIZE];
+                info.duration = song->display_duration(dur);
+
+                info.project_id = i;
+                info.song_id = j;
+                delete song;
+                pthread_mutex_unlock(&fs_lock);
+
+                pthread_mutex_lock(&list_lock);
+                songs.push_back(info);
+                pthread_mutex_unlock(&list_lock);
             }
+            pthread_mutex_lock(&fs_lock);
+            delete proj;
+            pthread_mutex_unlock(&fs_lock);
+            delete proj_name;
         }
+        pthread_mutex_lock(&list_lock);
+        list_loading = false;
+        pthread_mutex_unlock(&list_lock);
+    }
+
+    void start_listing() {
+        list_loading = true;
+        list_cancel = false;
+        list_thread_started = (pthread_create(&list_thread, NULL, list_worker, (void*)this) == 0);
+        if (!list_thread_started) {
+            list_all_songs(); // no thread- list in the foreground
+        }
+    }
+
+    void stop_listing() {
+        if (!list_thread_started) return;
+        list_cancel = true;
+        pthread_join(list_thread, NULL);
+        list_thread_started = false;
+    }
+
+    bool open_selected_song() {
+        /* Opens the full song object for the track selection screen. */
+        pthread_mutex_lock(&fs_lock);
+        selected_project = fs->getproject(selected_info.project_id);
+        if (selected_project != NULL) {
+            selected_song = selected_project->getsong(selected_info.song_id);
+        }
+        pthread_mutex_unlock(&fs_lock);
+        if (selected_song == NULL) {
+            close_selected_song();
+            return false;
+        }
+        selected_song_info = &selected_info;
+        return true;
+    }
+
+    void close_selected_song() {
+        pthread_mutex_lock(&fs_lock);
+        if (overview != NULL) {
+            delete overview;
+            overview = NULL;
+        }
+        if (selected_song != NULL) {
+            delete selected_song;
+            selected_song = NULL;
+        }
+        if (selected_project != NULL) {
+            delete selected_project;
+            selected_project = NULL;
+        }
+        pthread_mutex_unlock(&fs_lock);
+        selected_song_info = NULL;
     }
 
     void draw_song_list() {
-        clear();
+        erase(); // not clear(), which repaints the whole screen as rows come in
+        pthread_mutex_lock(&list_lock);
         int max_y, max_x;
         getmaxyx(stdscr, max_y, max_x);
 
@@ -152,8 +294,14 @@ private:
         printw(": Quit");
 
         // Show song count
-        mvprintw(instr_row + 2, 0, "Total songs: %d  |  Selected: %d of %d",
-                (int)songs.size(), current_selection + 1, (int)songs.size());
+        if (list_loading) {
+            mvprintw(instr_row + 2, 0, "Loading songs... %d so far  |  Selected: %d",
+                    (int)songs.size(), current_selection + 1);
+        } else {
+            mvprintw(instr_row + 2, 0, "Total songs: %d  |  Selected: %d of %d",
+                    (int)songs.size(), current_selection + 1, (int)songs.size());
+        }
+        pthread_mutex_unlock(&list_lock);
 
         refresh();
     }
@@ -192,6 +340,7 @@ private:
             if ((int)i == current_selection) {
                 attroff(A_REVERSE | COLOR_PAIR(2));
             }
+            draw_overview(4 + i, 14, max_x - 15, i + 1);
         }
 
         // Count selected tracks
@@ -224,6 +373,11 @@ private:
         attroff(COLOR_PAIR(3));
         printw(": Export  ");
 
+        attron(COLOR_PAIR(3));
+        printw("O");
+        attroff(COLOR_PAIR(3));
+        printw(": Overview  ");
+
         attron(COLOR_PAIR(3));
         printw("ESC");
         attroff(COLOR_PAIR(3));
@@ -264,7 +418,8 @@ private:
         // Ensure export directory exists
         ensure_directory_exists(export_dir.c_str());
 
-        hd24song* song = selected_song_info->song;
+        pthread_mutex_lock(&fs_lock);
+        hd24song* song = selected_song;
         __uint32 sample_rate = song->samplerate();
         __uint32 song_length = song->songlength_in_wamples();
 
@@ -352,6 +507,7 @@ private:
         }
 
         delete[] byte_buffer;
+        pthread_mutex_unlock(&fs_lock);
 
         // Show result
         mvprintw(6, 0, "");
@@ -373,8 +529,33 @@ private:
 public:
     HD24Browser(hd24fs* filesystem, const string& output_dir)
         : fs(filesystem), current_selection(0), view_mode(0),
-          selected_song_info(NULL), export_dir(output_dir), scroll_offset(0) {
+          selected_song_info(NULL), export_dir(output_dir), scroll_offset(0),
+          overview(NULL), list_thread_started(false), list_loading(false),
+          list_cancel(false), selected_project(NULL), selected_song(NULL) {
         memset(track_selected, 0, sizeof(track_selected));
+        pthread_mutex_init(&fs_lock, NULL);
+        pthread_mutex_init(&list_lock, NULL);
+    }
+
+    ~HD24Browser() {
+        stop_listing();
+        close_selected_song();
+        pthread_mutex_destroy(&fs_lock);
+        pthread_mutex_destroy(&list_lock);
+    }
+
+    int song_count() {
+        pthread_mutex_lock(&list_lock);
+        int count = (int)songs.size();
+        pthread_mutex_unlock(&list_lock);
+        return count;
+    }
+
+    bool listing() {
+        pthread_mutex_lock(&list_lock);
+        bool loading = list_loading;
+        pthread_mutex_unlock(&list_lock);
+        return loading;
     }
 
     void run() {
@@ -394,24 +575,17 @@ public:
             init_pair(4, COLOR_RED, COLOR_BLACK);     // Errors
         }
 
-        // Load songs
-        list_all_songs();
-
-        if (songs.empty()) {
-            clear();
-            attron(COLOR_PAIR(4) | A_BOLD);
-            mvprintw(0, 0, "No songs found on HD24 device.");
-            attroff(COLOR_PAIR(4) | A_BOLD);
-            mvprintw(2, 0, "Press any key to exit...");
-            refresh();
-            getch();
-            endwin();
-            return;
-        }
+        // Load songs in the background; rows show up as they are read
+        start_listing();
 
         bool running = true;
+        int list_row = 0; // song list position to return to
         while (running) {
             if (view_mode == 0) {
+                bool loading = listing();
+                if ((!loading) && (song_count() == 0)) break;
+                // poll for new rows while loading, otherwise wait for keys
+                timeout(loading ? 100 : -1);
                 draw_song_list();
 
                 int ch = getch();
@@ -420,14 +594,25 @@ public:
                         if (current_selection > 0) current_selection--;
                         break;
                     case KEY_DOWN:
-                        if (current_selection < (int)songs.size() - 1) current_selection++;
+                        if (current_selection < song_count() - 1) current_selection++;
                         break;
                     case 10: // ENTER
                     case KEY_ENTER:
-                        selected_song_info = &songs[current_selection];
+                        if (current_selection >= song_count()) break;
+                        pthread_mutex_lock(&list_lock);
+                        selected_info = songs[current_selection];
+                        pthread_mutex_unlock(&list_lock);
+                        if (!open_selected_song()) break;
+                        timeout(-1);
                         view_mode = 1;
+                        list_row = current_selection;
                         current_selection = 0;
                         memset(track_selected, 0, sizeof(track_selected));
+                        // Show the overview right away if one was made before
+                        overview = new hd24peaks(selected_song);
+                        pthread_mutex_lock(&fs_lock);
+                        overview->load();
+                        pthread_mutex_unlock(&fs_lock);
                         break;
                     case 'q':
                     case 'Q':
@@ -466,9 +651,14 @@ public:
                     case 'E':
                         export_tracks();
                         break;
+                    case 'o':
+                    case 'O':
+                        make_overview();
+                        break;
                     case 27: // ESC
+                        close_selected_song();
                         view_mode = 0;
-                        current_selection = 0;
+                        current_selection = list_row;
                         break;
                     case 'q':
                     case 'Q':
@@ -478,6 +668,18 @@ public:
             }
         }
 
+        if (running) {
+            timeout(-1);
+            clear();
+            attron(COLOR_PAIR(4) | A_BOLD);
+            mvprintw(0, 0, "No songs found on HD24 device.");
+            attroff(COLOR_PAIR(4) | A_BOLD);
+            mvprintw(2, 0, "Press any key to exit...");
+            refresh();
+            getch();
+        }
+
+        stop_listing();
         endwin();
     }
 };
@@ -578,8 +780,7 @@ int main(int argc, char** argv) {
     string* volume_name = fs->volumename();
     cout << "Found HD24 device: " << device_name->c_str() << endl;
     cout << "Volume name: " << volume_name->c_str() << endl;
-    delete device_name;
-    delete volume_name;
+    delete volume_name; // (device name is owned by fs)
 
     cout << endl << "Starting browser..." << endl;
     cout << "Press any key to continue...";
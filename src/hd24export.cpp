@@ -0,0 +1,1060 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <convertlib.h>
+#include <memutils.h>
+#include <hd24fs.h>
+#include <hd24utils.h>
+#include <hd24sndfile.h>
+#include <hd24transferengine.h>
+#include <sharedlibs.h>
+#include <ui_mixer.h>
+
+/* Unattended export of songs to audio files.
+   Uses the same transfer engine as HD24connect, but never opens a
+   window, so it can run on headless machines. Songs are selected as
+   <project>.<song> (as listed by --list) or as a whole project.
+
+   Export settings can be given on the command line, or per job in a
+   job file: one job per line, with the same options and song
+   selections as the command line. Options on the command line are
+   the defaults for all jobs in the file.
+
+   With --progress=json, progress is written to stdout as one JSON
+   object per line, for use by scripts that run exports of several
+   drives side by side. Percentages are of all songs together.
+   Errors are then written as error events too; otherwise they go
+   to stderr. */
+
+using namespace std;
+
+#define MAXTRACKS 24
+#define NOLOCATE -1
+
+typedef struct
+{
+	__uint32 project;	/* base 1 */
+	__uint32 song;		/* base 1, 0 for all songs of the project */
+} songselector;
+
+typedef struct
+{
+	string dir;
+	string nameformat;
+	bool havenameformat;
+	int format;
+	bool tracks[MAXTRACKS];
+	bool alltracks;
+	string start;		/* time, empty for song start */
+	string end;		/* time, empty for song end */
+	int startloc;		/* locate point, or NOLOCATE */
+	int endloc;
+	bool split;
+	__uint64 splitbytes;
+	int silencemode;
+	__uint32 silencethreshold;
+	bool overwrite;
+	bool allsongs;
+	vector<songselector> songs;
+} exportjob;
+
+typedef struct
+{
+	__uint32 job;		/* base 1 */
+	__uint32 project;
+	__uint32 song;
+	__uint64 bytes;
+	int prefix;
+} exportitem;
+
+string device;
+string headerfilename;
+string jobfilename;
+bool force=false;
+bool jsonprogress=false;
+bool listsongs=false;
+bool listformats=false;
+exportjob defaults;
+vector<exportjob> jobs;
+
+/* What the status callback reports on. */
+exportitem* currentitem=NULL;
+int lastpercent=-1;
+
+void showusage()
+{
+	cout << "Usage: hd24export [options] [<project>[.<song>] ...]" << endl
+	     << "Drive options:" << endl
+	     << "  --dev=<device>       HD24 drive or drive image (default: auto-detect)" << endl
+	     << "  --force              use the device even if it does not look like an HD24 drive" << endl
+	     << "  --header=<file>      use a header file for the drive" << endl
+	     << "  --list               list projects and songs, then exit" << endl
+	     << "  --formats            list the export formats, then exit" << endl
+	     << "  --job=<file>         read export jobs from a file, one per line" << endl
+	     << "  --progress=json      report progress as JSON lines on stdout" << endl
+	     << "Export options:" << endl
+	     << "  --all                export all songs of all projects" << endl
+	     << "  --dir=<dir>          output directory (default: current directory)" << endl
+	     << "  --format=<format>    format number or name, see --formats (default wav-mono)" << endl
+	     << "  --tracks=<list>      tracks to export, e.g. 1-8,11 (default: all)" << endl
+	     << "  --start=<time>       start of the range, as [[h:]m:]s[.frac] (default: song start)" << endl
+	     << "  --end=<time>         end of the range (default: song end)" << endl
+	     << "  --startloc=<n>       start at locate point n instead" << endl
+	     << "  --endloc=<n>         end at locate point n instead" << endl
+	     << "  --split=<MB>         split files larger than this (default 1024)" << endl
+	     << "  --nosplit            never split files" << endl
+	     << "  --name=<format>      file name format, as in HD24connect" << endl
+	     << "  --silence=<mode>     keep, skip (leave out silent tracks) or trim" << endl
+	     << "  --threshold=<n>      sample level below which audio counts as silence" << endl
+	     << "  --overwrite          overwrite existing files" << endl;
+}
+
+void initjob(exportjob* job)
+{
+	job->dir=".";
+	job->nameformat="";
+	job->havenameformat=false;
+	job->format=0;
+	for (int i=0;i<MAXTRACKS;i++)
+	{
+		job->tracks[i]=false;
+	}
+	job->alltracks=true;
+	job->start="";
+	job->end="";
+	job->startloc=NOLOCATE;
+	job->endloc=NOLOCATE;
+	job->split=true;
+	job->splitbytes=1024*1024*1024;
+	job->silencemode=hd24transferengine::SILENCE_KEEP;
+	job->silencethreshold=0;
+	job->overwrite=false;
+	job->allsongs=false;
+}
+
+bool isnumber(string str)
+{
+	if (str=="")
+	{
+		return false;
+	}
+	for (__uint32 i=0;i<str.length();i++)
+	{
+		if (!isdigit((unsigned char)str[i]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool parsetime(string str,double* seconds)
+{
+	/* [[h:]m:]s[.frac] */
+	double total=0;
+	string::size_type pos=0;
+	int fields=0;
+	while (true)
+	{
+		string::size_type colon=str.find(':',pos);
+		string field=str.substr(pos,(colon==string::npos)?(string::npos):(colon-pos));
+		if (field=="")
+		{
+			return false;
+		}
+		char* endptr=NULL;
+		double value=strtod(field.c_str(),&endptr);
+		if ((*endptr!='\0')||(value<0))
+		{
+			return false;
+		}
+		if ((colon!=string::npos)&&(!isnumber(field)))
+		{
+			return false; // only the seconds can have a fraction
+		}
+		total=total*60+value;
+		fields++;
+		if (colon==string::npos)
+		{
+			break;
+		}
+		pos=colon+1;
+	}
+	if (fields>3)
+	{
+		return false;
+	}
+	*seconds=total;
+	return true;
+}
+
+bool parsetracks(string str,exportjob* job)
+{
+	/* Comma separated track numbers and ranges, e.g. 1-8,11 */
+	for (int i=0;i<MAXTRACKS;i++)
+	{
+		job->tracks[i]=false;
+	}
+	job->alltracks=false;
+	string::size_type pos=0;
+	while (pos<=str.length())
+	{
+		string::size_type comma=str.find(',',pos);
+		string item=str.substr(pos,(comma==string::npos)?(string::npos):(comma-pos));
+		string::size_type dash=item.find('-');
+		string first=item.substr(0,dash);
+		string last=(dash==string::npos)?(first):(item.substr(dash+1));
+		if ((!isnumber(first))||(!isnumber(last)))
+		{
+			return false;
+		}
+		long from=Convert::str2long(first);
+		long to=Convert::str2long(last);
+		if ((from<1)||(to>MAXTRACKS)||(from>to))
+		{
+			return false;
+		}
+		for (long t=from;t<=to;t++)
+		{
+			job->tracks[t-1]=true;
+		}
+		if (comma==string::npos)
+		{
+			break;
+		}
+		pos=comma+1;
+	}
+	return true;
+}
+
+string formatname(const char* desc)
+{
+	/* "WAV (24 bit), stereo" becomes "wav-stereo" */
+	string name="";
+	string strdesc=desc;
+	for (__uint32 i=0;(i<strdesc.length())&&(strdesc[i]!=' ');i++)
+	{
+		name+=(char)tolower((unsigned char)strdesc[i]);
+	}
+	string::size_type space=strdesc.rfind(' ');
+	if (space!=string::npos)
+	{
+		name+="-"+strdesc.substr(space+1);
+	}
+	return name;
+}
+
+int findformat(string str)
+{
+	hd24transferengine* transeng=new hd24transferengine();
+	int found=-1;
+	int count=transeng->supportedformatcount();
+	if (isnumber(str))
+	{
+		found=Convert::str2long(str);
+		if (found>=count)
+		{
+			found=-1;
+		}
+	} else {
+		for (int i=0;i<count;i++)
+		{
+			if (formatname(transeng->getformatdesc(i))==str)
+			{
+				found=i;
+				break;
+			}
+		}
+	}
+	delete transeng;
+	return found;
+}
+
+bool parsesong(string str,exportjob* job)
+{
+	/* <project> or <project>.<song> */
+	songselector sel;
+	string::size_type dot=str.find('.');
+	string proj=str.substr(0,dot);
+	string song=(dot==string::npos)?("0"):(str.substr(dot+1));
+	if ((!isnumber(proj))||(!isnumber(song)))
+	{
+		return false;
+	}
+	sel.project=Convert::str2long(proj);
+	sel.song=Convert::str2long(song);
+	if ((sel.project==0)||((dot!=string::npos)&&(sel.song==0)))
+	{
+		return false;
+	}
+	job->songs.push_back(sel);
+	return true;
+}
+
+bool hasprefix(string arg,const char* prefix,string* value)
+{
+	if (arg.substr(0,strlen(prefix))!=prefix)
+	{
+		return false;
+	}
+	*value=arg.substr(strlen(prefix));
+	return true;
+}
+
+int parsejobarg(string arg,exportjob* job)
+{
+	/* Returns 0 if the argument was used, 1 if it is invalid and
+	   -1 if it is not an export option. */
+	string value;
+	if (arg.substr(0,1)!="-")
+	{
+		return (parsesong(arg,job))?(0):(1);
+	}
+	if (arg=="--all")
+	{
+		job->allsongs=true;
+		return 0;
+	}
+	if (hasprefix(arg,"--dir=",&value))
+	{
+		job->dir=value;
+		return 0;
+	}
+	if (hasprefix(arg,"--format=",&value))
+	{
+		job->format=findformat(value);
+		return (job->format<0)?(1):(0);
+	}
+	if (hasprefix(arg,"--tracks=",&value))
+	{
+		return (parsetracks(value,job))?(0):(1);
+	}
+	double seconds;
+	if (hasprefix(arg,"--start=",&value))
+	{
+		job->start=value;
+		return (parsetime(value,&seconds))?(0):(1);
+	}
+	if (hasprefix(arg,"--end=",&value))
+	{
+		job->end=value;
+		return (parsetime(value,&seconds))?(0):(1);
+	}
+	if (hasprefix(arg,"--startloc=",&value))
+	{
+		job->startloc=Convert::str2long(value);
+		return (isnumber(value))?(0):(1);
+	}
+	if (hasprefix(arg,"--endloc=",&value))
+	{
+		job->endloc=Convert::str2long(value);
+		return (isnumber(value))?(0):(1);
+	}
+	if (hasprefix(arg,"--split=",&value))
+	{
+		job->split=true;
+		job->splitbytes=(__uint64)Convert::str2long(value)*1024*1024;
+		return (job->splitbytes==0)?(1):(0);
+	}
+	if (arg=="--nosplit")
+	{
+		job->split=false;
+		return 0;
+	}
+	if (hasprefix(arg,"--name=",&value))
+	{
+		job->nameformat=value;
+		job->havenameformat=true;
+		return 0;
+	}
+	if (hasprefix(arg,"--silence=",&value))
+	{
+		if (value=="keep")
+		{
+			job->silencemode=hd24transferengine::SILENCE_KEEP;
+		} else if (value=="skip") {
+			job->silencemode=hd24transferengine::SILENCE_SKIPTRACKS;
+		} else if (value=="trim") {
+			job->silencemode=hd24transferengine::SILENCE_TRIM;
+		} else {
+			return 1;
+		}
+		return 0;
+	}
+	if (hasprefix(arg,"--threshold=",&value))
+	{
+		job->silencethreshold=Convert::str2long(value);
+		return (isnumber(value))?(0):(1);
+	}
+	if (arg=="--overwrite")
+	{
+		job->overwrite=true;
+		return 0;
+	}
+	return -1;
+}
+
+string jsonstring(const char* str)
+{
+	string result="\"";
+	for (__uint32 i=0;str[i]!='\0';i++)
+	{
+		unsigned char c=(unsigned char)str[i];
+		if ((c=='"')||(c=='\\'))
+		{
+			result+='\\';
+			result+=(char)c;
+		} else if (c<0x20) {
+			char esc[8];
+			sprintf(esc,"\\u%04x",c);
+			result+=esc;
+		} else {
+			result+=(char)c;
+		}
+	}
+	result+="\"";
+	return result;
+}
+
+void showerror(string message)
+{
+	/* With --progress=json, stdout only holds JSON objects, so
+	   errors are written as error events there. */
+	if (jsonprogress)
+	{
+		printf("{\"event\":\"error\",\"message\":%s}\n",jsonstring(message.c_str()).c_str());
+		fflush(stdout);
+		return;
+	}
+	cerr << message << endl;
+}
+
+int parsecommandline(int argc, char **argv)
+{
+	int invalid = 0;
+	string value;
+	vector<string> invalidargs;
+	initjob(&defaults);
+
+	for (int c = 1; c < argc; c++) {
+		string arg = argv[c];
+
+		if (hasprefix(arg,"--dev=",&value)) {
+			device = value;
+			continue;
+		}
+
+		if (arg == "--force") {
+			force = true;
+			continue;
+		}
+
+		if (hasprefix(arg,"--header=",&value)) {
+			headerfilename = value;
+			continue;
+		}
+
+		if (arg == "--list") {
+			listsongs = true;
+			continue;
+		}
+
+		if (arg == "--formats") {
+			listformats = true;
+			continue;
+		}
+
+		if (hasprefix(arg,"--job=",&value)) {
+			jobfilename = value;
+			continue;
+		}
+
+		if (arg == "--progress=json") {
+			jsonprogress = true;
+			continue;
+		}
+
+		int result = parsejobarg(arg,&defaults);
+		if (result == 0) {
+			continue;
+		}
+		invalidargs.push_back(arg);
+		invalid = 1;
+	}
+	/* reported once all arguments are seen, as --progress=json
+	   may come after them */
+	for (__uint32 i = 0; i < invalidargs.size(); i++) {
+		showerror("Invalid argument: "+invalidargs[i]);
+	}
+	return invalid;
+}
+
+int readjobfile()
+{
+	/* Each line holds the export options and songs of one job,
+	   on top of the options given on the command line. */
+	ifstream in(jobfilename.c_str());
+	if (!in)
+	{
+		showerror("Cannot read job file "+jobfilename);
+		return 1;
+	}
+	string line;
+	int linenum=0;
+	while (getline(in,line))
+	{
+		linenum++;
+		exportjob job=defaults;
+		job.songs.clear();
+		job.allsongs=false;
+		bool empty=true;
+		string::size_type pos=0;
+		while (pos<line.length())
+		{
+			while ((pos<line.length())&&(isspace((unsigned char)line[pos])))
+			{
+				pos++;
+			}
+			if ((pos>=line.length())||(line[pos]=='#'))
+			{
+				break;
+			}
+			string::size_type endpos=pos;
+			while ((endpos<line.length())&&(!isspace((unsigned char)line[endpos])))
+			{
+				endpos++;
+			}
+			string arg=line.substr(pos,endpos-pos);
+			pos=endpos;
+			empty=false;
+			if (parsejobarg(arg,&job)!=0)
+			{
+				string* linestr=Convert::int2str(linenum);
+				showerror(jobfilename+":"+*linestr+": invalid argument: "+arg);
+				delete linestr;
+				return 1;
+			}
+		}
+		if (!empty)
+		{
+			jobs.push_back(job);
+		}
+	}
+	return 0;
+}
+
+void transferstatus(void* ui,const char* message,double percent)
+{
+	/* Called by the transfer engine; there is no user interface,
+	   so the progress goes to the console. */
+	int pct=(int)percent;
+	if (jsonprogress)
+	{
+		if ((pct==lastpercent)||(currentitem==NULL))
+		{
+			return;
+		}
+		lastpercent=pct;
+		printf("{\"event\":\"progress\",\"job\":%lu,\"song\":\"%lu.%lu\",\"percent\":%d,\"message\":%s}\n",
+			(unsigned long)currentitem->job,(unsigned long)currentitem->project,
+			(unsigned long)currentitem->song,pct,jsonstring(message).c_str());
+		fflush(stdout);
+		return;
+	}
+	cerr << message << endl;
+}
+
+SoundFileWrapper* loadsoundfile(char* absprogpath)
+{
+	/* Looks for libsndfile next to the program and in the default
+	   places, without the error dialogs of HD24connect. Returns
+	   NULL if it cannot be loaded. */
+	SoundFileWrapper* soundfile=new SoundFileWrapper(absprogpath,false);
+	if (!(soundfile->libloaded))
+	{
+		delete soundfile;
+		return NULL;
+	}
+	return soundfile;
+}
+
+bool checkformats(SoundFileWrapper* soundfile)
+{
+	/* Formats written with libsndfile need the library; rather
+	   than fail every song, refuse to start. */
+	if (soundfile!=NULL)
+	{
+		return true;
+	}
+	bool ok=true;
+	hd24transferengine* transeng=new hd24transferengine();
+	for (__uint32 j=0;j<jobs.size();j++)
+	{
+		if (transeng->format_usessndfile(jobs[j].format))
+		{
+			showerror(string("Format ")+formatname(transeng->getformatdesc(jobs[j].format))
+				+" needs libsndfile, which cannot be loaded.");
+			ok=false;
+			break;
+		}
+	}
+	delete transeng;
+	return ok;
+}
+
+void showsongs(hd24fs* fs)
+{
+	for (__uint32 p=1;p<=fs->projectcount();p++)
+	{
+		hd24project* project=fs->getproject(p);
+		if (project==NULL)
+		{
+			continue;
+		}
+		string* projname=project->projectname();
+		cout << "Project " << p << ": " << *projname << endl;
+		delete projname;
+		for (__uint32 s=1;s<=project->songcount();s++)
+		{
+			hd24song* song=project->getsong(s);
+			if (song==NULL)
+			{
+				continue;
+			}
+			string* songname=song->songname();
+			string* duration=song->display_duration();
+			cout << "  " << p << "." << s << "  " << *songname << ", "
+			     << *duration << ", " << song->logical_channels() << " ch, "
+			     << song->samplerate() << " Hz" << endl;
+			delete duration;
+			delete songname;
+			delete song;
+		}
+		delete project;
+	}
+}
+
+void showformats()
+{
+	hd24transferengine* transeng=new hd24transferengine();
+	for (int i=0;i<transeng->supportedformatcount();i++)
+	{
+		const char* desc=transeng->getformatdesc(i);
+		cout << i << "  " << formatname(desc) << "  (" << desc << ")" << endl;
+	}
+	delete transeng;
+}
+
+bool haslocatepoint(hd24song* song,int locnum,string* error)
+{
+	if ((__uint32)locnum<song->locatepointcount())
+	{
+		return true;
+	}
+	string* locstr=Convert::int2str(locnum);
+	*error="No locate point "+*locstr+" in this song";
+	delete locstr;
+	return false;
+}
+
+bool songrange(exportjob* job,hd24song* song,__uint32* startoffset,__uint32* endoffset,string* error)
+{
+	/* Export range in wamples, as the transfer engine wants it. */
+	__uint32 songlen=song->songlength_in_wamples();
+	__uint32 wamplespersec=song->samplerate()/song->chanmult();
+	*startoffset=0;
+	*endoffset=songlen;
+	double seconds;
+	if (job->startloc!=NOLOCATE)
+	{
+		if (!haslocatepoint(song,job->startloc,error))
+		{
+			return false;
+		}
+		*startoffset=song->getlocatepos(job->startloc);
+	} else if (parsetime(job->start,&seconds)) {
+		*startoffset=(__uint32)(seconds*wamplespersec);
+	}
+	if (job->endloc!=NOLOCATE)
+	{
+		if (!haslocatepoint(song,job->endloc,error))
+		{
+			return false;
+		}
+		*endoffset=song->getlocatepos(job->endloc);
+	} else if (parsetime(job->end,&seconds)) {
+		*endoffset=(__uint32)(seconds*wamplespersec);
+	}
+	if (*endoffset>songlen)
+	{
+		*endoffset=songlen;
+	}
+	if (*startoffset>=*endoffset)
+	{
+		*error="Nothing to export in the selected range";
+		return false;
+	}
+	return true;
+}
+
+__uint32 selectedtracks(exportjob* job,hd24song* song)
+{
+	__uint32 count=0;
+	for (__uint32 t=0;t<song->logical_channels();t++)
+	{
+		if ((job->alltracks)||(job->tracks[t]))
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+bool plansongs(hd24fs* fs,__uint32 jobnum,exportjob* job,vector<exportitem>* items)
+{
+	/* Expands the song selection of a job to single songs. */
+	vector<songselector> selection=job->songs;
+	if (job->allsongs)
+	{
+		for (__uint32 p=1;p<=fs->projectcount();p++)
+		{
+			songselector sel;
+			sel.project=p;
+			sel.song=0;
+			selection.push_back(sel);
+		}
+	}
+	vector<string> names;
+	__uint32 firstitem=items->size();
+	for (__uint32 i=0;i<selection.size();i++)
+	{
+		hd24project* project=NULL;
+		if (selection[i].project<=fs->projectcount())
+		{
+			project=fs->getproject(selection[i].project);
+		}
+		if ((project==NULL)||(selection[i].song>project->songcount()))
+		{
+			string* projstr=Convert::int32tostr(selection[i].project);
+			string message="No song "+*projstr;
+			delete projstr;
+			if (selection[i].song!=0)
+			{
+				string* songstr=Convert::int32tostr(selection[i].song);
+				message+="."+*songstr;
+				delete songstr;
+			}
+			showerror(message+" on this drive.");
+			if (project!=NULL)
+			{
+				delete project;
+			}
+			return false;
+		}
+		__uint32 first=(selection[i].song==0)?(1):(selection[i].song);
+		__uint32 last=(selection[i].song==0)?(project->songcount()):(selection[i].song);
+		for (__uint32 s=first;s<=last;s++)
+		{
+			hd24song* song=project->getsong(s);
+			if (song==NULL)
+			{
+				continue;
+			}
+			exportitem item;
+			item.job=jobnum;
+			item.project=selection[i].project;
+			item.song=s;
+			item.prefix=0;
+			item.bytes=0;
+			__uint32 startoffset;
+			__uint32 endoffset;
+			string rangeerror;
+			if (songrange(job,song,&startoffset,&endoffset,&rangeerror))
+			{
+				item.bytes=(__uint64)(endoffset-startoffset)*song->chanmult()
+					*(song->bitdepth()/8)*selectedtracks(job,song);
+			}
+			string* songname=song->songname();
+			names.push_back(*songname);
+			delete songname;
+			delete song;
+			items->push_back(item);
+		}
+		delete project;
+	}
+	/* Songs with the same name get their number in front of
+	   their file names, as in HD24connect. */
+	for (__uint32 i=0;i<names.size();i++)
+	{
+		for (__uint32 j=0;j<names.size();j++)
+		{
+			if ((i!=j)&&(names[i]==names[j]))
+			{
+				(*items)[firstitem+i].prefix=(*items)[firstitem+i].song;
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+bool outputexists(hd24transferengine* transeng,hd24song* song,int prefix)
+{
+	/* Checks the file names of all selected tracks, whole and
+	   as the first part of a split file. */
+	bool exists=false;
+	for (__uint32 t=0;(t<song->logical_channels())&&(!exists);t++)
+	{
+		if (!transeng->trackselected(t))
+		{
+			continue;
+		}
+		for (int partnum=0;partnum<=1;partnum++)
+		{
+			string* fname=transeng->generate_filename(t,partnum,prefix);
+			if (fname==NULL)
+			{
+				continue;
+			}
+			if (hd24utils::isfile(fname->c_str()))
+			{
+				exists=true;
+			}
+			delete fname;
+		}
+	}
+	return exists;
+}
+
+bool exportsong(hd24fs* fs,exportjob* job,exportitem* item,__uint32 songnum,
+		__uint32 totsongs,__uint64 totbytes,__uint64 bytesdone,
+		SoundFileWrapper* soundfile,__uint64* bytestransferred,string* error)
+{
+	hd24project* project=fs->getproject(item->project);
+	hd24song* song=(project==NULL)?(NULL):(project->getsong(item->song));
+	if (song==NULL)
+	{
+		*error="Cannot read song";
+		if (project!=NULL)
+		{
+			delete project;
+		}
+		return false;
+	}
+	__uint32 startoffset;
+	__uint32 endoffset;
+	if (!songrange(job,song,&startoffset,&endoffset,error))
+	{
+		delete song;
+		delete project;
+		return false;
+	}
+	if (selectedtracks(job,song)==0)
+	{
+		*error="Nothing to export in the selected tracks";
+		delete song;
+		delete project;
+		return false;
+	}
+
+	hd24transferengine* transeng=new hd24transferengine();
+	transeng->soundfile=soundfile;
+	transeng->setstatusfunction=transferstatus;
+	transeng->projectdir(job->dir.c_str());
+	string* nameformat=NULL;
+	if (job->havenameformat)
+	{
+		nameformat=new string(job->nameformat);
+	} else {
+		nameformat=hd24utils::getconfigvalue("filenameformat","");
+	}
+	transeng->filenameformat(nameformat);
+	delete nameformat;
+	transeng->selectedformat(job->format);
+	transeng->sizelimit(job->splitbytes);
+	transeng->silencemode(job->silencemode);
+	transeng->silencethreshold(job->silencethreshold);
+	transeng->sourcesong(song);
+	for (__uint32 t=0;t<song->logical_channels();t++)
+	{
+		transeng->trackselected(t,(job->alltracks)||(job->tracks[t]));
+	}
+	transeng->startoffset(startoffset);
+	transeng->endoffset(endoffset);
+	transeng->prepare_transfer_to_pc(songnum,totsongs,totbytes,bytesdone,
+		(job->split)?(1):(0),item->prefix);
+	if ((!job->overwrite)&&(outputexists(transeng,song,item->prefix)))
+	{
+		*error="Output files already exist";
+		delete transeng;
+		delete song;
+		delete project;
+		return false;
+	}
+
+	currentitem=item;
+	lastpercent=-1;
+	*bytestransferred=transeng->transfer_to_pc();
+	currentitem=NULL;
+	bool ok=(*bytestransferred!=0);
+	if (!ok)
+	{
+		if (transeng->lasterror()!=NULL)
+		{
+			*error=*(transeng->lasterror());
+		} else {
+			*error="Unexpected error transferring files";
+		}
+	}
+	delete transeng;
+	delete song;
+	delete project;
+	return ok;
+}
+
+int main (int argc, char **argv)
+{
+	int invalid = parsecommandline(argc, argv);
+	if (invalid != 0) {
+		if (!jsonprogress) {
+			showusage();
+		}
+		return invalid;
+	}
+	if (listformats) {
+		showformats();
+		return 0;
+	}
+	if (jobfilename != "") {
+		if (readjobfile() != 0) {
+			return 1;
+		}
+	}
+	if ((defaults.allsongs) || (defaults.songs.size() > 0)) {
+		jobs.insert(jobs.begin(),defaults);
+	}
+	if ((jobs.size() == 0) && (!listsongs)) {
+		if (jsonprogress) {
+			showerror("No songs selected.");
+		} else {
+			showusage();
+		}
+		return 1;
+	}
+
+	hd24fs* fs = NULL;
+	if (device == "") {
+		fs = new hd24fs((const char*)NULL,hd24fs::MODE_RDONLY);
+	} else {
+		if (hd24utils::isfile(device.c_str())) {
+			force = true; // drive images
+		}
+		fs = new hd24fs((const char*)NULL,hd24fs::MODE_RDONLY,&device,force);
+	}
+	if (!fs->isOpen()) {
+		showerror("Cannot open hd24 device.");
+		delete fs;
+		return 1;
+	}
+	if (headerfilename != "") {
+		if (!(fs->useheaderfile(headerfilename))) {
+			showerror("Couldn't load header file "+headerfilename);
+			delete fs;
+			return 1;
+		}
+	}
+	if (listsongs) {
+		showsongs(fs);
+		delete fs;
+		return 0;
+	}
+
+	vector<exportitem> items;
+	__uint64 totbytes = 0;
+	for (__uint32 j = 0; j < jobs.size(); j++) {
+		if (!plansongs(fs,j+1,&jobs[j],&items)) {
+			delete fs;
+			return 1;
+		}
+		string dirname = jobs[j].dir+"/";
+		if (!hd24utils::guaranteefiledirexists(&dirname)) {
+			showerror("Cannot create output directory "+jobs[j].dir);
+			delete fs;
+			return 1;
+		}
+	}
+	for (__uint32 i = 0; i < items.size(); i++) {
+		totbytes += items[i].bytes;
+	}
+
+	char absprogpath[2048];
+	hd24utils::getmyabsolutepath((const char**)argv,(char*)&absprogpath);
+	SoundFileWrapper* soundfile = loadsoundfile(absprogpath);
+	if (!checkformats(soundfile)) {
+		delete fs;
+		return 1;
+	}
+
+	double starttime = hd24utils::monotonicseconds();
+	__uint64 bytesdone = 0;
+	__uint64 totaltransferred = 0;
+	__uint32 failed = 0;
+	for (__uint32 i = 0; i < items.size(); i++) {
+		exportitem* item = &items[i];
+		exportjob* job = &jobs[item->job-1];
+		if (jsonprogress) {
+			printf("{\"event\":\"start\",\"job\":%lu,\"song\":\"%lu.%lu\",\"bytes\":%llu}\n",
+				(unsigned long)item->job,(unsigned long)item->project,
+				(unsigned long)item->song,(unsigned long long)item->bytes);
+			fflush(stdout);
+		} else {
+			cerr << "Exporting song " << item->project << "." << item->song << endl;
+		}
+		double songstart = hd24utils::monotonicseconds();
+		__uint64 transferred = 0;
+		string error = "";
+		bool ok = exportsong(fs,job,item,i+1,items.size(),totbytes,bytesdone,
+				soundfile,&transferred,&error);
+		double songseconds = hd24utils::monotonicseconds()-songstart;
+		/* count the planned bytes, so that percentages of
+		   the songs after a failed one stay right. */
+		bytesdone += item->bytes;
+		totaltransferred += transferred;
+		if (jsonprogress) {
+			if (ok) {
+				printf("{\"event\":\"done\",\"job\":%lu,\"song\":\"%lu.%lu\",\"bytes\":%llu,\"seconds\":%.3f}\n",
+					(unsigned long)item->job,(unsigned long)item->project,
+					(unsigned long)item->song,(unsigned long long)transferred,songseconds);
+			} else {
+				printf("{\"event\":\"error\",\"job\":%lu,\"song\":\"%lu.%lu\",\"message\":%s}\n",
+					(unsigned long)item->job,(unsigned long)item->project,
+					(unsigned long)item->song,jsonstring(error.c_str()).c_str());
+			}
+			fflush(stdout);
+		} else if (!ok) {
+			cerr << "Song " << item->project << "." << item->song << ": " << error << endl;
+		}
+		if (!ok) {
+			failed++;
+		}
+	}
+	double seconds = hd24utils::monotonicseconds()-starttime;
+	if (jsonprogress) {
+		printf("{\"event\":\"finished\",\"songs\":%lu,\"failed\":%lu,\"bytes\":%llu,\"seconds\":%.3f}\n",
+			(unsigned long)items.size(),(unsigned long)failed,
+			(unsigned long long)totaltransferred,seconds);
+		fflush(stdout);
+	} else {
+		cerr << items.size()-failed << " of " << items.size() << " songs exported." << endl;
+	}
+	if (soundfile != NULL) {
+		delete soundfile;
+	}
+	delete fs;
+	return (failed == 0) ? 0 : 1;
+}
@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <vector>
 #include "config.h"
 #include "hd24fs.h"
 #include "convertlib.h"
@@ -19,6 +20,10 @@
 #define LARGEFILE64_SOURCE
 #define SECTORSIZE 512
 #define ARGHEADER "--header="
+#define SCANTHREADS 4
+#define CHECKSUMSECTORS 128	/* sectors per read when calculating checksums */
+#define DUMPDIFFSECTORS 16	/* largest compare range shown as hex dump */
+#define MAXDIFFRUNS 256		/* max. number of differing ranges to list */
 
 #ifdef DARWIN
 #	define open64 open
@@ -92,13 +97,17 @@ void hd24seek(FSHANDLE devhd24, __uint64 seekpos)
 long unsigned int calcblockchecksum(hd24raw* rawdevice, unsigned long firstsector, unsigned long endsector)
 {
 	long unsigned int checksum32 = 0;
-	unsigned char origblock[5120];
+	unsigned char origblock[CHECKSUMSECTORS*SECTORSIZE];
 
-	for (unsigned long k = firstsector; k < endsector; k++)
+	for (unsigned long k = firstsector; k < endsector; k += CHECKSUMSECTORS)
 	{
-		rawdevice->readsectors(k, origblock, 1);
+		unsigned long sectors = endsector - k;
+		if (sectors > CHECKSUMSECTORS) {
+			sectors = CHECKSUMSECTORS;
+		}
+		rawdevice->readsectors(k, origblock, sectors);
 		
-		for (unsigned long i = 0; i < SECTORSIZE; i += 4) 
+		for (unsigned long i = 0; i < sectors * SECTORSIZE; i += 4) 
 		{
 			unsigned long num = Convert::getint32(origblock, i);
 			int byte1 = num % 256;
@@ -313,116 +322,157 @@ long editbytes(unsigned char* bootblock,string editstr)
 	return 0;
 }
 
-void compareblock(hd24raw* rawdevice,unsigned long firstsector,unsigned long endsector,long current)
+void showscanprogress(__uint64 bytesdone,__uint64 bytestotal)
+{
+	static __uint64 lastshown=0;
+	if ((bytesdone<lastshown)||(bytesdone-lastshown>=0x10000000)||(bytesdone==bytestotal)) {
+		string* curroff=Convert::int64tohex(bytesdone);
+		cout << "Scanned " << *curroff << " bytes\r";
+		cout.flush();
+		delete curroff;	curroff=NULL;
+		lastshown=bytesdone;
+	}
+}
+
+void dumpblockdiffs(hd24fs* fs1,unsigned long firstsector,unsigned long endsector,hd24fs* fs2,unsigned long current)
 {
+	/* Shows the differing lines of two small blocks as hex dump. */
 	unsigned int i;
 	unsigned int j;
-	unsigned int k;
-	unsigned char origblock[5120];
-	unsigned char destblock[5120];
-	string* startoff=Convert::int64tohex((__uint64)firstsector*512);
-	string* endoff=Convert::int64tohex((__uint64)endsector*512-1);
-	cout << "Compare range from offset "<< *startoff << " to offset " << *endoff <<endl;
-	delete startoff; 	startoff=NULL;
-	delete endoff;		endoff=NULL;
-	int anydifs=0;
-	for (k=firstsector; k<endsector; k++) 
-	{
-		rawdevice->readsectors(k,origblock,1);
-		rawdevice->readsectors(k-firstsector+current,destblock,1);
-		for (i=0;i<SECTORSIZE;i+=16) {
-			string strline1="";
-			string strline2="";
-			int havedifs=0;
-			long offset=k*512;
-			string* result1=Convert::int32tohex(offset+i);
-			strline1+= *result1+" ";
-			offset=current*512;
-			delete result1;	result1=NULL;
-			string* result2=Convert::int32tohex(offset+i);
-			strline2+= *result2+" ";
-			delete result2;	result2=NULL;
-			for (j=0;j<16;j++) 
+	unsigned char origblock[DUMPDIFFSECTORS*SECTORSIZE];
+	unsigned char destblock[DUMPDIFFSECTORS*SECTORSIZE];
+	hd24raw raw1(fs1);
+	hd24raw raw2(fs2);
+	unsigned long sectors=endsector-firstsector;
+	memset(origblock,0,sizeof(origblock));
+	memset(destblock,0,sizeof(destblock));
+	raw1.readsectors(firstsector,origblock,sectors);
+	raw2.readsectors(current,destblock,sectors);
+	for (i=0;i<sectors*SECTORSIZE;i+=16) {
+		if (memcmp(&origblock[i],&destblock[i],16)==0) {
+			continue;
+		}
+		string strline1="";
+		string strline2="";
+		string* result1=Convert::int32tohex(firstsector*512+i);
+		strline1+= *result1+" ";
+		delete result1;	result1=NULL;
+		string* result2=Convert::int32tohex(current*512+i);
+		strline2+= *result2+" ";
+		delete result2;	result2=NULL;
+		for (j=0;j<16;j++) 
+		{
+			if (origblock[i+j]!=destblock[i+j]) 
 			{
-				if (origblock[i+j]!=destblock[i+j]) 
-				{
-					string* result=Convert::byte2hex(origblock[i+j]);
-					strline1+= *result;
-					delete result; result=NULL;
-					havedifs=1;
-				} else {
-					strline1+="  ";
-				}
-				string *result= Convert::byte2hex(destblock[i+j]) ;
-				strline2+= *result;
+				string* result=Convert::byte2hex(origblock[i+j]);
+				strline1+= *result;
 				delete result; result=NULL;
-				if (j==7) {
-					strline1+= "-" ;
-					strline2+= "-" ;
-				} else {
-					strline1+= " " ;
-					strline2+= " " ;
-				}
+			} else {
+				strline1+="  ";
 			}
-			strline1+= " ";
-			strline2+= " ";
-			for (j=0;j<16;j++) {
-				strline1+= Convert::safebyte(origblock[i+j]);
-				if  (origblock[i+j]!=destblock[i+j]) {
-					strline2+= Convert::safebyte(destblock[i+j]);
-				} else {
-					strline2+=" ";
-				}
+			string *result= Convert::byte2hex(destblock[i+j]) ;
+			strline2+= *result;
+			delete result; result=NULL;
+			if (j==7) {
+				strline1+= "-" ;
+				strline2+= "-" ;
+			} else {
+				strline1+= " " ;
+				strline2+= " " ;
 			}
-			if (havedifs==1) {
-				anydifs=1;
-				cout << strline1 << endl;
-				cout << strline2 << endl;
+		}
+		strline1+= " ";
+		strline2+= " ";
+		for (j=0;j<16;j++) {
+			strline1+= Convert::safebyte(origblock[i+j]);
+			if  (origblock[i+j]!=destblock[i+j]) {
+				strline2+= Convert::safebyte(destblock[i+j]);
+			} else {
+				strline2+=" ";
 			}
 		}
+		cout << strline1 << endl;
+		cout << strline2 << endl;
+	}
+}
+
+void compareblock(hd24fs* fs1,unsigned long firstsector,unsigned long endsector,hd24fs* fs2,unsigned long current)
+{
+	/* Compares sectors firstsector..endsector-1 of fs1 with the same
+	 * number of sectors starting at 'current' on fs2 (which may be
+	 * the same device). Differences are listed as ranges; small 
+	 * blocks are also shown as hex dump.
+	 */
+	string* startoff=Convert::int64tohex((__uint64)firstsector*512);
+	string* endoff=Convert::int64tohex((__uint64)endsector*512-1);
+	cout << "Compare range from offset "<< *startoff << " to offset " << *endoff <<endl;
+	delete startoff; 	startoff=NULL;
+	delete endoff;		endoff=NULL;
+	vector<hd24diffrange> diffs;
+	__uint64 difbytes=0;
+	int status=hd24utils::diffsectors(fs1,firstsector,fs2,current,
+				endsector-firstsector,&difbytes,&diffs,NULL,showscanprogress);
+	cout << endl;
+	if (status==hd24utils::DIFF_NOMEMORY) {
+		cout << "Not enough memory to compare." << endl;
+		return;
 	}
-	if (anydifs==0) {
+	if (status==hd24utils::DIFF_CANCELLED) {
+		cout << "Compare cancelled; differences found so far:" << endl;
+	} else if (difbytes==0) {
 		cout << "Blocks are equal." << endl;
+		return;
+	}
+	if ((status==hd24utils::DIFF_COMPLETE)&&(endsector-firstsector<=DUMPDIFFSECTORS)) {
+		dumpblockdiffs(fs1,firstsector,endsector,fs2,current);
+	}
+	for (unsigned int i=0;(i<diffs.size())&&(i<MAXDIFFRUNS);i++) {
+		string* off1=Convert::int64tohex((__uint64)firstsector*512+diffs[i].offset);
+		string* off2=Convert::int64tohex((__uint64)current*512+diffs[i].offset);
+		string* len=Convert::int64tohex(diffs[i].length);
+		cout << "Differ at offset " << *off1 << "/" << *off2 
+		     << ", length " << *len << endl;
+		delete off1; off1=NULL;
+		delete off2; off2=NULL;
+		delete len; len=NULL;
 	}
+	if (diffs.size()>MAXDIFFRUNS) {
+		cout << "(" << diffs.size()-MAXDIFFRUNS << " more ranges not shown)" << endl;
+	}
+	cout << difbytes << " bytes differ in " << diffs.size() << " ranges." << endl;
 }
 
-long scanforblock(hd24raw* rawdevice,string tofind,unsigned long firstsector,unsigned long endsector,long current) 
+long scanforblock(hd24fs* fsys,string tofind,unsigned long firstsector,unsigned long endsector,long current,bool findall) 
 {
-	unsigned int i;
-	unsigned char bootblock[5120];
 	tofind=getbinstr(tofind);
 	if (tofind=="") return current;
 
 	/* Now that we know what to look for, let us try to find the string.
-	 * Note that we can search across sector boundaries because we read
-	 * 2 sectors at a time.
+	 * Matches may cross sector boundaries and may extend past the 
+	 * end of the range.
 	 */
 	string* startoff= Convert::int64tohex((__uint64)firstsector*512);
 	string* endoff=Convert::int64tohex((__uint64)endsector*512-1);
 	cout << "Scan range from offset "<< *startoff << " to offset " << *endoff << endl;
 	delete startoff; startoff=NULL;
 	delete endoff;	endoff=NULL;
-	for (i=firstsector; i<endsector; i++) {
-		rawdevice->readsectors(i,bootblock,2);
-		if ((i%0x1000)==0) {
-			string* curroff=Convert::int64tohex((__uint64)i*0x200);
-			cout << "Scan offset " << *curroff << "\r";
-			delete curroff;	curroff=NULL;
-		}	
-		/* check if string found. */
-		int j=0;
-		for (j=0;j<512;j++) {
-			
-			if (memcmp((const void *)&bootblock[j],(const void *)tofind.c_str(),(size_t)tofind.length())==0) {
-				string* foundoff=Convert::int64tohex((__uint64)i*512+j);
-				cout << endl << "Found on offset " << *foundoff << endl;
-				delete foundoff; foundoff=NULL;
-				return i;
-			}
-		}
-	}	
-	cout << endl << "Not found." << endl;
-	return current;
+	vector<__uint64> matches;
+	hd24utils::findpattern(fsys,(unsigned char*)tofind.c_str(),tofind.length(),
+			firstsector,endsector,findall,SCANTHREADS,&matches,NULL,showscanprogress);
+	cout << endl;
+	if (matches.size()==0) {
+		cout << "Not found." << endl;
+		return current;
+	}
+	for (unsigned int i=0;i<matches.size();i++) {
+		string* foundoff=Convert::int64tohex(matches[i]);
+		cout << "Found on offset " << *foundoff << endl;
+		delete foundoff; foundoff=NULL;
+	}
+	if (findall) {
+		cout << matches.size() << " matches." << endl;
+	}
+	return (long)(matches[0]/512);
 }
 
 void fstfix(unsigned char * bootblock,int fixsize) 
@@ -692,6 +742,8 @@ try{
 			cout << "   o<hex>   dump sector that contains offset <hex>" << endl;
 			cout << "   s x y..  scan marked block for byte sequence x y ..." << endl;
 			cout << "   s'...'   scan marked block for exact string" << endl;
+			cout << "   findall x y.. / findall'...'" << endl;
+			cout << "            list all matches in marked block" << endl;
 			cout << "   e<p> xx  edit byte sequence at pos p to xxxx " << endl;
 			cout << "   e<p> 'x' edit pos p to string 'x'" << endl;
 			cout << endl;
@@ -700,12 +752,18 @@ try{
 			cout << "   be       mark end of sector as block end" << endl;
 			cout << "   bc       block clear" << endl;
 			cout << "   diff     compare marked block with current" << endl;
+			cout << "   hash     hash marked block (or whole drive)" << endl;
 			cout << "   p        paste first sector of marked block to current sector" << endl;
 			cout << endl;
 			cout << "File commands:" << endl;
 			cout << "   n<xx>    set filename to xx" << endl;
 			cout << "   n        clear filename" << endl;
 			cout << "   w        write marked block to named file/device" << endl;
+			cout << "   rescue   error-tolerant copy of marked block (or whole" << endl;
+			cout << "            drive) to named file, keeping track of bad" << endl;
+			cout << "            sectors in <file>.map so it can be resumed" << endl;
+			cout << "   cmpfile  compare marked block (or whole drive) with" << endl;
+			cout << "            the same sectors of named file/device" << endl;
 			cout << "   wo       clear sector write offset for file/device write" << endl;
 			cout << "   wo<xx>   set write offset to xx sectors" << endl;
 			cout << "   ws       write back current edited sector to disk" << endl;
@@ -776,9 +834,67 @@ try{
 				cout << "Please set block start/end first." << endl;
 				continue;
 			}
-			compareblock(rawdevice,blockstart,blockend,sectornum);
+			compareblock(fsys,blockstart,blockend,fsys,sectornum);
 			continue;	
 		}
+		if (userinput=="cmpfile") {
+			nodump=1; // inhibit viewing the sector after this command.
+			unsigned long cmpstart=blockstart;
+			unsigned long cmpend=blockend;
+			if (blockend==blockstart) {
+				cmpstart=0;
+				cmpend=rawdevice->getlastsectornum(&lastsecerror)+1;
+			}
+			hd24fs* otherfs=new hd24fs((const char*)NULL,hd24fs::MODE_RDONLY,&filename,true);
+			if (!otherfs->isOpen()) {
+				cout << "Cannot open file " << filename << endl;
+			} else {
+				compareblock(fsys,cmpstart,cmpend,otherfs,cmpstart);
+			}
+			delete otherfs;
+			otherfs=NULL;
+			continue;
+		}
+		if (userinput=="hash") {
+			nodump=1; // inhibit viewing the sector after this command.
+			noread=1;
+			unsigned long hashstart=blockstart;
+			unsigned long hashend=blockend;
+			if (blockend==blockstart) {
+				hashstart=0;
+				hashend=rawdevice->getlastsectornum(&lastsecerror)+1;
+			}
+			__uint64 hash=0;
+			int status=hd24utils::hashsectors(fsys,hashstart,hashend,&hash,NULL,showscanprogress);
+			if (status==hd24utils::DIFF_NOMEMORY) {
+				cout << endl << "Not enough memory to compute hash." << endl;
+				continue;
+			}
+			if (status==hd24utils::DIFF_CANCELLED) {
+				cout << endl << "Hash cancelled." << endl;
+				continue;
+			}
+			string* strhash=Convert::int64tohex(hash);
+			cout << endl << "Hash of " << hashend-hashstart << " sectors is " << *strhash << endl;
+			delete strhash; strhash=NULL;
+			continue;
+		}
+		if (userinput.substr(0,7)=="findall") {
+			if (userinput=="findall") {
+				userinput+=lastsearch;
+			} else {
+				lastsearch=userinput.substr(7,userinput.length()-7);
+				while (lastsearch.substr(0,1)==" ") {
+					lastsearch=lastsearch.substr(1,lastsearch.length()-1);
+				}
+			}
+			if (blockend==blockstart) {
+  			   sectornum=scanforblock(fsys,lastsearch,0,0xffffffff,sectornum,true);
+			} else {
+  			   sectornum=scanforblock(fsys,lastsearch,blockstart,blockend,sectornum,true);
+			}
+			continue;
+		}
 		if (userinput.substr(0,1)=="s") {
 			if (userinput=="s") {
 				userinput+=lastsearch;
@@ -786,9 +902,9 @@ try{
 				lastsearch=userinput.substr(1,userinput.length()-1);
 			}
 			if (blockend==blockstart) {
-  			   sectornum=scanforblock(rawdevice,lastsearch,0,0xffffffff,sectornum);
+  			   sectornum=scanforblock(fsys,lastsearch,0,0xffffffff,sectornum,false);
 			} else {
-  			   sectornum=scanforblock(rawdevice,lastsearch,blockstart,blockend,sectornum);
+  			   sectornum=scanforblock(fsys,lastsearch,blockstart,blockend,sectornum,false);
 			}
 			continue;
 		}
@@ -896,6 +1012,30 @@ try{
 			cout << "Done." << endl;
 			continue;
 		}
+		if (userinput=="rescue") {
+			unsigned long rescuestart=blockstart;
+			unsigned long rescueend=blockend;
+			if (blockend==blockstart) {
+				rescuestart=0;
+				rescueend=rawdevice->getlastsectornum(&lastsecerror)+1;
+			}
+			string mapfilename=filename+".map";
+			cout << "Rescuing " << rescueend-rescuestart << " sectors to " << filename 
+			     << " (map file " << mapfilename << ")" << endl;
+			int result=hd24utils::rescuedrivesectors(fsys,&filename,&mapfilename,
+						rescuestart,rescueend-1,3,NULL,NULL);
+			if (result==hd24utils::RESCUE_CANNOTOPEN) {
+				cout << "Cannot write to file " << filename << ". Access denied?" << endl;
+			} else if (result==hd24utils::RESCUE_WRITEERROR) {
+				cout << "Error writing to file " << filename << ". Disk full? Run rescue again to continue." << endl;
+			} else if (result==hd24utils::RESCUE_BADSECTORS) {
+				cout << "Done, but some sectors could not be read. See " << mapfilename << endl;
+			} else {
+				cout << "Done." << endl;
+			}
+			nodump=1; // inhibit viewing the sector after this command.
+			continue;
+		}
 		if (userinput=="ws") {
 			cout << "user request to write sectors" << endl;
 			if (expertmode==1) {
@@ -0,0 +1,106 @@
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#include <convertlib.h>
+#include <hd24fs.h>
+#include <hd24utils.h>
+
+/* Converts plain drive images to smart drive images and back.
+   The direction follows from the source: a smart image becomes a
+   plain image, anything else becomes a smart image. */
+
+using namespace std;
+
+string sourcefilename;
+string targetfilename;
+int threads=4;
+bool compress=false;
+bool verify=true;
+
+void showusage()
+{
+	cout << "Usage: hd24imgconv [options] <source image> <target image>" << endl
+	     << "Options:" << endl
+	     << "  --threads=<n>  number of copy threads (default 4)" << endl
+	     << "  --compress     store clusters compressed where possible" << endl
+	     << "                 (plain to smart conversions only)" << endl
+	     << "  --noverify     do not read back and compare the target" << endl;
+}
+
+int parsecommandline(int argc, char **argv)
+{
+	int invalid = 0;
+	int filenames = 0;
+
+	for (int c = 1; c < argc; c++) {
+		string arg = argv[c];
+
+		if (arg.substr(0, 1) != "-") {
+			if (filenames == 0) {
+				sourcefilename = arg;
+			} else if (filenames == 1) {
+				targetfilename = arg;
+			} else {
+				cout << "Too many file names: " << arg << endl;
+				invalid = 1;
+			}
+			filenames++;
+			continue;
+		}
+
+		if (arg.substr(0,strlen("--threads=")) == "--threads=") {
+			threads = Convert::str2long(arg.substr(strlen("--threads=")));
+			continue;
+		}
+
+		if (arg == "--compress") {
+			compress = true;
+			continue;
+		}
+
+		if (arg == "--noverify") {
+			verify = false;
+			continue;
+		}
+
+		cout << "Invalid argument: " << arg << endl;
+		invalid = 1;
+	}
+	if ((invalid == 0) && (filenames != 2)) {
+		invalid = 1;
+	}
+	return invalid;
+}
+
+int main (int argc, char **argv)
+{
+	int invalid = parsecommandline(argc, argv);
+	if (invalid != 0) {
+		showusage();
+		return invalid;
+	}
+	if (sourcefilename == targetfilename) {
+		cout << "Source and target must be different files." << endl;
+		return 1;
+	}
+
+	char message[2048];
+	message[0] = '\0';
+	int cancel = 0;
+	int result = hd24utils::convertdriveimage(&sourcefilename, &targetfilename,
+				threads, compress, verify, message, &cancel);
+
+	if (result == hd24utils::CONVERT_COMPLETE) {
+		cout << message << endl;
+		return 0;
+	}
+	if (result == hd24utils::CONVERT_CANNOTOPEN) {
+		cout << "Cannot open source or create target image." << endl;
+	} else if (result == hd24utils::CONVERT_VERIFYFAILED) {
+		cout << "Verification failed: target differs from source." << endl;
+	} else {
+		cout << "Read/write error during conversion." << endl;
+	}
+	return result;
+}
@@ -24,76 +24,188 @@ using namespace std;
 */
 
 #include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<vector>
+#include	<sys/types.h>
+#include	<sys/stat.h>
+#include	<fcntl.h>
+#if defined(LINUX) || defined(DARWIN)
+#include	<unistd.h>
+#include	<pthread.h>
+#include	<sys/mman.h>
+#endif
 
-/* Include this header file to use functions from libsndfile. */
-#include	<sndfile.h>
+/* Raw track dumps hold 24 bit big endian samples. They are converted
+** to little endian WAV data by swapping bytes in large buffers, several
+** files at a time.
+*/
 
-/*    This will be the length of the buffer used to hold.frames while
-**    we process them.
+/*    This will be the length of the buffer used to hold the samples
+**    while we process them (a multiple of 3 bytes).
 */
-#define		BUFFER_LEN	1024
+#define		BUFFER_LEN	(3*1024*1024)
+#define		WAVHEADERSIZE	44
+#define		MAXTHREADS	16
+
+typedef struct
+{
+	string inputfilename;
+	string outputfilename;
+	int result;
+} towavjob;
+
+typedef struct
+{
+	vector<towavjob>* jobs;
+	unsigned int nextjob;
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_t lock;
+#endif
+} towavbatch;
 
-/* libsndfile can handle more than 6 channels but we'll restrict it to 6. */
-#define		MAX_CHANNELS	6
 string inputfilename;
 string outputfilename;
 string format;
 long rate;
 long bits;
-int convertfile(string inputfilename) {
-/* This is a buffer of double precision floating point values
- * which will hold our data while we process it.
- */
-	format="wav";
-	cout << "Converting " << inputfilename << endl;
-    if (rate==0) {
+int threads;
+bool usemmap;
+vector<towavjob> jobs;
+
+#if defined(LINUX) || defined(DARWIN)
+pthread_mutex_t outputlock=PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void showmessage(string message)
+{
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_lock(&outputlock);
+#endif
+	cout << message << endl;
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_unlock(&outputlock);
+#endif
+}
+
+long ratefromfilename(string inputfilename)
+{
 	if (
 		(inputfilename.find("44k1",0) != string::npos)
 		||(inputfilename.find("44K1",0) != string::npos)
 		||(inputfilename.find("44100",0) != string::npos)
 	) {
-		rate=44100;
+		return 44100;
 	}
 	if (
 		(inputfilename.find("48k",0) != string::npos)
 		||(inputfilename.find("48K",0) != string::npos)
 		||(inputfilename.find("48000",0) != string::npos)
 	) {
-		rate=48000;
+		return 48000;
 	}
 	if (
 		(inputfilename.find("88k2",0) != string::npos)
 		||(inputfilename.find("88K2",0) != string::npos)
 		||(inputfilename.find("88200",0) != string::npos)
 	) {
-		rate=88200;
+		return 88200;
 	}
 	if (
 		(inputfilename.find("96k",0) != string::npos)
 		||(inputfilename.find("96K",0) != string::npos)
 		||(inputfilename.find("96000",0) != string::npos)
 	) {
-		rate=96000;
-	}
-    }
-    bits=24;
-    static int data [BUFFER_LEN] ;
-
-    /* A SNDFILE is very much like a FILE in the Standard C library. The
-    ** sf_open function return an SNDFILE* pointer when they sucessfully
-	** open the specified file.
-    */
-    SNDFILE      *infile, *outfile ;
-
-    /* A pointer to an SF_INFO stutct is passed to sf_open.
-    ** On read, the library fills this struct with information about the file.
-    ** On write, the struct must be filled in before calling sf_open.
-    */
-    SF_INFO		sfinfoin ;
-    SF_INFO		sfinfoout;
-    int			readcount ;
+		return 96000;
+	}
+	return 0;
+}
+
+void putle(unsigned char* buf,unsigned long value,int bytes)
+{
+	for (int i=0;i<bytes;i++) {
+		buf[i]=(unsigned char)(value & 0xff);
+		value=value>>8;
+	}
+}
+
+void makewavheader(unsigned char* header,long samplerate,int bytespersample,__uint64 datasize)
+{
+	/* RIFF sizes are 32 bit; longer files get the largest size
+	   that still fits, as most readers will then use the file size.
+	   An odd sized data chunk is followed by a pad byte, which counts
+	   in the RIFF size but not in the data size. */
+	if (datasize>0xFFFFFFFFULL-37) {
+		datasize=0xFFFFFFFFULL-37;
+	}
+	memcpy(&header[0],"RIFF",4);
+	putle(&header[4],(unsigned long)(36+datasize+(datasize&1)),4);
+	memcpy(&header[8],"WAVEfmt ",8);
+	putle(&header[16],16,4);			/* fmt chunk size */
+	putle(&header[20],1,2);				/* PCM */
+	putle(&header[22],1,2);				/* channels */
+	putle(&header[24],samplerate,4);
+	putle(&header[28],samplerate*bytespersample,4);	/* bytes/sec */
+	putle(&header[32],bytespersample,2);		/* block align */
+	putle(&header[34],bytespersample*8,2);		/* bits/sample */
+	memcpy(&header[36],"data",4);
+	putle(&header[40],(unsigned long)datasize,4);
+}
+
+void repack(unsigned char* in,unsigned char* out,__uint32 samples,int bytespersample)
+{
+	/* Converts 24 bit big endian samples to 24 or 16 bit little endian.
+	   'in' and 'out' may be the same buffer. */
+	if (bytespersample==3) {
+		for (__uint32 i=0;i<samples;i++) {
+			unsigned char b0=in[0];
+			out[1]=in[1];
+			out[0]=in[2];
+			out[2]=b0;
+			in+=3;
+			out+=3;
+		}
+		return;
+	}
+	for (__uint32 i=0;i<samples;i++) {
+		unsigned char b0=in[0];
+		out[0]=in[1];
+		out[1]=b0;
+		in+=3;
+		out+=2;
+	}
+}
+
+__uint64 towavfilesize(FILE* file)
+{
+#ifdef WINDOWS
+	_fseeki64(file,0,SEEK_END);
+	__uint64 size=(__uint64)_ftelli64(file);
+	_fseeki64(file,0,SEEK_SET);
+#else
+	fseeko(file,0,SEEK_END);
+	__uint64 size=(__uint64)ftello(file);
+	fseeko(file,0,SEEK_SET);
+#endif
+	return size;
+}
+
+int convertfile(towavjob* job)
+{
+	string inputfilename=job->inputfilename;
+	string outputfilename=job->outputfilename;
+	long filerate=rate;
+	if (filerate==0) {
+		filerate=ratefromfilename(inputfilename);
+	}
+	if (filerate==0) {
+		showmessage("Cannot tell sample rate of "+inputfilename+", please use --rate");
+		return 1;
+	}
+	int bytespersample=(bits==16)?2:3;
+
 	if (inputfilename=="") {
-		cout << "Must specify --input filename" << endl;
+		showmessage("Must specify --input filename");
 		return 1;
 	}
 	if (outputfilename=="") {
@@ -102,123 +214,230 @@ int convertfile(string inputfilename) {
 		if (format=="wav") {
 			ext=".wav";
 		}
-		if (outputfilename.substr(outputfilename.length()-4,4)==".raw") {
+		if ((outputfilename.length()>4)&&(outputfilename.substr(outputfilename.length()-4,4)==".raw")) {
 			outputfilename=outputfilename.substr(0,outputfilename.length()-4)+ext;
+		} else {
+			outputfilename+=ext;
 		}
-		if (outputfilename=="") {
-			cout << "Must specify --output filename" << endl;
-			return 1;
-		}
-	}
-    const char	*infilename = inputfilename.c_str();
-    const char	*outfilename = outputfilename.c_str();
-
-    /* Here's where we open the input file. We pass sf_open the file name and
-    ** a pointer to an SF_INFO struct.
-    ** On successful open, sf_open returns a SNDFILE* pointer which is used
-    ** for all subsequent operations on that file.
-    ** If an error occurs during sf_open, the function returns a NULL pointer.
-	**
-	** If you are trying to open a raw headerless file you will need to set the
-	** format and channels fields of sfinfo before calling sf_open(). For
-	** instance to open a raw 16 bit stereo PCM file you would need the following
-	** two lines:
-	**
-	**		sfinfo.format   = SF_FORMAT_RAW | SF_FORMAT_PCM_16 ;
-	**		sfinfo.channels = 2 ;
-    */
-	sfinfoin.format   = SF_FORMAT_RAW | SF_FORMAT_PCM_24|SF_ENDIAN_BIG ;
-	sfinfoin.channels = 1 ;
-
-	if (format=="wav") {
-		sfinfoout.format   = SF_FORMAT_WAV ;
-	}
-	if (bits==16) {
-		sfinfoout.format|=SF_FORMAT_PCM_16;
-	}
-	if (bits==24) {
-		sfinfoout.format|=SF_FORMAT_PCM_24;
-	}
-
-	sfinfoout.samplerate=rate;
-	sfinfoout.channels = 1 ;
-    if (! (infile = sf_open (infilename, SFM_READ, &sfinfoin)))
-    {   /* Open failed so print an error message. */
-        printf ("Not able to open input file %s.\n", infilename) ;
-        /* Print the error message from libsndfile. */
-        puts (sf_strerror (NULL)) ;
-        return  1 ;
-        } ;
-
-    /* Open the output file. */
-    if (! (outfile = sf_open (outfilename, SFM_WRITE, &sfinfoout)))
-    {   printf ("Not able to open output file %s.\n", outfilename) ;
-        puts (sf_strerror (NULL)) ;
-        return  1 ;
-        } ;
-
-    /* While there are.frames in the input file, read them, process
-    ** them and write them to the output file.
-    */
-    while ((readcount = sf_read_int (infile, data, BUFFER_LEN)))
-    {   
-        sf_write_int (outfile, data, readcount) ;
-        } ;
-
-    /* Close input and output files. */
-    sf_close (infile) ;
-    sf_close (outfile) ;
-	return 0;
+	}
+	showmessage("Converting "+inputfilename);
+
+	FILE* infile=fopen(inputfilename.c_str(),"rb");
+	if (infile==NULL) {
+		showmessage("Not able to open input file "+inputfilename);
+		return 1;
+	}
+	__uint64 samples=towavfilesize(infile)/3;
+
+	FILE* outfile=fopen(outputfilename.c_str(),"wb");
+	if (outfile==NULL) {
+		showmessage("Not able to open output file "+outputfilename);
+		fclose(infile);
+		return 1;
+	}
+	unsigned char header[WAVHEADERSIZE];
+	makewavheader(header,filerate,bytespersample,samples*bytespersample);
+	int result=0;
+	if (fwrite(header,1,WAVHEADERSIZE,outfile)!=WAVHEADERSIZE) {
+		result=1;
+	}
+
+	unsigned char* buffer=(unsigned char*)malloc(BUFFER_LEN);
+	unsigned char* mapped=NULL;
+#if defined(LINUX) || defined(DARWIN)
+	if ((usemmap) && (samples>0)) {
+		mapped=(unsigned char*)mmap(NULL,(size_t)(samples*3),PROT_READ,MAP_PRIVATE,fileno(infile),0);
+		if (mapped==(unsigned char*)MAP_FAILED) {
+			mapped=NULL;
+		} else {
+			madvise(mapped,(size_t)(samples*3),MADV_SEQUENTIAL);
+		}
+	}
+#endif
+	__uint64 done=0;
+	while ((result==0) && (buffer!=NULL) && (done<samples)) {
+		__uint32 count=BUFFER_LEN/3;
+		if (samples-done<count) {
+			count=(__uint32)(samples-done);
+		}
+		unsigned char* in=buffer;
+		if (mapped!=NULL) {
+			in=&mapped[done*3];
+		} else if (fread(buffer,3,count,infile)!=count) {
+			result=1;
+			break;
+		}
+		repack(in,buffer,count,bytespersample);
+		if (fwrite(buffer,bytespersample,count,outfile)!=count) {
+			result=1;
+			break;
+		}
+		done+=count;
+	}
+	if ((result==0) && (buffer!=NULL) && (((samples*bytespersample)&1)!=0)) {
+		if (fputc(0,outfile)==EOF) {
+			result=1;
+		}
+	}
+#if defined(LINUX) || defined(DARWIN)
+	if (mapped!=NULL) {
+		munmap(mapped,(size_t)(samples*3));
+	}
+#endif
+	if (buffer==NULL) {
+		result=1;
+	} else {
+		free(buffer);
+	}
+	fclose(infile);
+	if (fclose(outfile)!=0) {
+		result=1;
+	}
+	if (result!=0) {
+		showmessage("Error converting "+inputfilename+" to "+outputfilename);
+	}
+	return result;
 }
 
-int parsecommandline(int argc, char **argv) 
+void* towavworker(void* batchptr)
+{
+	towavbatch* batch=(towavbatch*)batchptr;
+	while (1) {
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_lock(&batch->lock);
+#endif
+		unsigned int jobnum=batch->nextjob;
+		batch->nextjob++;
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_unlock(&batch->lock);
+#endif
+		if (jobnum>=batch->jobs->size()) {
+			break;
+		}
+		towavjob* job=&((*batch->jobs)[jobnum]);
+		job->result=convertfile(job);
+	}
+	return NULL;
+}
+
+int convertfiles(vector<towavjob>* jobs)
+{
+	/* Converts all files on a pool of threads; returns the number
+	   of files that failed. */
+	towavbatch batch;
+	batch.jobs=jobs;
+	batch.nextjob=0;
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_init(&batch.lock,NULL);
+	pthread_t worker[MAXTHREADS];
+	int started=0;
+	for (int i=1;(i<threads)&&(i<(int)jobs->size());i++) {
+		if (pthread_create(&worker[started],NULL,towavworker,(void*)&batch)!=0) {
+			break;
+		}
+		started++;
+	}
+	towavworker((void*)&batch);
+	for (int i=0;i<started;i++) {
+		pthread_join(worker[i],NULL);
+	}
+	pthread_mutex_destroy(&batch.lock);
+#endif
+#ifdef WINDOWS
+	towavworker((void*)&batch);
+#endif
+	int failed=0;
+	for (unsigned int i=0;i<jobs->size();i++) {
+		if ((*jobs)[i].result!=0) {
+			failed++;
+		}
+	}
+	return failed;
+}
+
+void addjob(string inputfilename,string outputfilename)
+{
+	towavjob job;
+	job.inputfilename=inputfilename;
+	job.outputfilename=outputfilename;
+	job.result=0;
+	jobs.push_back(job);
+}
+
+int parsecommandline(int argc, char **argv)
 {
 	int invalid = 0;
-	
+
 	for (int c = 1; c < argc; c++) {
 		string arg = argv[c];
-		
+
 		if (arg.substr(0, 1) != "-") {
-			inputfilename = arg;
-			outputfilename = "";
-			convertfile(inputfilename);		
+			addjob(arg,"");
 			continue;
 		}
-		
+
 		if (arg.substr(0,strlen("--input=")) == "--input=") {
 			inputfilename = arg.substr(strlen("--input="));
 			continue;
 		}
-		
+
 		if (arg.substr(0,strlen("--output=")) == "--output=") {
 			outputfilename = arg.substr(strlen("--output="));
 			continue;
 		}
-		
+
 		if (arg.substr(0,strlen("--rate=")) == "--rate=") {
 			rate = Convert::str2long(arg.substr(strlen("--rate=")));
 			continue;
 		}
-		
+
 		if (arg.substr(0,strlen("--bits=")) == "--bits=") {
 			bits = Convert::str2long(arg.substr(strlen("--bits=")));
 			continue;
 		}
 
+		if (arg.substr(0,strlen("--threads=")) == "--threads=") {
+			threads = Convert::str2long(arg.substr(strlen("--threads=")));
+			if (threads<1) threads=1;
+			if (threads>MAXTHREADS) threads=MAXTHREADS;
+			continue;
+		}
+
+		if (arg == "--mmap") {
+			usemmap = true;
+			continue;
+		}
+
 		cout << "Invalid argument: " << arg << endl;
 		invalid = 1;
 	}
+	if (inputfilename != "") {
+		addjob(inputfilename,outputfilename);
+	}
 	return invalid;
 }
 
-int main (int argc, char **argv) 
+int main (int argc, char **argv)
 {
+	format = "wav";
 	rate = 0;
+	bits = 24;
+	threads = 4;
+	usemmap = false;
 	int invalid = parsecommandline(argc, argv);
-	
+
 	if (invalid!=0) {
 		return invalid;
 	}
+	if (jobs.size()==0) {
+		cout << "Usage: hd24towav [--rate=<rate>] [--bits=16|24] [--threads=<n>] [--mmap]" << endl
+		     << "                 <file.raw> [<file.raw> ...]" << endl
+		     << "   or: hd24towav --input=<file.raw> --output=<file.wav>" << endl;
+		return 1;
+	}
+	if (convertfiles(&jobs)!=0) {
+		return 1;
+	}
 
     return 0 ;
 } /* main */
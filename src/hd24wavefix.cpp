@@ -21,20 +21,44 @@ using namespace std;
 #include <stdio.h>
 #include <stdlib.h>
 #include <iostream>
+#if defined(LINUX) || defined(DARWIN)
+#include <pthread.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 //#include "lib/convertlib.h"
 #define HEADERSIZE 44
 // #define SAMPLES_IN_QUARTER_BUF 512*1024
 #define SAMPLES_IN_QUARTER_BUF 128
-#define SAMPLES_IN_HALF_BUF 2*SAMPLES_IN_QUARTER_BUF
-#define SAMPLES_IN_FULL_BUF 2*SAMPLES_IN_HALF_BUF
+#define SAMPLES_IN_HALF_BUF (2*SAMPLES_IN_QUARTER_BUF)
+#define SAMPLES_IN_FULL_BUF (2*SAMPLES_IN_HALF_BUF)
 #define BYTES_PER_SAM 3
-#define BYTES_IN_QUARTER_BUF BYTES_PER_SAM*SAMPLES_IN_QUARTER_BUF
-#define BYTES_IN_HALF_BUF BYTES_PER_SAM*SAMPLES_IN_HALF_BUF
-#define BYTES_IN_FULL_BUF BYTES_PER_SAM*SAMPLES_IN_FULL_BUF
+#define BYTES_IN_QUARTER_BUF (BYTES_PER_SAM*SAMPLES_IN_QUARTER_BUF)
+#define BYTES_IN_HALF_BUF (BYTES_PER_SAM*SAMPLES_IN_HALF_BUF)
+#define BYTES_IN_FULL_BUF (BYTES_PER_SAM*SAMPLES_IN_FULL_BUF)
 #define MAXDIST 0x7fffffff
-unsigned char audiobuf[BYTES_IN_FULL_BUF];
-unsigned char deltabuf[BYTES_IN_FULL_BUF];
-unsigned char fixbuf[BYTES_IN_HALF_BUF];
+/* As in the original buffered code, audio is repaired in blocks of
+   SAMPLES_IN_HALF_BUF samples: all passes are done for a block before
+   the next one, the filter only looks ahead within the block, and it
+   uses the fully repaired end of the block before as history.
+   Blocks are grouped in chunks of CHUNKSAMPLES samples, which are
+   repaired by a pool of threads. Each chunk holds CHUNKLEAD samples
+   of history before it and CHUNKTRAIL samples after it, which stay 0
+   (the filter only sees those past the end of the file). A chunk is
+   first repaired with the unrepaired samples before it as history,
+   and fixed up once the chunk before it is done (see fixhistory). */
+#ifndef CHUNKSAMPLES
+#define CHUNKSAMPLES (1024*1024)	/* a multiple of SAMPLES_IN_HALF_BUF */
+#endif
+#define CHUNKLEAD FILTERBUFSIZE
+#define CHUNKTRAIL 4
+#define CHUNKWORKSAMPLES (CHUNKLEAD+CHUNKSAMPLES+CHUNKTRAIL)
+#define MAXTHREADS 16
+/* Automatic mask detection looks at MASKWINDOWS windows spread over the
+   file; each chunk then tries to detect its own mask from its data. */
+#define MASKWINDOWS 16
+#define MASKWINDOWBYTES 65536
 string inputfile;
 string outputfile;
 string maskbin;
@@ -42,35 +66,86 @@ FILE* infile;
 FILE* outfile;
 FILE* deltafile;
 __uint64 writeoffset;
-int maskpermutations;
 int simplemode=0;
 int testmode=0;
 int invertmask=0;
 int noinvertmask=0;
 int passes=3;
-int maskones;
-int* maskperm;
 int print;
-float weight[FILTERBUFSIZE+10];
+int threads=4;
+/* filter weights, for 0, 1 or 2 future reference samples */
+float weights[3][FILTERBUFSIZE];
+
+/* Candidate XOR values for each of the three repair passes, derived 
+   from a 16 bit damage mask. The candidate lists are padded with zeroes
+   to a multiple of 4 so they can be evaluated 4 at a time. */
+typedef struct
+{
+	int mask;
+	int candidates[3];
+	int* xorval[3];
+} wavefixmask;
+wavefixmask filemask;
+
+typedef struct
+{
+	__uint64 firstsample;	/* file sample number of sam[0] */
+	int samples;		/* number of samples in this chunk */
+	__uint32 bytes;		/* number of bytes to write for this chunk */
+	int* work;		/* CHUNKWORKSAMPLES 24 bit sample values */
+	int* sam;		/* &work[CHUNKLEAD] */
+	int* orig;		/* work as read from the file */
+	int* delta;
+	unsigned char* raw;	/* CHUNKWORKSAMPLES*BYTES_PER_SAM bytes */
+	wavefixmask regionmask;	/* mask detected for this chunk */
+	wavefixmask* mask;	/* mask used to repair this chunk */
+	int* dists;		/* distance per candidate */
+} wavefixchunk;
+
+typedef struct
+{
+	FILE* infile;
+	FILE* outfile;
+	FILE* deltafile;
+	__uint64 databytes;	/* bytes of audio in the input file */
+	__uint64 chunks;
+	__uint64 nextchunk;	/* next chunk to be repaired */
+	__uint64 nextwrite;	/* next chunk to be written */
+	int history[CHUNKLEAD];	/* last samples of the chunk written last */
+	bool writeerror;
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_t lock;
+	pthread_cond_t written;
+#endif
+} wavefixjob;
 
 #define TESTLEN (48000*3*120)
-void calcmaskpermutations(int mask)
+void calcmaskpermutations(wavefixmask* m,int mask)
 {
+	/* Every combination of the bits in the mask is a candidate 
+	   correction. The first pass applies the mask to the top byte of a
+	   sample, so only combinations of its lower 8 bits are distinct. */
 	int i;
-	maskperm=(int*)malloc(maskpermutations*sizeof(int));
-	int bitnum=0;
-	maskones=0;
+	int maskones=0;
 	int bitpos[16];
 	for (i=0;i<16;i++)
 	{
 		if ((mask & (1<<i)) !=0)
 		{
-			bitpos[bitnum]=i;
-			bitnum++;
+			bitpos[maskones]=i;
 			maskones++;
 		}
 	}
-	maskpermutations=(1<<maskones);		
+	int maskpermutations=(1<<maskones);
+	m->mask=mask;
+	bool seen[256];
+	memset(seen,0,sizeof(seen));
+	for (int pass=0;pass<3;pass++) {
+		m->candidates[pass]=0;
+		if (m->xorval[pass]!=NULL) free(m->xorval[pass]);
+		m->xorval[pass]=(int*)malloc((maskpermutations+3)*sizeof(int));
+		memset(m->xorval[pass],0,(maskpermutations+3)*sizeof(int));
+	}
 	for (int permu=0; permu< maskpermutations; permu++)
 	{
 		int maskval=0;
@@ -80,80 +155,142 @@ void calcmaskpermutations(int mask)
 				maskval+=(1<<bitpos[bitnum]);
 			}
 		}
-		maskperm[permu]=maskval;
+		if (!seen[maskval&0xff]) {
+			seen[maskval&0xff]=true;
+			m->xorval[0][m->candidates[0]++]=(maskval<<16)&0xffffff;
+		}
+		m->xorval[1][m->candidates[1]++]=maskval<<8;
+		m->xorval[2][m->candidates[2]++]=maskval;
 		if (print) printf("mask permutation %d is %x\n",permu,maskval);
 	}
 }
 
-void clearaudiobuf()
-{	
-	int i;
-	for (i=0;i<BYTES_IN_FULL_BUF;i++) {
-		audiobuf[i]=0;
-		deltabuf[i]=0;
+void freemask(wavefixmask* m)
+{
+	for (int pass=0;pass<3;pass++) {
+		if (m->xorval[pass]!=NULL) free(m->xorval[pass]);
+		m->xorval[pass]=NULL;
 	}
 }
-void shiftaudiobuf()
+
+__uint64 spreadbits[256];
+
+void initspreadbits()
 {
-	int i;
-	for (i=0;i<BYTES_IN_HALF_BUF;i++) {
-		audiobuf[i]=audiobuf[i+BYTES_IN_HALF_BUF];
-		audiobuf[i+BYTES_IN_HALF_BUF]=0;
-		deltabuf[i]=deltabuf[i+BYTES_IN_HALF_BUF];
-		deltabuf[i+BYTES_IN_HALF_BUF]=0;
-	}
-}
-int getsam(int samnum)
-{	
-	int bufpos=(samnum*3)+BYTES_IN_HALF_BUF;
-	int samval=audiobuf[bufpos+0]
-	          +(audiobuf[bufpos+1]<<8)
-		  +(audiobuf[bufpos+2]<<16);
-	samval = samval & 0xffffff;
-/*	if ((samnum % 100000)==0)
-	printf("Getsam %d (bufpos %d)= %x\n",samnum,bufpos,samval); */
-	return samval;
+	/* spreadbits[x] has the bits of x in separate bytes, most
+	   significant bit in the lowest byte. Adding these up counts
+	   8 bit positions at once. */
+	for (int x=0;x<256;x++) {
+		spreadbits[x]=0;
+		for (int bit=0;bit<8;bit++) {
+			if ((x & (0x80>>bit))!=0) {
+				spreadbits[x]|=((__uint64)1)<<(8*bit);
+			}
+		}
+	}
 }
-void setsam(int samnum,int samval)
+
+void countbits(unsigned char* buf,__uint32 bytes,__uint32* on)
 {
-	int bufpos=(samnum*3)+BYTES_IN_HALF_BUF;
-	samval=samval&0xFFFFFF;
-	unsigned char v1=(unsigned char)(samval);
-	unsigned char v2=(unsigned char)((samval>>8));
-	unsigned char v3=(unsigned char)((samval>>16));
-	int oldval=getsam(samnum);
+	/* Counts how often each bit of the 16 bit (big endian) words in
+	   buf is set; on[0] counts the most significant bit. */
+	__uint32 words=bytes/2;
+	__uint32 i=0;
+	while (i<words) {
+		/* byte counters cannot overflow within 255 words */
+		__uint32 n=words-i;
+		if (n>255) n=255;
+		__uint64 acchi=0;
+		__uint64 acclo=0;
+		for (__uint32 k=0;k<n;k++,i++) {
+			acchi+=spreadbits[buf[2*i]];
+			acclo+=spreadbits[buf[2*i+1]];
+		}
+		for (int bit=0;bit<8;bit++) {
+			on[bit]+=(acchi>>(8*bit))&0xff;
+			on[8+bit]+=(acclo>>(8*bit))&0xff;
+		}
+	}
+}
+
+int maskfromcounts(__uint32* on,int invert,bool verbose)
+{
+	/* Bits that are set much more or much less often than average
+	   are assumed to be damaged. */
+	int mask=0;
+	int totavg=0;
+	for (int i=0;i<16;i++)
+	{
+		if (verbose) cout << on[i] << endl;
+		totavg+=on[i];
+	}
+	totavg/=16;
+	if (verbose) printf("limit=%d\n",(totavg/4));
+	for (int i=0;i<16;i++)
+	{
+		int a=abs(totavg-(int)on[i]);
+		int b=(totavg/4);
+		if (invert==1)
+		{
+			b*=3;
+		}
+		int c=0;
+		if (a>b)
+		{
+			mask+=1<<(15-i);
+			c=1;
+		}
+		if (verbose) printf("a,b=%d,%d => %d\n",a,b,c);
+	}
+	return mask;
+}
+
+string maskstring(int mask)
+{
+	string maskstr="";
+	for (int i=0;i<16;i++)
+	{
+		maskstr+=((mask & (1<<(15-i)))!=0)?"1":"0";
+	}
+	return maskstr;
+}
+
+void initweights()
+{
+	/* Reference samples after the damaged sample count most; 
+	   older history counts less and less. With two future references
+	   the original per-sample code set weight[1] to 1.5 and kept the
+	   older weights of the last sample of the previous block, which
+	   had no future reference. */
+	for (int future=0;future<3;future++)
+	{
+		float* weight=weights[future];
+		weight[0]=1;
+		if (future==1) weight[1]=1.2;
+		for (int j=future+1;j<FILTERBUFSIZE;j++) {
+			weight[j]=weight[j-1]*WEIGHTMULT;
+		}
+	}
+	for (int j=2;j<FILTERBUFSIZE;j++) {
+		weights[2][j]=weights[0][j];
+	}
+	weights[2][1]=1.5;
+}
 
-	int prevval=getsam(samnum-1);
-	int prevval2=getsam(samnum-2);
+void setsam(wavefixchunk* chunk,int samnum,int samval)
+{
+	int* sam=chunk->sam;
+	samval=samval&0xFFFFFF;
+	int prevval=sam[samnum-1];
+	int prevval2=sam[samnum-2];
 	int delta=(samval>prevval)?samval-prevval:prevval-samval;
 	delta+=(prevval2>prevval)?prevval2-prevval:prevval-prevval2;
-	unsigned char dv1=(unsigned char)(delta);
-	unsigned char dv2=(unsigned char)((delta>>8));
-	unsigned char dv3=(unsigned char)((delta>>16));
 
 	if (print) {
-	printf("setsam %d (bufpos=%d) from %x to %x - %x %x %x\n",samnum,bufpos,oldval,samval,v1,v2,v3);
-	}
-//	printf("vals=%d %d %d\n",v1,v2,v3);
-	v1=v1&0xff;
-	v2=v2&0xff;
-	v3=v3&0xff;
-	dv1=dv1&0xff;
-	dv2=dv2&0xff;
-	dv3=dv3&0xff;
-	
-//	printf("vals=%d %d %d\n",v1,v2,v3);
-	audiobuf[bufpos+0]=v1;
-	audiobuf[bufpos+1]=v2;
-	audiobuf[bufpos+2]=v3;
-	deltabuf[bufpos+0]=dv1;
-	deltabuf[bufpos+1]=dv2;
-	deltabuf[bufpos+2]=dv3;
-	//if (audiobuf[bufpos+0]!=v1) { printf("memory error, v1 expected %x but got %x\n",v1,audiobuf[bufpos+0]); }
-//	if (audiobuf[bufpos+1]!=v2) { printf("memory error, v2 expected %x but got %x\n",v2,audiobuf[bufpos+1]); }
-	//if (audiobuf[bufpos+2]!=v3) { printf("memory error, v3 expected %x but got %x\n",v3,audiobuf[bufpos+2]); }
-
-//	printf("After setsam samval is %x\n",getsam(samnum));
+	printf("setsam %d from %x to %x\n",(int)(chunk->firstsample+samnum),sam[samnum],samval);
+	}
+	sam[samnum]=samval;
+	chunk->delta[CHUNKLEAD+samnum]=delta&0xFFFFFF;
 	return;
 }
 int tosigned(int samval) {
@@ -187,6 +324,26 @@ bool fileexists (string* fname) {
         return;
 } */
 
+int wavefixseek(FILE* file,__uint64 pos)
+{
+#ifdef WINDOWS
+	return _fseeki64(file,pos,SEEK_SET);
+#else
+	return fseeko(file,(off_t)pos,SEEK_SET);
+#endif
+}
+
+__uint64 wavefixfilesize(FILE* file)
+{
+#ifdef WINDOWS
+	_fseeki64(file,0,SEEK_END);
+	return (__uint64)_ftelli64(file);
+#else
+	fseeko(file,0,SEEK_END);
+	return (__uint64)ftello(file);
+#endif
+}
+
 int parsecommandline(int argc, char ** argv) 
 {
 	int invalid=0;
@@ -227,6 +384,12 @@ int parsecommandline(int argc, char ** argv)
 			passes=3;
 			continue;
 		}
+		if (arg.substr(0,strlen("--threads="))=="--threads=") {
+			threads=atoi(arg.substr(strlen("--threads=")).c_str());
+			if (threads<1) threads=1;
+			if (threads>MAXTHREADS) threads=MAXTHREADS;
+			continue;
+		}
 		if (arg.substr(0,strlen("--invertmask"))=="--invertmask") {
 			invertmask=1;
 			continue;
@@ -255,7 +418,7 @@ int parsecommandline(int argc, char ** argv)
 		
 		cout << "Invalid argument: " << arg << endl;
 		cout << "Usage:" << endl
-		<< "--simple[=0,1] --print --input=<infile> --output=<outfile> --passes=(1|2|3) --mask=00101010... [--invert (default) | --noinvert]" << endl;
+		<< "--simple[=0,1] --print --input=<infile> --output=<outfile> --passes=(1|2|3) --mask=00101010... [--invert (default) | --noinvert] --threads=<n>" << endl;
 
 
 		invalid=1;
@@ -276,83 +439,66 @@ int findmask(FILE* infile)
 		}
 	    }
             cout << "Using " << localmask <<" (" << maskbin << ") as maskval" << endl;
+	    calcmaskpermutations(&filemask,localmask);
             return localmask;
         }
 
-	fseek(infile,HEADERSIZE,SEEK_SET);
-
-	int readcount=fread((void*)&audiobuf[0],1,BYTES_IN_HALF_BUF,infile);
-//    cout << "readcount="<<readcount << endl;
-    int on[16];
-    for (int i=0;i<16;i++) { on[i]=0; }
-    for (int i=0;i<readcount;i+=2)
-    {
-        int val1=(int)((unsigned char)audiobuf[i]);
-        int val2=(int)((unsigned char)audiobuf[i+1]);
-        int x=(val1<<8)+val2; 
-        //int origx=x;
-        
-        for (int j=0;j<16;j++)
-        {
-            if ((x&0x8000)!=0) {
-//                cout << "1";
-                on[j]++;
-            } else {
-//                cout << "0";
-            }
-            x=x<<1;
-        }
-//        cout << " " << origx << endl;
-    }
-    cout << "readcount/2=" << (readcount/2) << endl;
-    int totones=0;
-
-    int mask=0;
-    int totavg=0;
-    for (int i=0;i<16;i++)
-    {
-        cout << on[i] << endl;
-        totavg+=on[i];
-    }
-    totavg/=16;
-    string maskstr="";
-    printf("limit=%d\n",(totavg/4));
-    for (int i=0;i<16;i++)
-    {
-	int a=abs(totavg-on[i]);
- 	int b=(totavg/4); 
-       	if (invertmask==1)
+	/* Count bits over a number of windows spread over the file. */
+	__uint64 filesize=wavefixfilesize(infile);
+	__uint64 databytes=(filesize>HEADERSIZE)?filesize-HEADERSIZE:0;
+	unsigned char* audiobuf=(unsigned char*)malloc(MASKWINDOWBYTES);
+	__uint32 on[16];
+	for (int i=0;i<16;i++) { on[i]=0; }
+	__uint64 readcount=0;
+	for (int window=0;window<MASKWINDOWS;window++)
 	{
-		b*=3;
+		__uint64 offset=0;
+		if (databytes>MASKWINDOWBYTES) {
+			offset=((databytes-MASKWINDOWBYTES)/(MASKWINDOWS-1))*window;
+			offset-=offset%2;
+		}
+		wavefixseek(infile,HEADERSIZE+offset);
+		__uint32 windowcount=fread((void*)&audiobuf[0],1,MASKWINDOWBYTES,infile);
+		countbits(audiobuf,windowcount,on);
+		readcount+=windowcount;
+		if (databytes<=MASKWINDOWBYTES) break;
 	}
-        int c;
-	if (a>b)
+	free(audiobuf);
+	cout << "readcount/2=" << (readcount/2) << endl;
+
+	int mask=maskfromcounts(on,invertmask,true);
+	if (((mask==0)||(mask==0xffff)) && (invertmask==0) && (noinvertmask==0))
 	{
-	    totones++;
-	    //int bitval=(1<<i);
-	    int bitval=1<<(15-i);
-	    mask+=bitval;
-	    maskstr+="1";
-	    c=1;
-	}
-	else {
-	    maskstr+="0";
-            c=0;
-	}
-	printf("a,b=%d,%d => %d\n",a,b,c);
-    }
-    if (((mask==0)||(mask==0xffff)) && (invertmask==0) && (noinvertmask==0))
-    {
-        invertmask=1;
-	mask=findmask(infile);
-    } else {
-    
-//    cout << endl;
-	    cout << "mask="<< maskstr;
-	    maskpermutations=1<<totones;
-	    calcmaskpermutations(mask);
-    }
-    return mask;
+		invertmask=1;
+		mask=maskfromcounts(on,invertmask,true);
+	}
+	cout << "mask="<< maskstring(mask);
+	calcmaskpermutations(&filemask,mask);
+	return mask;
+}
+
+void detectregionmask(wavefixchunk* chunk)
+{
+	/* Damage may differ between parts of a file, so each chunk uses
+	   the mask found in its own data, unless that is inconclusive. */
+	chunk->mask=&filemask;
+	if (maskbin!="") {
+		return;
+	}
+	__uint32 on[16];
+	for (int i=0;i<16;i++) { on[i]=0; }
+	countbits(&(chunk->raw[CHUNKLEAD*BYTES_PER_SAM]),chunk->bytes,on);
+	int mask=maskfromcounts(on,invertmask,false);
+	if ((mask==0)||(mask==0xffff)||(mask==filemask.mask)) {
+		return;
+	}
+	if (mask!=chunk->regionmask.mask) {
+		calcmaskpermutations(&(chunk->regionmask),mask);
+	}
+	if (print) {
+		printf("Using mask %x for samples from %lld\n",mask,(long long)chunk->firstsample);
+	}
+	chunk->mask=&(chunk->regionmask);
 }
 
 void copyheader(FILE* infile,FILE* outfile)
@@ -369,251 +515,418 @@ void copyheader(FILE* infile,FILE* outfile)
 	return;
 }
 
-void simplecopyaudio(FILE* infile,FILE* outfile,int mask)
-{
-	printf("mask=%x\n",mask);
-	fseek(infile,HEADERSIZE,SEEK_SET);
-	int readcount;
-
-	__uint32 totbytes=0;
-
-	__uint32 refsams[FILTERBUFSIZE];
-	int srefsam;
-	int dist;
-	__uint32 damagedsam;
-	int blocknum=0;
-	do {
-		shiftaudiobuf();
-		readcount=fread((void*)&audiobuf[BYTES_IN_HALF_BUF],1,BYTES_IN_HALF_BUF,infile);
-		totbytes+=readcount;
-		blocknum++;
-
-		/* ------------- step 1 ----------------*/
-		for (int i=0; i<SAMPLES_IN_HALF_BUF-1;i+=2) {
-			// get current + historic sams
-			refsams[0]=getsam(i); weight[0]=1;
-			int newstart=1;
-			if ((i+2)<SAMPLES_IN_HALF_BUF)
-			{
-				refsams[1]=getsam(i+2);
-				weight[1]=1.2;
-				newstart=2;
-			}
-			if ((i+4)<SAMPLES_IN_HALF_BUF)
-			{
-                               refsams[2]=getsam(i+4);
-                               weight[1]=1.5;
-                               newstart=3;
-			}
-			
-			for (int j=newstart;j<FILTERBUFSIZE;j++) { 
-				refsams[j]=getsam(i-j); 
-				weight[j]=weight[j-1]*WEIGHTMULT;
-			} 
-
-			damagedsam=getsam(i+1);
-
-			int distance=MAXDIST;
-			int winningsam=damagedsam;
-			if (simplemode!=0)
-			{
-				if ((simplemode==1) || (simplemode==2))
-				{
-				winningsam=refsams[0];
-				setsam(i+1,winningsam);
-				continue;
-				}
-				
-				winningsam=damagedsam;
-				setsam(i,damagedsam);
-				continue;
-			}
-			if (print) { printf("refsam, damagedsam= %d (%x) with %d (%x)\n",(int)(refsams[0]&0xffffff),(int)(refsams[0]&0xffffff),(int)(damagedsam&0xffffff),(int)(damagedsam&0xffffff)); }
-			for (int perm=0;perm<maskpermutations;perm++)
-			{
-				int testsam=damagedsam^(maskperm[perm]<<16);
-				if (testsam>0x7fffff) testsam-=0x1000000;
-				int temprefsam=refsams[0];
-				if (temprefsam>0x7fffff) temprefsam-=0x1000000; 
-//				int absdist=(testsam>temprefsam)?testsam-temprefsam:temprefsam-testsam;
-//				if (absdist>MAXSTEP) continue;
-				long long diff=0;
-				//if (print) { printf("calc distance between %d (%x) with %d (%x)\n",(int)(refsam&0xffffff),(int)(refsam&0xffffff),(int)(testsam&0xffffff),(int)(testsam&0xffffff)); }
-
-
-				int sdamsam=testsam;
-				if (sdamsam>0x7fffff) sdamsam-=0x1000000;
-
-				diff=0;
-				for (int j=0;j<FILTERBUFSIZE;j++) { 
-					srefsam=refsams[j];
-					if (srefsam>0x7fffff) srefsam-=0x1000000; 
-					dist=(srefsam>sdamsam)?srefsam-sdamsam:sdamsam-srefsam;
-					int wdist=(int)(dist/weight[j]);
-					diff+=wdist;
-				}
-
-				if ((long long)diff<(long long)distance)
-				{
-					winningsam=testsam;
-					distance=diff;
-					if (print) { 
-					printf("new distance is %d\n",(int)diff); }
-				}
-			}
-			
-			if (print) printf("%x \n",(int)(refsams[0]&0xffffff));	
-			if ((long long)winningsam!=(long long)damagedsam)
-			{
-			if (print) printf("%x -> %x \n",(int)(damagedsam&0xffffff),(int)(winningsam&0xffffff));	
-			} else {
-			if (print) printf("%x\n",(int)(damagedsam&0xffffff));
-			}
+int bestcandidate(int* dists,int candidates)
+{
+	/* First candidate with the smallest distance */
+	int best=-1;
+	int distance=MAXDIST;
+	for (int k=0;k<candidates;k++) {
+		if (dists[k]<distance) {
+			distance=dists[k];
+			best=k;
+		}
+	}
+	return best;
+}
 
-			setsam(i+1,winningsam);
-		}
-		if (passes>1) {
-	        int refsam;
-		if (simplemode==0) {
-		/* ------------- step 2 ----------------*/
-		for (int i=0; i<SAMPLES_IN_HALF_BUF-1;i+=2) {
-			refsam=getsam(i+1);
-			damagedsam=getsam(i);
-
-			int distance=MAXDIST;
-			int winningsam=damagedsam;
-			if (print) { printf("refsam, damagedsam= %d (%x) with %d (%x)\n",(int)refsam,(int)refsam,(int)damagedsam,(int)damagedsam); }
-			for (int perm=0;perm<maskpermutations;perm++)
-			{
-				int testsam=damagedsam^(maskperm[perm]<<8);
-				if (testsam>0x7fffff) testsam-=0x1000000;
-				__uint32 diff=0;
-				if (print) { printf("calc distance between %d (%x) with %d (%x)\n",(int)refsam,(int)refsam,(int)testsam,(int)testsam); }
-
-				int srefsam=refsam;
-				int sdamsam=testsam;
-				if (srefsam>0x7fffff)	srefsam-=0x1000000;
-				if (sdamsam>0x7fffff) sdamsam-=0x1000000;
-
-				diff=(srefsam>sdamsam)?srefsam-sdamsam:sdamsam-srefsam;
-				if (print) { printf("distance is %d, compare with prevdist %d\n",(int)diff,(int)distance); }
-				if ((long long)diff<(long long)distance)
-				{
-					winningsam=testsam;
-					distance=diff;
-				}
-			}
-				
-				
-			if (print) printf("%x \n",(int)refsam);	
-			if ((long long)winningsam!=(long long)damagedsam)
-			{
-			if (print) printf("%x -> %x \n",(int)damagedsam,(int)winningsam);	
-			} else {
-			if (print) printf("%x\n",(int)damagedsam);
-			}
+int weightedcandidate(wavefixmask* m,int damagedsam,int* srefsams,float* weight,int* dists)
+{
+	/* Returns the candidate correction for damagedsam that is closest
+	   to the (weighted) reference samples. Candidates are evaluated 4
+	   at a time when SSE2 is available. */
+	int* xorval=m->xorval[0];
+	int candidates=m->candidates[0];
+	int k=0;
+#if defined(__SSE2__)
+	__m128i dam=_mm_set1_epi32(damagedsam);
+	__m128i limit=_mm_set1_epi32(0x7fffff);
+	__m128i wrap=_mm_set1_epi32(0x1000000);
+	for (k=0;k<candidates;k+=4) {
+		__m128i testsam=_mm_xor_si128(dam,_mm_loadu_si128((__m128i*)&xorval[k]));
+		testsam=_mm_sub_epi32(testsam,_mm_and_si128(_mm_cmpgt_epi32(testsam,limit),wrap));
+		__m128i diff=_mm_setzero_si128();
+		for (int j=0;j<FILTERBUFSIZE;j++) {
+			__m128i dist=_mm_sub_epi32(_mm_set1_epi32(srefsams[j]),testsam);
+			__m128i sign=_mm_srai_epi32(dist,31);
+			dist=_mm_sub_epi32(_mm_xor_si128(dist,sign),sign);
+			__m128 wdist=_mm_div_ps(_mm_cvtepi32_ps(dist),_mm_set1_ps(weight[j]));
+			diff=_mm_add_epi32(diff,_mm_cvttps_epi32(wdist));
+		}
+		_mm_storeu_si128((__m128i*)&dists[k],diff);
+	}
+#endif
+	for (;k<candidates;k++) {
+		int sdamsam=tosigned(damagedsam^xorval[k]);
+		int diff=0;
+		for (int j=0;j<FILTERBUFSIZE;j++) {
+			int dist=(srefsams[j]>sdamsam)?srefsams[j]-sdamsam:sdamsam-srefsams[j];
+			diff+=(int)(dist/weight[j]);
+		}
+		dists[k]=diff;
+	}
+	return bestcandidate(dists,candidates);
+}
 
-			setsam(i,winningsam);
+int nearestcandidate(wavefixmask* m,int pass,int damagedsam,int srefsam,int* dists)
+{
+	/* Returns the candidate correction for damagedsam that is closest
+	   to the reference sample. */
+	int* xorval=m->xorval[pass];
+	int candidates=m->candidates[pass];
+	int k=0;
+#if defined(__SSE2__)
+	__m128i dam=_mm_set1_epi32(damagedsam);
+	__m128i ref=_mm_set1_epi32(srefsam);
+	__m128i limit=_mm_set1_epi32(0x7fffff);
+	__m128i wrap=_mm_set1_epi32(0x1000000);
+	for (k=0;k<candidates;k+=4) {
+		__m128i testsam=_mm_xor_si128(dam,_mm_loadu_si128((__m128i*)&xorval[k]));
+		testsam=_mm_sub_epi32(testsam,_mm_and_si128(_mm_cmpgt_epi32(testsam,limit),wrap));
+		__m128i dist=_mm_sub_epi32(ref,testsam);
+		__m128i sign=_mm_srai_epi32(dist,31);
+		dist=_mm_sub_epi32(_mm_xor_si128(dist,sign),sign);
+		_mm_storeu_si128((__m128i*)&dists[k],dist);
+	}
+#endif
+	for (;k<candidates;k++) {
+		int sdamsam=tosigned(damagedsam^xorval[k]);
+		dists[k]=(srefsam>sdamsam)?srefsam-sdamsam:sdamsam-srefsam;
+	}
+	return bestcandidate(dists,candidates);
+}
+
+void simplecopyaudio(wavefixchunk* chunk,int first)
+{
+	/* Repairs the block of a chunk that starts at sample 'first'.
+	   When the file has an odd number of samples, its last sample
+	   is paired with the 0 after it. */
+	int* sam=chunk->sam;
+	wavefixmask* m=chunk->mask;
+	int srefsams[FILTERBUFSIZE];
+	int damagedsam;
+	int winningsam;
+	int best;
+	int blockend=first+SAMPLES_IN_HALF_BUF;
+	int end=(blockend<chunk->samples)?blockend:chunk->samples;
+
+	/* ------------- step 1 ----------------*/
+	for (int i=first; i<end;i+=2) {
+		// get current + historic sams
+		srefsams[0]=tosigned(sam[i]);
+		int newstart=1;
+		if ((i+2)<blockend)
+		{
+			srefsams[1]=tosigned(sam[i+2]);
+			newstart=2;
 		}
-		if (passes>2)
+		if ((i+4)<blockend)
 		{
-		/* ------------- step 3 ----------------*/
-		for (int i=0; i<SAMPLES_IN_HALF_BUF-1;i+=2) {
-			refsam=getsam(i);
-			damagedsam=getsam(i+1);
-
-			int distance=MAXDIST;
-			int winningsam=damagedsam;
-			if (print) { printf("refsam, damagedsam= %d (%x) with %d (%x)\n",(int)refsam,(int)refsam,(int)damagedsam,(int)damagedsam); }
-			for (int perm=0;perm<maskpermutations;perm++)
-			{
-				int testsam=damagedsam^(maskperm[perm]);
-				if (testsam>0x7fffff) testsam-=0x1000000;
-				__uint32 diff=0;
-				if (print) { printf("calc distance between %d (%x) with %d (%x)\n",(int)refsam,(int)refsam,(int)testsam,(int)testsam); }
-
-				int srefsam=refsam;
-				int sdamsam=testsam;
-				if (srefsam>0x7fffff)	srefsam-=0x1000000;
-				if (sdamsam>0x7fffff) sdamsam-=0x1000000;
-
-				diff=(srefsam>sdamsam)?srefsam-sdamsam:sdamsam-srefsam;
-				if (print) { printf("distance is %d, compare with prevdist %d\n",(int)diff,(int)distance); }
-				if ((long long)diff<(long long)distance)
-				{
-					winningsam=testsam;
-					distance=diff;
-				}
-			}
-				
-				
-			if (print) printf("%x \n",(int)refsam);	
-			if ((long long)winningsam!=(long long)damagedsam)
-			{
-			if (print) printf("%x -> %x \n",(int)damagedsam,(int)winningsam);	
-			} else {
-			if (print) printf("%x\n",(int)damagedsam);
-			}
+			srefsams[2]=tosigned(sam[i+4]);
+			newstart=3;
+		}
+		float* weight=weights[newstart-1];
 
-			setsam(i+1,winningsam);
+		for (int j=newstart;j<FILTERBUFSIZE;j++) {
+			srefsams[j]=tosigned(sam[i-j]);
 		}
+
+		damagedsam=sam[i+1];
+
+		if (simplemode!=0)
+		{
+			setsam(chunk,i,damagedsam);
+			continue;
 		}
+		best=weightedcandidate(m,damagedsam,srefsams,weight,chunk->dists);
+		winningsam=(best<0)?damagedsam:damagedsam^m->xorval[0][best];
+		if (print) {
+			if (winningsam!=damagedsam) {
+				printf("%x -> %x (ref %x)\n",damagedsam,winningsam,sam[i]);
+			} else {
+				printf("%x\n",damagedsam);
+			}
 		}
+		setsam(chunk,i+1,winningsam);
+	}
+	if ((passes<=1)||(simplemode!=0)) {
+		return;
+	}
+	/* ------------- step 2 ----------------*/
+	for (int i=first; i<end;i+=2) {
+		damagedsam=sam[i];
+		best=nearestcandidate(m,1,damagedsam,tosigned(sam[i+1]),chunk->dists);
+		winningsam=(best<0)?damagedsam:damagedsam^m->xorval[1][best];
+		if ((print) && (winningsam!=damagedsam)) {
+			printf("%x -> %x \n",damagedsam,winningsam);
 		}
-	
-		if (readcount>0) {
-			int writecount=fwrite(
-					(void*)&audiobuf[BYTES_IN_HALF_BUF],1,readcount,outfile);
-			if (writecount==0) {
-				cout << "Cannot write output file" << endl;
-			}
-			fwrite((void*)&deltabuf[BYTES_IN_HALF_BUF],1,readcount,deltafile);
+		setsam(chunk,i,winningsam);
+	}
+	if (passes<=2) {
+		return;
+	}
+	/* ------------- step 3 ----------------*/
+	for (int i=first; i<end;i+=2) {
+		damagedsam=sam[i+1];
+		best=nearestcandidate(m,2,damagedsam,tosigned(sam[i]),chunk->dists);
+		winningsam=(best<0)?damagedsam:damagedsam^m->xorval[2][best];
+		if ((print) && (winningsam!=damagedsam)) {
+			printf("%x -> %x \n",damagedsam,winningsam);
 		}
+		setsam(chunk,i+1,winningsam);
 	}
-	while ((testmode==0&&readcount>0) || (testmode==1 && totbytes<TESTLEN));
 	return;
 }
 
-void dropbadaudio(FILE* infile,FILE* outfile,int mask)
+void dropbadaudio(wavefixchunk* chunk,int first)
 {
-	fseek(infile,HEADERSIZE,SEEK_SET);
-	int readcount;
-	__uint32 refsam;
-	__uint32 damagedsam;
-	int blocknum=0;
-	do {
-		shiftaudiobuf();
-		readcount=fread((void*)&audiobuf[BYTES_IN_HALF_BUF],1,BYTES_IN_HALF_BUF,infile);
-		if (blocknum==0)
-		{
-			printf("First 10 values in file are\n");
-			for (int i=0; i<10;i++) {
-				if (print) printf("%x ",getsam(i));
-			}
-			if (print) printf("\n");
+	/* Replaces every damaged sample in a block by the sample before it. */
+	int* sam=chunk->sam;
+	int end=first+SAMPLES_IN_HALF_BUF;
+	if (end>chunk->samples) end=chunk->samples;
+	if ((print) && (chunk->firstsample==0) && (first==0))
+	{
+		printf("First 10 values in file are\n");
+		for (int i=0; i<10;i++) {
+			printf("%x ",sam[i]);
+		}
+		printf("\n");
+	}
+
+	for (int i=first; i<end;i+=2) {
+		setsam(chunk,i+1,sam[i]);
+	}
+	return;
+}
+
+void readchunk(wavefixjob* job,wavefixchunk* chunk,__uint64 chunknum)
+{
+	/* Reads a chunk plus the samples before it, which are its history
+	   until the chunk before it is repaired. Samples before the start
+	   or past the end of the file are 0. */
+	__uint64 totalsamples=(job->databytes+BYTES_PER_SAM-1)/BYTES_PER_SAM;
+	chunk->firstsample=chunknum*CHUNKSAMPLES;
+	__uint64 left=totalsamples-chunk->firstsample;
+	chunk->samples=(left<CHUNKSAMPLES)?(int)left:CHUNKSAMPLES;
+	__uint64 leftbytes=job->databytes-chunk->firstsample*BYTES_PER_SAM;
+	chunk->bytes=(leftbytes<CHUNKSAMPLES*BYTES_PER_SAM)?(__uint32)leftbytes:CHUNKSAMPLES*BYTES_PER_SAM;
+
+	memset(chunk->raw,0,CHUNKWORKSAMPLES*BYTES_PER_SAM);
+	memset(chunk->delta,0,CHUNKWORKSAMPLES*sizeof(int));
+	__uint64 firstbyte=0;
+	__uint32 rawoffset=CHUNKLEAD*BYTES_PER_SAM;
+	if (chunk->firstsample!=0) {
+		firstbyte=(chunk->firstsample-CHUNKLEAD)*BYTES_PER_SAM;
+		rawoffset=0;
+	}
+	__uint64 endbyte=(chunk->firstsample+chunk->samples)*BYTES_PER_SAM;
+	if (endbyte>job->databytes) endbyte=job->databytes;
+	wavefixseek(job->infile,HEADERSIZE+firstbyte);
+	size_t readcount=fread((void*)&(chunk->raw[rawoffset]),1,endbyte-firstbyte,job->infile);
+	if (readcount<endbyte-firstbyte) {
+		cout << "Cannot read input file" << endl;
+	}
+	for (int i=0;i<CHUNKWORKSAMPLES;i++) {
+		unsigned char* raw=&(chunk->raw[i*BYTES_PER_SAM]);
+		chunk->work[i]=raw[0]+(raw[1]<<8)+(raw[2]<<16);
+	}
+	memcpy(chunk->orig,chunk->work,CHUNKWORKSAMPLES*sizeof(int));
+}
+
+void repairblock(wavefixchunk* chunk,int first)
+{
+	if ((simplemode==1)||(simplemode==2)) {
+		dropbadaudio(chunk,first);
+	} else {
+		simplecopyaudio(chunk,first);
+	}
+}
+
+void repairchunk(wavefixchunk* chunk)
+{
+	detectregionmask(chunk);
+	for (int first=0;first<chunk->samples;first+=SAMPLES_IN_HALF_BUF) {
+		repairblock(chunk,first);
+	}
+}
+
+void fixhistory(wavefixchunk* chunk,int* history)
+{
+	/* Once the chunk before is done, its last samples are the real
+	   history of this chunk. If they differ from what the chunk was
+	   repaired with, its blocks are repaired again from the samples
+	   as read, until a block ends the same as before: the blocks
+	   after it then do not change either. */
+	int* sam=chunk->sam;
+	if (memcmp(&sam[-CHUNKLEAD],history,CHUNKLEAD*sizeof(int))==0) {
+		return;
+	}
+	memcpy(&sam[-CHUNKLEAD],history,CHUNKLEAD*sizeof(int));
+	int oldend[CHUNKLEAD];
+	for (int first=0;first<chunk->samples;first+=SAMPLES_IN_HALF_BUF) {
+		int blockend=first+SAMPLES_IN_HALF_BUF;
+		bool fullblock=(blockend<=chunk->samples);
+		if (fullblock) {
+			memcpy(oldend,&sam[blockend-CHUNKLEAD],CHUNKLEAD*sizeof(int));
+		}
+		int restore=(fullblock)?SAMPLES_IN_HALF_BUF:chunk->samples+CHUNKTRAIL-first;
+		memcpy(&sam[first],&(chunk->orig[CHUNKLEAD+first]),restore*sizeof(int));
+		repairblock(chunk,first);
+		if ((fullblock) && (memcmp(oldend,&sam[blockend-CHUNKLEAD],CHUNKLEAD*sizeof(int))==0)) {
+			return;
 		}
-		blocknum++;
+	}
+}
 
-		/* ------------- step 1 ----------------*/
-		for (int i=0; i<SAMPLES_IN_HALF_BUF-1;i+=2) {
-			refsam=getsam(i);
-			damagedsam=getsam(i+1);
+void packchunk(wavefixchunk* chunk)
+{
+	for (int i=0;i<chunk->samples;i++) {
+		unsigned char* raw=&(chunk->raw[(CHUNKLEAD+i)*BYTES_PER_SAM]);
+		int samval=chunk->sam[i];
+		raw[0]=(unsigned char)(samval);
+		raw[1]=(unsigned char)(samval>>8);
+		raw[2]=(unsigned char)(samval>>16);
+	}
+}
 
-			int winningsam=refsam;
+void writechunk(wavefixjob* job,wavefixchunk* chunk)
+{
+	int writecount=fwrite((void*)&(chunk->raw[CHUNKLEAD*BYTES_PER_SAM]),1,chunk->bytes,job->outfile);
+	if ((chunk->bytes>0) && (writecount==0)) {
+		if (!job->writeerror) {
+			cout << "Cannot write output file" << endl;
+		}
+		job->writeerror=true;
+	}
+	if (job->deltafile==NULL) {
+		return;
+	}
+	/* re-use the raw buffer for the delta values */
+	for (int i=0;i<chunk->samples;i++) {
+		unsigned char* raw=&(chunk->raw[(CHUNKLEAD+i)*BYTES_PER_SAM]);
+		int delta=chunk->delta[CHUNKLEAD+i];
+		raw[0]=(unsigned char)(delta);
+		raw[1]=(unsigned char)(delta>>8);
+		raw[2]=(unsigned char)(delta>>16);
+	}
+	fwrite((void*)&(chunk->raw[CHUNKLEAD*BYTES_PER_SAM]),1,chunk->bytes,job->deltafile);
+}
 
-			setsam(i+1,winningsam);
+void* fixworker(void* jobptr)
+{
+	/* Takes the next chunk, repairs it and writes it out as soon as
+	   all chunks before it have been written. */
+	wavefixjob* job=(wavefixjob*)jobptr;
+	wavefixchunk chunk;
+	chunk.work=(int*)malloc(CHUNKWORKSAMPLES*sizeof(int));
+	chunk.delta=(int*)malloc(CHUNKWORKSAMPLES*sizeof(int));
+	chunk.orig=(int*)malloc(CHUNKWORKSAMPLES*sizeof(int));
+	chunk.raw=(unsigned char*)malloc(CHUNKWORKSAMPLES*BYTES_PER_SAM);
+	chunk.dists=(int*)malloc((65536+4)*sizeof(int));
+	if ((chunk.work==NULL)||(chunk.delta==NULL)||(chunk.orig==NULL)||(chunk.raw==NULL)||(chunk.dists==NULL)) {
+		cout << "Out of memory" << endl;
+		if (chunk.work!=NULL) free(chunk.work);
+		if (chunk.orig!=NULL) free(chunk.orig);
+		if (chunk.delta!=NULL) free(chunk.delta);
+		if (chunk.raw!=NULL) free(chunk.raw);
+		if (chunk.dists!=NULL) free(chunk.dists);
+		return NULL;
+	}
+	chunk.regionmask.mask=-1;
+	for (int pass=0;pass<3;pass++) {
+		chunk.regionmask.xorval[pass]=NULL;
+	}
+	chunk.sam=&chunk.work[CHUNKLEAD];
+	while (1) {
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_lock(&job->lock);
+#endif
+		__uint64 chunknum=job->nextchunk;
+		if (chunknum<job->chunks) {
+			job->nextchunk++;
+			readchunk(job,&chunk,chunknum);
 		}
-	
-		if (readcount>0) {
-			int writecount=fwrite(
-					(void*)&audiobuf[BYTES_IN_HALF_BUF],1,readcount,outfile);
-			if (writecount==0) {
-				cout << "Cannot write output file" << endl;
-			}
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_unlock(&job->lock);
+#endif
+		if (chunknum>=job->chunks) {
+			break;
+		}
+		repairchunk(&chunk);
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_lock(&job->lock);
+		while (job->nextwrite!=chunknum) {
+			pthread_cond_wait(&job->written,&job->lock);
 		}
+		pthread_mutex_unlock(&job->lock);
+#endif
+		/* job->history only changes when this chunk is written */
+		fixhistory(&chunk,job->history);
+		packchunk(&chunk);
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_lock(&job->lock);
+#endif
+		writechunk(job,&chunk);
+		if (chunk.samples>=CHUNKLEAD) {
+			memcpy(job->history,&chunk.sam[chunk.samples-CHUNKLEAD],CHUNKLEAD*sizeof(int));
+		}
+		job->nextwrite++;
+#if defined(LINUX) || defined(DARWIN)
+		pthread_cond_broadcast(&job->written);
+		pthread_mutex_unlock(&job->lock);
+#endif
+	}
+	freemask(&chunk.regionmask);
+	free(chunk.work);
+	free(chunk.orig);
+	free(chunk.delta);
+	free(chunk.raw);
+	free(chunk.dists);
+	return NULL;
+}
 
+void fixaudio(FILE* infile,FILE* outfile,FILE* deltafile)
+{
+	wavefixjob job;
+	job.infile=infile;
+	job.outfile=outfile;
+	job.deltafile=deltafile;
+	__uint64 filesize=wavefixfilesize(infile);
+	job.databytes=(filesize>HEADERSIZE)?filesize-HEADERSIZE:0;
+	if ((testmode==1) && (job.databytes>TESTLEN)) {
+		job.databytes=TESTLEN;
 	}
-	while (readcount>0);
+	__uint64 totalsamples=(job.databytes+BYTES_PER_SAM-1)/BYTES_PER_SAM;
+	job.chunks=(totalsamples+CHUNKSAMPLES-1)/CHUNKSAMPLES;
+	job.nextchunk=0;
+	job.nextwrite=0;
+	memset(job.history,0,sizeof(job.history));
+	job.writeerror=false;
+	if (print) {
+		/* keep debug output in file order */
+		threads=1;
+	}
+	initweights();
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_init(&job.lock,NULL);
+	pthread_cond_init(&job.written,NULL);
+	pthread_t worker[MAXTHREADS];
+	int started=0;
+	for (int i=1;i<threads;i++) {
+		if (pthread_create(&worker[started],NULL,fixworker,(void*)&job)!=0) {
+			break;
+		}
+		started++;
+	}
+	fixworker((void*)&job);
+	for (int i=0;i<started;i++) {
+		pthread_join(worker[i],NULL);
+	}
+	pthread_cond_destroy(&job.written);
+	pthread_mutex_destroy(&job.lock);
+#endif
+#ifdef WINDOWS
+	fixworker((void*)&job);
+#endif
 	return;
 }
 
@@ -622,17 +935,18 @@ void dothefix(FILE* infile, FILE* outfile)
 	if (outfile!=NULL) {
 		copyheader(infile,outfile);
 	}
+	initspreadbits();
 	int mask=findmask(infile);
-    // lowpass-filter 
+    // lowpass-filter
 	if (outfile==NULL) {
 		cout << "No output file specified, just printing mask: " << mask << endl;
 		return;
 	}
-	clearaudiobuf();
-	simplecopyaudio(infile,outfile,mask);
+	fixaudio(infile,outfile,deltafile);
+	freemask(&filemask);
 }
 
-int main (int argc,char ** argv) 
+int main (int argc,char ** argv)
 {
 	print=0;
 	int invalid=parsecommandline(argc,argv);
@@ -643,23 +957,24 @@ int main (int argc,char ** argv)
 		cout << "Usage: hd24wavefix --input=<inputfile> --output=<outputfile>" << endl;
 		return 1;
 	}
-	clearaudiobuf();
 	// Open files
 	infile=fopen(inputfile.c_str(),"rb");
+	if (infile==NULL) {
+		cout << "Cannot open input file " << inputfile << endl;
+		return 1;
+	}
 	outfile=NULL;
+	deltafile=NULL;
         if (outputfile!="") {
 		outfile=fopen(outputfile.c_str(),"wb");
 		deltafile=fopen("delta.wav","wb");
         }
 	dothefix(infile,outfile);
-	if (outputfile!="") 
+	if (outputfile!="")
 	{
 		fclose(outfile);
-		outfile=fopen(outputfile.c_str(),"rb");
-	
 		if (deltafile!=NULL) fclose(deltafile);
-		fclose(outfile);
 	}
 	fclose(infile);
-	return 0;	
+	return 0;
 }
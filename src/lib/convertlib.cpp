@@ -46,36 +46,50 @@ string* Convert::int2str(int x, unsigned int pad, string padchar)
 	return newst;
 }
 
-string* Convert::int64tostr(__sint64 x) 
+char* Convert::int2buf(char* buf,__sint64 x,unsigned int pad,char padchar)
 {
-	bool isneg=false;
-	string * newst = new string("");
-	if (x == 0) 
+	/* Writes x in decimal to buf (CONVERT_NUMSIZE bytes), padded on
+	   the left to at least pad characters. Does not allocate, so it
+	   can be used from code that runs many times per second. */
+	char digits[CONVERT_NUMSIZE];
+	int len=0;
+	bool isneg=(x<0);
+	unsigned long long y=(isneg)?(0-(unsigned long long)x):((unsigned long long)x);
+	do
 	{
-		*newst = "0";
-	} 
-	else 
+		digits[len++]=(char)('0'+(y%10));
+		y/=10;
+	} while (y!=0);
+	if (isneg)
 	{
-		if (x<0)
-		{
-			isneg=true;
-			x=0-x;
-		}
-		while (x != 0) 
-		{
-			long long digit = x % (long long) 10;
-			string dec = "0123456789";
-			*newst = dec.substr(digit, 1) + *newst;
-			
-			x -= (long long) (x % (long long) 10);
-			x /= (long long) 10;
-		}
+		digits[len++]='-';
 	}
-	if (isneg)
+	if (pad>CONVERT_NUMSIZE-1)
 	{
-		*newst="-"+*newst;
+		pad=CONVERT_NUMSIZE-1;
 	}
-	return newst;
+	int pos=0;
+	while ((unsigned int)(pos+len)<pad)
+	{
+		buf[pos++]=padchar;
+	}
+	while (len>0)
+	{
+		buf[pos++]=digits[--len];
+	}
+	buf[pos]='\0';
+	return buf;
+}
+
+char* Convert::int2buf(char* buf,__sint64 x)
+{
+	return int2buf(buf,x,0,'0');
+}
+
+string* Convert::int64tostr(__sint64 x) 
+{
+	char buf[CONVERT_NUMSIZE];
+	return new string(int2buf(buf,x));
 }
 
 string* Convert::int2str(int x) 
@@ -139,24 +153,27 @@ string* Convert::int64tohex(__sint64 x)
 	return newst;
 }
 
+char* Convert::int32tohexbuf(char* buf,unsigned long x)
+{
+	/* As int32tohex, into buf (CONVERT_HEX32SIZE bytes). */
+	static const char hex[]="0123456789ABCDEF";
+	int pos=0;
+	for (int shift=28;shift>=0;shift-=4)
+	{
+		buf[pos++]=hex[(x>>shift)&0xF];
+		if (shift==16)
+		{
+			buf[pos++]=':';
+		}
+	}
+	buf[pos]='\0';
+	return buf;
+}
+
 string* Convert::int32tohex(unsigned long x) 
 {
-	__sint64 q = x;
-	unsigned char a = q % 256; q = q >> 8;
-	unsigned char b = q % 256; q = q >> 8;
-	unsigned char c = q % 256; q = q >> 8;
-	unsigned char d = q % 256; q = q >> 8;
-	string* b2h4 = byte2hex(d);
-	string* b2h3 = byte2hex(c);
-	string* b2h2 = byte2hex(b);
-	string* b2h1 = byte2hex(a);
-	string* newst = new string();
-	*newst += *b2h4 + *b2h3 + ":" + *b2h2 + *b2h1;
-	delete (b2h1);
-	delete (b2h2);
-	delete (b2h3);
-	delete (b2h4);
-	return newst;
+	char buf[CONVERT_HEX32SIZE];
+	return new string(int32tohexbuf(buf,x));
 }
 
 unsigned int Convert::getint24(unsigned char * buf, int loc) 
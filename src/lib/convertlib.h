@@ -7,6 +7,11 @@ using namespace std;
 #include <string>
 #include <iostream>
 
+/* Buffer sizes for the formatting functions that write into a buffer
+   given by the caller */
+#define CONVERT_NUMSIZE		32	/* int2buf */
+#define CONVERT_HEX32SIZE	10	/* int32tohexbuf, "XXXX:XXXX" */
+
 class Convert 
 {
 	public:
@@ -24,6 +29,9 @@ class Convert
 		static string*		int64tostr(__sint64 x);
 		static string*		int64tohex(__sint64 x);
 		static string*		int32tohex(unsigned long x);
+		static char*		int2buf(char* buf,__sint64 x,unsigned int pad,char padchar);
+		static char*		int2buf(char* buf,__sint64 x);
+		static char*		int32tohexbuf(char* buf,unsigned long x);
 		static string*		readstring(unsigned char * orig,int offset,int len);
 		static string*		padright(string & strinput,int inlen,string strpad);
 		static string*		padleft(string & strinput,int inlen,string strpad);
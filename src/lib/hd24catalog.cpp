@@ -0,0 +1,472 @@
+/* Host-side catalog cache.
+
+   Listing a drive means reading every project sector and the info and
+   allocation sectors of every song, scattered over the song area.
+   To make this instant on repeat visits, those sectors are kept in a
+   file on the host, one per drive (by device name; not while a header
+   file is in use).
+   The file is only trusted when it was written for the same superblock,
+   drive info, drive usage table and project sectors as found on disk,
+   so revalidating it costs no more than reading those few sectors.
+   Sectors written by this program are dropped from the cache, to be
+   read again on demand.
+
+   This does not cover the song sectors: a song that was renamed or
+   had its locate points changed on the recorder, without recording,
+   is still listed as it was. To keep such edits from being reverted,
+   songs and projects merge their changes into the sectors as found
+   on disk when they are saved (see mergemetasectors).
+
+   The cache lives in $HOME/.hd24 (%APPDATA%\HD24 on Windows), or in the
+   directory given by HD24CATALOGDIR. An empty HD24CATALOGDIR disables it,
+   as does nohostcache() for a single drive (e.g. a scratch image).
+   Other per-drive host files (such as peak files, see hd24peaks.cpp)
+   go in the same place.
+*/
+#ifdef WINDOWS
+#include <io.h>
+#endif
+#define CATALOG_MAGIC		"HD24CAT1"
+#define CATALOG_HEADERSIZE	20
+#define CATALOG_MAXENTRYSECTORS	64
+#define CATALOG_MAXENTRIES	100000
+#define CATALOG_MAXPROJECTSECTORS	1024
+
+static __uint64 catalog_hash(__uint64 hash,unsigned char* buffer,__uint32 bytes)
+{
+	// FNV-1a
+	for (__uint32 i=0;i<bytes;i++)
+	{
+		hash^=buffer[i];
+		hash*=0x100000001b3ULL;
+	}
+	return hash;
+}
+
+string* hd24fs::hostcachefilename(const char* prefix,const char* suffix)
+{
+	/* Returns the name of a host-side cache file for the current
+	   device (prefix+device hash+suffix), or NULL when caching is
+	   not possible or disabled. */
+	if (nohostfiles)
+	{
+		return NULL;
+	}
+	if (devicename==NULL)
+	{
+		return NULL;
+	}
+	if (*devicename=="")
+	{
+		return NULL;
+	}
+	if (headersectors!=0)
+	{
+		// sectors come partly from a header file
+		return NULL;
+	}
+#ifdef WINDOWS
+	char slash='\\';
+#else
+	char slash='/';
+#endif
+	string* filename=NULL;
+	const char* dir=getenv("HD24CATALOGDIR");
+	if (dir!=NULL)
+	{
+		if (dir[0]=='\0')
+		{
+			return NULL;
+		}
+		filename=new string(dir);
+	} else {
+#ifdef WINDOWS
+		const char* home=getenv("APPDATA");
+#else
+		const char* home=getenv("HOME");
+#endif
+		if (home==NULL)
+		{
+			return NULL;
+		}
+		filename=new string(home);
+		if ((filename->length()>0)&&((*filename)[filename->length()-1]!=slash))
+		{
+			*filename+=slash;
+		}
+#ifdef WINDOWS
+		*filename+="HD24";
+		mkdir(filename->c_str());
+#else
+		*filename+=".hd24";
+		mkdir(filename->c_str(),0700);
+#endif
+	}
+	if ((filename->length()>0)&&((*filename)[filename->length()-1]!=slash))
+	{
+		*filename+=slash;
+	}
+	__uint64 namehash=catalog_hash(0xcbf29ce484222325ULL,
+		(unsigned char*)devicename->c_str(),devicename->length());
+	char name[20];
+	sprintf(name,"%08lx%08lx",
+		(unsigned long)(namehash>>32),(unsigned long)(namehash&0xFFFFFFFF));
+	*filename+=prefix;
+	*filename+=name;
+	*filename+=suffix;
+	return filename;
+}
+
+void hd24fs::nohostcache()
+{
+	/* For scratch drives: reads and writes no host-side cache
+	   files for this drive, whatever HD24CATALOGDIR says. */
+	clearcatalog();
+	catalogloaded=true;
+	nohostfiles=true;
+}
+
+string* hd24fs::catalogfilename()
+{
+	return hostcachefilename("catalog-",".h24c");
+}
+
+__uint64 hd24fs::catalogkey()
+{
+	/* Hashes the superblock, drive info and drive usage sectors
+	   as they are on disk now. */
+	if (!(isOpen()))
+	{
+		return 0;
+	}
+	__uint64 key=0xcbf29ce484222325ULL;
+	unsigned char* buffer=(unsigned char*)memutils::mymalloc("catalogkey",2*SECTORSIZE,1);
+	if (buffer==NULL)
+	{
+		return 0;
+	}
+	readsectors(devhd24,0,buffer,2);
+	key=catalog_hash(key,buffer,2*SECTORSIZE);
+	memutils::myfree("catalogkey",buffer);
+
+	__uint32 usagecount=driveusagesectorcount();
+	if (usagecount==0)
+	{
+		return key;
+	}
+	buffer=(unsigned char*)memutils::mymalloc("catalogkey",usagecount*SECTORSIZE,1);
+	if (buffer==NULL)
+	{
+		return 0;
+	}
+	readsectors(devhd24,driveusagefirstsector(),buffer,usagecount);
+	key=catalog_hash(key,buffer,usagecount*SECTORSIZE);
+	memutils::myfree("catalogkey",buffer);
+
+	// project names and song lists
+	getsector_bootinfo();
+	if (sector_boot==NULL)
+	{
+		return 0;
+	}
+	__uint32 firstprojsec=Convert::getint32(sector_boot,FSINFO_FIRST_PROJECT_SECTOR);
+	__uint32 projcount=maxprojects()*Convert::getint32(sector_boot,FSINFO_SECTORS_PER_PROJECT);
+	if ((projcount==0)||(projcount>CATALOG_MAXPROJECTSECTORS))
+	{
+		return key;
+	}
+	buffer=(unsigned char*)memutils::mymalloc("catalogkey",projcount*SECTORSIZE,1);
+	if (buffer==NULL)
+	{
+		return 0;
+	}
+	readsectors(devhd24,firstprojsec,buffer,projcount);
+	key=catalog_hash(key,buffer,projcount*SECTORSIZE);
+	memutils::myfree("catalogkey",buffer);
+	return key;
+}
+
+void hd24fs::clearcatalog()
+{
+	if (catalog==NULL)
+	{
+		return;
+	}
+	for (__uint32 i=0;i<catalog->size();i++)
+	{
+		memutils::myfree("catalog entry",(*catalog)[i].data);
+	}
+	delete catalog;
+	catalog=NULL;
+	catalogdirty=false;
+	catalogfirstsector=0xFFFFFFFF;
+	cataloglastsector=0;
+}
+
+void hd24fs::catalogadd(hd24catalogentry* entry)
+{
+	catalog->push_back(*entry);
+	if (entry->sector<catalogfirstsector)
+	{
+		catalogfirstsector=entry->sector;
+	}
+	if (entry->sector+(entry->count-1)>cataloglastsector)
+	{
+		cataloglastsector=entry->sector+(entry->count-1);
+	}
+}
+
+void hd24fs::loadcatalog()
+{
+	catalogloaded=true;
+	clearcatalog();
+	string* filename=catalogfilename();
+	if (filename==NULL)
+	{
+		return;
+	}
+	catalog=new vector<hd24catalogentry>;
+	__uint64 key=catalogkey();
+	FILE* catfile=fopen(filename->c_str(),"rb");
+	delete filename;
+	if (catfile==NULL)
+	{
+		return;
+	}
+	unsigned char header[CATALOG_HEADERSIZE];
+	bool valid=false;
+	if (fread(header,1,CATALOG_HEADERSIZE,catfile)==CATALOG_HEADERSIZE)
+	{
+		__uint64 filekey=((__uint64)Convert::getint32(header,8)<<32)
+				+Convert::getint32(header,12);
+		valid=((memcmp(header,CATALOG_MAGIC,8)==0)&&(filekey==key)&&(key!=0));
+	}
+	if (!valid)
+	{
+		// different drive contents; start over.
+#if (HD24FSDEBUG==1)
+		cout << "Catalog cache outdated" << endl;
+#endif
+		fclose(catfile);
+		return;
+	}
+	__uint32 entries=Convert::getint32(header,16);
+	if (entries>CATALOG_MAXENTRIES)
+	{
+		entries=0;
+	}
+	for (__uint32 i=0;i<entries;i++)
+	{
+		unsigned char entryheader[8];
+		if (fread(entryheader,1,8,catfile)!=8)
+		{
+			break;
+		}
+		hd24catalogentry entry;
+		entry.sector=Convert::getint32(entryheader,0);
+		entry.count=Convert::getint32(entryheader,4);
+		if ((entry.count==0)||(entry.count>CATALOG_MAXENTRYSECTORS))
+		{
+			break;
+		}
+		entry.data=(unsigned char*)memutils::mymalloc("catalog entry",entry.count*SECTORSIZE,1);
+		if (entry.data==NULL)
+		{
+			break;
+		}
+		if (fread(entry.data,SECTORSIZE,entry.count,catfile)!=entry.count)
+		{
+			memutils::myfree("catalog entry",entry.data);
+			break;
+		}
+		catalogadd(&entry);
+	}
+	fclose(catfile);
+#if (HD24FSDEBUG==1)
+	cout << "Loaded " << catalog->size() << " entries from catalog cache" << endl;
+#endif
+}
+
+void hd24fs::savecatalog()
+{
+	if (catalog==NULL)
+	{
+		return;
+	}
+	if (!catalogdirty)
+	{
+		return;
+	}
+	string* filename=catalogfilename();
+	if (filename==NULL)
+	{
+		return;
+	}
+	string* tempname=new string(*filename);
+	*tempname+=".tmp";
+	__uint64 key=catalogkey();
+	FILE* catfile=fopen(tempname->c_str(),"wb");
+	bool ok=((catfile!=NULL)&&(key!=0));
+	if (catfile!=NULL)
+	{
+		unsigned char header[CATALOG_HEADERSIZE];
+		memcpy(header,CATALOG_MAGIC,8);
+		Convert::setint32(header,8,(__uint32)(key>>32));
+		Convert::setint32(header,12,(__uint32)(key&0xFFFFFFFF));
+		Convert::setint32(header,16,catalog->size());
+		if (fwrite(header,1,CATALOG_HEADERSIZE,catfile)!=CATALOG_HEADERSIZE)
+		{
+			ok=false;
+		}
+		for (__uint32 i=0;(ok)&&(i<catalog->size());i++)
+		{
+			hd24catalogentry* entry=&(*catalog)[i];
+			unsigned char entryheader[8];
+			Convert::setint32(entryheader,0,entry->sector);
+			Convert::setint32(entryheader,4,entry->count);
+			if ((fwrite(entryheader,1,8,catfile)!=8)
+			  ||(fwrite(entry->data,SECTORSIZE,entry->count,catfile)!=entry->count))
+			{
+				ok=false;
+			}
+		}
+		if (fclose(catfile)!=0)
+		{
+			ok=false;
+		}
+	}
+	if (ok)
+	{
+#ifdef WINDOWS
+		remove(filename->c_str());
+#endif
+		ok=(rename(tempname->c_str(),filename->c_str())==0);
+	}
+	if (!ok)
+	{
+		remove(tempname->c_str());
+	} else {
+		catalogdirty=false;
+	}
+	delete tempname;
+	delete filename;
+}
+
+void hd24fs::catalogforget(__uint32 secnum,int sectors)
+{
+	/* Called before sectors are written: any cached copy of them
+	   is no longer valid. Most writes are audio, far outside the
+	   project and song sectors, and return right away. */
+	if (catalog==NULL)
+	{
+		return;
+	}
+	__uint32 lastsec=secnum+(sectors-1);
+	if ((lastsec<catalogfirstsector)||(secnum>cataloglastsector))
+	{
+		return;
+	}
+	for (__uint32 i=0;i<catalog->size();)
+	{
+		hd24catalogentry* entry=&(*catalog)[i];
+		if ((entry->sector<=lastsec)&&(secnum<=(entry->sector+(entry->count-1))))
+		{
+			memutils::myfree("catalog entry",entry->data);
+			catalog->erase(catalog->begin()+i);
+			catalogdirty=true;
+			continue;
+		}
+		i++;
+	}
+}
+
+long hd24fs::readmetasectors(__uint32 secnum,unsigned char* buffer,int sectors)
+{
+	/* Reads project or song sectors, from the catalog cache if
+	   possible. Data is returned as on disk (no fstfix). */
+	if (!catalogloaded)
+	{
+		loadcatalog();
+	}
+	if ((catalog!=NULL)&&(sectors>0))
+	{
+		for (__uint32 i=0;i<catalog->size();i++)
+		{
+			hd24catalogentry* entry=&(*catalog)[i];
+			if ((entry->sector==secnum)&&(entry->count>=(__uint32)sectors))
+			{
+				memcpy(buffer,entry->data,sectors*SECTORSIZE);
+				return sectors*SECTORSIZE;
+			}
+		}
+	}
+	long bytes=readsectors(devhd24,secnum,buffer,sectors);
+	if ((catalog!=NULL)&&(bytes==sectors*SECTORSIZE)
+	   &&(sectors>0)&&(sectors<=CATALOG_MAXENTRYSECTORS)
+	   &&(catalog->size()<CATALOG_MAXENTRIES))
+	{
+		hd24catalogentry entry;
+		entry.sector=secnum;
+		entry.count=sectors;
+		entry.data=(unsigned char*)memutils::mymalloc("catalog entry",sectors*SECTORSIZE,1);
+		if (entry.data!=NULL)
+		{
+			memcpy(entry.data,buffer,sectors*SECTORSIZE);
+			catalogadd(&entry);
+			catalogdirty=true;
+		}
+	}
+	return bytes;
+}
+
+void hd24fs::mergemetasectors(__uint32 secnum,unsigned char* buffer,int sectors)
+{
+	/* Called before project or song sectors read by readmetasectors
+	   are written back (buffer as on disk, no fstfix). If they came
+	   from the catalog cache and have changed on disk since, the
+	   cache was outdated: only the bytes changed by this program are
+	   kept, all others are taken from disk. */
+	if ((catalog==NULL)||(sectors<=0))
+	{
+		return;
+	}
+	hd24catalogentry* entry=NULL;
+	for (__uint32 i=0;i<catalog->size();i++)
+	{
+		if (((*catalog)[i].sector==secnum)&&((*catalog)[i].count>=(__uint32)sectors))
+		{
+			entry=&(*catalog)[i];
+			break;
+		}
+	}
+	if (entry==NULL)
+	{
+		// read from disk, or written since
+		return;
+	}
+	__uint32 bytes=sectors*SECTORSIZE;
+	unsigned char* ondisk=(unsigned char*)memutils::mymalloc("mergemetasectors",bytes,1);
+	if (ondisk==NULL)
+	{
+		return;
+	}
+	if ((readsectors(devhd24,secnum,ondisk,sectors)==(long)bytes)
+	   &&(memcmp(ondisk,entry->data,bytes)!=0))
+	{
+		for (__uint32 i=0;i<bytes;i++)
+		{
+			if (buffer[i]==entry->data[i])
+			{
+				buffer[i]=ondisk[i];
+			}
+		}
+		// other cached songs may be outdated as well
+#if (HD24FSDEBUG==1)
+		cout << "Catalog cache outdated at sector " << secnum << endl;
+#endif
+		clearcatalog();
+		catalog=new vector<hd24catalogentry>;
+		catalogdirty=true;
+	}
+	memutils::myfree("mergemetasectors",ondisk);
+}
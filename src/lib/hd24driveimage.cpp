@@ -13,10 +13,14 @@ have knowledge about the structure of the data it contains.
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <vector>
 #define SECTORSIZE 512
-#define CLUSTERSIZE 4096
+#define CLUSTERSIZE IMGCLUSTERSECTORS
 #define FS_OFFSET 8193
 #define ALLOCSECTORNUM 1 /* TODO: should get from superblock but would be slower */
+#define ALLOCSECTORS 8192
+#define ALLOCENTRIESPERSECTOR (SECTORSIZE/4)
+#define ALLOCENTRIES (ALLOCSECTORS*ALLOCENTRIESPERSECTOR)
 #define ERROR_CANNOT_READ_ALLOCTABLE 1
 #define ERROR_CANNOT_WRITE 2
 #define ERROR_FILESIZE_LOOKUP_FAILED 3
@@ -24,7 +28,14 @@ have knowledge about the structure of the data it contains.
 #define ERROR_CANNOT_WRITE_ALLOCTABLE 5
 #define ERROR_CANNOT_READ_SUPERBLOCK 6
 #define ERROR_INVALID_DRIVEIMAGEHANDLE 7
-
+#define ERROR_CANNOT_READ_CLUSTER 8
+#define ERROR_UNSUPPORTED_FEATURES 9
+
+/* Compressed cluster records start with a 16 byte header:
+   4 byte signature, codec, 3 reserved bytes, 
+   32 bit packed size and 32 bit unpacked size in bytes. */
+#define PACKHEADERSIZE 16
+#define PACKSIGNATURE "CCLU"
 #       define INT_FSHANDLE_INVALID -1
 #if defined(LINUX) || defined(DARWIN)
 #       define FSHANDLE int
@@ -89,6 +100,11 @@ long hd24driveimage::rawwritesectors(unsigned long sectornum,unsigned char* buff
 	}
 	
 #endif
+       double tracestart=0;
+       if (this->trace!=NULL)
+       {
+               tracestart=hd24utils::monotonicseconds();
+       }
        hd24driveimage::rawseek((__uint64)sectornum*SECTORSIZE);
        int WRITESIZE=SECTORSIZE*sectors;
 #if defined(LINUX) || defined(DARWIN) || defined(__APPLE__)
@@ -101,6 +117,11 @@ long hd24driveimage::rawwritesectors(unsigned long sectornum,unsigned char* buff
                 bytes=WRITESIZE;
         };
 #endif  
+        if (this->trace!=NULL)
+        {
+                this->trace->record(hd24iotrace::OP_WRITE,hd24iotrace::LAYER_IMAGE,
+                        sectornum,sectors,tracestart);
+        }
         return bytes>>9;
 }
 
@@ -111,6 +132,11 @@ long hd24driveimage::rawreadsectors(unsigned long sectornum,unsigned char * buff
 	<< " first sector having been read follows:"
 	<< endl;
 #endif
+	double tracestart=0;
+	if (this->trace!=NULL)
+	{
+		tracestart=hd24utils::monotonicseconds();
+	}
 	//FSHANDLE currdevice=devhd24;
        	//rawseek(currdevice,(__uint64)sectornum*SECTORSIZE);
        	rawseek((__uint64)sectornum*SECTORSIZE);
@@ -127,20 +153,41 @@ long hd24driveimage::rawreadsectors(unsigned long sectornum,unsigned char * buff
 	}
 #endif
 //	hd24utils::dumpsector((const char*)buffer);
+	if (this->trace!=NULL)
+	{
+		this->trace->record(hd24iotrace::OP_READ,hd24iotrace::LAYER_IMAGE,
+			sectornum,sectors,tracestart);
+	}
         return bytes_read>>9;
 }
 
-__uint32 hd24driveimage::blocknumtosector(__uint32 blocknum)
+void hd24driveimage::loadalloctable()
 {
-	__uint32 sectornum=(blocknum>>7)+ALLOCSECTORNUM;
-	__uint32 wordnum=blocknum & 0x7f; /* entry index within sector */
-	__uint32 bytenum=wordnum*4;  /* byte offset of entry index */
-
-	unsigned char sectorbuffer[SECTORSIZE];
-	memset(&sectorbuffer[0],0,SECTORSIZE); /* Init sector with 0 values only */
-
-	__uint32 secsread=this->rawreadsectors(sectornum,&sectorbuffer[0],1);
-	if (secsread==0)
+	/* Reads the complete cluster allocation table (4 megabytes) 
+	   in one go, so that cluster lookups no longer need any disk 
+	   access. */
+	if (this->alloctableloaded)
+	{
+		return;
+	}
+	if (this->alloctable==NULL)
+	{
+		this->alloctable=(__uint32*)memutils::mymalloc("hd24driveimage::alloctable",ALLOCENTRIES,sizeof(__uint32));
+		if (this->alloctable==NULL)
+		{
+			throw ERROR_CANNOT_READ_ALLOCTABLE;
+		}
+	}
+	unsigned char* tablebuffer=(unsigned char*)memutils::mymalloc("hd24driveimage::loadalloctable",ALLOCSECTORS,SECTORSIZE);
+	if (tablebuffer==NULL)
+	{
+		throw ERROR_CANNOT_READ_ALLOCTABLE;
+	}
+#if (SMARTIMAGEDEBUG==1)
+	cout << "Loading smart image allocation table." << endl;
+#endif
+	__uint32 secsread=this->rawreadsectors(ALLOCSECTORNUM,tablebuffer,ALLOCSECTORS);
+	if (secsread!=ALLOCSECTORS)
 	{
 		/* Didn't manage to read the alloc table. 
 		   Shouldn't happen, but perhaps we run into a data error
@@ -148,13 +195,180 @@ __uint32 hd24driveimage::blocknumtosector(__uint32 blocknum)
                    created yet (could be the case when used incorrectly on 
                    an uninitialized image?) 
                 */
+		memutils::myfree("hd24driveimage::loadalloctable",tablebuffer);
 		throw ERROR_CANNOT_READ_ALLOCTABLE;
 	}
-	__uint32 sec=0;
-	         sec+=sectorbuffer[bytenum+3];
-	sec<<=8; sec+=sectorbuffer[bytenum+2];
-	sec<<=8; sec+=sectorbuffer[bytenum+1];
-	sec<<=8; sec+=sectorbuffer[bytenum];
+	for (__uint32 i=0;i<ALLOCENTRIES;i++)
+	{
+		__uint32 bytenum=i*4;
+		__uint32 sec=0;
+		         sec+=tablebuffer[bytenum+3];
+		sec<<=8; sec+=tablebuffer[bytenum+2];
+		sec<<=8; sec+=tablebuffer[bytenum+1];
+		sec<<=8; sec+=tablebuffer[bytenum];
+		this->alloctable[i]=sec;
+	}
+	/* The superblock holds the feature flags that tell which
+	   allocation table entry types are in use by this image. */
+	memset(tablebuffer,0,SECTORSIZE);
+	if (this->rawreadsectors(0,tablebuffer,1)!=1)
+	{
+		memutils::myfree("hd24driveimage::loadalloctable",tablebuffer);
+		throw ERROR_CANNOT_READ_SUPERBLOCK;
+	}
+	__uint32 flags=superblockfeatures(tablebuffer);
+	memutils::myfree("hd24driveimage::loadalloctable",tablebuffer);
+	if ((flags&~IMGFEATURES_KNOWN)!=0)
+	{
+		/* Written by a version that knows about more entry 
+		   types than we do; we cannot tell what entries mean. */
+		throw ERROR_UNSUPPORTED_FEATURES;
+	}
+	this->featureflags=flags;
+	this->alloctableloaded=true;
+}
+
+__uint32 hd24driveimage::superblockfeatures(unsigned char* superblock)
+{
+	__uint32 flags=0;
+	           flags+=superblock[39];
+	flags<<=8; flags+=superblock[38];
+	flags<<=8; flags+=superblock[37];
+	flags<<=8; flags+=superblock[36];
+	return flags;
+}
+
+bool hd24driveimage::supported()
+{
+	/* Tells if this version knows about all features the image
+	   uses. Images from before feature flags existed have none. */
+	unsigned char superblock[SECTORSIZE];
+	if (rawreadsectors(0,superblock,1)!=1)
+	{
+		/* Leave reporting read errors to the actual access. */
+		return true;
+	}
+	return ((superblockfeatures(superblock)&~IMGFEATURES_KNOWN)==0);
+}
+
+bool hd24driveimage::issmartimage(unsigned char* superblock)
+{
+	/* Checks the signature of a container superblock (as read,
+	   no fstfix). */
+	return ((memcmp(superblock,IMGSIGNATURE,8)==0)
+	      ||(memcmp(superblock,IMGSIGNATURE_FEATURES,8)==0));
+}
+
+bool hd24driveimage::iscompressedentry(__uint32 entry)
+{
+	/* Only images marked as having compressed clusters have them;
+	   elsewhere the top bit is just part of the sector number.
+	   IMGCLUSTER_ZERO has the compressed bit set as well. */
+	if ((this->featureflags&IMGFEATURE_COMPRESSEDCLUSTERS)==0)
+	{
+		return false;
+	}
+	return ((entry!=IMGCLUSTER_ZERO)&&((entry&IMGCLUSTER_COMPRESSED)!=0));
+}
+
+void hd24driveimage::unloadalloctable()
+{
+	this->alloctableloaded=false;
+	this->clustercachevalid=false;
+}
+
+void hd24driveimage::setfeature(__uint32 feature)
+{
+	/* Marks the image as using the given feature, so that software
+	   that does not know about it can refuse to touch the image. */
+	loadalloctable();
+	if ((this->featureflags&feature)==feature)
+	{
+		return;
+	}
+	unsigned char superblock[SECTORSIZE];
+	if (rawreadsectors(0,superblock,1)!=1)
+	{
+		throw ERROR_CANNOT_READ_SUPERBLOCK;
+	}
+	__uint32 flags=this->featureflags|feature;
+	memcpy(superblock,IMGSIGNATURE_FEATURES,8);
+	superblock[36]=(unsigned char)(flags&0xff); flags>>=8;
+	superblock[37]=(unsigned char)(flags&0xff); flags>>=8;
+	superblock[38]=(unsigned char)(flags&0xff); flags>>=8;
+	superblock[39]=(unsigned char)(flags&0xff);
+	if (rawwritesectors(0,superblock,1)!=1)
+	{
+		throw ERROR_CANNOT_WRITE;
+	}
+	this->featureflags|=feature;
+}
+
+__uint32 hd24driveimage::alloctableentry(__uint32 blocknum)
+{
+	if (blocknum>=ALLOCENTRIES)
+	{
+		throw ERROR_CANNOT_READ_ALLOCTABLE;
+	}
+	loadalloctable();
+	return this->alloctable[blocknum];
+}
+
+void hd24driveimage::alloctableentry(__uint32 blocknum,__uint32 entry)
+{
+	/* Sets an allocation table entry and writes the sector 
+	   holding it back to the image (write-through). */
+	if (blocknum>=ALLOCENTRIES)
+	{
+		throw ERROR_CANNOT_WRITE_ALLOCTABLE;
+	}
+	loadalloctable();
+	this->alloctable[blocknum]=entry;
+	if (blocknum==this->clustercacheblock)
+	{
+		this->clustercachevalid=false;
+	}
+	flushalloctable(blocknum,1);
+}
+
+void hd24driveimage::flushalloctable(__uint32 firstblock,__uint32 count)
+{
+	/* Writes the allocation table sectors holding the entries for
+	   the given block range back to the image, using a single write. */
+	if (count==0) return;
+	__uint32 firstsector=firstblock/ALLOCENTRIESPERSECTOR;
+	__uint32 lastsector=(firstblock+count-1)/ALLOCENTRIESPERSECTOR;
+	__uint32 sectors=(lastsector-firstsector)+1;
+	unsigned char* tablebuffer=(unsigned char*)memutils::mymalloc("hd24driveimage::flushalloctable",sectors,SECTORSIZE);
+	if (tablebuffer==NULL)
+	{
+		throw ERROR_CANNOT_WRITE_ALLOCTABLE;
+	}
+	__uint32 firstentry=firstsector*ALLOCENTRIESPERSECTOR;
+	for (__uint32 i=0;i<sectors*ALLOCENTRIESPERSECTOR;i++)
+	{
+		__uint32 sec=this->alloctable[firstentry+i];
+		tablebuffer[i*4]=(unsigned char)(sec&0xff); sec>>=8;
+		tablebuffer[i*4+1]=(unsigned char)(sec&0xff); sec>>=8;
+		tablebuffer[i*4+2]=(unsigned char)(sec&0xff); sec>>=8;
+		tablebuffer[i*4+3]=(unsigned char)(sec&0xff);
+	}
+	long sectors_written=hd24driveimage::rawwritesectors(firstsector+ALLOCSECTORNUM,tablebuffer,sectors);
+	memutils::myfree("hd24driveimage::flushalloctable",tablebuffer);
+#if (SMARTIMAGEDEBUG==1)
+	cout << "Sectors written to sector "<< firstsector+ALLOCSECTORNUM<<"=" << sectors_written << ", handle " << this->m_handle<<endl;
+#endif
+	if (sectors_written!=(long)sectors)
+	{
+		/* The on-disk table is now behind; reload it next time. */
+		unloadalloctable();
+		throw ERROR_CANNOT_WRITE_ALLOCTABLE;
+	}
+}
+
+__uint32 hd24driveimage::blocknumtosector(__uint32 blocknum)
+{
+	__uint32 sec=alloctableentry(blocknum);
 	if (blocknum!=0) {
 		return sec+FS_OFFSET;
 	}
@@ -163,45 +377,18 @@ __uint32 hd24driveimage::blocknumtosector(__uint32 blocknum)
 
 bool hd24driveimage::isreserved(__uint32 blocknum)
 {
-	unsigned char sectorbuffer[SECTORSIZE];
-
 	/* Verifies if the given block number is already in use on disk.
-	   blocknum*4=bytenum of word to verify in 
-           drive image allocation table.
-	   If the word contains zero, it's not reserved; otherwise it is.
-           We have 512/4=128 entries per sector.
-           To determine which sector to verify, we divide blocknum by 128.
-           If we do this prior to the *4 multiplication, we also work 
-           around surpassing the 32-bit limit.
+	   If the allocation table entry contains zero, it's not reserved; 
+	   otherwise it is.
 	   FIXME: Should look at boot sector to find out sectornum of
                   alloc table sector.
 	*/
-
-	__uint32 sectornum=(blocknum>>7)+ALLOCSECTORNUM;
-	__uint32 wordnum=blocknum & 0x7f; /* entry index within sector */
-	__uint32 bytenum=wordnum*4;  /* byte offset of entry index */
-
-	memset(&sectorbuffer[0],0,SECTORSIZE); /* Init sector with 0 values only */
-	
-	__uint32 secsread=hd24driveimage::rawreadsectors(sectornum,&sectorbuffer[0],1);
-	if (secsread==0)
-	{
-		/* Didn't manage to read the alloc table. 
-		   Shouldn't happen, but perhaps we run into a data error
-                   or we try to read a sector of an alloc table that wasn't
-                   created yet (could be the case when used incorrectly on 
-                   an uninitialized image?) 
-                */
-		throw ERROR_CANNOT_READ_ALLOCTABLE;
-	}
-	if (
-		(sectorbuffer[bytenum]==((unsigned char)0))
-		&&(sectorbuffer[bytenum+1]==((unsigned char)0))
-		&&(sectorbuffer[bytenum+2]==((unsigned char)0))
-		&&(sectorbuffer[bytenum+3]==((unsigned char)0))
-	)
+	__uint32 entry=alloctableentry(blocknum);
+	if ((entry==IMGCLUSTER_FREE)||(entry==IMGCLUSTER_ZERO)
+	   ||iscompressedentry(entry))
 	{
-		/* Word is zero, in other words: it's not reserved. */
+		/* Word is zero (or the cluster has no raw space of its
+		   own), in other words: it's not reserved. */
 #if (SMARTIMAGEDEBUG==1)
 		cout << "Blocknum "<<blocknum<<" is not reserved."<<endl;
 #endif
@@ -305,104 +492,159 @@ __uint32 hd24driveimage::getcontainerlastsectornum()
 #endif
 }
 
-void hd24driveimage::reserveblock(__uint32 blocknum)
+bool hd24driveimage::growcontainer(__uint32 firstsector,__uint32 sectors)
 {
-
-	/* Given a drive image and a block number, verifies if the block is
-           already reserved or not.
-           If not, a block is appended to the file and the allocation info
-           is set to point to it (subtracting the FS overhead to permit
-           using the full 2TB range).
-        */
-#if (SMARTIMAGEDEBUG==1)
-	cout << "hd24driveimage::reserveblock " << endl;
-        cout << "for handle " << this->m_handle  << endl;
-#endif
-#if (SMARTIMAGEDEBUG==1)
-        cout << ", blocknum to reserve=" << blocknum 
-             << endl;
-	cout << "Check if block "<<blocknum<<" is reserved." << endl;
-#endif
-	
-	if (isreserved(blocknum))
+	/* Appends the given number of zero-filled sectors to the container 
+	   file, which is expected to end right before firstsector.
+	   Where possible, the file is grown without writing any data 
+	   (preallocated space or a hole that reads back as zeroes). */
+	__uint64 oldsize=(__uint64)firstsector*SECTORSIZE;
+	__uint64 newsize=oldsize+(__uint64)sectors*SECTORSIZE;
+#if defined(LINUX)
+	if (fallocate(this->m_handle,0,oldsize,newsize-oldsize)==0)
 	{
-#if (SMARTIMAGEDEBUG==1)
-		cout << "Block "<<blocknum<<"is already reserved, no need to re-reserve." << endl;
-#endif
-		return;
+		return true;
 	}
-#if (SMARTIMAGEDEBUG==1)
-	cout << "Block "<<blocknum<<" still needs to be reserved." << endl;
 #endif
-	unsigned char buffer[CLUSTERSIZE*SECTORSIZE];
-	unsigned char sectorbuffer[SECTORSIZE];
-        memset(buffer,0,CLUSTERSIZE*SECTORSIZE);
-	__uint32 lastsec=hd24driveimage::getcontainerlastsectornum();
-#if (SMARTIMAGEDEBUG==1)
-	cout << "Container's last sectornum="<<lastsec << endl;
+#if defined(LINUX) || defined(DARWIN)
+	if (ftruncate(this->m_handle,newsize)==0)
+	{
+		return true;
+	}
 #endif
-        long sectors_written=rawwritesectors(lastsec+1,&buffer[0],CLUSTERSIZE);
-#if (SMARTIMAGEDEBUG==1)
-	cout << "Sectors written, clustersize=" << sectors_written <<","<<CLUSTERSIZE << endl;
+#ifdef WINDOWS
+	LARGE_INTEGER li;
+	li.QuadPart=newsize;
+	if (SetFilePointerEx(this->m_handle,li,NULL,FILE_BEGIN))
+	{
+		if (SetEndOfFile(this->m_handle))
+		{
+			return true;
+		}
+	}
 #endif
-	if (sectors_written!=CLUSTERSIZE)
+	/* Fall back to writing zeroes, one cluster at a time. */
+	unsigned char* buffer=(unsigned char*)memutils::mymalloc("hd24driveimage::growcontainer",CLUSTERSIZE,SECTORSIZE);
+	if (buffer==NULL)
 	{
-		throw ERROR_APPEND_FAILED;
+		return false;
+	}
+	__uint32 sectors_left=sectors;
+	__uint32 sectornum=firstsector;
+	while (sectors_left>0)
+	{
+		__uint32 towrite=sectors_left;
+		if (towrite>CLUSTERSIZE) towrite=CLUSTERSIZE;
+		long sectors_written=rawwritesectors(sectornum,buffer,towrite);
+		if (sectors_written!=(long)towrite)
+		{
+			memutils::myfree("hd24driveimage::growcontainer",buffer);
+			return false;
+		}
+		sectornum+=towrite;
+		sectors_left-=towrite;
 	}
+	memutils::myfree("hd24driveimage::growcontainer",buffer);
+	return true;
+}
 
-	/* Now update entry for blocknum to point to newly appended block */
-	__uint32 sectornum=(blocknum>>7)+ALLOCSECTORNUM;
-	__uint32 wordnum=blocknum & 0x7f; /* entry index within sector */
-	__uint32 bytenum=wordnum*4;  /* byte offset of entry index */
+void hd24driveimage::reserveblock(__uint32 blocknum)
+{
+	reserveblocks(blocknum,1);
+}
+
+void hd24driveimage::reserveblocks(__uint32 firstblock,__uint32 count)
+{
+	/* Given a drive image and a range of block numbers, verifies which
+           blocks are already reserved. 
+           Space for all blocks that are not is appended to the file in 
+           one go and the allocation info is set to point to it 
+           (subtracting the FS overhead to permit using the full 2TB range).
+           The allocation table is then updated using a single write.
+        */
 #if (SMARTIMAGEDEBUG==1)
-	cout << "bytenum for block "<<blocknum<<"=" << bytenum << endl;
+	cout << "hd24driveimage::reserveblocks " << endl;
+        cout << "for handle " << this->m_handle  << endl;
+        cout << ", blocknums to reserve=" << firstblock 
+             << "+" << count << endl;
 #endif
-	memset(&sectorbuffer[0],0,SECTORSIZE); /* Init sector with 0 values only */
-	
-	__uint32 secsread=hd24driveimage::rawreadsectors(sectornum,&sectorbuffer[0],1);
-	if (secsread==0)
+	if (count==0) return;
+	if (firstblock>=ALLOCENTRIES)
 	{
-		/* Didn't manage to read the alloc table. 
-		   Shouldn't happen, but perhaps we run into a data error
-                   or we try to read a sector of an alloc table that wasn't
-                   created yet (could be the case when used incorrectly on 
-                   an uninitialized image?) 
-                */
-		throw ERROR_CANNOT_READ_ALLOCTABLE;
+		throw ERROR_CANNOT_WRITE_ALLOCTABLE;
+	}
+	if (firstblock+count>ALLOCENTRIES)
+	{
+		count=ALLOCENTRIES-firstblock;
 	}
+	loadalloctable();
 
-	if (blocknum!=0) { 
-		lastsec-=FS_OFFSET;
-	} else { 
-		//newly added sector for blocknum is on lastsec+1;
-		// (which incidentally equals FS_OFFSET for blocknum 0)
-		lastsec++; 
+	/* Zero clusters get real space as well; the space that is
+	   appended reads back as zeroes so their content is preserved.
+	   Compressed clusters must be expanded before getting here. */
+	__uint32 needed=0;
+	for (__uint32 i=0;i<count;i++)
+	{
+		__uint32 entry=this->alloctable[firstblock+i];
+		if ((entry==IMGCLUSTER_FREE)||(entry==IMGCLUSTER_ZERO))
+		{
+			needed++;
+		}
 	}
+	if (needed==0)
+	{
 #if (SMARTIMAGEDEBUG==1)
-	cout << "Setting entry for blocknum " <<blocknum<<"to point to sector "<<lastsec;
+		cout << "All blocks are already reserved, no need to re-reserve." << endl;
 #endif
-	if (blocknum!=0) {
+		return;
+	}
 #if (SMARTIMAGEDEBUG==1)
-		cout <<" of content"<<endl;
+	cout << needed << " blocks still need to be reserved." << endl;
 #endif
-	} else {
+	__uint32 lastsec=hd24driveimage::getcontainerlastsectornum();
 #if (SMARTIMAGEDEBUG==1)
-		cout <<" of container" << endl;
+	cout << "Container's last sectornum="<<lastsec << endl;
 #endif
+	if ((this->featureflags&IMGFEATURE_COMPRESSEDCLUSTERS)!=0)
+	{
+		/* Entries with the top bit set mean compressed clusters in 
+		   this image, so raw clusters must stay below that. */
+		__uint64 lastentry=(__uint64)lastsec+1+(__uint64)(needed-1)*CLUSTERSIZE-FS_OFFSET;
+		if (lastentry>=IMGCLUSTER_COMPRESSED)
+		{
+			throw ERROR_APPEND_FAILED;
+		}
+	}
+	if (!growcontainer(lastsec+1,needed*CLUSTERSIZE))
+	{
+		throw ERROR_APPEND_FAILED;
 	}
-	sectorbuffer[bytenum]=(unsigned char)(lastsec&0xff); lastsec>>=8;
-	sectorbuffer[bytenum+1]=(unsigned char)(lastsec&0xff); lastsec>>=8;
-	sectorbuffer[bytenum+2]=(unsigned char)(lastsec&0xff); lastsec>>=8;
-	sectorbuffer[bytenum+3]=(unsigned char)(lastsec&0xff); lastsec>>=8;
 
-	sectors_written=hd24driveimage::rawwritesectors(sectornum,&sectorbuffer[0],1);
+	/* Now update entries to point to the newly appended blocks. */
+	__uint32 nextsec=lastsec+1;
+	for (__uint32 i=0;i<count;i++)
+	{
+		__uint32 blocknum=firstblock+i;
+		__uint32 entry=this->alloctable[blocknum];
+		if ((entry!=IMGCLUSTER_FREE)&&(entry!=IMGCLUSTER_ZERO))
+		{
+			continue;
+		}
+		if (blocknum!=0) { 
+			/* Content-relative; blocknumtosector() adds FS_OFFSET
+			   back so the block starts exactly at nextsec. */
+			this->alloctable[blocknum]=nextsec-FS_OFFSET;
+		} else {
+			// block 0 points to a container sector
+			// (which incidentally equals FS_OFFSET for blocknum 0)
+			this->alloctable[blocknum]=nextsec;
+		}
 #if (SMARTIMAGEDEBUG==1)
-	cout << "Sectors written to sector "<< sectornum<<"=" << sectors_written << ", handle " << this->m_handle<<endl;
+		cout << "Setting entry for blocknum " <<blocknum<<" to point to sector "<<nextsec<<" of container"<<endl;
 #endif
-	if (sectors_written!=1)
-	{
-		throw ERROR_CANNOT_WRITE_ALLOCTABLE;
+		nextsec+=CLUSTERSIZE;
 	}
+	flushalloctable(firstblock,count);
 	return;
 }
 
@@ -441,6 +683,7 @@ int hd24driveimage::initimage(string* imagefilename,__uint32 endsector)
         if (hd24driveimage::isinvalidhandle(this->m_handle)) {
 		throw ERROR_INVALID_DRIVEIMAGEHANDLE;
 	}
+	unloadalloctable();
 	hd24driveimage::rawseek(0);
 
 	/*
@@ -462,7 +705,7 @@ int hd24driveimage::initimage(string* imagefilename,__uint32 endsector)
 	*/
 
 	// drive signature
-	memcpy(bootblock,(const void*)("SMARTIMG"),8); 
+	memcpy(bootblock,(const void*)(IMGSIGNATURE),8); 
 
 	// cluster size
 	__uint32 clustersize=CLUSTERSIZE;
@@ -537,6 +780,10 @@ int hd24driveimage::initimage(string* imagefilename,__uint32 endsector)
 FSHANDLE hd24driveimage::handle(FSHANDLE p_handle)
 {
 	// TODO: format image as needed.
+	if (p_handle!=this->m_handle)
+	{
+		unloadalloctable();
+	}
 	this->m_handle=p_handle;
 	return m_handle;
 }
@@ -561,9 +808,366 @@ FSHANDLE hd24driveimage::open(string* imagefilename)
               FILE_SHARE_READ|FILE_SHARE_WRITE,
               NULL,OPEN_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
 #endif
+	unloadalloctable();
 	return this->m_handle;
 }
 
+bool hd24driveimage::iszerodata(unsigned char* buffer,__uint32 bytes)
+{
+	/* Checks a word at a time; sector buffers are always
+	   a multiple of the word size. */
+	__uint32 words=bytes/sizeof(__uint32);
+	__uint32* wordbuf=(__uint32*)buffer;
+	for (__uint32 i=0;i<words;i++)
+	{
+		if (wordbuf[i]!=0) return false;
+	}
+	for (__uint32 i=words*sizeof(__uint32);i<bytes;i++)
+	{
+		if (buffer[i]!=0) return false;
+	}
+	return true;
+}
+
+__uint32 hd24driveimage::delta24encode(unsigned char* in,__uint32 inlen,unsigned char* out,__uint32 outmax)
+{
+	/* Simple lossless coder for 24 bit audio: every 3 bytes are
+	   taken as a sample and the difference to the previous sample
+	   is stored as a variable length number (7 bits per byte,
+	   high bit set when more bytes follow). The lowest bit of each
+	   number tells whether it holds a difference (0) or a count of
+	   repeated samples (1), so that silence packs very well.
+	   Bytes left over after the last whole sample are stored as-is.
+	   Returns the packed size, or 0 if it doesn't fit in outmax. */
+	__uint32 samples=inlen/3;
+	__uint32 outpos=0;
+	__uint32 prev=0;
+	__uint32 i=0;
+	while (i<samples)
+	{
+		__uint32 curr=((__uint32)in[i*3]<<16)
+			     +((__uint32)in[i*3+1]<<8)
+			     +((__uint32)in[i*3+2]);
+		__uint32 token;
+		if (curr==prev)
+		{
+			__uint32 run=1;
+			while ((i+run)<samples
+				&&(in[(i+run)*3]==in[i*3])
+				&&(in[(i+run)*3+1]==in[i*3+1])
+				&&(in[(i+run)*3+2]==in[i*3+2]))
+			{
+				run++;
+			}
+			token=(run<<1)|1;
+			i+=run;
+		}
+		else
+		{
+			__uint32 delta=(curr-prev)&0xffffff;
+			/* Map signed differences to small unsigned numbers:
+			   0,-1,1,-2,2... become 0,1,2,3,4... */
+			__uint32 zigzag;
+			if ((delta&0x800000)!=0)
+			{
+				zigzag=((0x1000000-delta)<<1)-1;
+			}
+			else
+			{
+				zigzag=delta<<1;
+			}
+			token=zigzag<<1;
+			prev=curr;
+			i++;
+		}
+		if (outpos+5>outmax)
+		{
+			return 0;
+		}
+		while (token>=0x80)
+		{
+			out[outpos++]=(unsigned char)((token&0x7f)|0x80);
+			token>>=7;
+		}
+		out[outpos++]=(unsigned char)token;
+	}
+	__uint32 tail=inlen-(samples*3);
+	if (outpos+tail>outmax)
+	{
+		return 0;
+	}
+	if (tail>0)
+	{
+		memcpy(&out[outpos],&in[samples*3],tail);
+		outpos+=tail;
+	}
+	return outpos;
+}
+
+bool hd24driveimage::delta24decode(unsigned char* in,__uint32 inlen,unsigned char* out,__uint32 outlen)
+{
+	/* Counterpart of delta24encode. Returns false when the packed
+	   data does not unpack to exactly outlen bytes. */
+	__uint32 samples=outlen/3;
+	__uint32 inpos=0;
+	__uint32 prev=0;
+	__uint32 i=0;
+	while (i<samples)
+	{
+		__uint32 token=0;
+		int shift=0;
+		while (true)
+		{
+			if ((inpos>=inlen)||(shift>28))
+			{
+				return false;
+			}
+			unsigned char c=in[inpos++];
+			token|=((__uint32)(c&0x7f))<<shift;
+			if ((c&0x80)==0) break;
+			shift+=7;
+		}
+		__uint32 run=1;
+		if ((token&1)!=0)
+		{
+			run=token>>1;
+			if ((run==0)||(run>(samples-i)))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			__uint32 zigzag=token>>1;
+			__uint32 delta;
+			if ((zigzag&1)!=0)
+			{
+				delta=(0x1000000-((zigzag+1)>>1))&0xffffff;
+			}
+			else
+			{
+				delta=zigzag>>1;
+			}
+			prev=(prev+delta)&0xffffff;
+		}
+		for (__uint32 j=0;j<run;j++)
+		{
+			out[i*3]=(unsigned char)(prev>>16);
+			out[i*3+1]=(unsigned char)((prev>>8)&0xff);
+			out[i*3+2]=(unsigned char)(prev&0xff);
+			i++;
+		}
+	}
+	__uint32 tail=outlen-(samples*3);
+	if (inpos+tail!=inlen)
+	{
+		return false;
+	}
+	if (tail>0)
+	{
+		memcpy(&out[samples*3],&in[inpos],tail);
+	}
+	return true;
+}
+
+bool hd24driveimage::allocpackbuffers()
+{
+	/* One cluster worth of unpacked data plus one cluster (and a
+	   sector for the record header) worth of packed data. */
+	if (this->clustercache==NULL)
+	{
+		this->clustercache=(unsigned char*)memutils::mymalloc("hd24driveimage::clustercache",CLUSTERSIZE,SECTORSIZE);
+		if (this->clustercache==NULL) return false;
+	}
+	if (this->packbuffer==NULL)
+	{
+		this->packbuffer=(unsigned char*)memutils::mymalloc("hd24driveimage::packbuffer",CLUSTERSIZE+1,SECTORSIZE);
+		if (this->packbuffer==NULL) return false;
+	}
+	return true;
+}
+
+void hd24driveimage::loadcompressedblock(__uint32 blocknum)
+{
+	/* Unpacks a compressed cluster into the cluster cache. */
+	if ((this->clustercachevalid)&&(this->clustercacheblock==blocknum))
+	{
+		return;
+	}
+	if (!allocpackbuffers())
+	{
+		throw ERROR_CANNOT_READ_CLUSTER;
+	}
+	__uint32 recordsector=alloctableentry(blocknum)&IMGCLUSTER_SECTORMASK;
+	if (rawreadsectors(recordsector,this->packbuffer,1)!=1)
+	{
+		throw ERROR_CANNOT_READ_CLUSTER;
+	}
+	unsigned char* header=this->packbuffer;
+	__uint32 packedsize=(header[11]<<24)+(header[10]<<16)+(header[9]<<8)+header[8];
+	__uint32 unpackedsize=(header[15]<<24)+(header[14]<<16)+(header[13]<<8)+header[12];
+	if ((memcmp(header,PACKSIGNATURE,4)!=0)
+	  ||(header[4]!=IMGCODEC_DELTA24)
+	  ||(unpackedsize!=CLUSTERSIZE*SECTORSIZE)
+	  ||(packedsize>CLUSTERSIZE*SECTORSIZE))
+	{
+		throw ERROR_CANNOT_READ_CLUSTER;
+	}
+	__uint32 recordsectors=(PACKHEADERSIZE+packedsize+SECTORSIZE-1)/SECTORSIZE;
+	if (recordsectors>1)
+	{
+		if (rawreadsectors(recordsector+1,&(this->packbuffer[SECTORSIZE]),recordsectors-1)!=(long)(recordsectors-1))
+		{
+			throw ERROR_CANNOT_READ_CLUSTER;
+		}
+	}
+	this->clustercachevalid=false;
+	if (!delta24decode(&(this->packbuffer[PACKHEADERSIZE]),packedsize,this->clustercache,unpackedsize))
+	{
+		throw ERROR_CANNOT_READ_CLUSTER;
+	}
+	this->clustercacheblock=blocknum;
+	this->clustercachevalid=true;
+}
+
+__uint32 hd24driveimage::packcluster(int codec,unsigned char* cluster,unsigned char* record)
+{
+	/* Packs a full cluster into a compressed record (header, packed
+	   data, zero padding up to a whole sector) in the given buffer
+	   of IMGPACKBUFFERSECTORS sectors. Returns the record size in
+	   sectors, or 0 if the cluster doesn't pack well enough to be
+	   worth it (or is all zeroes, which needs no record at all). */
+	if (codec!=IMGCODEC_DELTA24)
+	{
+		return 0;
+	}
+	if (iszerodata(cluster,CLUSTERSIZE*SECTORSIZE))
+	{
+		return 0;
+	}
+	/* Require a saving of at least 1/8th of a cluster. */
+	__uint32 maxpacked=(CLUSTERSIZE*SECTORSIZE)-((CLUSTERSIZE*SECTORSIZE)/8);
+	__uint32 packedsize=delta24encode(cluster,CLUSTERSIZE*SECTORSIZE,&(record[PACKHEADERSIZE]),maxpacked);
+	if (packedsize==0)
+	{
+		return 0;
+	}
+	__uint32 recordsectors=(PACKHEADERSIZE+packedsize+SECTORSIZE-1)/SECTORSIZE;
+	unsigned char* header=record;
+	memcpy(header,PACKSIGNATURE,4);
+	header[4]=(unsigned char)codec;
+	header[5]=0; header[6]=0; header[7]=0;
+	__uint32 val=packedsize;
+	header[8]=(unsigned char)(val&0xff); val>>=8;
+	header[9]=(unsigned char)(val&0xff); val>>=8;
+	header[10]=(unsigned char)(val&0xff); val>>=8;
+	header[11]=(unsigned char)(val&0xff);
+	val=CLUSTERSIZE*SECTORSIZE;
+	header[12]=(unsigned char)(val&0xff); val>>=8;
+	header[13]=(unsigned char)(val&0xff); val>>=8;
+	header[14]=(unsigned char)(val&0xff); val>>=8;
+	header[15]=(unsigned char)(val&0xff);
+	__uint32 padding=(recordsectors*SECTORSIZE)-(PACKHEADERSIZE+packedsize);
+	memset(&(record[PACKHEADERSIZE+packedsize]),0,padding);
+	return recordsectors;
+}
+
+bool hd24driveimage::storepackedblock(__uint32 blocknum,unsigned char* record,__uint32 recordsectors)
+{
+	/* Appends a packed record to the container and points the
+	   cluster's allocation entry at it. */
+	__uint32 lastsec=getcontainerlastsectornum();
+	__uint32 recordsector=lastsec+1;
+	if (recordsector>=IMGCLUSTER_SECTORMASK)
+	{
+		/* Record would be out of reach of the allocation entry. */
+		return false;
+	}
+	if (rawwritesectors(recordsector,record,recordsectors)!=(long)recordsectors)
+	{
+		throw ERROR_APPEND_FAILED;
+	}
+	setfeature(IMGFEATURE_COMPRESSEDCLUSTERS);
+	alloctableentry(blocknum,recordsector|IMGCLUSTER_COMPRESSED);
+#if (SMARTIMAGEDEBUG==1)
+	cout << "Stored blocknum " << blocknum << " compressed to " << recordsectors << " sectors at sector " << recordsector << endl;
+#endif
+	return true;
+}
+
+bool hd24driveimage::storecompressedblock(__uint32 blocknum,unsigned char* buffer)
+{
+	/* Packs a full cluster and appends it to the container as a
+	   compressed record. Returns false if the cluster doesn't pack
+	   well enough to be worth it; the caller then stores it raw. */
+	if (this->m_codec!=IMGCODEC_DELTA24)
+	{
+		return false;
+	}
+	if (!allocpackbuffers())
+	{
+		return false;
+	}
+	__uint32 recordsectors=packcluster(this->m_codec,buffer,this->packbuffer);
+	if (recordsectors==0)
+	{
+		return false;
+	}
+	return storepackedblock(blocknum,this->packbuffer,recordsectors);
+}
+
+void hd24driveimage::expandblock(__uint32 blocknum)
+{
+	/* Turns a compressed cluster back into a regular one, so that
+	   part of it can be overwritten in place. The old record is
+	   left behind unused, as the container never shrinks. */
+	loadcompressedblock(blocknum);
+	this->alloctable[blocknum]=IMGCLUSTER_ZERO;
+	reserveblock(blocknum);
+	__uint32 blockstartsector=blocknumtosector(blocknum);
+	this->clustercachevalid=false;
+	if (rawwritesectors(blockstartsector,this->clustercache,CLUSTERSIZE)!=CLUSTERSIZE)
+	{
+		throw ERROR_CANNOT_WRITE;
+	}
+}
+
+void hd24driveimage::zeroblock(__uint32 blocknum)
+{
+	/* Marks a cluster as holding nothing but zeroes. Where possible, 
+	   the space it used is handed back to the host file system. */
+	__uint32 entry=alloctableentry(blocknum);
+	if (entry==IMGCLUSTER_ZERO)
+	{
+		return;
+	}
+	setfeature(IMGFEATURE_ZEROCLUSTERS);
+#if defined(LINUX) && defined(FALLOC_FL_PUNCH_HOLE)
+	if ((entry!=IMGCLUSTER_FREE)&&(!iscompressedentry(entry)))
+	{
+		__uint64 offset=(__uint64)blocknumtosector(blocknum)*SECTORSIZE;
+		fallocate(this->m_handle,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			offset,(__uint64)CLUSTERSIZE*SECTORSIZE);
+	}
+#endif
+	alloctableentry(blocknum,IMGCLUSTER_ZERO);
+#if (SMARTIMAGEDEBUG==1)
+	cout << "Blocknum " << blocknum << " is now a zero cluster." << endl;
+#endif
+}
+
+void hd24driveimage::compression(int codec)
+{
+	/* Sets the codec used for clusters that are written in full
+	   from here on. Existing clusters are left as they are. */
+	this->m_codec=codec;
+}
+
+int hd24driveimage::compression()
+{
+	return this->m_codec;
+}
+
 long hd24driveimage::readblocksectors(__uint32 blocknum, __uint32 secnum,unsigned char* buffer,int sectors)
 {
 	/* Given a custernum, startsector within that cluster and sector count,
@@ -579,12 +1183,19 @@ long hd24driveimage::readblocksectors(__uint32 blocknum, __uint32 secnum,unsigne
 		<<",sectors="<<sectors
 	<<endl;
 #endif
-        if (!isreserved(blocknum))
+	__uint32 entry=alloctableentry(blocknum);
+        if ((entry==IMGCLUSTER_ZERO)||((blocknum!=0)&&(entry==IMGCLUSTER_FREE)))
 	{
            /* Cluster doesn't exist, all-zero sectors will be returned. */
 	 	memset(&buffer[0],0,sectors*SECTORSIZE);
 		return sectors; // FIXME: return 0 when surpassing drive size
 	}
+	if (iscompressedentry(entry))
+	{
+		loadcompressedblock(blocknum);
+		memcpy(&buffer[0],&(this->clustercache[secnum*SECTORSIZE]),sectors*SECTORSIZE);
+		return sectors;
+	}
 	__uint32 blockstartsector=blocknumtosector(blocknum);
 	__uint32 readcount=rawreadsectors(blockstartsector+secnum,&buffer[0],sectors);
 	return readcount; // TODO: Return sector count actually read
@@ -632,45 +1243,64 @@ long hd24driveimage::content_readsectors(__uint32 secnum, unsigned char* buffer,
 	<<endl;
 #endif
 	__uint32 clustersize=CLUSTERSIZE; // TODO: get from superblock
-	__uint32 startcluster=int(secnum/clustersize);
-	__uint32 endcluster=int((secnum-1+sectors)/clustersize);
-
-	__uint32 sectors_in_startblock=clustersize - (secnum % clustersize);
 	__uint32 startsector=(secnum%CLUSTERSIZE);
-
-	if ((__uint32)(sectors)<sectors_in_startblock) { sectors_in_startblock=sectors; }
-
-#if (SMARTIMAGEDEBUG==1)
-	cout 
-		<< "startcluster="<<startcluster
-		<< "endcluster="<<endcluster
-		<< "sectors to read from startblock="<<sectors_in_startblock
-	<<endl;
-#endif
-	__uint32 sectors_in_rest=sectors-sectors_in_startblock;
-	__uint32 sectors_in_endblock=sectors_in_rest % clustersize;
-	__uint32 sectors_in_middleblocks=sectors-(sectors_in_startblock+sectors_in_endblock);
-
 	__uint32 totsectors=0;
-	__uint32 clusteroffset=0;
-
-	if (sectors_in_startblock>0)
+	__uint32 sectors_left=sectors;
+	__uint32 currcluster=int(secnum/clustersize);
+	__uint32 bufferoffset=0;
+
+	/* Clusters that were appended one after the other are also
+	   stored one after the other in the container, so rather than
+	   reading cluster by cluster, reads of such clusters are merged
+	   into a single read (a 'run'). */
+	__uint32 runsector=0;
+	__uint32 runsectors=0;
+	__uint32 runbufferoffset=0;
+
+	while (true)
 	{
-		totsectors+=readblocksectors(startcluster,startsector,&(buffer[0]),sectors_in_startblock);
-	}
-
-	while (sectors_in_middleblocks>0)
-	{
-		clusteroffset++;	
-		sectors_in_middleblocks-=clustersize;	/* always a multiple of cluster size */
-		__uint32 currcluster=startcluster+clusteroffset;
-		totsectors+=readblocksectors(currcluster,0,&(buffer[clusteroffset*clustersize]),clustersize);
-	}
-
-	if (sectors_in_endblock>0)
-	{
-		clusteroffset++;
-		totsectors+=readblocksectors(endcluster,0,&(buffer[clusteroffset*clustersize]),sectors_in_endblock);
+		__uint32 sectors_in_block=0;
+		__uint32 containersector=0;
+		bool rawcluster=false;
+		if (sectors_left>0)
+		{
+			sectors_in_block=clustersize-startsector;
+			if (sectors_left<sectors_in_block) { sectors_in_block=sectors_left; }
+			rawcluster=isreserved(currcluster);
+			if (rawcluster)
+			{
+				containersector=blocknumtosector(currcluster)+startsector;
+			}
+		}
+		bool extendsrun=(rawcluster&&(runsectors>0)
+				&&((runsector+runsectors)==containersector));
+		if ((runsectors>0)&&(!extendsrun))
+		{
+			/* Anything but the next cluster of the run ends it. */
+			totsectors+=rawreadsectors(runsector,&(buffer[runbufferoffset]),runsectors);
+			runsectors=0;
+		}
+		if (sectors_left==0)
+		{
+			break;
+		}
+		if (rawcluster)
+		{
+			if (runsectors==0)
+			{
+				runsector=containersector;
+				runbufferoffset=bufferoffset;
+			}
+			runsectors+=sectors_in_block;
+		}
+		else
+		{
+			totsectors+=readblocksectors(currcluster,startsector,&(buffer[bufferoffset]),sectors_in_block);
+		}
+		bufferoffset+=sectors_in_block*SECTORSIZE;
+		sectors_left-=sectors_in_block;
+		startsector=0;
+		currcluster++;
 	}
 	return totsectors;	
 }
@@ -687,46 +1317,152 @@ long hd24driveimage::content_writesectors(__uint32 secnum, unsigned char* buffer
 #endif
 	/* Write a number of sectors to the image. 
            The call is split up so it never crosses block boundaries. */
+	if (sectors==0)
+	{
+		return 0;
+	}
 	__uint32 clustersize=CLUSTERSIZE;  // TODO: get from superblock
 	__uint32 startcluster=int(secnum/clustersize);
 	__uint32 endcluster=int((secnum-1+sectors)/clustersize);
-
+	__uint32 clusters=(endcluster-startcluster)+1;
+
+	/* First decide per cluster how the data will be stored.
+	   Zeroes written to a cluster that reads back as zeroes anyway 
+	   need no space at all, full clusters of zeroes are only 
+	   flagged in the allocation table and full clusters may be 
+	   stored compressed. Everything else is written as-is. */
+	vector<bool> writeraw(clusters,false);
 	__uint32 startsector=(secnum%CLUSTERSIZE);
-
-	__uint32 sectors_in_startblock=clustersize - (secnum % clustersize);
-	if ((__uint32)sectors<sectors_in_startblock) { sectors_in_startblock=sectors; }
-	__uint32 sectors_in_rest=sectors-sectors_in_startblock;
-	__uint32 sectors_in_endblock=sectors_in_rest % clustersize;
-	__uint32 sectors_in_middleblocks=sectors-(sectors_in_startblock+sectors_in_endblock);
-
 	__uint32 totsectors=0;
-	__uint32 clusteroffset=0;
-
-	if (sectors_in_startblock>0)
+	__uint32 sectors_left=sectors;
+	__uint32 bufferoffset=0;
+	__uint32 i;
+	for (i=0;i<clusters;i++)
 	{
-		totsectors+=writeblocksectors(startcluster,startsector,&(buffer[0]),sectors_in_startblock);
+		__uint32 currcluster=startcluster+i;
+		__uint32 sectors_in_block=clustersize-startsector;
+		if (sectors_left<sectors_in_block) { sectors_in_block=sectors_left; }
+		bool fullcluster=(sectors_in_block==clustersize);
+		__uint32 entry=alloctableentry(currcluster);
+		bool reads_as_zero=((entry==IMGCLUSTER_ZERO)
+				||((currcluster!=0)&&(entry==IMGCLUSTER_FREE)));
+		bool has_rawspace=(!reads_as_zero)&&(!iscompressedentry(entry));
+		unsigned char* data=&(buffer[bufferoffset]);
+
+		if (iszerodata(data,sectors_in_block*SECTORSIZE)
+		    &&(reads_as_zero||fullcluster))
+		{
+			if (!reads_as_zero)
+			{
+				zeroblock(currcluster);
+			}
+			totsectors+=sectors_in_block;
+		}
+		else if (fullcluster&&(!has_rawspace)&&storecompressedblock(currcluster,data))
+		{
+			totsectors+=sectors_in_block;
+		}
+		else
+		{
+			if (iscompressedentry(entry))
+			{
+				if (fullcluster)
+				{
+					/* No need to unpack what we're about to overwrite. */
+					alloctableentry(currcluster,IMGCLUSTER_ZERO);
+				}
+				else
+				{
+					expandblock(currcluster);
+				}
+			}
+			writeraw[i]=true;
+		}
+		bufferoffset+=sectors_in_block*SECTORSIZE;
+		sectors_left-=sectors_in_block;
+		startsector=0;
 	}
 
-	while (sectors_in_middleblocks>0)
+	/* Reserve all clusters that still need space, a run at a time. */
+	i=0;
+	while (i<clusters)
 	{
-		clusteroffset++;	
-		sectors_in_middleblocks-=clustersize;	/* always a multiple of cluster size */
-		__uint32 currcluster=startcluster+clusteroffset;
-		totsectors+=writeblocksectors(currcluster,0,&(buffer[clusteroffset*clustersize]),clustersize);
+		if (!writeraw[i]) { i++; continue; }
+		__uint32 runstart=i;
+		while ((i<clusters)&&(writeraw[i])) i++;
+		reserveblocks(startcluster+runstart,i-runstart);
 	}
 
-	if (sectors_in_endblock>0)
+	startsector=(secnum%CLUSTERSIZE);
+	sectors_left=sectors;
+	bufferoffset=0;
+	for (i=0;i<clusters;i++)
 	{
-		clusteroffset++;
-		totsectors+=writeblocksectors(endcluster,0,&(buffer[clusteroffset*clustersize]),sectors_in_endblock);
+		__uint32 sectors_in_block=clustersize-startsector;
+		if (sectors_left<sectors_in_block) { sectors_in_block=sectors_left; }
+		if (writeraw[i])
+		{
+			totsectors+=writeblocksectors(startcluster+i,startsector,&(buffer[bufferoffset]),sectors_in_block);
+		}
+		bufferoffset+=sectors_in_block*SECTORSIZE;
+		sectors_left-=sectors_in_block;
+		startsector=0;
 	}
 	return totsectors;
 }
 
+long hd24driveimage::content_writecluster(__uint32 blocknum,unsigned char* cluster,
+			unsigned char* record,__uint32 recordsectors)
+{
+	/* Writes one full cluster, given the result of packcluster for
+	   it (recordsectors is 0 if it didn't pack). Stores it the same
+	   way content_writesectors would, without packing it again. */
+	__uint32 entry=alloctableentry(blocknum);
+	bool reads_as_zero=((entry==IMGCLUSTER_ZERO)
+			||((blocknum!=0)&&(entry==IMGCLUSTER_FREE)));
+	bool has_rawspace=(!reads_as_zero)&&(!iscompressedentry(entry));
+	if ((recordsectors==0)&&(iszerodata(cluster,CLUSTERSIZE*SECTORSIZE)))
+	{
+		if (!reads_as_zero)
+		{
+			zeroblock(blocknum);
+		}
+		return CLUSTERSIZE;
+	}
+	if ((recordsectors>0)&&(!has_rawspace)
+	   &&(storepackedblock(blocknum,record,recordsectors)))
+	{
+		return CLUSTERSIZE;
+	}
+	if (iscompressedentry(entry))
+	{
+		/* No need to unpack what we're about to overwrite. */
+		alloctableentry(blocknum,IMGCLUSTER_ZERO);
+	}
+	reserveblock(blocknum);
+	return writeblocksectors(blocknum,0,cluster,CLUSTERSIZE);
+}
+
 void hd24driveimage::initvars()
 {
 	this->suppresslogs=false;
 	this->m_handle=FSHANDLE_INVALID;
+	this->alloctable=NULL;
+	this->alloctableloaded=false;
+	this->featureflags=0;
+	this->m_codec=IMGCODEC_NONE;
+	this->packbuffer=NULL;
+	this->clustercache=NULL;
+	this->clustercacheblock=0;
+	this->clustercachevalid=false;
+	this->trace=NULL;
+}
+
+void hd24driveimage::iotrace(hd24iotrace* tracer)
+{
+	/* Record reads and writes of the container file, so that
+	   they can be compared with those of the wrapped drive. */
+	this->trace=tracer;
 }
 
 hd24driveimage::hd24driveimage()
@@ -736,7 +1472,21 @@ hd24driveimage::hd24driveimage()
 
 hd24driveimage::~hd24driveimage()
 {
-
+	if (this->alloctable!=NULL)
+	{
+		memutils::myfree("hd24driveimage::alloctable",this->alloctable);
+		this->alloctable=NULL;
+	}
+	if (this->packbuffer!=NULL)
+	{
+		memutils::myfree("hd24driveimage::packbuffer",this->packbuffer);
+		this->packbuffer=NULL;
+	}
+	if (this->clustercache!=NULL)
+	{
+		memutils::myfree("hd24driveimage::clustercache",this->clustercache);
+		this->clustercache=NULL;
+	}
 }
 
 /*======================================
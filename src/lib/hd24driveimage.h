@@ -6,6 +6,25 @@
 #include <string>
 #include "convertlib.h"
 #define IMGCLUSTER_FREE (0x00000000)
+#define IMGCLUSTER_ZERO (0xFFFFFFFF)
+#define IMGCLUSTER_COMPRESSED (0x80000000)
+#define IMGCLUSTER_SECTORMASK (0x7FFFFFFF)
+
+/* Images that use any feature get a different signature, so that
+   versions from before feature flags do not take them for images
+   with plain clusters only. */
+#define IMGSIGNATURE "SMARTIMG"
+#define IMGSIGNATURE_FEATURES "SMARTIM2"
+
+#define IMGFEATURE_ZEROCLUSTERS (0x00000001)
+#define IMGFEATURE_COMPRESSEDCLUSTERS (0x00000002)
+#define IMGFEATURES_KNOWN (IMGFEATURE_ZEROCLUSTERS|IMGFEATURE_COMPRESSEDCLUSTERS)
+
+#define IMGCLUSTERSECTORS 4096
+#define IMGPACKBUFFERSECTORS (IMGCLUSTERSECTORS+1)	/* enough for any packed record */
+
+#define IMGCODEC_NONE 0
+#define IMGCODEC_DELTA24 1
 
 #if defined(LINUX) || defined(DARWIN)
 #	define FSHANDLE int
@@ -21,12 +40,51 @@
 
 using namespace std;
 
+class hd24iotrace;
+
 class hd24driveimage 
 {
 private:
 	FSHANDLE m_handle;
+
+	/* In-memory copy of the cluster allocation table. Loaded
+	   on first use, kept in sync by writing through on updates. */
+	__uint32* alloctable;
+	bool alloctableloaded;
+	void loadalloctable();
+	void unloadalloctable();
+	__uint32 alloctableentry(__uint32 blocknum);
+	void alloctableentry(__uint32 blocknum,__uint32 entry);
+	void flushalloctable(__uint32 firstblock,__uint32 count);
+	__uint32 featureflags;
+	void setfeature(__uint32 feature);
+	static __uint32 superblockfeatures(unsigned char* superblock);
+	bool iscompressedentry(__uint32 entry);
+
+	/* Compressed cluster support. The most recently unpacked
+	   cluster is kept around so that reading it sector by sector
+	   does not unpack it over and over again. */
+	int m_codec;
+	unsigned char* packbuffer;
+	unsigned char* clustercache;
+	__uint32 clustercacheblock;
+	bool clustercachevalid;
+	bool allocpackbuffers();
+	void loadcompressedblock(__uint32 blocknum);
+	bool storecompressedblock(__uint32 blocknum,unsigned char* buffer);
+	bool storepackedblock(__uint32 blocknum,unsigned char* record,__uint32 recordsectors);
+	void expandblock(__uint32 blocknum);
+	void zeroblock(__uint32 blocknum);
+	static bool iszerodata(unsigned char* buffer,__uint32 bytes);
+	static __uint32 delta24encode(unsigned char* in,__uint32 inlen,
+				unsigned char* out,__uint32 outmax);
+	static bool delta24decode(unsigned char* in,__uint32 inlen,
+				unsigned char* out,__uint32 outlen);
+
 	bool isreserved(__uint32 blocknum);
 	void reserveblock(__uint32 blocknum);
+	void reserveblocks(__uint32 firstblock,__uint32 count);
+	bool growcontainer(__uint32 firstsector,__uint32 sectors);
         static bool isinvalidhandle(FSHANDLE handle);
 
 	__uint32 blocknumtosector(__uint32 blocknum);
@@ -49,6 +107,7 @@ private:
 
 	void rawseek(__uint64 seekpos);
 	bool suppresslogs;
+	hd24iotrace* trace;	/* container I/O tracing, NULL if off */
 public:
 	hd24driveimage();
 	~hd24driveimage();
@@ -57,10 +116,22 @@ public:
 	FSHANDLE open(string* imagefilename);
 	FSHANDLE handle(FSHANDLE p_handle);
 	FSHANDLE handle();
+	bool supported();
+	static bool issmartimage(unsigned char* superblock);
 	long content_readsectors(__uint32 secnum, 
                           unsigned char* buffer,int sectors);
 	long content_writesectors(__uint32 secnum, 
                           unsigned char* buffer,int sectors);
+	void compression(int codec);
+	int compression();
+	/* Packing a full cluster is the costly part of storing it
+	   compressed. Threads sharing an image can do it up front with
+	   packcluster, outside of any lock, and then hand the record
+	   over to content_writecluster. */
+	static __uint32 packcluster(int codec,unsigned char* cluster,unsigned char* record);
+	long content_writecluster(__uint32 blocknum,unsigned char* cluster,
+				unsigned char* record,__uint32 recordsectors);
+	void iotrace(hd24iotrace* tracer);
 	void close();
 	__uint32 getcontainerlastsectornum();
 	__uint32 getcontentlastsectornum();
@@ -69,6 +69,8 @@
 #define ERROR_INVALID 0xFFFFFFFF
 #include "hd24project.cpp"
 #include "hd24song.cpp"
+#include "hd24catalog.cpp"
+#include "hd24iotrace.cpp"
 #if defined(LINUX) || defined(DARWIN)
 const int hd24fs::MODE_RDONLY=O_RDONLY;
 const int hd24fs::MODE_RDWR=O_RDWR;
@@ -885,21 +887,31 @@ FSHANDLE hd24fs::findhd24device(int mode,string* devname,bool force,bool tryhard
 	}
 
         readsectors_noheader(handle,sectornum,findhdbuf,1); // fstfix follows
-	string* rawfstype=Convert::readstring(findhdbuf,0,8);
+	bool issmart=hd24driveimage::issmartimage(findhdbuf);
 	fstfix(findhdbuf,512);
         string* fstype=Convert::readstring(findhdbuf,0,8);
 #if (HD24FSDEBUG==1)
 	cout << "FStype=" <<*fstype<<endl;
 #endif
 	bool isadat=false;
-        if (*rawfstype=="SMARTIMG") 
+        if (issmart) 
         {
                 this->smartimage=new hd24driveimage();
+		this->smartimage->iotrace(this->iotracer);
 #if (HD24FSDEBUG==1)
 		cout << "Mounting FS inside smartimage." << endl;
 #endif
 		this->smartimagehandle=smartimage->handle(handle);
-		delete rawfstype;
+		if (!this->smartimage->supported())
+		{
+			/* Made by a newer version; we might misread it. */
+			delete fstype;
+			delete this->smartimage;
+			this->smartimage=NULL;
+			hd24closedevice(handle,"Unsupported smart image");
+			this->smartimagehandle=FSHANDLE_INVALID;
+			return FSHANDLE_INVALID;
+		}
 		return this->smartimagehandle;
         } else {
 		if (this->smartimage!=NULL)
@@ -908,7 +920,6 @@ FSHANDLE hd24fs::findhd24device(int mode,string* devname,bool force,bool tryhard
 		}
 		this->smartimage=NULL;
 	}
-	delete rawfstype;
         if (*fstype=="ADAT FST") {
 		/* Okay, but if we are 'trying harder' we can run into
  		   a false positive for old HD24 drives that are now in
@@ -1182,6 +1193,13 @@ void hd24fs::initvars()
 	this->devicename=NULL;
 	this->highestFSsectorwritten=0;
 	this->needcommit=false;
+	this->catalog=NULL;
+	this->catalogloaded=false;
+	this->catalogdirty=false;
+	this->nohostfiles=false;
+	this->catalogfirstsector=0xFFFFFFFF;
+	this->cataloglastsector=0;
+	this->iotracer=NULL;
 
 	// 0x10c76 is last sector of song/project area (without undo buffer)
 	return;	
@@ -1248,10 +1266,6 @@ hd24fs::~hd24fs()
 #if (HD24FSDEBUG==1)
 	cout << "hd24fs::~hd24fs();" << endl;
 #endif
-	if (this->devicename!=NULL) {
-		delete this->devicename;
-		this->devicename=NULL;
-	}
 #if (HD24FSDEBUG==1)
 	cout << "Commit and close FS handle (if isopen)" << endl;
 #endif
@@ -1259,8 +1273,14 @@ hd24fs::~hd24fs()
 	{
 		//if (!this->isdevicefile()) 
 		commit();
+		savecatalog();
 		hd24closedevice(this->devhd24,"hd24close (after doing a commit)");
 	}
+	clearcatalog();
+	if (this->devicename!=NULL) {
+		delete this->devicename;
+		this->devicename=NULL;
+	}
 #if (HD24FSDEBUG==1)
 	cout << "Free superblock mem" << endl;
 #endif
@@ -1307,6 +1327,7 @@ hd24fs::~hd24fs()
 		this->imagedir=NULL;
 	}
 	this->hd24sync();
+	stopiotrace();
 }
 
 bool hd24fs::isOpen() 
@@ -1318,6 +1339,47 @@ bool hd24fs::isOpen()
 	return false;
 }	
 
+hd24iotrace* hd24fs::startiotrace(__uint32 events)
+{
+	/* Starts recording sector I/O, keeping up to the given
+	   number of most recent events (see hd24iotrace.cpp). */
+	stopiotrace();
+	iotracer=new hd24iotrace(events);
+	if (smartimage!=NULL)
+	{
+		smartimage->iotrace(iotracer);
+	}
+	return iotracer;
+}
+
+void hd24fs::stopiotrace()
+{
+	if (iotracer==NULL)
+	{
+		return;
+	}
+	if (smartimage!=NULL)
+	{
+		smartimage->iotrace(NULL);
+	}
+	delete iotracer;
+	iotracer=NULL;
+}
+
+hd24iotrace* hd24fs::iotrace()
+{
+	return iotracer;
+}
+
+int hd24fs::iotag(int tag)
+{
+	/* Sets what sector I/O of the calling thread is done for from
+	   now on, for tracing. Returns the previous tag so that it can be
+	   restored. The tag is kept even while not tracing, so that a
+	   trace started halfway through a transfer is labeled right. */
+	return hd24iotrace::tag(tag);
+}
+
 void hd24fs::fstfix(unsigned char * bootblock,int fixsize) 
 {
 	if (bootblock==NULL) return;
@@ -1399,8 +1461,16 @@ long hd24fs::writesectors(FSHANDLE devhd24,unsigned long sectornum,unsigned char
 	}
 	FSHANDLE currdevice=devhd24;
 	FSHANDLE mysmartimagehandle=devhd24;
+	hd24iotrace* tracer=NULL;
+	double tracestart=0;
 	if (this!=NULL)
 	{
+		tracer=this->iotracer;
+		if (tracer!=NULL)
+		{
+			tracestart=hd24utils::monotonicseconds();
+		}
+		this->catalogforget(sectornum,sectors);
 		__uint32 lastsec=sectornum+(sectors-1);
 		if (lastsec<=0x10c76)
 		{
@@ -1450,6 +1520,11 @@ long hd24fs::writesectors(FSHANDLE devhd24,unsigned long sectornum,unsigned char
 			smartimage->handle(mysmartimagehandle);
 			__uint32 wresult=512*(smartimage->content_writesectors(sectornum,buffer,sectors));
 			smartimage->handle(oldhandle);
+			if (tracer!=NULL)
+			{
+				tracer->record(hd24iotrace::OP_WRITE,hd24iotrace::LAYER_DRIVE,
+					sectornum,sectors,tracestart);
+			}
 			return wresult;
 		}
 	}
@@ -1469,6 +1544,11 @@ long hd24fs::writesectors(FSHANDLE devhd24,unsigned long sectornum,unsigned char
 		bytes=WRITESIZE;
 	};
 #endif
+	if (tracer!=NULL)
+	{
+		tracer->record(hd24iotrace::OP_WRITE,hd24iotrace::LAYER_DRIVE,
+			sectornum,sectors,tracestart);
+	}
        	return bytes;
 }
 
@@ -1481,8 +1561,15 @@ long hd24fs::readsectors(FSHANDLE devhd24,unsigned long sectornum,unsigned char
 	
 	FSHANDLE currdevice=devhd24;
 	FSHANDLE mysmartimagehandle=devhd24;
+	hd24iotrace* tracer=NULL;
+	double tracestart=0;
 	int setheader=0;
 	if (this!=NULL) {
+		tracer=this->iotracer;
+		if (tracer!=NULL)
+		{
+			tracestart=hd24utils::monotonicseconds();
+		}
 		if ((this->headersectors)!=0)
 		{
 			if (sectornum<this->headersectors) 
@@ -1505,6 +1592,11 @@ long hd24fs::readsectors(FSHANDLE devhd24,unsigned long sectornum,unsigned char
 				smartimage->content_readsectors(sectornum,buffer,sectorcount));
 				
 				smartimage->handle(oldhandle);
+				if (tracer!=NULL)
+				{
+					tracer->record(hd24iotrace::OP_READ,hd24iotrace::LAYER_DRIVE,
+						sectornum,sectorcount,tracestart);
+				}
 				return intresult;
 			}
 		}
@@ -1523,6 +1615,11 @@ long hd24fs::readsectors(FSHANDLE devhd24,unsigned long sectornum,unsigned char
 		bytes_read = 0;
 	}
 #endif
+	if (tracer!=NULL)
+	{
+		tracer->record(hd24iotrace::OP_READ,hd24iotrace::LAYER_DRIVE,
+			sectornum,sectorcount,tracestart);
+	}
         return bytes_read;
 }
 
@@ -1622,6 +1719,10 @@ bool hd24fs::useheaderfile(string headerfilename)
 #endif
 
 	if (isinvalidhandle(handle)) return false;
+	// no catalog caching while a header is in use
+	savecatalog();
+	clearcatalog();
+	catalogloaded=false;
 	hd24header=handle;
 	this->headersectors=0;
 	int lastsecerror=0;
@@ -2934,6 +3035,7 @@ bool hd24fs::commit(bool fullcommit)
 		// (which is to allow safe read-only operation).
 		return true;
 	};
+	int oldiotag=iotag(hd24iotrace::TAG_COMMIT);
 	__uint32 sector=0;
 	__uint32 blocksize=1;
 	__uint32 count=1;
@@ -2994,6 +3096,7 @@ bool hd24fs::commit(bool fullcommit)
 	highestFSsectorwritten=0; // reset 
 	this->hd24sync();
 	this->needcommit=false;
+	iotag(oldiotag);
 	return true;
 }
 void hd24fs::hd24sync()
@@ -3298,6 +3401,9 @@ __uint32 hd24fs::writesuperblock(__uint32 lastsec)
 
 void hd24fs::force_reload()
 {
+	savecatalog();
+	clearcatalog();
+	catalogloaded=false;
 #if (HD24FSDEBUG==1)
 	cout << "Free superblock mem" << endl;
 #endif
@@ -4,10 +4,13 @@
 #include <config.h>
 #include <stdio.h>
 #include <string>
+#include <vector>
 #include <hd24utils.h>
 #include "memutils.h"
 #include "convertlib.h"
+#include "hd24iotrace.h"
 #define CLUSTER_UNDEFINED (0xFFFFFFFF)
+#define DURATIONSIZE 16 /* buffer size for hd24song::display_duration(char*...) */
 
 #if defined(LINUX) || defined(DARWIN)
 #	define FSHANDLE int
@@ -47,8 +50,15 @@ class hd24song : public AudioStorage
 	friend class hd24fs;
 	friend class hd24transferjob;
 	friend class hd24transferengine;
+	friend class hd24peaks;
 	private:
 		__uint32 framespersec;
+		__uint32 tc_samrate;	// rate the timecode divisors are for
+		__uint32 tc_chanmult;
+		__uint32 tc_persec;	// wamples per second/minute/hour
+		__uint32 tc_permin;
+		__uint32 tc_perhour;
+		void timecodedivisors(__uint32 samrate);
 		unsigned char* buffer;		// for songinfo
 		unsigned char* audiobuffer;	// for audio data 
 		unsigned char* scratchbook;	// for write-back audio data
@@ -171,6 +181,10 @@ class hd24song : public AudioStorage
 		string*  display_duration(__uint32 offset,__uint32 samrate);
 
 		string*  display_cursor();
+		char*    display_duration(char* buf);
+		char*    display_duration(char* buf,__uint32 offset);
+		char*    display_duration(char* buf,__uint32 offset,__uint32 samrate);
+		char*    display_cursor(char* buf);
 		__uint32 cursorpos();
 		__uint32 locatepointcount();
 		__uint32 getlocatepos(int locatepoint);
@@ -217,6 +231,7 @@ class hd24project
 {
 	friend class hd24fs;
 	friend class hd24song;
+	friend class hd24peaks;
 
 	private:
 		unsigned char* buffer;
@@ -251,6 +266,13 @@ class hd24project
 class hd24driveimage;
 #endif
 
+typedef struct
+{
+	__uint32 sector;
+	__uint32 count;
+	unsigned char* data;	// sectors as found on disk (before fstfix)
+} hd24catalogentry;
+
 class hd24fs 
 {
 	friend class hd24project;
@@ -259,6 +281,7 @@ class hd24fs
 	friend class hd24utils;
 	friend class hd24test;
 	friend class hd24driveimage;
+	friend class hd24peaks;
 
 	private:
 		const char* imagedir;
@@ -365,6 +388,27 @@ class hd24fs
 		hd24driveimage* smartimage;
 		FSHANDLE smartimagehandle;
 
+		/* Host-side copy of project and song sectors, kept between
+		   sessions (see hd24catalog.cpp) */
+		vector<hd24catalogentry>* catalog;
+		bool catalogloaded;
+		bool catalogdirty;
+		bool nohostfiles;	/* see nohostcache() */
+		__uint32 catalogfirstsector;	/* all entries lie within */
+		__uint32 cataloglastsector;	/* these sectors */
+		long readmetasectors(__uint32 secnum,unsigned char* buffer,int sectors);
+		void mergemetasectors(__uint32 secnum,unsigned char* buffer,int sectors);
+		string* hostcachefilename(const char* prefix,const char* suffix);
+		string* catalogfilename();
+		__uint64 catalogkey();
+		void loadcatalog();
+		void savecatalog();
+		void clearcatalog();
+		void catalogadd(hd24catalogentry* entry);
+		void catalogforget(__uint32 secnum,int sectors);
+
+		hd24iotrace* iotracer;	/* NULL unless tracing */
+
 
 	public:
 		__uint32 lasterror;
@@ -405,6 +449,11 @@ class hd24fs
 		__uint32 getbytesperaudioblock();
 		static void fstfix(unsigned char* bootblock,int fixsize);
 		bool isOpen();	
+		hd24iotrace* startiotrace(__uint32 events);
+		void stopiotrace();
+		hd24iotrace* iotrace();
+		int iotag(int tag);
+		void nohostcache();
 		int mode();
 		string* volumename();
 		string* getdevicename();
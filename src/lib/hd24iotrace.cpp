@@ -0,0 +1,257 @@
+/* Sector I/O tracing.
+
+   When tracing is enabled on a file system (hd24fs::startiotrace),
+   every readsectors/writesectors call is recorded with its sector,
+   length, latency and a tag telling what it was done for (transfer,
+   realtime playback cache, commit, catalog; see hd24fs::iotag).
+   The tag is kept per thread, so a transfer and the realtime cache
+   can run at the same time without mislabeling each other's I/O.
+   For smart drive images the reads and writes of the container file
+   are recorded as well, as a second layer, so that the effect of
+   fragmentation inside the image can be told from that on the drive.
+
+   Events go into a fixed size ring; when it is full the oldest events
+   are overwritten. Recording takes no locks, so it can be left on
+   while transfers and playback run in other threads. Reading out the
+   ring (summary, writechrometrace) should be done while no I/O is
+   going on; events that are being written at that time are skipped.
+   Latency histograms count all events, also those no longer in the
+   ring.
+
+   writechrometrace writes the events in the Trace Event format that
+   chrome://tracing and Perfetto can show on a time line. */
+
+const int hd24iotrace::TAG_OTHER=0;
+const int hd24iotrace::TAG_TRANSFER=1;
+const int hd24iotrace::TAG_REALTIME=2;
+const int hd24iotrace::TAG_COMMIT=3;
+const int hd24iotrace::TAG_CATALOG=4;
+const int hd24iotrace::OP_READ=0;
+const int hd24iotrace::OP_WRITE=1;
+const int hd24iotrace::LAYER_DRIVE=0;
+const int hd24iotrace::LAYER_IMAGE=1;
+
+static __thread int iotrace_threadtag=0;	/* hd24iotrace::TAG_OTHER */
+
+hd24iotrace::hd24iotrace(__uint32 events)
+{
+	if (events==0)
+	{
+		events=1;
+	}
+	ringsize=events;
+	ring=(hd24ioevent*)memutils::mymalloc("hd24iotrace",ringsize,sizeof(hd24ioevent));
+	if (ring==NULL)
+	{
+		ringsize=0;
+	}
+	reset();
+}
+
+hd24iotrace::~hd24iotrace()
+{
+	if (ring!=NULL)
+	{
+		memutils::myfree("hd24iotrace",ring);
+		ring=NULL;
+	}
+}
+
+void hd24iotrace::reset()
+{
+	nextevent=0;
+	for (__uint32 i=0;i<ringsize;i++)
+	{
+		ring[i].sequence=0;
+	}
+	for (int l=0;l<IOTRACE_LAYERS;l++)
+	{
+		for (int t=0;t<IOTRACE_TAGS;t++)
+		{
+			for (int op=0;op<IOTRACE_OPS;op++)
+			{
+				for (int b=0;b<IOTRACE_BUCKETS;b++)
+				{
+					histogram[l][t][op][b]=0;
+				}
+			}
+		}
+	}
+	starttime=hd24utils::monotonicseconds();
+}
+
+int hd24iotrace::tag(int newtag)
+{
+	int oldtag=iotrace_threadtag;
+	if ((newtag>=0)&&(newtag<IOTRACE_TAGS))
+	{
+		iotrace_threadtag=newtag;
+	}
+	return oldtag;
+}
+
+int hd24iotrace::tag()
+{
+	return iotrace_threadtag;
+}
+
+const char* hd24iotrace::tagname(int tag)
+{
+	switch (tag)
+	{
+		case TAG_TRANSFER: return "transfer";
+		case TAG_REALTIME: return "realtime";
+		case TAG_COMMIT: return "commit";
+		case TAG_CATALOG: return "catalog";
+	}
+	return "other";
+}
+
+double hd24iotrace::bucketlimit(int bucket)
+{
+	/* Bucket n holds latencies below 2^n microseconds (and at least
+	   those of bucket n-1); the last bucket holds everything above. */
+	double limit=0.000001;
+	for (int i=0;i<bucket;i++)
+	{
+		limit*=2;
+	}
+	return limit;
+}
+
+void hd24iotrace::record(int op,int layer,__uint32 sector,__uint32 sectors,double start)
+{
+	if (ringsize==0)
+	{
+		return;
+	}
+	double latency=hd24utils::monotonicseconds()-start;
+	int eventtag=iotrace_threadtag;
+	__uint32 slot=__sync_fetch_and_add(&nextevent,1);
+	hd24ioevent* event=&ring[slot%ringsize];
+	event->sequence=0;
+	event->start=start;
+	event->latency=latency;
+	event->sector=sector;
+	event->sectors=sectors;
+	event->op=(unsigned char)op;
+	event->layer=(unsigned char)layer;
+	event->tag=(unsigned char)eventtag;
+	__sync_synchronize();
+	event->sequence=slot+1;
+
+	int bucket=0;
+	double limit=0.000001;
+	while ((bucket<(IOTRACE_BUCKETS-1))&&(latency>=limit))
+	{
+		bucket++;
+		limit*=2;
+	}
+	__sync_fetch_and_add(&histogram[layer][eventtag][op][bucket],1);
+}
+
+__uint32 hd24iotrace::firstevent()
+{
+	__uint32 last=nextevent;
+	if (last>ringsize)
+	{
+		return last-ringsize;
+	}
+	return 0;
+}
+
+__uint32 hd24iotrace::eventcount()
+{
+	return nextevent-firstevent();
+}
+
+__uint32 hd24iotrace::latencyhistogram(int tag,int layer,int op,int bucket)
+{
+	if ((tag<0)||(tag>=IOTRACE_TAGS)||(layer<0)||(layer>=IOTRACE_LAYERS)
+	   ||(op<0)||(op>=IOTRACE_OPS)||(bucket<0)||(bucket>=IOTRACE_BUCKETS))
+	{
+		return 0;
+	}
+	return histogram[layer][tag][op][bucket];
+}
+
+void hd24iotrace::summary(int tag,int layer,hd24iosummary* result)
+{
+	/* Totals for the events still in the ring with the given tag
+	   (-1 for all tags) on the given layer. Sequentiality and seek
+	   distance are measured against the previous request on the
+	   same layer, whatever it was done for, as that is where the
+	   drive (or image file) was. */
+	result->requests=0;
+	result->sectors=0;
+	result->seconds=0;
+	result->sequential=0;
+	result->seekdistance=0;
+
+	bool haveprevious=false;
+	__uint32 previousend=0;
+	__uint32 last=nextevent;
+	for (__uint32 i=firstevent();i<last;i++)
+	{
+		hd24ioevent* event=&ring[i%ringsize];
+		if ((event->sequence!=i+1)||(event->layer!=layer))
+		{
+			continue;
+		}
+		if ((tag<0)||(event->tag==tag))
+		{
+			result->requests++;
+			result->sectors+=event->sectors;
+			result->seconds+=event->latency;
+			if (haveprevious)
+			{
+				if (event->sector==previousend)
+				{
+					result->sequential++;
+				} else if (event->sector>previousend) {
+					result->seekdistance+=event->sector-previousend;
+				} else {
+					result->seekdistance+=previousend-event->sector;
+				}
+			}
+		}
+		haveprevious=true;
+		previousend=event->sector+event->sectors;
+	}
+}
+
+bool hd24iotrace::writechrometrace(const char* filename)
+{
+	FILE* out=fopen(filename,"w");
+	if (out==NULL)
+	{
+		return false;
+	}
+	fprintf(out,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(out,"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+		"\"args\":{\"name\":\"drive sectors\"}},\n",LAYER_DRIVE+1);
+	fprintf(out,"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+		"\"args\":{\"name\":\"image container\"}}",LAYER_IMAGE+1);
+	__uint32 last=nextevent;
+	for (__uint32 i=firstevent();i<last;i++)
+	{
+		hd24ioevent* event=&ring[i%ringsize];
+		if (event->sequence!=i+1)
+		{
+			continue;
+		}
+		fprintf(out,",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			"\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+			"\"args\":{\"sector\":%lu,\"sectors\":%lu}}",
+			(event->op==OP_WRITE)?("write"):("read"),
+			tagname(event->tag),
+			(event->start-starttime)*1000000.0,
+			event->latency*1000000.0,
+			event->layer+1,
+			(unsigned long)event->sector,
+			(unsigned long)event->sectors);
+	}
+	fprintf(out,"\n]}\n");
+	fclose(out);
+	return true;
+}
@@ -0,0 +1,71 @@
+#ifndef __hd24iotrace_h__
+#define __hd24iotrace_h__
+
+#include <config.h>
+#include <stdio.h>
+
+/* Optional record of the sector I/O done by a file system, to find
+   out where time goes when reading from a slow drive or a heavily
+   fragmented song. See hd24iotrace.cpp. */
+
+#define IOTRACE_TAGS		5
+#define IOTRACE_OPS		2
+#define IOTRACE_LAYERS		2
+#define IOTRACE_BUCKETS		24	/* latency histogram buckets */
+
+typedef struct
+{
+	double start;		/* seconds, as hd24utils::monotonicseconds() */
+	double latency;		/* seconds */
+	__uint32 sector;
+	__uint32 sectors;
+	__uint32 sequence;	/* set last; tells a complete event from one being written */
+	unsigned char op;
+	unsigned char layer;
+	unsigned char tag;
+} hd24ioevent;
+
+typedef struct
+{
+	__uint32 requests;
+	__uint64 sectors;
+	double seconds;
+	__uint32 sequential;	/* requests starting where the previous one ended */
+	__uint64 seekdistance;	/* total sectors skipped over between requests */
+} hd24iosummary;
+
+class hd24iotrace
+{
+private:
+	hd24ioevent* ring;
+	__uint32 ringsize;
+	volatile __uint32 nextevent;
+	volatile __uint32 histogram[IOTRACE_LAYERS][IOTRACE_TAGS][IOTRACE_OPS][IOTRACE_BUCKETS];
+	double starttime;
+	__uint32 firstevent();
+public:
+	static const int TAG_OTHER;
+	static const int TAG_TRANSFER;	/* transfers to/from the PC */
+	static const int TAG_REALTIME;	/* realtime playback cache */
+	static const int TAG_COMMIT;
+	static const int TAG_CATALOG;
+	static const int OP_READ;
+	static const int OP_WRITE;
+	static const int LAYER_DRIVE;	/* sectors as seen by the file system */
+	static const int LAYER_IMAGE;	/* container sectors of a smart image */
+
+	hd24iotrace(__uint32 events);
+	~hd24iotrace();
+	static int tag(int newtag);	/* for the calling thread; returns the previous tag */
+	static int tag();
+	static const char* tagname(int tag);
+	void record(int op,int layer,__uint32 sector,__uint32 sectors,double start);
+	void reset();
+	__uint32 eventcount();
+	__uint32 latencyhistogram(int tag,int layer,int op,int bucket);
+	static double bucketlimit(int bucket);
+	void summary(int tag,int layer,hd24iosummary* result);
+	bool writechrometrace(const char* filename);
+};
+
+#endif
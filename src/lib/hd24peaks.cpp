@@ -0,0 +1,512 @@
+#include <config.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include "hd24peaks.h"
+#include "hd24utils.h"
+#include "memutils.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#define PEAKS_MAGIC		"HD24PKS1"
+#define PEAKS_HEADERSIZE	28
+#define PEAKS_ENTRYSIZE		6
+#define PEAKS_SONGINFOSECTORS	7	/* TOTAL_SECTORS_PER_SONG, see hd24fs.cpp */
+#define SECTORSIZE		512
+
+hd24peaks::hd24peaks(hd24song* p_song)
+{
+	this->song=p_song;
+	this->tracks=0;
+	this->songlen=0;
+	this->havepeaks=false;
+	for (int i=0;i<PEAKS_LEVELS;i++)
+	{
+		peaks[i]=NULL;
+		peakcount[i]=0;
+	}
+}
+
+hd24peaks::~hd24peaks()
+{
+	freepeaks();
+}
+
+void hd24peaks::freepeaks()
+{
+	for (int i=0;i<PEAKS_LEVELS;i++)
+	{
+		if (peaks[i]!=NULL)
+		{
+			memutils::myfree("hd24peaks",peaks[i]);
+			peaks[i]=NULL;
+		}
+		peakcount[i]=0;
+	}
+	havepeaks=false;
+}
+
+bool hd24peaks::allocpeaks()
+{
+	freepeaks();
+	__uint32 perpeak=PEAKS_BASESAMPLES;
+	for (int i=0;i<PEAKS_LEVELS;i++)
+	{
+		peakcount[i]=(songlen+perpeak-1)/perpeak;
+		if (peakcount[i]==0)
+		{
+			peakcount[i]=1;
+		}
+		peaks[i]=(hd24peak*)memutils::mymalloc("hd24peaks",tracks*peakcount[i],sizeof(hd24peak));
+		if (peaks[i]==NULL)
+		{
+			freepeaks();
+			return false;
+		}
+		memset(peaks[i],0,tracks*peakcount[i]*sizeof(hd24peak));
+		perpeak*=PEAKS_LEVELFACTOR;
+	}
+	return true;
+}
+
+__uint64 hd24peaks::songkey()
+{
+	/* The song info and allocation sectors change whenever the
+	   song is rerecorded, lengthened or renamed. */
+	return hd24utils::hashbuffer(song->buffer,PEAKS_SONGINFOSECTORS*SECTORSIZE);
+}
+
+string* hd24peaks::sidecarname()
+{
+	__uint32 songsector=song->parentproject->getsongsectornum(song->mysongid);
+	char suffix[20];
+	sprintf(suffix,"-%08lx.h24p",(unsigned long)songsector);
+	return song->parentfs->hostcachefilename("peaks-",suffix);
+}
+
+void hd24peaks::clearacc(hd24peakacc* acc)
+{
+	acc->min=32767;
+	acc->max=-32768;
+	acc->sumsq=0;
+}
+
+void hd24peaks::accumulate(short* samples,__uint32 count,hd24peakacc* acc)
+{
+	/* Squares are taken of the samples divided by 2 so that pairs
+	   of them can be summed in 32 bits. */
+	__uint32 i=0;
+#if defined(__SSE2__)
+	if (count>=8)
+	{
+		__m128i vmin=_mm_set1_epi16(32767);
+		__m128i vmax=_mm_set1_epi16(-32768);
+		__m128i vsum=_mm_setzero_si128();
+		__m128i zero=_mm_setzero_si128();
+		for (;i+8<=count;i+=8)
+		{
+			__m128i v=_mm_loadu_si128((__m128i*)&samples[i]);
+			vmin=_mm_min_epi16(vmin,v);
+			vmax=_mm_max_epi16(vmax,v);
+			__m128i half=_mm_srai_epi16(v,1);
+			__m128i sq=_mm_madd_epi16(half,half);
+			vsum=_mm_add_epi64(vsum,_mm_unpacklo_epi32(sq,zero));
+			vsum=_mm_add_epi64(vsum,_mm_unpackhi_epi32(sq,zero));
+		}
+		short mins[8];
+		short maxs[8];
+		__uint64 sums[2];
+		_mm_storeu_si128((__m128i*)mins,vmin);
+		_mm_storeu_si128((__m128i*)maxs,vmax);
+		_mm_storeu_si128((__m128i*)sums,vsum);
+		for (int j=0;j<8;j++)
+		{
+			if (mins[j]<acc->min) acc->min=mins[j];
+			if (maxs[j]>acc->max) acc->max=maxs[j];
+		}
+		acc->sumsq+=(sums[0]+sums[1])*4;
+	}
+#endif
+	for (;i<count;i++)
+	{
+		int v=samples[i];
+		if (v<acc->min) acc->min=v;
+		if (v>acc->max) acc->max=v;
+		int half=v>>1;
+		acc->sumsq+=((__uint64)(half*half))*4;
+	}
+}
+
+void hd24peaks::storepeak(hd24peakacc* acc,__uint32 count,hd24peak* peak)
+{
+	peak->min=(short)acc->min;
+	peak->max=(short)acc->max;
+	double rms=0;
+	if (count>0)
+	{
+		rms=sqrt((double)acc->sumsq/(double)count);
+	}
+	if (rms>65535)
+	{
+		rms=65535;
+	}
+	peak->rms=(unsigned short)rms;
+}
+
+void hd24peaks::buildlevels()
+{
+	/* Each level is made from the one below it. */
+	for (int level=1;level<PEAKS_LEVELS;level++)
+	{
+		for (__uint32 track=0;track<tracks;track++)
+		{
+			hd24peak* from=&peaks[level-1][track*peakcount[level-1]];
+			hd24peak* to=&peaks[level][track*peakcount[level]];
+			for (__uint32 i=0;i<peakcount[level];i++)
+			{
+				__uint32 first=i*PEAKS_LEVELFACTOR;
+				__uint32 last=first+PEAKS_LEVELFACTOR;
+				if (last>peakcount[level-1])
+				{
+					last=peakcount[level-1];
+				}
+				int min=32767;
+				int max=-32768;
+				double sumsq=0;
+				for (__uint32 j=first;j<last;j++)
+				{
+					if (from[j].min<min) min=from[j].min;
+					if (from[j].max>max) max=from[j].max;
+					sumsq+=(double)from[j].rms*(double)from[j].rms;
+				}
+				if (last<=first)
+				{
+					min=0;
+					max=0;
+				}
+				to[i].min=(short)min;
+				to[i].max=(short)max;
+				to[i].rms=(last>first)?(unsigned short)sqrt(sumsq/(last-first)):0;
+			}
+		}
+	}
+}
+
+bool hd24peaks::generate(int* cancel,void (*progress)(__uint64 samplesdone,__uint64 samplestotal))
+{
+	/* Reads the whole song once, a block at a time, and computes
+	   the finest level from it; the other levels follow from that. */
+	freepeaks();
+	hd24fs* fs=song->fs();
+	if (fs==NULL)
+	{
+		return false;
+	}
+	tracks=song->logical_channels();
+	songlen=song->songlength_in_wamples()*song->chanmult();
+	if (tracks==0)
+	{
+		return false;
+	}
+	__uint32 blocksize=fs->getbytesperaudioblock();
+	__uint32 bytespersam=song->bitdepth()/8;
+	__uint32 samplesperlogicalchannel=(blocksize/tracks)/bytespersam;
+	bool mustdeinterlace=(song->chanmult()>1);
+	if (!allocpeaks())
+	{
+		return false;
+	}
+
+	unsigned char* audiodata=(unsigned char*)memutils::blockalloc("hd24peaks::generate",blocksize);
+	unsigned char* deinterlacedata=(unsigned char*)memutils::blockalloc("hd24peaks::generate",blocksize);
+	short* samples=(short*)memutils::mymalloc("hd24peaks::generate",samplesperlogicalchannel,sizeof(short));
+	hd24peakacc* acc=(hd24peakacc*)memutils::mymalloc("hd24peaks::generate",tracks,sizeof(hd24peakacc));
+	bool ok=((audiodata!=NULL)&&(deinterlacedata!=NULL)&&(samples!=NULL)&&(acc!=NULL));
+
+	for (__uint32 i=1;i<=tracks;i++)
+	{
+		song->readenabletrack(i,true);
+		if (acc!=NULL) clearacc(&acc[i-1]);
+	}
+	__uint32 fill=0;	// samples in the current peak so far
+	__uint32 peaknum=0;
+	for (__uint32 samplenum=0;(ok)&&(samplenum<songlen);samplenum+=samplesperlogicalchannel)
+	{
+		if (cancel!=NULL)
+		{
+			if (*cancel==1)
+			{
+				ok=false;
+				break;
+			}
+		}
+		__uint32 samsincurrblock=samplesperlogicalchannel;
+		if (samplenum+samsincurrblock>songlen)
+		{
+			samsincurrblock=songlen-samplenum;
+		}
+		song->getmtrackaudiodata(samplenum,samsincurrblock,audiodata,hd24song::READMODE_COPY);
+		unsigned char* blockdata=audiodata;
+		if (mustdeinterlace)
+		{
+			song->deinterlaceblock(audiodata,deinterlacedata);
+			blockdata=deinterlacedata;
+		}
+		__uint32 blockfill=fill;
+		__uint32 blockpeaknum=peaknum;
+		for (__uint32 track=0;track<tracks;track++)
+		{
+			// keep the top 16 bits of each (little endian) sample
+			unsigned char* trackdata=&blockdata[track*samplesperlogicalchannel*bytespersam];
+			for (__uint32 i=0;i<samsincurrblock;i++)
+			{
+				samples[i]=(short)(trackdata[i*3+1]|(trackdata[i*3+2]<<8));
+			}
+			fill=blockfill;
+			peaknum=blockpeaknum;
+			__uint32 pos=0;
+			while (pos<samsincurrblock)
+			{
+				__uint32 take=PEAKS_BASESAMPLES-fill;
+				if (take>samsincurrblock-pos)
+				{
+					take=samsincurrblock-pos;
+				}
+				accumulate(&samples[pos],take,&acc[track]);
+				fill+=take;
+				pos+=take;
+				if (fill==PEAKS_BASESAMPLES)
+				{
+					storepeak(&acc[track],fill,&peaks[0][track*peakcount[0]+peaknum]);
+					clearacc(&acc[track]);
+					fill=0;
+					peaknum++;
+				}
+			}
+		}
+		if (progress!=NULL)
+		{
+			progress(samplenum+samsincurrblock,songlen);
+		}
+	}
+	if ((ok)&&(fill>0)&&(peaknum<peakcount[0]))
+	{
+		for (__uint32 track=0;track<tracks;track++)
+		{
+			storepeak(&acc[track],fill,&peaks[0][track*peakcount[0]+peaknum]);
+		}
+	}
+	if (audiodata!=NULL) memutils::blockfree("hd24peaks::generate",audiodata);
+	if (deinterlacedata!=NULL) memutils::blockfree("hd24peaks::generate",deinterlacedata);
+	if (samples!=NULL) memutils::myfree("hd24peaks::generate",samples);
+	if (acc!=NULL) memutils::myfree("hd24peaks::generate",acc);
+	if (!ok)
+	{
+		freepeaks();
+		return false;
+	}
+	buildlevels();
+	havepeaks=true;
+	return true;
+}
+
+bool hd24peaks::save()
+{
+	if (!havepeaks)
+	{
+		return false;
+	}
+	string* filename=sidecarname();
+	if (filename==NULL)
+	{
+		return false;
+	}
+	FILE* peakfile=fopen(filename->c_str(),"wb");
+	delete filename;
+	if (peakfile==NULL)
+	{
+		return false;
+	}
+	unsigned char header[PEAKS_HEADERSIZE];
+	__uint64 key=songkey();
+	memcpy(header,PEAKS_MAGIC,8);
+	Convert::setint32(header,8,(__uint32)(key>>32));
+	Convert::setint32(header,12,(__uint32)(key&0xFFFFFFFF));
+	Convert::setint32(header,16,tracks);
+	Convert::setint32(header,20,songlen);
+	Convert::setint32(header,24,PEAKS_LEVELS);
+	bool ok=(fwrite(header,1,PEAKS_HEADERSIZE,peakfile)==PEAKS_HEADERSIZE);
+
+	/* Peaks are stored as 16 bit big endian values (min,max,rms),
+	   in memory order. */
+	for (int level=0;(ok)&&(level<PEAKS_LEVELS);level++)
+	{
+		__uint32 entries=tracks*peakcount[level];
+		unsigned char* buf=(unsigned char*)memutils::mymalloc("hd24peaks::save",entries,PEAKS_ENTRYSIZE);
+		if (buf==NULL)
+		{
+			ok=false;
+			break;
+		}
+		for (__uint32 i=0;i<entries;i++)
+		{
+			hd24peak* peak=&peaks[level][i];
+			unsigned char* out=&buf[i*PEAKS_ENTRYSIZE];
+			out[0]=(unsigned char)(((unsigned short)peak->min)>>8);
+			out[1]=(unsigned char)(((unsigned short)peak->min)&0xFF);
+			out[2]=(unsigned char)(((unsigned short)peak->max)>>8);
+			out[3]=(unsigned char)(((unsigned short)peak->max)&0xFF);
+			out[4]=(unsigned char)(peak->rms>>8);
+			out[5]=(unsigned char)(peak->rms&0xFF);
+		}
+		if (fwrite(buf,PEAKS_ENTRYSIZE,entries,peakfile)!=entries)
+		{
+			ok=false;
+		}
+		memutils::myfree("hd24peaks::save",buf);
+	}
+	if (fclose(peakfile)!=0)
+	{
+		ok=false;
+	}
+	return ok;
+}
+
+bool hd24peaks::load()
+{
+	/* Loads the peaks from the sidecar file, if there is one and
+	   it was made from the song as it is now. */
+	freepeaks();
+	string* filename=sidecarname();
+	if (filename==NULL)
+	{
+		return false;
+	}
+	FILE* peakfile=fopen(filename->c_str(),"rb");
+	delete filename;
+	if (peakfile==NULL)
+	{
+		return false;
+	}
+	unsigned char header[PEAKS_HEADERSIZE];
+	bool ok=(fread(header,1,PEAKS_HEADERSIZE,peakfile)==PEAKS_HEADERSIZE);
+	if (ok)
+	{
+		__uint64 key=((__uint64)Convert::getint32(header,8)<<32)
+				+Convert::getint32(header,12);
+		ok=((memcmp(header,PEAKS_MAGIC,8)==0)
+		  &&(key==songkey())
+		  &&(Convert::getint32(header,16)==song->logical_channels())
+		  &&(Convert::getint32(header,20)==song->songlength_in_wamples()*song->chanmult())
+		  &&(Convert::getint32(header,24)==PEAKS_LEVELS));
+	}
+	if (ok)
+	{
+		tracks=song->logical_channels();
+		songlen=song->songlength_in_wamples()*song->chanmult();
+		ok=allocpeaks();
+	}
+	for (int level=0;(ok)&&(level<PEAKS_LEVELS);level++)
+	{
+		__uint32 entries=tracks*peakcount[level];
+		unsigned char* buf=(unsigned char*)memutils::mymalloc("hd24peaks::load",entries,PEAKS_ENTRYSIZE);
+		if (buf==NULL)
+		{
+			ok=false;
+			break;
+		}
+		if (fread(buf,PEAKS_ENTRYSIZE,entries,peakfile)!=entries)
+		{
+			ok=false;
+		} else {
+			for (__uint32 i=0;i<entries;i++)
+			{
+				hd24peak* peak=&peaks[level][i];
+				unsigned char* in=&buf[i*PEAKS_ENTRYSIZE];
+				peak->min=(short)((in[0]<<8)|in[1]);
+				peak->max=(short)((in[2]<<8)|in[3]);
+				peak->rms=(unsigned short)((in[4]<<8)|in[5]);
+			}
+		}
+		memutils::myfree("hd24peaks::load",buf);
+	}
+	fclose(peakfile);
+	if (!ok)
+	{
+		freepeaks();
+		return false;
+	}
+	havepeaks=true;
+	return true;
+}
+
+bool hd24peaks::get(int* cancel,void (*progress)(__uint64 samplesdone,__uint64 samplestotal))
+{
+	/* Loads the peaks from their sidecar file, or generates them
+	   (and saves them for next time) if there is no valid one. */
+	if (load())
+	{
+		return true;
+	}
+	if (!generate(cancel,progress))
+	{
+		return false;
+	}
+	save();
+	return true;
+}
+
+bool hd24peaks::valid()
+{
+	return havepeaks;
+}
+
+int hd24peaks::levels()
+{
+	return PEAKS_LEVELS;
+}
+
+__uint32 hd24peaks::samplesperpeak(int level)
+{
+	__uint32 perpeak=PEAKS_BASESAMPLES;
+	for (int i=0;i<level;i++)
+	{
+		perpeak*=PEAKS_LEVELFACTOR;
+	}
+	return perpeak;
+}
+
+__uint32 hd24peaks::count(int level)
+{
+	if ((level<0)||(level>=PEAKS_LEVELS))
+	{
+		return 0;
+	}
+	return peakcount[level];
+}
+
+hd24peak* hd24peaks::trackpeaks(int level,__uint32 tracknum)
+{
+	/* Returns the count(level) peaks of the given (1-based) track. */
+	if ((!havepeaks)||(level<0)||(level>=PEAKS_LEVELS))
+	{
+		return NULL;
+	}
+	if ((tracknum<1)||(tracknum>tracks))
+	{
+		return NULL;
+	}
+	return &peaks[level][(tracknum-1)*peakcount[level]];
+}
+
+int hd24peaks::bestlevel(__uint32 samplesperpixel)
+{
+	/* Returns the coarsest level that still has at least one peak
+	   per pixel at the given zoom. */
+	int level=0;
+	while ((level+1<PEAKS_LEVELS)&&(samplesperpeak(level+1)<=samplesperpixel))
+	{
+		level++;
+	}
+	return level;
+}
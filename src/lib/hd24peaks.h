@@ -0,0 +1,65 @@
+#ifndef __hd24peaks_h__
+#define __hd24peaks_h__
+
+#include <config.h>
+#include <string>
+#include "hd24fs.h"
+
+#define PEAKS_LEVELS		4
+#define PEAKS_BASESAMPLES	4096	/* samples per peak at the finest level */
+#define PEAKS_LEVELFACTOR	8	/* each next level is this much coarser */
+
+using namespace std;
+
+typedef struct
+{
+	short min;		// top 16 bits of the 24 bit samples
+	short max;
+	unsigned short rms;
+} hd24peak;
+
+typedef struct
+{
+	int min;
+	int max;
+	__uint64 sumsq;
+} hd24peakacc;
+
+/* Overview of the audio of a song: per track min/max/RMS values at
+   several zoom levels. Generating it takes one pass over the song;
+   the result is kept in a sidecar file on the host, so later views
+   of the same song load it instantly. */
+class hd24peaks
+{
+	private:
+		hd24song* song;
+		__uint32 tracks;
+		__uint32 songlen;
+		__uint32 peakcount[PEAKS_LEVELS];
+		hd24peak* peaks[PEAKS_LEVELS];	// per level: all peaks of track 1, then track 2, etc.
+		bool havepeaks;
+		__uint64 songkey();
+		string* sidecarname();
+		void freepeaks();
+		bool allocpeaks();
+		void buildlevels();
+		static void accumulate(short* samples,__uint32 count,hd24peakacc* acc);
+		static void storepeak(hd24peakacc* acc,__uint32 count,hd24peak* peak);
+		static void clearacc(hd24peakacc* acc);
+
+	public:
+		hd24peaks(hd24song* p_song);
+		~hd24peaks();
+		bool load();
+		bool save();
+		bool generate(int* cancel,void (*progress)(__uint64 samplesdone,__uint64 samplestotal));
+		bool get(int* cancel,void (*progress)(__uint64 samplesdone,__uint64 samplestotal));
+		bool valid();
+		int levels();
+		__uint32 samplesperpeak(int level);
+		__uint32 count(int level);
+		hd24peak* trackpeaks(int level,__uint32 tracknum);
+		int bestlevel(__uint32 samplesperpixel);
+};
+
+#endif
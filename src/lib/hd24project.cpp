@@ -34,7 +34,7 @@ hd24project::hd24project(hd24fs* p_parent, __sint32 p_myprojectid,
 	buffer = (unsigned char*)memutils::mymalloc("hd24project(1)",1024,1);
 	parentfs = p_parent;
 	if (!isnew) {
-		p_parent->readsectors(p_parent->devhd24,
+		p_parent->readmetasectors(
 			p_parent->getprojectsectornum(myprojectid),
 			buffer,1); // fstfix follows
 			
@@ -75,7 +75,7 @@ hd24project::hd24project(hd24fs* p_parent, __sint32 p_myprojectid)
 			buffer[i]=0;
 		}
 	} else {
-		p_parent->readsectors(p_parent->devhd24,
+		p_parent->readmetasectors(
 			projsecnum,
 			buffer,1); // fstfix follows
 			
@@ -239,6 +239,7 @@ void hd24project::save(__uint32 projsector)
 		return;	 // nothing to do!
 	}
 	parentfs->fstfix(buffer,512); // sector is now in native format again 
+	parentfs->mergemetasectors(projsector,buffer,1);
 	parentfs->setsectorchecksum(buffer,0,projsector,1);     
 	parentfs->writesectors(parentfs->devhd24,
 			projsector,
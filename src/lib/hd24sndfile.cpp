@@ -3,6 +3,13 @@
 #include <fstream>
 #include <iostream>
 #include <convertlib.h>
+#include <string.h>
+#ifdef WINDOWS
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
 using std::ofstream;
 using std::cout; // PRAGMA allowed
 using std::endl;
@@ -13,6 +20,25 @@ hd24sndfile::hd24sndfile(int p_format,SoundFileWrapper* p_soundfile)
 	_handletype=0; // default is 0=libsndfile, 1=native file
 	sf_format=p_format;
 	soundfile=p_soundfile;
+	datastart=0;
+	datalimit=-1;
+}
+
+static void truncatefile(const char* filename,long length)
+{
+#ifdef WINDOWS
+	int fd=_open(filename,_O_RDWR|_O_BINARY);
+	if (fd<0) return;
+	_chsize(fd,length);
+	_close(fd);
+#else
+	if (::truncate(filename,length)!=0)
+	{
+#if (HD24SNDFILEDEBUG==1)
+		cout << "Could not truncate " << filename << endl;
+#endif
+	}
+#endif
 }
 
 hd24sndfile::~hd24sndfile()
@@ -86,6 +112,9 @@ void hd24sndfile::open(const char* filename,int filemode,SF_INFO* infoblock)
 	sfinfo=infoblock;
 	sndfilehandle=NULL;
 	outfilehandle=new ofstream(filename,ios_base::out|ios_base::trunc|ios_base::binary);
+	m_filename=filename;
+	datastart=0;
+	datalimit=-1;
 
 	if ((sf_format & 0xFF0000) ==SF_FORMAT_WAV)
 	{
@@ -112,6 +141,7 @@ void hd24sndfile::open(const char* filename,int filemode,SF_INFO* infoblock)
 		buf[31]=(char)(((rate)>>24)%256);	
 	
 		outfilehandle->write(buf,44);
+		datastart=44;
 		return;
 	
 	}
@@ -138,6 +168,7 @@ void hd24sndfile::open(const char* filename,int filemode,SF_INFO* infoblock)
 		Convert::setfloat80((unsigned char*)buf,28,rate);
 	
 		outfilehandle->write(buf,54);
+		datastart=54;
 		return;
 	
 	}
@@ -195,6 +226,12 @@ void hd24sndfile::close()
 	    {
 		// set sample rate, len, etc. in header
 		long pos=outfilehandle->tellp();
+		bool mustcut=((datalimit>=0)&&(pos>datastart+datalimit));
+		if (mustcut)
+		{
+			pos=datastart+datalimit;
+			outfilehandle->seekp(pos);
+		}
 
 		// Optional zero padding for word alignment
 		// (#1666)
@@ -212,19 +249,28 @@ void hd24sndfile::close()
 		outfilehandle->seekp(4);	
 		outfilehandle->write(bufword,4);
 
-		bufword[0]=(char)((pos-44)%256);
-		bufword[1]=(char)(((pos-44)>>8)%256);	
-		bufword[2]=(char)(((pos-44)>>16)%256);	
-		bufword[3]=(char)(((pos-44)>>24)%256);	
-		outfilehandle->seekp(40);	
+		bufword[0]=(char)((pos-datastart)%256);
+		bufword[1]=(char)(((pos-datastart)>>8)%256);	
+		bufword[2]=(char)(((pos-datastart)>>16)%256);	
+		bufword[3]=(char)(((pos-datastart)>>24)%256);	
+		outfilehandle->seekp(datastart-4);	
 		outfilehandle->write(bufword,4);
 	
 		outfilehandle->close();
+		if (mustcut)
+		{
+			truncatefile(m_filename.c_str(),pos+(pos%2));
+		}
 		break;
 	    }
 	    case SF_FORMAT_AIFF:
 	    {
 		long pos=outfilehandle->tellp();
+		bool mustcut=((datalimit>=0)&&(pos>datastart+datalimit));
+		if (mustcut)
+		{
+			pos=datastart+datalimit;
+		}
 		char bufword[4];
 		bufword[3]=(char)((pos-8)%256);
 		bufword[2]=(char)(((pos-8)>>8)%256);	
@@ -257,6 +303,10 @@ void hd24sndfile::close()
 
 		    
 		outfilehandle->close();
+		if (mustcut)
+		{
+			truncatefile(m_filename.c_str(),pos);
+		}
 		break;
 	    
 	    }
@@ -279,3 +329,41 @@ void hd24sndfile::write_float(float* buf,__uint32 frames)
 }
 
 
+
+bool hd24sndfile::timereference(__uint64 samplenum)
+{
+	/* Stores the position of the first sample of the file (in
+	   samples since the song start) in a BWF 'bext' chunk.
+	   Only for native WAV files, before any audio is written. */
+	if ((outfilehandle==NULL)||((sf_format & 0xFF0000)!=SF_FORMAT_WAV))
+	{
+		return false;
+	}
+	if ((datastart!=44)||((long)outfilehandle->tellp()!=datastart))
+	{
+		return false;
+	}
+	unsigned char bext[8+602+8];
+	memset(bext,0,sizeof(bext));
+	memcpy(&bext[0],"bext",4);
+	bext[4]=(unsigned char)(602%256);
+	bext[5]=(unsigned char)(602/256);
+	// TimeReferenceLow, TimeReferenceHigh, Version
+	for (int i=0;i<8;i++)
+	{
+		bext[8+338+i]=(unsigned char)((samplenum>>(8*i))&0xFF);
+	}
+	bext[8+346]=1;
+	memcpy(&bext[8+602],"data",4);
+	outfilehandle->seekp(36);
+	outfilehandle->write((const char*)bext,sizeof(bext));
+	datastart=36+sizeof(bext);
+	return true;
+}
+
+void hd24sndfile::truncate(__uint64 databytes)
+{
+	/* Native files only: on close, drop any audio after the
+	   given number of bytes. */
+	datalimit=(__sint64)databytes;
+}
@@ -3,7 +3,9 @@
 class SoundFileWrapper;
 #include <config.h>
 #include <fstream>
+#include <string>
 using std::ofstream;
+using std::string;
 #include <sharedlibs.h>
 #include <sndfile.h>
 
@@ -15,6 +17,9 @@ private:
 	int _handletype;
 	SoundFileWrapper* soundfile; /* runtime loading wrapper for libsndfile */
 	int sf_format;
+	string m_filename;	/* native files only */
+	long datastart;		/* header bytes before the audio data */
+	__sint64 datalimit;	/* audio bytes to keep on close, -1=all */
 public:
 	SNDFILE* sndfilehandle;
 	ofstream *outfilehandle;
@@ -32,6 +37,8 @@ public:
 	void writerawbuf(unsigned char* buf,__uint32 subblockbytes);
 	void close();
 	void write_float(float* buf,__uint32 frames);
+	bool timereference(__uint64 samplenum);
+	void truncate(__uint64 databytes);
 };
 
 #endif
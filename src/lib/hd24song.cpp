@@ -3,6 +3,12 @@
 #include "hd24fs.h"
 #include "convertlib.h"
 #include "memutils.h"
+#if (defined(__GNUC__)||defined(__clang__))&&(defined(__x86_64__)||defined(__i386__))
+/* SSSE3 kernels are built even when the compiler does not target
+   SSSE3 by default; they are only used if the CPU has it. */
+#define SONG_SSSE3 1
+#include <tmmintrin.h>
+#endif
 #define FRAMESPERSEC 30 /* 30 or 100; 30=default for HD24 (=SMPTE rate) */
 #if (SONGDEBUG==1)
 #define MEMLEAKMULT 10000
@@ -120,9 +126,11 @@ void hd24song::loadblockintocache(__uint32 blocktoqueue)
 
 	}
 ///////////////////////////////////////////////////
+	int oldiotag=parentfs->iotag(hd24iotrace::TAG_REALTIME);
 	parentfs->readsectors(parentfs->devhd24,
 		rtallocstartsector+((blocknum-rtallocstartblock)*blocksize_in_sectors),
 		cachebuf_ptr[currcachebufnum],blocksize_in_sectors); // raw read
+	parentfs->iotag(oldiotag);
 
 //	cachebuf_ptr[currcachebufnum]=NULL; // TODO: READ SECTORS!!!
 	
@@ -214,7 +222,7 @@ void hd24song::silenceaudioblocks(__uint32 allocsector,__uint32 numblocks)
 
 	__uint32 sectorstoclear=parentfs->getblocksizeinsectors();
 	sectorstoclear*=numblocks;
-	unsigned char* clearblock=(unsigned char*)memutils::mymalloc("silenceaudioblocks",sectorstoclear*512,1);
+	unsigned char* clearblock=(unsigned char*)memutils::blockalloc("silenceaudioblocks",sectorstoclear*512);
 	if (clearblock==NULL) 
 	{
 		// Alloc failed, use low-memory use version
@@ -228,12 +236,11 @@ void hd24song::silenceaudioblocks(__uint32 allocsector,__uint32 numblocks)
 	}
 	else 
 	{
-		memset(clearblock,0,512*sectorstoclear);
 		parentfs->writesectors(parentfs->devhd24,
 		allocsector,
 		clearblock,
 		sectorstoclear);
-		memutils::myfree("silenceaudioblocks",clearblock);
+		memutils::blockfree("silenceaudioblocks",clearblock);
 	}
 	return;
 }
@@ -750,6 +757,11 @@ hd24song::hd24song(hd24project* p_parent,__uint32 p_songid)
 	scratchbook=NULL;
 	buffer=NULL;
 	framespersec=FRAMESPERSEC;
+	tc_samrate=0;
+	tc_chanmult=0;
+	tc_persec=0;
+	tc_permin=0;
+	tc_perhour=0;
 	lastallocentrynum=0; 	
 	busyrecording=false;
 	mysongid=p_songid;
@@ -778,8 +790,9 @@ hd24song::hd24song(hd24project* p_parent,__uint32 p_songid)
 #if (SONGDEBUG == 1)
 	cout << "2" << endl;
 #endif
-	audiobuffer=(unsigned char *)memutils::mymalloc("hd24song-audiobuffer",blocksize_in_bytes+SECTORSIZE,1);
-	scratchbook=(unsigned char *)memutils::mymalloc("hd24song-scratchbook",blocksize_in_bytes+SECTORSIZE,1);
+	// block buffers are always read into before use, no need to clear them
+	audiobuffer=(unsigned char *)memutils::blockalloc("hd24song-audiobuffer",blocksize_in_bytes+SECTORSIZE,false);
+	scratchbook=(unsigned char *)memutils::blockalloc("hd24song-scratchbook",blocksize_in_bytes+SECTORSIZE,false);
 
 	if (audiobuffer==NULL) {
 #if (SONGDEBUG ==1)
@@ -802,7 +815,7 @@ hd24song::hd24song(hd24project* p_parent,__uint32 p_songid)
 	for (i=0;i<CACHEBUFFERS;i++)
 	{
 		cachebuf_blocknum[i]=CACHEBLOCK_UNUSED;
-		cachebuf_ptr[i]=(unsigned char*)memutils::mymalloc("hd24song-cachebufptr[i]",blocksize_in_bytes,1);
+		cachebuf_ptr[i]=(unsigned char*)memutils::blockalloc("hd24song-cachebufptr[i]",blocksize_in_bytes,false);
 	}
 
 	__uint32 songsector=parentproject->getsongsectornum(mysongid);
@@ -810,8 +823,7 @@ hd24song::hd24song(hd24project* p_parent,__uint32 p_songid)
 	cout << "Reading # song sectors= " << TOTAL_SECTORS_PER_SONG 
 	<< "from sec " << songsector << endl;
 #endif	
-	parentfs->readsectors(parentfs->devhd24,
-			songsector,
+	parentfs->readmetasectors(songsector,
 			buffer,TOTAL_SECTORS_PER_SONG);
 	parentfs->fstfix(buffer,TOTAL_SECTORS_PER_SONG*512);
 	
@@ -988,12 +1000,12 @@ hd24song::~hd24song()
 	}
 	if (scratchbook != NULL)
 	{
-		memutils::myfree("~hd24song-scratchbook",scratchbook);
+		memutils::blockfree("~hd24song-scratchbook",scratchbook);
 		scratchbook=NULL;
 	}
 	if (audiobuffer != NULL)
 	{
-		memutils::myfree("~hd24song-audiobuffer",audiobuffer);
+		memutils::blockfree("~hd24song-audiobuffer",audiobuffer);
 		audiobuffer=NULL;
 	}
 	if (blocksector != NULL) 
@@ -1007,7 +1019,7 @@ hd24song::~hd24song()
 	for (i=0;i<CACHEBUFFERS;i++) 
 	{
 		if (cachebuf_ptr[i]!=NULL) {
-			memutils::myfree("cachebuf_ptr[i]",cachebuf_ptr[i] );	
+			memutils::blockfree("cachebuf_ptr[i]",cachebuf_ptr[i] );	
 		}
 	}
 	if (cachebuf_ptr!=NULL)
@@ -1301,6 +1313,12 @@ string* hd24song::display_cursor()
 {
 	return (display_duration(songcursor));	
 }
+
+char* hd24song::display_cursor(char* buf)
+{
+	return (display_duration(buf,songcursor));
+}
+
 __uint32 hd24song::cursorpos() 
 {
 	return songcursor;
@@ -1310,33 +1328,78 @@ bool hd24song::endofsong()
 	if (songcursor>=songlength_in_wamples()) return true;
 	return false;
 }
-string* hd24song::display_duration(__uint32 offset,__uint32 samrate) 
+void hd24song::timecodedivisors(__uint32 samrate)
 {
-	if (samrate==0) 
+	/* Wamples per second, minute and hour for the given rate.
+	   These only change with the sample rate, so they are kept
+	   for the next call; formatting the cursor position (which
+	   the recorder does many times per second) then takes a few
+	   divisions instead of a few dozen. */
+	__uint32 mult=chanmult();
+	if ((samrate==tc_samrate)&&(mult==tc_chanmult))
 	{
-		string* nulldur=Convert::int2str(0,2,"0");
-		*nulldur+=":00:00.00";
-		return nulldur;	
-	}
-	samrate/=chanmult();
-	__uint32 subsec=display_subseconds(offset,samrate);
-	if (samrate>0) {
-		subsec=this->framespersec*subsec/samrate;
-	}
-	string* newstr=	Convert::int2str(display_hours(offset),2,"0");
-	*newstr+=":";
-	string* mins=Convert::int2str(display_minutes(offset),2,"0");
-	*newstr+=*mins;
-	delete mins;
-        *newstr+=":";
-	string* secs=Convert::int2str(display_seconds(offset),2,"0");
-	*newstr+=*secs;
-	delete secs;
-        *newstr+=".";
-	string* subsecs=Convert::int2str(subsec,2,"0");
-	*newstr+=*subsecs;
-	delete subsecs;
-	return newstr;
+		return;
+	}
+	tc_samrate=samrate;
+	tc_chanmult=mult;
+	tc_persec=(mult==0)?(samrate):(samrate/mult);
+	tc_permin=tc_persec*60;
+	tc_perhour=tc_permin*60;
+}
+
+char* hd24song::display_duration(char* buf,__uint32 offset,__uint32 samrate)
+{
+	/* Writes offset as HH:MM:SS.FF (FF in frames) to buf, which
+	   must hold DURATIONSIZE bytes. Does not allocate. */
+	if (samrate!=0)
+	{
+		timecodedivisors(samrate);
+	}
+	if ((samrate==0)||(tc_persec==0))
+	{
+		strcpy(buf,"00:00:00.00");
+		return buf;
+	}
+	__uint32 hours=offset/tc_perhour;
+	offset-=hours*tc_perhour;
+	__uint32 minutes=offset/tc_permin;
+	offset-=minutes*tc_permin;
+	__uint32 seconds=offset/tc_persec;
+	offset-=seconds*tc_persec;
+	__uint32 frames=this->framespersec*offset/tc_persec;
+
+	if (hours>9999)
+	{
+		hours=9999; // keep within DURATIONSIZE
+	}
+	char* pos=buf;
+	Convert::int2buf(pos,hours,2,'0');
+	pos+=strlen(pos);
+	*pos++=':';
+	Convert::int2buf(pos,minutes,2,'0');
+	pos+=2;
+	*pos++=':';
+	Convert::int2buf(pos,seconds,2,'0');
+	pos+=2;
+	*pos++='.';
+	Convert::int2buf(pos,frames,2,'0');
+	return buf;
+}
+
+char* hd24song::display_duration(char* buf,__uint32 offset)
+{
+	return display_duration(buf,offset,samplerate());
+}
+
+char* hd24song::display_duration(char* buf)
+{
+	return display_duration(buf,songlength_in_wamples());
+}
+
+string* hd24song::display_duration(__uint32 offset,__uint32 samrate) 
+{
+	char buf[DURATIONSIZE];
+	return new string(display_duration(buf,offset,samrate));
 }
 
 string* hd24song::display_duration(__uint32 offset) 
@@ -1884,12 +1947,12 @@ int hd24song::getmtrackaudiodata(__uint32 firstsamnum,__uint32 samples,unsigned
 #if (SONGDEBUG==1)
 	cout << "first,last track="<<first_readenabled<<","<<last_readenabled<<endl;
 #endif
-	__uint32 chanmult=physical_channels()/logical_channels();
-
-	__uint32 physicaltracksreadenabled=chanmult*(last_readenabled-first_readenabled)+1;
-	__uint32 firsttrackoffset=chanmult*first_readenabled*tracksamples_per_block*bytes_per_sample;
+	// tracksamples_per_block is per logical track, so at high sample
+	// rates it already covers both physical channels of a track.
+	__uint32 tracksreadenabled=(last_readenabled-first_readenabled)+1;
+	__uint32 firsttrackoffset=first_readenabled*tracksamples_per_block*bytes_per_sample;
 	__uint32 sectoroffset=firsttrackoffset/SECTORSIZE;
-	__uint32 readlength=(physicaltracksreadenabled*bytes_per_sample*tracksamples_per_block)/SECTORSIZE;
+	__uint32 readlength=(tracksreadenabled*bytes_per_sample*tracksamples_per_block)/SECTORSIZE;
 #if (SONGDEBUG==1)
 	cout << "sectoroffset,readlength="<<sectoroffset<<","<<readlength<< endl;
 #endif
@@ -1911,21 +1974,182 @@ int hd24song::getmtrackaudiodata(__uint32 firstsamnum,__uint32 samples,unsigned
 	return firstsamnum%tracksamples_per_block;
 }
 
+/* High sample rate songs store each logical channel as two physical
+   channels: the first holds the even samples, the second the odd ones.
+   pairsamples24 merges such halves into one run of samples, and
+   splitsamples24 does the reverse, for 24 bit samples. On CPUs with
+   SSSE3 they work on 8 samples (24 bytes per half) at a time with
+   byte shuffles. */
+
+static void pairsamples24_scalar(unsigned char* even,unsigned char* odd,
+			unsigned char* target,__uint32 samples)
+{
+	for (__uint32 i=0;i<samples;i++)
+	{
+		target[0]=even[0];
+		target[1]=even[1];
+		target[2]=even[2];
+		target[3]=odd[0];
+		target[4]=odd[1];
+		target[5]=odd[2];
+		even+=3;
+		odd+=3;
+		target+=6;
+	}
+}
+
+static void splitsamples24_scalar(unsigned char* source,unsigned char* even,
+			unsigned char* odd,__uint32 samples)
+{
+	for (__uint32 i=0;i<samples;i++)
+	{
+		even[0]=source[0];
+		even[1]=source[1];
+		even[2]=source[2];
+		odd[0]=source[3];
+		odd[1]=source[4];
+		odd[2]=source[5];
+		source+=6;
+		even+=3;
+		odd+=3;
+	}
+}
+
+#if defined(SONG_SSSE3)
+static bool cpuhasssse3()
+{
+#if defined(__SSSE3__)
+	return true;
+#else
+	static int hasssse3=-1;
+	if (hasssse3==-1)
+	{
+		__builtin_cpu_init();
+		hasssse3=(__builtin_cpu_supports("ssse3"))?1:0;
+	}
+	return (hasssse3==1);
+#endif
+}
+
+__attribute__((target("ssse3")))
+static void pairsamples24_ssse3(unsigned char* even,unsigned char* odd,
+			unsigned char* target,__uint32 samples)
+{
+	const __m128i e0=_mm_setr_epi8(0,1,2,-1,-1,-1,3,4,5,-1,-1,-1,6,7,8,-1);
+	const __m128i o0=_mm_setr_epi8(-1,-1,-1,0,1,2,-1,-1,-1,3,4,5,-1,-1,-1,6);
+	const __m128i e1=_mm_setr_epi8(-1,-1,3,4,5,-1,-1,-1,6,7,8,-1,-1,-1,9,10);
+	const __m128i o1=_mm_setr_epi8(1,2,-1,-1,-1,3,4,5,-1,-1,-1,6,7,8,-1,-1);
+	const __m128i e2=_mm_setr_epi8(9,-1,-1,-1,10,11,12,-1,-1,-1,13,14,15,-1,-1,-1);
+	const __m128i o2=_mm_setr_epi8(-1,7,8,9,-1,-1,-1,10,11,12,-1,-1,-1,13,14,15);
+	__uint32 i=0;
+	for (;i+8<=samples;i+=8)
+	{
+		// 24 bytes from each half make 48 bytes of output; the
+		// loads overlap so that none reads past those 24 bytes
+		__m128i out0=_mm_or_si128(
+			_mm_shuffle_epi8(_mm_loadu_si128((__m128i*)&even[0]),e0),
+			_mm_shuffle_epi8(_mm_loadu_si128((__m128i*)&odd[0]),o0));
+		__m128i out1=_mm_or_si128(
+			_mm_shuffle_epi8(_mm_loadu_si128((__m128i*)&even[6]),e1),
+			_mm_shuffle_epi8(_mm_loadu_si128((__m128i*)&odd[6]),o1));
+		__m128i out2=_mm_or_si128(
+			_mm_shuffle_epi8(_mm_loadu_si128((__m128i*)&even[8]),e2),
+			_mm_shuffle_epi8(_mm_loadu_si128((__m128i*)&odd[8]),o2));
+		_mm_storeu_si128((__m128i*)&target[0],out0);
+		_mm_storeu_si128((__m128i*)&target[16],out1);
+		_mm_storeu_si128((__m128i*)&target[32],out2);
+		even+=24;
+		odd+=24;
+		target+=48;
+	}
+	pairsamples24_scalar(even,odd,target,samples-i);
+}
+
+__attribute__((target("ssse3")))
+static void splitsamples24_ssse3(unsigned char* source,unsigned char* even,
+			unsigned char* odd,__uint32 samples)
+{
+	const __m128i e0s0=_mm_setr_epi8(0,1,2,6,7,8,12,13,14,-1,-1,-1,-1,-1,-1,-1);
+	const __m128i e0s1=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,2,3,4,8,9,10,14);
+	const __m128i e1s1=_mm_setr_epi8(15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+	const __m128i e1s2=_mm_setr_epi8(-1,0,4,5,6,10,11,12,-1,-1,-1,-1,-1,-1,-1,-1);
+	const __m128i o0s0=_mm_setr_epi8(3,4,5,9,10,11,15,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+	const __m128i o0s1=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,0,1,5,6,7,11,12,13,-1);
+	const __m128i o0s2=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,1);
+	const __m128i o1s2=_mm_setr_epi8(2,3,7,8,9,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1);
+	__uint32 i=0;
+	for (;i+8<=samples;i+=8)
+	{
+		// 48 bytes of input make 24 bytes for each half
+		__m128i s0=_mm_loadu_si128((__m128i*)&source[0]);
+		__m128i s1=_mm_loadu_si128((__m128i*)&source[16]);
+		__m128i s2=_mm_loadu_si128((__m128i*)&source[32]);
+		_mm_storeu_si128((__m128i*)&even[0],_mm_or_si128(
+			_mm_shuffle_epi8(s0,e0s0),_mm_shuffle_epi8(s1,e0s1)));
+		_mm_storel_epi64((__m128i*)&even[16],_mm_or_si128(
+			_mm_shuffle_epi8(s1,e1s1),_mm_shuffle_epi8(s2,e1s2)));
+		_mm_storeu_si128((__m128i*)&odd[0],_mm_or_si128(
+			_mm_or_si128(_mm_shuffle_epi8(s0,o0s0),_mm_shuffle_epi8(s1,o0s1)),
+			_mm_shuffle_epi8(s2,o0s2)));
+		_mm_storel_epi64((__m128i*)&odd[16],_mm_shuffle_epi8(s2,o1s2));
+		source+=48;
+		even+=24;
+		odd+=24;
+	}
+	splitsamples24_scalar(source,even,odd,samples-i);
+}
+#endif
+
+static void pairsamples24(unsigned char* even,unsigned char* odd,
+			unsigned char* target,__uint32 samples)
+{
+#if defined(SONG_SSSE3)
+	if (cpuhasssse3())
+	{
+		pairsamples24_ssse3(even,odd,target,samples);
+		return;
+	}
+#endif
+	pairsamples24_scalar(even,odd,target,samples);
+}
+
+static void splitsamples24(unsigned char* source,unsigned char* even,
+			unsigned char* odd,__uint32 samples)
+{
+#if defined(SONG_SSSE3)
+	if (cpuhasssse3())
+	{
+		splitsamples24_ssse3(source,even,odd,samples);
+		return;
+	}
+#endif
+	splitsamples24_scalar(source,even,odd,samples);
+}
+
 void hd24song::interlaceblock(unsigned char* sourcebuffer,unsigned char* targetbuffer) 
 {
 	/* This is needed for high sample rates as high sample rate recordings
            take up two physical channels for each logical audio channel */
 	__uint32 blocksize_in_sectors=parentfs->getblocksizeinsectors();
 	__uint32 blocksize_in_bytes=blocksize_in_sectors*SECTORSIZE;
-	__uint32 blocksize_doubleblock=blocksize_in_bytes/logical_channels();
+	__uint32 channels=logical_channels();
+	__uint32 blocksize_doubleblock=blocksize_in_bytes/channels;
 	__uint32 blocksize_halfblock=blocksize_in_bytes/physical_channels();
 
 	__uint32 bits=(this->bitdepth());
 	__uint32 bytes_per_sample=bits/8;
 	__uint32 tracksamples_per_halfblock=(blocksize_halfblock/bytes_per_sample);
 	__uint32 choffset=0;
-	for (__uint32 ch=0;ch<logical_channels();ch++) 
+	for (__uint32 ch=0;ch<channels;ch++) 
 	{	
+		if (bytes_per_sample==3)
+		{
+			splitsamples24(&sourcebuffer[choffset],&targetbuffer[choffset],
+				&targetbuffer[choffset+blocksize_halfblock],
+				tracksamples_per_halfblock);
+			choffset+=blocksize_doubleblock;
+			continue;
+		}
 		for (__uint32 i=0;i<tracksamples_per_halfblock;i++) 
 		{
 			__uint32 samoff_target=i*bytes_per_sample+choffset;
@@ -1933,8 +2157,8 @@ void hd24song::interlaceblock(unsigned char* sourcebuffer,unsigned char* targetb
 			for (__uint32 j=0;j<bytes_per_sample;j++) {	
 				targetbuffer[samoff_target+j]
 					=sourcebuffer[samoff_source+j];
-				targetbuffer[samoff_target+j+bytes_per_sample]
-					=sourcebuffer[samoff_source+j+blocksize_halfblock];
+				targetbuffer[samoff_target+j+blocksize_halfblock]
+					=sourcebuffer[samoff_source+j+bytes_per_sample];
 			}
 		}
 		choffset+=blocksize_doubleblock;
@@ -1947,15 +2171,24 @@ void hd24song::deinterlaceblock(unsigned char* sourcebuffer,unsigned char* targe
            take up two physical channels for each logical audio channel */	
 	__uint32 blocksize_in_sectors=parentfs->getblocksizeinsectors();
 	__uint32 blocksize_in_bytes=blocksize_in_sectors*SECTORSIZE;
-	__uint32 blocksize_doubleblock=blocksize_in_bytes/logical_channels();
+	__uint32 channels=logical_channels();
+	__uint32 blocksize_doubleblock=blocksize_in_bytes/channels;
 	__uint32 blocksize_halfblock=blocksize_in_bytes/physical_channels();
 
 	__uint32 bits=(this->bitdepth());
 	__uint32 bytes_per_sample=bits/8;
 	__uint32 tracksamples_per_halfblock=(blocksize_halfblock/bytes_per_sample);
 	__uint32 choffset=0;
-	for (__uint32 ch=0;ch<logical_channels();ch++) 
+	for (__uint32 ch=0;ch<channels;ch++) 
 	{	
+		if (bytes_per_sample==3)
+		{
+			pairsamples24(&sourcebuffer[choffset],
+				&sourcebuffer[choffset+blocksize_halfblock],
+				&targetbuffer[choffset],tracksamples_per_halfblock);
+			choffset+=blocksize_doubleblock;
+			continue;
+		}
 		for (__uint32 i=0;i<tracksamples_per_halfblock;i++) 
 		{
 			__uint32 samoff_source=i*bytes_per_sample+choffset;
@@ -2296,6 +2529,7 @@ void hd24song::save()
 #endif
 
 	parentfs->fstfix(buffer,TOTAL_SECTORS_PER_SONG*512); // sector is now once again in native format
+	parentfs->mergemetasectors(songsector,buffer,TOTAL_SECTORS_PER_SONG);
 
 	parentfs->setsectorchecksum(buffer,0,songsector,2);     // checksum for 2 sectors of song data
 	parentfs->setsectorchecksum(buffer,2*512,songsector+2,5); // checksum for 5 sectors of allocation data
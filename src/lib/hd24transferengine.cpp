@@ -10,6 +10,15 @@
 #define TRACKACTION_ERASE 0
 #define TRACKACTION_SMPTE 1
 #define TRACKACTION_MONO 2
+const int hd24transferengine::SILENCE_KEEP=0;
+const int hd24transferengine::SILENCE_SKIPTRACKS=1;	/* leave out silent tracks */
+const int hd24transferengine::SILENCE_TRIM=2;		/* same, and trim silence at start and end */
+const int hd24transferstats::STAGE_READ=0;
+const int hd24transferstats::STAGE_DEINTERLACE=1;
+const int hd24transferstats::STAGE_INTERLEAVE=2;
+const int hd24transferstats::STAGE_MIX=3;
+const int hd24transferstats::STAGE_WRITE=4;
+const int hd24transferstats::STAGE_PROGRESS=5;
 /* 
 	Note: prior to working on this code, it's recommended to read
 	document samplerates.txt in the doc directory as some of the
@@ -17,6 +26,43 @@
 	The document will help you straighten out your mind so 
 	things are simpler to understand.
 */
+hd24transferstats::hd24transferstats()
+{
+	reset();
+}
+
+void hd24transferstats::reset()
+{
+	for (int i=0;i<TRANSFERSTAGES;i++)
+	{
+		bytes[i]=0;
+		calls[i]=0;
+		seconds[i]=0;
+	}
+	totalseconds=0;
+}
+
+void hd24transferstats::add(int stage,double starttime,__uint64 stagebytes)
+{
+	seconds[stage]+=hd24utils::monotonicseconds()-starttime;
+	bytes[stage]+=stagebytes;
+	calls[stage]++;
+}
+
+const char* hd24transferstats::stagename(int stage)
+{
+	switch (stage)
+	{
+		case STAGE_READ: return "read";
+		case STAGE_DEINTERLACE: return "deinterlace";
+		case STAGE_INTERLEAVE: return "interleave";
+		case STAGE_MIX: return "mix";
+		case STAGE_WRITE: return "write";
+		case STAGE_PROGRESS: return "progress";
+	}
+	return "";
+}
+
 hd24transferjob::hd24transferjob()
 {
 #if (HD24TRANSFERDEBUG==1)
@@ -105,6 +151,8 @@ void hd24transferjob::init_vars()
 	
 	m_startoffset=0;
 	m_endoffset=0;
+	m_silencemode=0;
+	m_silencethreshold=0;
 	filepath=(char**)memutils::mymalloc("filepath",MAXPHYSICALCHANNELS,sizeof(char*));
 	filehandle=(SNDFILE**)memutils::mymalloc("filehandle",MAXPHYSICALCHANNELS,sizeof(SNDFILE*));
 	for (int i=0;i<MAXPHYSICALCHANNELS;i++)
@@ -361,6 +409,13 @@ int hd24transferengine::format_outputchannels(int format)
 	return m_format_outputchannels[format];
 }
 
+bool hd24transferengine::format_usessndfile(int format)
+{
+	/* Formats written with libsndfile cannot be exported
+	   without a loaded soundfile library. */
+	return m_format_sndfile[format];
+}
+
 const char* hd24transferengine::projectdir()
 {
 #if (HD24TRANSFERDEBUG==1) 
@@ -416,6 +471,11 @@ hd24transferengine::~hd24transferengine()
 		delete strdatetime;
 		strdatetime=NULL;
 	}
+	if (stats!=NULL)
+	{
+		delete stats;
+		stats=NULL;
+	}
 }
 
 void hd24transferengine::init_vars()
@@ -436,6 +496,10 @@ void hd24transferengine::init_vars()
 	setstatusfunction=NULL;
 	soundfile=NULL;
 	strdatetime=NULL;
+	stats=new hd24transferstats();
+	eta_lasttime=0;
+	eta_lastbytes=0;
+	eta_rate=0;
 #if (HD24TRANSFERDEBUG==1) 
 	cout << "hd24transferengine::init_vars() - job="<<job<<endl;
 #endif
@@ -957,6 +1021,8 @@ void hd24transferengine::prepare_transfer_to_pc(__uint32 songnum,
 	 << ", prefix=" << prefix << endl;
 #endif
 	this->totbytestotransfer=totbytestotransfer;
+	this->totbytestransferred=totbytestransferred;
+	this->prefix=prefix;
 	job->wantsplit=p_wantsplit;
 	//	this->transfer_to_pc();
 }
@@ -1014,6 +1080,25 @@ void hd24transferengine::generatetimestamp()
 	//////////////
 }
 
+static void appendremaining(char* msg,__uint32 remaining)
+{
+	/* Appends " Time remaining: [HH:]MM:SS" to a progress message.
+	   Progress is reported several times per second, so this
+	   formats into the caller's buffer instead of allocating. */
+	char num[CONVERT_NUMSIZE];
+	__uint32 seconds=(remaining%60);
+	__uint32 minutes=(remaining-seconds)/60;
+	strcat(msg," Time remaining: ");
+	if (minutes>59) {
+		strcat(msg,Convert::int2buf(num,minutes/60,2,'0'));
+		strcat(msg,":");
+		minutes=(minutes%60);
+	}
+	strcat(msg,Convert::int2buf(num,minutes,2,'0'));
+	strcat(msg,":");
+	strcat(msg,Convert::int2buf(num,seconds,2,'0'));
+}
+
 __sint64 hd24transferengine::transfer_to_pc()
 {
 	// function returns bytes transferred for the transfer of only the current file.
@@ -1028,6 +1113,11 @@ __sint64 hd24transferengine::transfer_to_pc()
 		lasterror("No source song defined, transfer aborted.");
 		return 0;
 	}
+	if ((m_format_sndfile[selectedformat()])&&((soundfile==NULL)||(!(soundfile->libloaded))))
+	{
+		lasterror("Soundfile library not loaded, transfer aborted");
+		return 0;
+	}
 	if (ui!=NULL)
 	{
 		if (((HD24UserInterface*)ui)->transfer_cancel==1) 
@@ -1191,8 +1281,21 @@ __sint64 hd24transferengine::transfer_to_pc()
 		}
 	}
 	
+	/* Silence-aware export needs a file per track, so that each
+	   can start, end or be left out on its own. */
+	bool silenceaware=((job->silencemode()!=SILENCE_KEEP)
+		&&(m_format_outputchannels[selectedformat()]==1)
+		&&(!mustmixdown)&&(partnum==0));
+	for (unsigned int tracknum=0;tracknum<MAXPHYSICALCHANNELS;tracknum++)
+	{
+		silence_started[tracknum]=false;
+		silence_written[tracknum]=0;
+		silence_audible[tracknum]=0;
+	}
+
 	this->transfer_in_progress(true);
-	time (&transferstarttime);
+	transferstarttime=hd24utils::monotonicseconds();
+	eta_start(totbytestransferred);
 		
 	partsamcount=0; totsamcount=0;
 	int trackwithingroup=0;
@@ -1208,14 +1311,15 @@ __sint64 hd24transferengine::transfer_to_pc()
 #endif
 	}
 	int blocksize=currenthd24->getbytesperaudioblock();
+	int oldiotag=currenthd24->iotag(hd24iotrace::TAG_TRANSFER);
 	// to hold normally read audio data:
-	unsigned char* audiodata=(unsigned char*)memutils::mymalloc("ftransfer_to_pc",blocksize,1);
+	unsigned char* audiodata=(unsigned char*)memutils::blockalloc("ftransfer_to_pc",blocksize);
 
 	// for high-samplerate block deinterlacing:
-	unsigned char* deinterlacedata=(unsigned char*)memutils::mymalloc("ftransfer_to_pc",blocksize,1); 
+	unsigned char* deinterlacedata=(unsigned char*)memutils::blockalloc("ftransfer_to_pc",blocksize);
 
 	// for interlacing multi-track data:
-	unsigned char* interlacedata=(unsigned char*)memutils::mymalloc("ftransfer_to_pc",blocksize,1); 
+	unsigned char* interlacedata=(unsigned char*)memutils::blockalloc("ftransfer_to_pc",blocksize);
 
 
 	__uint32 samplesperlogicalchannel=(blocksize/logical_channels)/bytespersam;
@@ -1224,7 +1328,7 @@ __sint64 hd24transferengine::transfer_to_pc()
 	hd24sndfile* mixdownfile=NULL;
 	if (mustmixdown)
 	{
-		outputBuffer=(float*)memutils::mymalloc("outputBuffer",2*samplesperlogicalchannel,sizeof(float)); // 2 because it is stereo
+		outputBuffer=(float*)memutils::blockalloc("outputBuffer",2*samplesperlogicalchannel*sizeof(float)); // 2 because it is stereo
 		mixdownfile=new hd24sndfile(SF_FORMAT_WAV|SF_FORMAT_PCM_32
 		                            |SF_FORMAT_FLOAT,soundfile);
 		infoblock.channels=2;
@@ -1329,11 +1433,15 @@ __sint64 hd24transferengine::transfer_to_pc()
 	  cout << "samplenum=" << samplenum << ", sams in block=" << samsincurrblock << endl; 
 	#endif	
 		
+		double stagestart=hd24utils::monotonicseconds();
 		int skipsams=job->sourcesong()->getmtrackaudiodata(samplenum+job->startoffset(),samsincurrblock,&audiodata[0],hd24song::READMODE_COPY);	
+		stats->add(hd24transferstats::STAGE_READ,stagestart,subblockbytes*logical_channels);
 		unsigned char* whattowrite=&audiodata[0];
 		if (mustdeinterlace==1) 
 		{
+			stagestart=hd24utils::monotonicseconds();
 			job->sourcesong()->deinterlaceblock(&audiodata[0],&deinterlacedata[0]);
+			stats->add(hd24transferstats::STAGE_DEINTERLACE,stagestart,blocksize);
 			whattowrite=&deinterlacedata[0];
 		}
 	
@@ -1360,7 +1468,7 @@ __sint64 hd24transferengine::transfer_to_pc()
 #if (HD24TRANSFERDEBUG==1) 
 			cout << "Mixing " << endl;
 #endif									
-			
+			stagestart=hd24utils::monotonicseconds();
 			for (__uint32 tracknum=0;tracknum<logical_channels;tracknum++) 
 			{
 				unsigned char* currsam=&whattowrite[tracknum*bytesperlogicalchannel
@@ -1388,8 +1496,13 @@ __sint64 hd24transferengine::transfer_to_pc()
 					((float*)outputBuffer)[i*2] = transfermixer->masterout(0,i); // left 
 					((float*)outputBuffer)[i*2+1] = transfermixer->masterout(1,i); // right	
 				}
+				stats->add(hd24transferstats::STAGE_MIX,stagestart,subblockbytes*logical_channels);
+				stagestart=hd24utils::monotonicseconds();
 				mixdownfile->write_float(outputBuffer,(subblockbytes/3)*infoblock.channels);
-			}		
+				stats->add(hd24transferstats::STAGE_WRITE,stagestart,(subblockbytes/3)*infoblock.channels*sizeof(float));
+			} else {
+				stats->add(hd24transferstats::STAGE_MIX,stagestart,subblockbytes*logical_channels);
+			}
 		}
 		// when mixing down, let's not export raw files as well.
 					
@@ -1421,8 +1534,13 @@ __sint64 hd24transferengine::transfer_to_pc()
 				&&(islastchanofgroup[tracknum]) 
 			) {
 				// file is mono
-				if (!mustmixdown) {
+				stagestart=hd24utils::monotonicseconds();
+				if (silenceaware) {
+				   _write_silenceaware(filehandle[tracknum],tracknum,&whattowrite[tracknum*bytesperlogicalchannel+((mustdeinterlace+1)*skipsams*bytespersam)],subblockbytes,samplenum);
+				   stats->add(hd24transferstats::STAGE_WRITE,stagestart,subblockbytes);
+				} else if (!mustmixdown) {
 	   			   writerawbuf(filehandle[tracknum],&whattowrite[tracknum*bytesperlogicalchannel+((mustdeinterlace+1)*skipsams*bytespersam)],subblockbytes);
+				   stats->add(hd24transferstats::STAGE_WRITE,stagestart,subblockbytes);
 				}
 				currbytestransferred+=subblockbytes;
 			} else {
@@ -1440,7 +1558,9 @@ __sint64 hd24transferengine::transfer_to_pc()
 				}
 				// interlace channel onto multi channel file buffer
 				if (!mustmixdown) {
+					stagestart=hd24utils::monotonicseconds();
 					hd24utils::interlacetobuffer(&whattowrite[tracknum*bytesperlogicalchannel+((mustdeinterlace+1)*skipsams*bytespersam)],&interlacedata[0],subblockbytes,bytespersam,trackwithingroup,trackspergroup);
+					stats->add(hd24transferstats::STAGE_INTERLEAVE,stagestart,subblockbytes);
 				}
 		
 				if (islastchanofgroup[tracknum]) {
@@ -1450,7 +1570,9 @@ __sint64 hd24transferengine::transfer_to_pc()
 	#endif							
 					//soundfile->sf_write_raw(filehandle[tracknum],&interlacedata[0],subblockbytes*trackspergroup); 
 					if (!mustmixdown) {
+						stagestart=hd24utils::monotonicseconds();
 						writerawbuf(filehandle[tracknum],&interlacedata[0],subblockbytes*trackspergroup); 
+						stats->add(hd24transferstats::STAGE_WRITE,stagestart,subblockbytes*trackspergroup);
 					}
 					currbytestransferred+=subblockbytes*trackspergroup;
 				}
@@ -1459,6 +1581,7 @@ __sint64 hd24transferengine::transfer_to_pc()
 		partsamcount+=(subblockbytes/bytespersam);
 	//	totsamcount+=subblockbytes;
 	
+		stagestart=hd24utils::monotonicseconds();
 		__uint32 pct; // to use for display percentage
 		double dblpct; // to use for ETA calculation
 	#if (HD24TRANSFERDEBUG==1) 
@@ -1517,13 +1640,16 @@ __sint64 hd24transferengine::transfer_to_pc()
 	
 	
 	
-		time (&endtime);
+		endtime=hd24utils::monotonicseconds();
 		olddifseconds=difseconds;
-		difseconds=(long long int)difftime(endtime,transferstarttime);
+		difseconds=(long long int)(endtime-transferstarttime);
 	#if (HD24TRANSFERDEBUG==1) 
 		cout << "difseconds=" << difseconds << endl
 		 << "olddifseconds=" << olddifseconds << endl;
 	#endif	
+		__uint32 remaining_seconds=eta_remaining(
+			(__uint64)(totbytestransferred+currbytestransferred),
+			(__uint64)totbytestotransfer);
 		if ( 
 	   	    ((dblpct-oldpct)>=1)  ||
 		    ((difseconds-olddifseconds)>=1)
@@ -1534,62 +1660,61 @@ __sint64 hd24transferengine::transfer_to_pc()
 		           screen updates with large audio files) */
 			oldpct=dblpct;
 
-			string* pctmsg=new string("Transferring audio to PC... ");
+			char pctmsg[PROGRESSMSGSIZE];
+			char num[CONVERT_NUMSIZE];
+			strcpy(pctmsg,"Transferring audio to PC... ");
 			if (totsongs>1)
 			{
-				*pctmsg+="Song ";
-				string* cursongnum=Convert::int2str(songnum);
-				*pctmsg+=*cursongnum+"/";			
-				delete cursongnum;
-				string* totsongnum=Convert::int2str(totsongs);
-				*pctmsg+=*totsongnum+", ";			
-				delete totsongnum;
+				strcat(pctmsg,"Song ");
+				strcat(pctmsg,Convert::int2buf(num,songnum));
+				strcat(pctmsg,"/");
+				strcat(pctmsg,Convert::int2buf(num,totsongs));
+				strcat(pctmsg,", ");
 			}
-			string* strpct=Convert::int2str(pct);
-			*pctmsg+=*strpct+"%";
+			strcat(pctmsg,Convert::int2buf(num,pct));
+			strcat(pctmsg,"%");
 			
-			if (pct>0)
+			if (remaining_seconds!=0xffffffff)
 			{
-				long long int tdifseconds=(long long int)difftime(endtime,transferstarttime);		
-				__uint32 estimated_seconds=(__uint32)((tdifseconds*100)/dblpct);
-				__uint32 remaining_seconds=estimated_seconds-tdifseconds;
-
 				lastremain=remaining_seconds;
-				
-				__uint32 seconds=(lastremain%60);
-				__uint32 minutes=(lastremain-seconds)/60;
-				__uint32 hours=0;
-				
-				*pctmsg+=" Time remaining: ";
-
-				if (minutes>59) {
-					hours=(minutes/60);
-					minutes=(minutes%60);
-					string* strhours=Convert::int2str(hours,2,"0");
-					*pctmsg+=*strhours;
-					*pctmsg+=":";
-					delete(strhours);				
-				}
-	
-				string* minsec=Convert::int2str(minutes,2,"0");
-		
-				*minsec+=":";
-			
-				string* strsecs=Convert::int2str(seconds,2,"0");
-				*minsec+=*strsecs;
-				delete(strsecs);
-					
-				*pctmsg+=*minsec;
-				delete(minsec);				
+				appendremaining(pctmsg,lastremain);
 			}
 			
-			delete (strpct);
 			setstatus(ui,pctmsg,dblpct);
-			delete pctmsg;
 		}			
+		stats->add(hd24transferstats::STAGE_PROGRESS,stagestart,0);
 	}
 	
+	if ((silenceaware)&&(job->silencemode()==SILENCE_TRIM))
+	{
+		for (__uint32 tracknum=0;tracknum<logical_channels;tracknum++)
+		{
+			if (silence_started[tracknum])
+			{
+				filehandle[tracknum]->truncate(silence_audible[tracknum]);
+			}
+		}
+	}
+	double closestart=hd24utils::monotonicseconds();
 	closeoutputfiles((hd24sndfile**)&filehandle[0],logical_channels);
+	stats->add(hd24transferstats::STAGE_WRITE,closestart,0);
+	if (silenceaware)
+	{
+		// tracks without any audio get no file at all.
+		for (__uint32 tracknum=0;tracknum<logical_channels;tracknum++)
+		{
+			if ((job->trackselected[tracknum]==0)||(silence_started[tracknum]))
+			{
+				continue;
+			}
+			string* fname=generate_filename(tracknum,partnum,prefix);
+			if (fname!=NULL)
+			{
+				remove(fname->c_str());
+				delete fname;
+			}
+		}
+	}
 	for (int i=0;i<MAXPHYSICALCHANNELS;i++) {
 		if (filehandle[i]!=NULL)
 		{
@@ -1606,19 +1731,19 @@ __sint64 hd24transferengine::transfer_to_pc()
 	}
 	if (audiodata!=NULL)
 	{
-		memutils::myfree("audiodata",audiodata);
+		memutils::blockfree("audiodata",audiodata);
 	}
 	if (deinterlacedata!=NULL)
 	{
-		memutils::myfree("deinterlacedata",deinterlacedata);
+		memutils::blockfree("deinterlacedata",deinterlacedata);
 	}
 	if (interlacedata!=NULL)
 	{
-		memutils::myfree("interlacedata",interlacedata);
+		memutils::blockfree("interlacedata",interlacedata);
 	}
 	if (outputBuffer!=NULL)
 	{
-		memutils::myfree("outputBuffer",outputBuffer);
+		memutils::blockfree("outputBuffer",outputBuffer);
 
 	}
 	if (mixdownfile!=NULL)
@@ -1628,6 +1753,8 @@ __sint64 hd24transferengine::transfer_to_pc()
 	if (transfermixer!=NULL) {
 		transfermixer->samplerate(oldmixersamplerate);
 	}
+	stats->totalseconds+=hd24utils::monotonicseconds()-transferstarttime;
+	currenthd24->iotag(oldiotag);
 
 	return currbytestransferred;
 }
@@ -1661,6 +1788,13 @@ MixerControl* hd24transferengine::mixer()
 	return this->transfermixer;	
 }
 
+hd24transferstats* hd24transferengine::transferstats()
+{
+	/* Stats add up over all transfers done by this engine
+	   until they are reset. */
+	return this->stats;
+}
+
 string* hd24transferengine::generate_filename(int tracknum,int partnum,int prefix)
 {
 #if (HD24TRANSFERDEBUG==1) 
@@ -1720,6 +1854,7 @@ string* hd24transferengine::generate_filename(int tracknum,int partnum,int prefi
 
 	string* fname=new string(dirname->c_str());
 	delete dirname;
+	string::size_type dirlen=fname->length();
 	
 	int formatptr=0;
 	int formatlen=strlen(fnameformat->c_str());
@@ -1862,15 +1997,13 @@ string* hd24transferengine::generate_filename(int tracknum,int partnum,int prefi
 	/* only add prefix if song num is not included in format */
         if ((prefix!=0) && (needprefix==1))
         {
+		/* goes in front of the file name, not of the path */
 		string* strsongnum=Convert::int2str(prefix,2,"0");
-		string* newfname=new string(fname->c_str());
-		delete fname;
-		fname=new string("Song");
-		*fname+=*strsongnum;        
-		*fname+="-";
+		string songprefix="Song";
+		songprefix+=*strsongnum;        
+		songprefix+="-";
 		delete (strsongnum);
-		*fname+=*newfname;
-		delete newfname;
+		fname->insert(dirlen,songprefix);
         }
 #if (HD24TRANSFERDEBUG==1) 
 	cout << "filename so far is " << *fname << endl
@@ -1926,6 +2059,141 @@ __sint64 hd24transferengine::sizelimit()
 	return job->sizelimit();
 }
 
+void hd24transferjob::silencemode(int mode)
+{
+	this->m_silencemode=mode;
+}
+
+int hd24transferjob::silencemode()
+{
+	return this->m_silencemode;
+}
+
+void hd24transferjob::silencethreshold(__uint32 threshold)
+{
+	this->m_silencethreshold=threshold;
+}
+
+__uint32 hd24transferjob::silencethreshold()
+{
+	return this->m_silencethreshold;
+}
+
+void hd24transferengine::silencemode(int mode)
+{
+	job->silencemode(mode);
+}
+
+int hd24transferengine::silencemode()
+{
+	return job->silencemode();
+}
+
+void hd24transferengine::silencethreshold(__uint32 threshold)
+{
+	/* Samples with a magnitude (24 bit) up to the threshold count
+	   as silence; 0 means only digital silence. */
+	job->silencethreshold(threshold);
+}
+
+__uint32 hd24transferengine::silencethreshold()
+{
+	return job->silencethreshold();
+}
+
+void hd24transferengine::_write_heldback(hd24sndfile* filehandle,__uint32 tracknum,
+		__uint32 samples)
+{
+	/* Writes the first samples of a track that were held back as
+	   silence, once it turns out the track has audio after all.
+	   They are read from disk again, for this track only. */
+	hd24song* song=job->sourcesong();
+	__uint32 blocksize=job->sourcefs()->getbytesperaudioblock();
+	__uint32 bytespersam=(song->bitdepth()/8);
+	__uint32 samplesperlogicalchannel=(blocksize/song->logical_channels())/bytespersam;
+	__uint32 bytesperlogicalchannel=samplesperlogicalchannel*bytespersam;
+	int mustdeinterlace=song->chanmult()-1;
+	unsigned char* audiodata=(unsigned char*)memutils::blockalloc("_write_heldback",blocksize);
+	unsigned char* deinterlacedata=(unsigned char*)memutils::blockalloc("_write_heldback",blocksize);
+	if ((audiodata!=NULL)&&(deinterlacedata!=NULL))
+	{
+		for (__uint32 i=1;i<=MAXPHYSICALCHANNELS;i++)
+		{
+			song->readenabletrack(i,(i==tracknum+1));
+		}
+		__uint32 samsincurrblock;
+		for (__uint32 samplenum=0;samplenum<samples;samplenum+=samsincurrblock)
+		{
+			samsincurrblock=samplesperlogicalchannel
+				-((samplenum+job->startoffset())%samplesperlogicalchannel);
+			if (samplenum+samsincurrblock>samples)
+			{
+				samsincurrblock=samples-samplenum;
+			}
+			int skipsams=song->getmtrackaudiodata(samplenum+job->startoffset(),samsincurrblock,&audiodata[0],hd24song::READMODE_COPY);
+			unsigned char* whattowrite=&audiodata[0];
+			if (mustdeinterlace==1)
+			{
+				song->deinterlaceblock(&audiodata[0],&deinterlacedata[0]);
+				whattowrite=&deinterlacedata[0];
+			}
+			writerawbuf(filehandle,&whattowrite[tracknum*bytesperlogicalchannel+((mustdeinterlace+1)*skipsams*bytespersam)],samsincurrblock*bytespersam);
+		}
+		for (__uint32 i=1;i<=MAXPHYSICALCHANNELS;i++)
+		{
+			song->readenabletrack(i,(job->trackselected[i-1]==1));
+		}
+	}
+	if (audiodata!=NULL)
+	{
+		memutils::blockfree("_write_heldback",audiodata);
+	}
+	if (deinterlacedata!=NULL)
+	{
+		memutils::blockfree("_write_heldback",deinterlacedata);
+	}
+}
+
+void hd24transferengine::_write_silenceaware(hd24sndfile* filehandle,__uint32 tracknum,
+		unsigned char* trackdata,__uint32 subblockbytes,__uint32 samplenum)
+{
+	/* Writes a block of a mono track file, holding back silence
+	   until the track has audio. Afterwards, everything is written
+	   but the end of the last audio is remembered so trailing
+	   silence can be cut off when the file is closed. */
+	__uint32 bytespersam=(job->sourcesong()->bitdepth()/8);
+	__uint32 firstsam=0;
+	__uint32 lastsam=0;
+	bool hasaudio=hd24utils::findaudio(trackdata,subblockbytes/bytespersam,
+			job->silencethreshold(),&firstsam,&lastsam);
+	if (!silence_started[tracknum])
+	{
+		if (!hasaudio)
+		{
+			return;
+		}
+		silence_started[tracknum]=true;
+		// Trimmed files start at the first audio and must say where
+		// that is; formats without a time reference keep the silence.
+		if ((job->silencemode()==SILENCE_TRIM)
+		   &&(filehandle->timereference(job->startoffset()+samplenum+firstsam)))
+		{
+			trackdata=&trackdata[firstsam*bytespersam];
+			subblockbytes-=firstsam*bytespersam;
+			lastsam-=firstsam;
+		} else {
+			_write_heldback(filehandle,tracknum,samplenum);
+			silence_written[tracknum]=samplenum*bytespersam;
+		}
+	}
+	if (hasaudio)
+	{
+		silence_audible[tracknum]=silence_written[tracknum]+(lastsam+1)*bytespersam;
+	}
+	writerawbuf(filehandle,trackdata,subblockbytes);
+	silence_written[tracknum]+=subblockbytes;
+}
+
 bool hd24transferengine::anyfilesexist(hd24song* thesong) 
 {
 	bool anyexist=false;
@@ -1989,9 +2257,14 @@ bool hd24transferengine::anyfilesexist(hd24song* thesong)
 }
 
 void hd24transferengine::setstatus(void* ui,string* message,double percentage)
+{
+	setstatus(ui,message->c_str(),percentage);
+}
+
+void hd24transferengine::setstatus(void* ui,const char* message,double percentage)
 {	
 #if (HD24TRANSFERDEBUG==1)
-	cout << message->c_str() << endl;
+	cout << message << endl;
 	if (ui==NULL)
 	{
 		cout << "WARNING-- no ui defined, transfer status not updating in GUI" << endl;// PRAGMA allowed
@@ -1999,7 +2272,7 @@ void hd24transferengine::setstatus(void* ui,string* message,double percentage)
 #endif
 	if (setstatusfunction!=NULL)
 	{
-		setstatusfunction(ui,message->c_str(),percentage);
+		setstatusfunction(ui,message,percentage);
 	}
 	return;
 }
@@ -2099,14 +2372,26 @@ __uint32 hd24transferengine::requiredsonglength_in_wamples(hd24song* tsong,SF_IN
 	
 	return maxlen_in_wamples;
 }
-/*
-void hd24transferengine::_generate_smpte(__uint32 wamplesperlogicalchannel,__uint32 wamsincurrblock,__uint32 samplenum,unsigned char* audiodata)
+void hd24transferengine::_generate_smpte(__uint32 wamplesperlogicalchannel,__uint32 wamsincurrblock,__uint32 wamplenum,unsigned char* audiodata)
 {
 	hd24song* tsong=job->targetsong(); // should exist as was verified by transfer_to_hd24()
 	if (tsong==NULL) return; // just in case it's destructed+cleared.
+	if (job->smptegen==NULL) return;
 
 	__uint32 bytespersam=(tsong->bitdepth()/8);
 	__uint32 logical_channels=tsong->logical_channels();
+	__uint32 chanmult=tsong->chanmult();
+	__uint32 halfchansize=0;
+	if (chanmult==2)
+	{
+		halfchansize=wamplesperlogicalchannel*bytespersam;
+	}
+	__uint32 samsincurrblock=wamsincurrblock*chanmult;
+
+	/* LTC levels for this block are rendered once, and used for
+	   every track that needs SMPTE striping. */
+	unsigned char* smptebits=NULL;
+
 	//  Fill audio buffer for tracks that need SMPTE striping 
 	for (__uint32 tracknum=0;tracknum<logical_channels;tracknum++) 
 	{
@@ -2121,22 +2406,38 @@ void hd24transferengine::_generate_smpte(__uint32 wamplesperlogicalchannel,__uin
 			// track not marked for smpte striping
 			continue;
 		}
-		// TODO: samsincurrblock instead of samplesperlogicalchannel?
-		__uint32 firstbyte=tracknum*samplesperlogicalchannel*bytespersam;
-		__uint32 bytenum=firstbyte;
+		if (smptebits==NULL)
+		{
+			smptebits=(unsigned char*)memutils::mymalloc("_generate_smpte",samsincurrblock,1);
+			if (smptebits==NULL) return;
+			job->smptegen->getbits(wamplenum*chanmult,samsincurrblock,smptebits);
+		}
+		// same layout as used by _prepare_audio
+		__uint32 firstbyte=tracknum*wamsincurrblock*bytespersam*chanmult;
+		__uint32 whichbyte=firstbyte;
+		int evenodd=0;
 
 		for (__uint32 samnum=0;samnum<samsincurrblock;samnum++) {
 			// smpte stripe:
-			__uint32 samval=((job->smptegen->getbit(samplenum+samnum)*2)-1)*2000000;
-			
-			audiodata[bytenum]=(unsigned char)samval & 0xff;
-			audiodata[bytenum+1]=(unsigned char)(samval>>8) & 0xff;
-			audiodata[bytenum+2]=(unsigned char)(samval>>16) & 0xff;
-			bytenum+=3;
+			__uint32 samval=((smptebits[samnum]*2)-1)*2000000;
+			int offs=(evenodd*halfchansize);
+			audiodata[whichbyte+offs+0]=(unsigned char)samval & 0xff;
+			audiodata[whichbyte+offs+1]=(unsigned char)(samval>>8) & 0xff;
+			audiodata[whichbyte+offs+2]=(unsigned char)(samval>>16) & 0xff;
+			if (chanmult==2)
+			{
+				whichbyte+=(evenodd*bytespersam);
+				evenodd=1-evenodd;
+			} else {
+				whichbyte+=bytespersam;
+			}
 		}
 	}
+	if (smptebits!=NULL)
+	{
+		memutils::myfree("_generate_smpte",smptebits);
+	}
 }
-*/
 
 void hd24transferengine::_generate_silence(__uint32 wamplesperlogicalchannel,__uint32 wamsincurrblock,__uint32 wamplenum,unsigned char* audiodata)
 {
@@ -2178,6 +2479,45 @@ void hd24transferengine::_generate_silence(__uint32 wamplesperlogicalchannel,__u
 		}
 	}
 }
+void hd24transferengine::eta_start(__uint64 bytesdone)
+{
+	/* Call at the start of each transfer. The rate carries over
+	   between songs of one job, but not between jobs. */
+	if (bytesdone==0)
+	{
+		eta_rate=0;
+	}
+	eta_lasttime=hd24utils::monotonicseconds();
+	eta_lastbytes=bytesdone;
+}
+
+__uint32 hd24transferengine::eta_remaining(__uint64 bytesdone,__uint64 bytestotal)
+{
+	/* Estimates the remaining seconds from recent throughput,
+	   so that a slow start (such as lengthening a song or a cold
+	   disk cache) does not distort the estimate for the rest of
+	   the transfer. Returns 0xffffffff while there is no estimate. */
+	double now=hd24utils::monotonicseconds();
+	double interval=now-eta_lasttime;
+	if ((interval>=0.5)&&(bytesdone>eta_lastbytes))
+	{
+		double rate=(double)(bytesdone-eta_lastbytes)/interval;
+		if (eta_rate==0)
+		{
+			eta_rate=rate;
+		} else {
+			eta_rate=(0.8*eta_rate)+(0.2*rate);
+		}
+		eta_lasttime=now;
+		eta_lastbytes=bytesdone;
+	}
+	if ((eta_rate==0)||(bytesdone>=bytestotal))
+	{
+		return 0xffffffff;
+	}
+	return (__uint32)((double)(bytestotal-bytesdone)/eta_rate);
+}
+
 double hd24transferengine::update_eta(const char* etamessage,__uint64 translen,
 				__uint64 currbytestransferred,
 				__uint64 totbytestransferred,
@@ -2214,13 +2554,15 @@ double hd24transferengine::update_eta(const char* etamessage,__uint64 translen,
 	cout << "pct=" << pct << " oldpct="<<oldpct<<endl
 	 << "dblpct=" << dblpct <<endl;
 #endif
-	time (&endtime);
+	endtime=hd24utils::monotonicseconds();
 	olddifseconds=difseconds;
-	difseconds=(long long int)difftime(endtime,transferstarttime);
+	difseconds=(long long int)(endtime-transferstarttime);
 #if (HD24TRANSFERDEBUG==1) 
 	cout << "difseconds=" << difseconds << endl
 	<< "olddifseconds=" << olddifseconds << endl;
 #endif	
+	__uint32 remaining_seconds=eta_remaining(
+		totbytestransferred+currbytestransferred,totbytestotransfer);
 	if ( 
    	    ((dblpct-oldpct)>=1)  ||
 	    ((difseconds-olddifseconds)>=1)
@@ -2231,50 +2573,20 @@ double hd24transferengine::update_eta(const char* etamessage,__uint64 translen,
 	           screen updates with large audio files) */
 		oldpct=pct;
 
-		string* pctmsg=new string(etamessage);
-		// TODO: Estimated time remaining goes here			
-		string* strpct=Convert::int2str(pct);
-		*pctmsg+=*strpct+"%";
-                delete strpct;
+		char pctmsg[PROGRESSMSGSIZE];
+		char num[CONVERT_NUMSIZE];
+		strncpy(pctmsg,etamessage,PROGRESSMSGSIZE-CONVERT_NUMSIZE*3);
+		pctmsg[PROGRESSMSGSIZE-CONVERT_NUMSIZE*3]='\0';
+		strcat(pctmsg,Convert::int2buf(num,pct));
+		strcat(pctmsg,"%");
 		
-		
-		if (pct>0)
+		if (remaining_seconds!=0xffffffff)
 		{
-			long long int tdifseconds=(long long int)difftime(endtime,transferstarttime);		
-			__uint32 estimated_seconds=(__uint32)((tdifseconds*100)/dblpct);
-			__uint32 remaining_seconds=estimated_seconds-tdifseconds;
-
 			lastremain=remaining_seconds;
-			
-			__uint32 seconds=(lastremain%60);
-			__uint32 minutes=(lastremain-seconds)/60;
-			__uint32 hours=0;
-			
-			*pctmsg+=" Time remaining: ";
-
-			if (minutes>59) {
-				hours=(minutes/60);
-				minutes=(minutes%60);
-				string* strhours=Convert::int2str(hours,2,"0");
-				*pctmsg+=*strhours;
-				*pctmsg+=":";
-				delete(strhours);				
-			}
-
-			string* minsec=Convert::int2str(minutes,2,"0");
-	
-			*minsec+=":";
-		
-			string* strsecs=Convert::int2str(seconds,2,"0");
-			*minsec+=*strsecs;
-			delete(strsecs);
-				
-			*pctmsg+=*minsec;
-			delete(minsec);				
+			appendremaining(pctmsg,lastremain);
 		}	
 
 		setstatus(ui,pctmsg,dblpct);
-		delete pctmsg;
 	}
 	return dblpct;
 }
@@ -2515,7 +2827,7 @@ __sint64 hd24transferengine::transfer_to_hd24()
 		return 0;
 	}
 ///////// START: VARIOUS INIT /////////////////
-	time(&transferstarttime); // for transfer speed statistics, ETA
+	transferstarttime=hd24utils::monotonicseconds(); // for transfer speed statistics
 
 
 	double oldpct=0; // to use for display percentage
@@ -2574,12 +2886,13 @@ __sint64 hd24transferengine::transfer_to_hd24()
 //////// START: GET SONG/FS METRICS //////////////
 	hd24fs* currenthd24=job->targetfs();
 	int audioblocksizebytes=currenthd24->getbytesperaudioblock(); // typically 1152*512.
+	int oldiotag=currenthd24->iotag(hd24iotrace::TAG_TRANSFER);
 
 	// to hold normally read audio data:
 	unsigned char* audiodata=NULL;
 //	ui->stop_transfer->show();
 
-	audiodata=(unsigned char*)memutils::mymalloc("button_transfertohd24",audioblocksizebytes,1);
+	audiodata=(unsigned char*)memutils::blockalloc("button_transfertohd24",audioblocksizebytes);
 	__uint32 logical_channels=tsong->logical_channels();
 	__uint32 bytespersam=(tsong->bitdepth()/8);
 	__uint32 samplesperlogicalchannel=(audioblocksizebytes/logical_channels)/bytespersam;
@@ -2678,6 +2991,7 @@ __sint64 hd24transferengine::transfer_to_hd24()
 	}
 
 	__uint64 totbytestransferred=0; // only for multi song transfer- does not apply.
+	eta_start(0); // lengthening the song is not part of the ETA
 	//deactivate_ui();	
 	for (__uint32 wamplenum=0;
 		wamplenum<translen_wamples;
@@ -2735,10 +3049,13 @@ __sint64 hd24transferengine::transfer_to_hd24()
 		_generate_silence(wamplesperlogicalchannel,wamsincurrblock,wamplenum,&audiodata[0]);
 		
 		/* Fill audio buffer (for tracks that need SMPTE striping) */
-//		_generate_smpte(wamplesperlogicalchannel,wamsincurrblock,wamplenum,&audiodata[0]);
+		_generate_smpte(wamplesperlogicalchannel,wamsincurrblock,wamplenum,&audiodata[0]);
 		
 		/* Process (mix-to-)mono audio tracks - Read audio */
+		double stagestart=hd24utils::monotonicseconds();
 		_prepare_audio(wamplesperlogicalchannel,wamsincurrblock,wamplenum,&audiodata[0],&sfinfoin[0],&sfeof[0]);
+		stats->add(hd24transferstats::STAGE_READ,stagestart,
+			wamsincurrblock*bytespersam*tsong->chanmult()*logical_channels);
 	
 		/*
 		 
@@ -2759,18 +3076,23 @@ __sint64 hd24transferengine::transfer_to_hd24()
 		#endif
 		//int writesams=  (result was not used)
 		// FIXME: putmtrackaudiodata still thinks it's working with samples instead of wamples.
+		stagestart=hd24utils::monotonicseconds();
 		tsong->putmtrackaudiodata(
 			(wamplenum+startoffset),
 			wamsincurrblock,
 			&audiodata[0],
 			hd24song::WRITEMODE_COPY
 		);	
+		stats->add(hd24transferstats::STAGE_WRITE,stagestart,
+			wamsincurrblock*bytespersam*tsong->chanmult()*logical_channels);
 	
 		totbytestransferred+=(wamsincurrblock*bytespersam*tsong->chanmult());
 
+		stagestart=hd24utils::monotonicseconds();
 		oldpct=update_eta("Transferring audio to HD24...",
 			translen_wamples,currbytestransferred,totbytestransferred,
 			totbytestotransfer,oldpct);  // recalculate/show progress
+		stats->add(hd24transferstats::STAGE_PROGRESS,stagestart,0);
 	} // end for (__uint32 samplenum=0; 	((__uint64)samplenum)<translen_wamples;		samplenum+=samsincurrblock)
 
 	if (job->smptegen!=NULL)
@@ -2782,7 +3104,7 @@ __sint64 hd24transferengine::transfer_to_hd24()
 
 	if (audiodata!=NULL)
 	{
-	    memutils::myfree("audiodata",audiodata);
+	    memutils::blockfree("audiodata",audiodata);
 	    audiodata=NULL;
 	}
 
@@ -2801,10 +3123,14 @@ __sint64 hd24transferengine::transfer_to_hd24()
 	setstatus(ui,pctmsg,100);
 	delete pctmsg;
 
+	double stopstart=hd24utils::monotonicseconds();
 	tsong->stoprecord();
+	stats->add(hd24transferstats::STAGE_WRITE,stopstart,0);
 	tsong->unarmalltracks();
 
 	this->closeinputfiles((SNDFILE**)&(job->filehandle[0]),tsong->logical_channels());
+	stats->totalseconds+=hd24utils::monotonicseconds()-transferstarttime;
+	currenthd24->iotag(oldiotag);
 	#if (HD24TRANSFERDEBUG==1) 
 		cout << "transfer complete" << endl;
 	#endif	
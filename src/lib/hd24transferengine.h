@@ -30,6 +30,8 @@ private:
 	bool have_smpte;
 	int m_trackaction[24];
 	SMPTEgenerator* smptegen;
+	int m_silencemode;
+	__uint32 m_silencethreshold;
 public:
 	
 	string* m_projectdir;        
@@ -69,6 +71,35 @@ public:
 	int trackaction(int base1tracknum);
         void filenameformat(string* filenameformat);
         string* filenameformat();        
+	void silencemode(int mode);
+	int silencemode();
+	void silencethreshold(__uint32 threshold);
+	__uint32 silencethreshold();
+};
+
+#define TRANSFERSTAGES 6
+#define PROGRESSMSGSIZE 256	/* longest transfer progress message */
+
+class hd24transferstats
+{
+	/* Time spent in each stage of a transfer, to tell whether
+	   a slow transfer is held up by the disk, by processing or
+	   by writing the output. */
+public:
+	static const int STAGE_READ;		/* reading audio from disk/files */
+	static const int STAGE_DEINTERLACE;	/* high sample rate block layout */
+	static const int STAGE_INTERLEAVE;	/* stereo/multi channel files */
+	static const int STAGE_MIX;		/* mixdown */
+	static const int STAGE_WRITE;		/* writing audio to files/disk */
+	static const int STAGE_PROGRESS;	/* progress and ETA reporting */
+	__uint64 bytes[TRANSFERSTAGES];
+	__uint64 calls[TRANSFERSTAGES];
+	double seconds[TRANSFERSTAGES];
+	double totalseconds;	/* whole transfers, including untimed work */
+	hd24transferstats();
+	void reset();
+	void add(int stage,double starttime,__uint64 stagebytes);
+	static const char* stagename(int stage);
 };
 
 class hd24transferengine
@@ -89,8 +120,12 @@ private:
 	int* audiobuf[24]; /* for libsndfile int reading from file */
 	bool isfirstchanofgroup[24]; /* for exporting stereo pairs/groups of channels */
 	bool islastchanofgroup[24]; /* for exporting stereo pairs/groups of channels */
+	bool silence_started[24]; /* for silence-aware export: track has had audio */
+	__uint64 silence_written[24]; /* bytes written to the track file */
+	__uint64 silence_audible[24]; /* bytes up to the last audible sample */
 	
 	void setstatus(void* ui,string* message,double percent);
+	void setstatus(void* ui,const char* message,double percent);
         void generatetimestamp();
 
 	void openbuffers(unsigned char** audiobuf,unsigned int channels,unsigned int bufsize);
@@ -109,9 +144,16 @@ private:
 	bool anyfilesexist(hd24song* thesong);
 	void transfer_in_progress(bool active);
 
-        time_t jobtimestamp; // these are for benchmarking the transfer	
-        time_t transferstarttime; // these are for benchmarking the transfer	
-	time_t endtime;
+        time_t jobtimestamp; // for the timestamp in exported file names
+	double transferstarttime; // these are for benchmarking the transfer
+	double endtime;
+
+	hd24transferstats* stats;
+	double eta_lasttime;	/* throughput based ETA */
+	__uint64 eta_lastbytes;
+	double eta_rate;	/* smoothed bytes per second */
+	void eta_start(__uint64 bytesdone);
+	__uint32 eta_remaining(__uint64 bytesdone,__uint64 bytestotal);
 
 	/* Regarding populating list of supported file formats 
            TODO: Move to a separate class?
@@ -135,7 +177,15 @@ private:
 				__uint32 samplenum,unsigned char* audiodata,
 				SF_INFO* sfinfoin, int* sfeof);
 	__uint32 _lengthen_song_as_needed(hd24song* tsong,SF_INFO* sfinfo); // returns wamples
+	void _write_silenceaware(hd24sndfile* filehandle,__uint32 tracknum,
+				unsigned char* trackdata,__uint32 subblockbytes,
+				__uint32 samplenum);
+	void _write_heldback(hd24sndfile* filehandle,__uint32 tracknum,
+				__uint32 samples);
 public:
+	static const int SILENCE_KEEP;
+	static const int SILENCE_SKIPTRACKS;
+	static const int SILENCE_TRIM;
         SoundFileWrapper* soundfile;
         bool (*uiconfirmfunction)(void* ui,const char*);
         void (*setstatusfunction)(void* ui,const char*,double progress_pct);
@@ -149,12 +199,15 @@ public:
         
         void mixer(MixerControl* m_mixer);
         MixerControl* mixer();
+
+	hd24transferstats* transferstats();
         
         void lasterror(const char* errormessage);
         string* lasterror();
         
 	int supportedformatcount();
 	int format_outputchannels(int i);
+	bool format_usessndfile(int i);
 	const char* getformatdesc(int formatnum);
         	
         void trackselected(__uint32 base0tracknum,bool select);
@@ -205,6 +258,10 @@ public:
 	int trackaction(int base1tracknum);
         void filenameformat(string* filenameformat);
         string* filenameformat();
+	void silencemode(int mode);
+	int silencemode();
+	void silencethreshold(__uint32 threshold);
+	__uint32 silencethreshold();
 };
 
 #endif
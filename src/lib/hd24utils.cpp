@@ -24,6 +24,13 @@
 #define DIRSLASH "/"
 #endif
 
+#if defined(LINUX) || defined(DARWIN)
+#	include <pthread.h>
+#endif
+#ifdef DARWIN
+#	include <mach/mach_time.h>
+#endif
+
 #include <string>
 #include <sys/types.h>
 /* sys/type.h should include time.h, but it doesn't seem to on MinGW */
@@ -35,6 +42,8 @@
 #include <iostream>
 #include <fstream>
 #include <math.h>
+#include <vector>
+#include <algorithm>
 
 #include <hd24devicenamegenerator.h>
 #include <FL/FLTKstuff.H>
@@ -43,6 +52,10 @@
 #include "convertlib.h"
 #include "hd24utils.h"
 #include "memutils.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "hd24driveimage.h"
 #include <hd24sndfile.h>
 
 #define _LARGE_FILES
@@ -75,6 +88,54 @@ const int hd24utils::SIZEMODE_ACTUAL=4;
 const int hd24utils::SIZEMODE_ALLOCATED=8;
 
 const int hd24utils::SIZEMODE_MASK=0x0c;
+
+const int hd24utils::RESCUE_COMPLETE=0;
+const int hd24utils::RESCUE_CANNOTOPEN=1;
+const int hd24utils::RESCUE_CANCELLED=2;
+const int hd24utils::RESCUE_BADSECTORS=3;
+const int hd24utils::RESCUE_WRITEERROR=4;
+
+const int hd24utils::CONVERT_COMPLETE=0;
+const int hd24utils::CONVERT_CANNOTOPEN=1;
+const int hd24utils::CONVERT_CANCELLED=2;
+const int hd24utils::CONVERT_IOERROR=3;
+const int hd24utils::CONVERT_VERIFYFAILED=4;
+
+const int hd24utils::DIFF_COMPLETE=0;
+const int hd24utils::DIFF_CANCELLED=1;
+const int hd24utils::DIFF_NOMEMORY=2;
+
+/* Rescue imaging works in the spirit of GNU ddrescue: first get as much
+   healthy data as possible using large reads, skipping past trouble,
+   and only then go back to retry the failed areas sector by sector.
+   Progress is kept in a text map file so an interrupted job can be
+   resumed later. */
+#define RESCUE_CHUNKSECTORS	1024	/* sectors per read in fast passes (512k) */
+#define RESCUE_MAXSKIPSECTORS	131072	/* max. sectors skipped after a failure (64M) */
+#define RESCUE_SAVEINTERVAL	256	/* reads between map file updates */
+#define RESCUESTATUS_UNTRIED	'?'
+#define RESCUESTATUS_FAILED	'*'	/* large read failed, not yet split up */
+#define RESCUESTATUS_BAD	'-'
+#define RESCUESTATUS_GOOD	'+'
+
+/* Image conversion only copies what is in use on the drive (when it
+   holds a file system we know), using several threads to keep the
+   disks busy. Work is handed out in pieces that line up with smart
+   image clusters, so smart images can elide or compress whole clusters. */
+#define CONVERT_CHUNKSECTORS	4096	/* sectors per piece of work (2M) */
+#define CONVERT_MAXTHREADS	16
+
+/* Pattern scans read large chunks; consecutive chunks overlap by 
+   the pattern length so that matches across chunk boundaries are
+   found as well. Chunks are handed out in order so that the drive
+   is still read (more or less) sequentially. */
+#define SCAN_CHUNKSECTORS	4096	/* sectors per chunk (2M) */
+#define SCAN_MAXTHREADS		16
+#define SCAN_NOMATCH		(~((__uint64)0))
+
+/* Hashing and comparing sector ranges is done by a background thread
+   reading ahead into one buffer while the other one is processed. */
+#define DIFF_CHUNKSECTORS	2048	/* sectors per read (1M) */
 #ifdef WINDOWS
 bool hd24utils::isXPorlater()
 {
@@ -321,6 +382,7 @@ int hd24utils::gencatalog(hd24fs* currenthd24,string* strcatalog,
 	time(&currenttime);
 	timestamp = *localtime(&currenttime);
 	strftime(timebuf,sizeof(timebuf),"%a %Y-%m-%d %H:%M:%S %Z", &timestamp);
+	int oldiotag=currenthd24->iotag(hd24iotrace::TAG_CATALOG);
 	*strcatalog+= "     Catalog timestamp      : ";
 	*strcatalog+= timebuf ;
 	*strcatalog+="\n";
@@ -338,6 +400,7 @@ int hd24utils::gencatalog(hd24fs* currenthd24,string* strcatalog,
 
 	*strcatalog+="\n";
 	gencatalog_showprojects(currenthd24,strcatalog,catalogoptions);
+	currenthd24->iotag(oldiotag);
 	return 0;
 }
 
@@ -485,6 +548,71 @@ void hd24utils::interlacetobuffer(unsigned char* sourcebuf,unsigned char* target
 	}
 }
 
+bool hd24utils::findaudio(unsigned char* samples,__uint32 samcount,
+		__uint32 threshold,__uint32* firstsam,__uint32* lastsam)
+{
+	/* Looks for audio in a run of 24 bit little endian samples.
+	   A sample is audio when its magnitude exceeds the threshold
+	   (0 means anything but digital silence). Returns false if
+	   there is none, otherwise sets the first and last audible
+	   sample numbers. */
+	__uint32 totbytes=samcount*3;
+	if (threshold==0)
+	{
+		// digital silence: any nonzero byte means audio.
+		__uint32 first=0;
+		__uint32 last=totbytes;
+#ifdef __SSE2__
+		__m128i zero=_mm_setzero_si128();
+		while ((first+16)<=totbytes)
+		{
+			__m128i v=_mm_loadu_si128((__m128i*)&samples[first]);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(v,zero))!=0xFFFF) break;
+			first+=16;
+		}
+#endif
+		while ((first<totbytes)&&(samples[first]==0)) first++;
+		if (first==totbytes)
+		{
+			return false;
+		}
+#ifdef __SSE2__
+		while (last>=first+16)
+		{
+			__m128i v=_mm_loadu_si128((__m128i*)&samples[last-16]);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(v,zero))!=0xFFFF) break;
+			last-=16;
+		}
+#endif
+		while (samples[last-1]==0) last--;
+		*firstsam=first/3;
+		*lastsam=(last-1)/3;
+		return true;
+	}
+	__uint32 samnum;
+	for (samnum=0;samnum<samcount;samnum++)
+	{
+		unsigned char* sam=&samples[samnum*3];
+		long val=sam[0]+(sam[1]<<8)+(sam[2]<<16);
+		if (val>=(1<<23)) val=(1<<24)-val;
+		if ((__uint32)val>threshold) break;
+	}
+	if (samnum==samcount)
+	{
+		return false;
+	}
+	*firstsam=samnum;
+	for (samnum=samcount-1;samnum>*firstsam;samnum--)
+	{
+		unsigned char* sam=&samples[samnum*3];
+		long val=sam[0]+(sam[1]<<8)+(sam[2]<<16);
+		if (val>=(1<<23)) val=(1<<24)-val;
+		if ((__uint32)val>threshold) break;
+	}
+	*lastsam=samnum;
+	return true;
+}
+
 bool hd24utils::dirExists(const char * pszDirName)
 {
 #ifdef WIN32
@@ -517,7 +645,7 @@ bool hd24utils::dirExists(const char * pszDirName)
 bool hd24utils::isdir(const char* name)
 {
 	struct stat fi;
-	if (stat(name, &fi))
+	if (stat(name, &fi)==0)
 	{
 		if (S_ISDIR(fi.st_mode))
 		{
@@ -532,7 +660,7 @@ bool hd24utils::isdir(const char* name)
 bool hd24utils::isfile(const char* name)
 {
 	struct stat fi;
-	if (stat(name, &fi))
+	if (stat(name, &fi)==0)
 	{
 		if (S_ISDIR(fi.st_mode))
 		{
@@ -674,191 +802,1690 @@ int hd24utils::savedrivesectors(hd24fs* currenthd24,string* outputfilename,unsig
 	return 0;
 }
 
-int hd24utils::savedriveimage(hd24fs* currenthd24,string* imagefilename,char* message,int* cancel) {
-	unsigned long firstsector=0;
-	int lastsecerror=0;
-	unsigned long endsector=currenthd24->getlastsectornum(&lastsecerror);
-	return savedrivesectors(currenthd24,imagefilename,firstsector,endsector,message,cancel);
-}
+typedef struct 
+{
+	unsigned long start;
+	unsigned long count;
+	char status;
+} rescuerange;
 
-int hd24utils::newdriveimage(string* imagefilename,__uint32 endsector,char* message,int* cancel) {
-	if (endsector<1353963)
+struct hd24rescuejob
+{
+	hd24fs* fs;
+	FSHANDLE handle;
+	unsigned long firstsector;
+	unsigned long endsector;
+	unsigned char* buffer;
+	vector<rescuerange>* map;
+	string* mapfilename;
+	char* message;
+	int* cancel;
+	int pass;
+	__uint32 readsdone;
+};
+
+static void rescuemap_set(vector<rescuerange>* map,unsigned long start,unsigned long count,char status)
+{
+	/* Marks the range start..start+count-1 with the given status,
+	   splitting up existing ranges where needed and merging
+	   neighbours with equal status. */
+	if (count==0) return;
+	unsigned long end=start+count;
+	vector<rescuerange> result;
+	rescuerange newrange;
+	newrange.start=start;
+	newrange.count=count;
+	newrange.status=status;
+	bool inserted=false;
+
+	for (unsigned int i=0;i<map->size();i++)
 	{
-		// min. number of sectors is 1353964
-		// this makes the min. end sector at least 1353963
-		// requested drive size is less than possible minimum size
-		if (message!=NULL)
+		rescuerange r=(*map)[i];
+		unsigned long rend=r.start+r.count;
+		if ((rend<=start)||(r.start>=end))
 		{
-			strcpy(message,"Requested drive image is smaller than minimum of 1353964 sectors");
+			if ((!inserted)&&(r.start>=end))
+			{
+				result.push_back(newrange);
+				inserted=true;
+			}
+			result.push_back(r);
+			continue;
+		}
+		if (r.start<start)
+		{
+			rescuerange head=r;
+			head.count=start-r.start;
+			result.push_back(head);
+		}
+		if (!inserted)
+		{
+			result.push_back(newrange);
+			inserted=true;
+		}
+		if (rend>end)
+		{
+			rescuerange tail=r;
+			tail.start=end;
+			tail.count=rend-end;
+			result.push_back(tail);
 		}
-		return -1;
 	}
-	
-	unsigned long firstsector=0;
-#if (UTILDEBUG==1)
-cout << "about to save drive sectors" <<endl;
-#endif
-	int result=savedrivesectors(NULL,imagefilename,firstsector,endsector,message,cancel);
-	if (result!=0)
+	if (!inserted)
 	{
-		return result;
+		result.push_back(newrange);
 	}
-#if (UTILDEBUG==1)
-cout << "saved drive sectors, creating new fs object to format" <<endl;
-#endif
-	hd24fs* newfs=new hd24fs((const char*)NULL,hd24fs::MODE_RDWR,imagefilename,true);
-#if (UTILDEBUG==1)
-	cout << "Last sectornum of newly created fs=" << newfs->getlastsectornum() << endl
- << "write enabling fs" <<endl;
-#endif
-	newfs->write_enable();
-#if (UTILDEBUG==1)
-cout << "quickformatting fs" <<endl;
-#endif
-	newfs->quickformat(message);
-#if (UTILDEBUG==1)
-	cout << "format result=" << *message << endl
- << "deleting format fs object" <<endl;
-#endif
-	delete newfs;
-#if (UTILDEBUG==1)
-cout << "destructed fs object" <<endl;
-#endif	
-	return 0;
-}
 
-void hd24utils::dumpsector(const char* buffer)
-{
-	for (int i=0;i<512;i+=16) {
-		string* dummy=Convert::int32tohex(i);
-	       	cout << *dummy	<< "  "; // PRAGMA allowed
-		delete dummy; dummy=NULL;
-		for (int j=0;j<16;j++) {
-			string* dummy= Convert::byte2hex(buffer[i+j]);
-			cout << *dummy; // PRAGMA allowed, dumpsector
-			if (j==7) {
-				cout << "-" ; // PRAGMA allowed, dumpsector
-			} else {
-				cout << " " ; // PRAGMA allowed, dumpsector
+	map->clear();
+	for (unsigned int i=0;i<result.size();i++)
+	{
+		if (map->size()>0)
+		{
+			rescuerange* last=&((*map)[map->size()-1]);
+			if ((last->status==result[i].status)
+			  &&(last->start+last->count==result[i].start))
+			{
+				last->count+=result[i].count;
+				continue;
 			}
-			delete dummy; dummy=NULL;
 		}
-		cout << " "; // PRAGMA allowed, dumpsector
-		for (int j=0;j<16;j++) {
-			cout << Convert::safebyte(buffer[i+j]); // PRAGMA allowed, dumpsector
+		map->push_back(result[i]);
+	}
+}
+
+static unsigned long rescuemap_count(vector<rescuerange>* map,char status)
+{
+	unsigned long total=0;
+	for (unsigned int i=0;i<map->size();i++)
+	{
+		if ((*map)[i].status==status)
+		{
+			total+=(*map)[i].count;
 		}
-		cout << "" << endl; // PRAGMA allowed, dumpsector
 	}
+	return total;
 }
-int hd24utils::saveheader(hd24fs* currenthd24,string* headerfilename) {
-	return savedrivesectors(currenthd24,headerfilename,0,0x700,NULL,NULL);
-	// TODO: 0x700 sectors is arbitrary. First song entry is at 0x77,
-	// total of 99*99 songs of 7 sectors each puts actual required length 
-	// at 0x10c76. However, this has served fine so far.
 
+static bool rescuemap_load(string* mapfilename,vector<rescuerange>* map,
+			unsigned long firstsector,unsigned long endsector)
+{
+	/* Loads an existing map file. Returns false if there is none
+	   (or if it doesn't describe the requested range), in which 
+           case a fresh job should be started. */
+	ifstream mapfile(mapfilename->c_str());
+	if (!mapfile.is_open())
+	{
+		return false;
+	}
+	map->clear();
+	string line;
+	while (getline(mapfile,line))
+	{
+		if (line.length()==0) continue;
+		if (line.substr(0,1)=="#") continue;
+		unsigned long start=0;
+		unsigned long count=0;
+		char status=RESCUESTATUS_UNTRIED;
+		if (sscanf(line.c_str(),"%lu %lu %c",&start,&count,&status)!=3)
+		{
+			continue;
+		}
+		if ((start<firstsector)||(count==0)) continue;
+		if (start+count-1>endsector) continue;
+		rescuemap_set(map,start,count,status);
+	}
+	mapfile.close();
+	if (map->size()==0)
+	{
+		return false;
+	}
+	/* Anything the map doesn't mention is still untried. */
+	rescuerange first=(*map)[0];
+	rescuerange last=(*map)[map->size()-1];
+	if (first.start>firstsector)
+	{
+		rescuemap_set(map,firstsector,first.start-firstsector,RESCUESTATUS_UNTRIED);
+	}
+	if (last.start+last.count-1<endsector)
+	{
+		rescuemap_set(map,last.start+last.count,endsector-(last.start+last.count-1),RESCUESTATUS_UNTRIED);
+	}
+	return true;
 }
 
-void hd24utils::findfile(const char* rawname,const char* path,char* result) 
+static bool rescuemap_save(string* mapfilename,vector<rescuerange>* map)
 {
-	string* strpath=new string(path);
+	string tmpname=*mapfilename+".tmp";
+	ofstream mapfile(tmpname.c_str(),ios::out|ios::trunc);
+	if (!mapfile.is_open())
+	{
+		return false;
+	}
+	mapfile << "# hd24tools rescue map" << endl;
+	mapfile << "# status: ? untried, * failed large read, - bad sector, + rescued" << endl;
+	mapfile << "# firstsector sectorcount status" << endl;
+	for (unsigned int i=0;i<map->size();i++)
+	{
+		mapfile << (*map)[i].start << " " 
+			<< (*map)[i].count << " " 
+			<< (*map)[i].status << endl;
+	}
+	mapfile.close();
 #ifdef WINDOWS
-	string* pathsep=new string(";");
-#else
-	string* pathsep=new string(":");
+	_unlink(mapfilename->c_str());
 #endif
-	int last=0;	
-	string* exename;
-	string* exepath;	
-#if (UTILDEBUG==1)
-	cout << "search path for exe " << endl;
+	return (rename(tmpname.c_str(),mapfilename->c_str())==0);
+}
+
+static bool rescuewritesectors(FSHANDLE handle,__uint64 targetsector,unsigned char* buffer,__uint32 sectors)
+{
+	__uint64 targetoff=targetsector*SECTORSIZE;
+	__uint32 bytes=sectors*SECTORSIZE;
+#if defined(LINUX) || defined(DARWIN)
+	ssize_t byteswritten=pwrite64(handle,buffer,bytes,targetoff);
+	return (byteswritten==(ssize_t)bytes);
 #endif
-	while (last==0)
+#ifdef WINDOWS
+	LARGE_INTEGER li;
+	li.QuadPart=targetoff;
+	SetFilePointerEx(handle,li,NULL,FILE_BEGIN);
+	DWORD byteswritten=0;
+	if (!WriteFile(handle,buffer,bytes,&byteswritten,NULL))
 	{
-		unsigned int idx=strpath->find(pathsep->c_str());
-		if (idx==string::npos) {
-			last=1;
-			exepath=new string(strpath->c_str());
-			exename=new string(strpath->c_str());
-			*strpath="";
-		} else {
-			exepath=new string(strpath->substr(0,idx));
-			exename=new string(strpath->substr(0,idx));
-			*strpath=strpath->substr(idx+1);
-		}
-#if (UTILDEBUG==1)
-		cout << "exepath= " << *exepath << endl;
+		return false;
+	}
+	return (byteswritten==bytes);
 #endif
-		if (exepath->substr(exepath->length()-1,1)!=PATHSLASH) {
-		     *exepath+=PATHSLASH;
-		}	
-		if (exename->substr(exename->length()-1,1)!=PATHSLASH) {
-		     *exename+=PATHSLASH;
-		}	
+}
 
-		*exename+=rawname;
-#if (UTILDEBUG==1)
-		cout << "test if file " << exename->c_str() << " exists" << endl;
-#endif
-		if (hd24utils::fileExists(exename->c_str())) {
-			strncpy(result,exepath->c_str(),2048);
-			if (exename!=NULL) {
-				delete exename;
-				exename=NULL;
+int hd24utils::rescuepass(hd24rescuejob* job,char fromstatus,unsigned long readsize,bool skipahead,char failstatus)
+{
+	/* Reads all ranges with status 'fromstatus' using reads of
+	   'readsize' sectors. Rescued sectors are written to the image and 
+	   marked good, unreadable ones get 'failstatus'. In skip-ahead mode,
+	   each failure skips an increasing number of sectors to get past 
+	   weak areas quickly; skipped sectors are left untried. 
+	   Returns RESCUE_CANCELLED on user cancel, RESCUE_WRITEERROR if
+	   the image cannot be written, 0 otherwise. */
+	vector<rescuerange> todo;
+	for (unsigned int i=0;i<job->map->size();i++)
+	{
+		if ((*job->map)[i].status==fromstatus)
+		{
+			todo.push_back((*job->map)[i]);
+		}
+	}
+
+	for (unsigned int i=0;i<todo.size();i++)
+	{
+		unsigned long pos=todo[i].start;
+		unsigned long rend=todo[i].start+todo[i].count;
+		unsigned long skip=readsize;
+		while (pos<rend)
+		{
+			if (job->cancel!=NULL)
+			{
+				if (*(job->cancel)!=0)
+				{
+					return RESCUE_CANCELLED;
+				}
 			}
-			if (exepath!=NULL) {
-				delete exepath;
-				exepath=NULL;
+			unsigned long numsectors=readsize;
+			if ((rend-pos)<numsectors)
+			{
+				numsectors=rend-pos;
 			}
-			if (strpath!=NULL) {		
-				delete strpath;
-				strpath=NULL;
+			long bytesread=job->fs->readsectors_noheader(job->fs,pos,job->buffer,numsectors);
+			bool readok=(bytesread==(long)(numsectors*SECTORSIZE));
+			if (readok)
+			{
+				if (!rescuewritesectors(job->handle,pos-job->firstsector,job->buffer,numsectors))
+				{
+					/* Can't write the image; no point in going on. */
+					return RESCUE_WRITEERROR;
+				}
+				rescuemap_set(job->map,pos,numsectors,RESCUESTATUS_GOOD);
+				skip=readsize;
+			} else {
+				rescuemap_set(job->map,pos,numsectors,failstatus);
 			}
-			if (pathsep!=NULL) {
-				delete pathsep;
-				pathsep=NULL;
+			pos+=numsectors;
+			if ((!readok)&&(skipahead))
+			{
+				unsigned long skipsectors=skip;
+				if ((rend-pos)<skipsectors)
+				{
+					skipsectors=rend-pos;
+				}
+				pos+=skipsectors;
+				skip*=2;
+				if (skip>RESCUE_MAXSKIPSECTORS)
+				{
+					skip=RESCUE_MAXSKIPSECTORS;
+				}
+			}
+			job->readsdone++;
+			if ((job->readsdone%RESCUE_SAVEINTERVAL)==0)
+			{
+				rescuemap_save(job->mapfilename,job->map);
+			}
+			if (job->message!=NULL) 
+			{
+				if ((job->readsdone%100)==0)
+				{
+					sprintf(job->message,"Rescue pass %d: sector %ld of %ld, %ld bad",
+						job->pass,pos,(job->endsector+1),
+						rescuemap_count(job->map,RESCUESTATUS_BAD)
+						+rescuemap_count(job->map,RESCUESTATUS_FAILED));
+					Fl::wait(0);
+				}
 			}
-			return ;
-		}
-		if (exename!=NULL) {
-			delete exename;
-			exename=NULL;
 		}
-		if (exepath!=NULL) {
-			delete exepath;
-			exepath=NULL;
-		}		
-	}	
-
-	if (strpath!=NULL) {		
-		delete strpath;
-		strpath=NULL;
-	}
-	if (pathsep!=NULL) {
-		delete pathsep;
-		pathsep=NULL;
 	}
-
-	result[0]=(char)0;
-	return;
+	return 0;
 }
 
-bool hd24utils::fileExists(const char* strFilename) {
-	struct stat stFileInfo;
- 	int intStat;
-
-	// Attempt to get the file attributes
-	intStat = stat(strFilename,&stFileInfo);
-	if(intStat == 0) 
+int hd24utils::rescuedrivesectors(hd24fs* currenthd24,string* outputfilename,string* mapfilename,unsigned long firstsector,unsigned long endsector,int retries,char* message,int* cancel) 
+{
+	/* Error-tolerant alternative to savedrivesectors.
+	   Pass 1 copies using large reads, skipping ahead on failure.
+	   Pass 2 fills in the areas skipped by pass 1.
+	   Pass 3 splits up failed large reads into single sectors.
+	   Further passes retry bad sectors 'retries' times.
+	   The map file is consulted first, so previously rescued sectors
+	   are never read again. Unreadable sectors are left unwritten 
+	   (reading back as zeroes). */
+	if (currenthd24==NULL)
 	{
-		// We were able to get the file attributes
-		// so the file obviously exists.
-		return true;
+		return RESCUE_CANNOTOPEN;
 	}
-	// We were not able to get the file attributes.
-	// This may mean that we don't have permission to
-	// access the folder which contains this file. If you
-	// need to do that level of checking, lookup the
-	// return values of stat which will give you
+#if defined(LINUX) || defined(DARWIN)
+	FSHANDLE handle=open64(outputfilename->c_str(),O_WRONLY|O_CREAT,0664);
+#endif
+#ifdef WINDOWS
+	FSHANDLE handle=CreateFile(outputfilename->c_str(),GENERIC_WRITE|GENERIC_READ,
+              FILE_SHARE_READ|FILE_SHARE_WRITE,
+              NULL,OPEN_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+#endif
+	if (hd24fs::isinvalidhandle(handle)) {
+		return RESCUE_CANNOTOPEN;
+	}
+#if defined(LINUX) || defined(DARWIN)
+	/* Make sure the image has its full size even if the last
+	   sectors of the drive turn out to be unreadable. */
+	__uint64 imagebytes=((__uint64)(endsector-firstsector)+1)*SECTORSIZE;
+	struct stat fi;
+	if (fstat(handle,&fi)==0)
+	{
+		if ((__uint64)fi.st_size<imagebytes)
+		{
+			if (ftruncate(handle,imagebytes)!=0)
+			{
+				close(handle);
+				return RESCUE_WRITEERROR;
+			}
+		}
+	}
+#endif
+
+	vector<rescuerange> map;
+	if (!rescuemap_load(mapfilename,&map,firstsector,endsector))
+	{
+		rescuemap_set(&map,firstsector,(endsector-firstsector)+1,RESCUESTATUS_UNTRIED);
+	}
+
+	hd24rescuejob job;
+	job.fs=currenthd24;
+	job.handle=handle;
+	job.firstsector=firstsector;
+	job.endsector=endsector;
+	job.map=&map;
+	job.mapfilename=mapfilename;
+	job.message=message;
+	job.cancel=cancel;
+	job.readsdone=0;
+	job.buffer=(unsigned char*)memutils::mymalloc("rescuedrivesectors",RESCUE_CHUNKSECTORS*SECTORSIZE,1);
+	if (job.buffer==NULL)
+	{
+#if defined(LINUX) || defined(DARWIN)
+		close(handle);
+#endif
+#ifdef WINDOWS
+		CloseHandle(handle);
+#endif
+		return RESCUE_CANNOTOPEN;
+	}
+
+	int result=0;
+	job.pass=1;
+	result=rescuepass(&job,RESCUESTATUS_UNTRIED,RESCUE_CHUNKSECTORS,true,RESCUESTATUS_FAILED);
+	if (result==0)
+	{
+		job.pass=2;
+		result=rescuepass(&job,RESCUESTATUS_UNTRIED,RESCUE_CHUNKSECTORS,false,RESCUESTATUS_FAILED);
+	}
+	if (result==0)
+	{
+		job.pass=3;
+		result=rescuepass(&job,RESCUESTATUS_FAILED,1,false,RESCUESTATUS_BAD);
+	}
+	for (int retry=0;(retry<retries)&&(result==0);retry++)
+	{
+		if (rescuemap_count(&map,RESCUESTATUS_BAD)==0)
+		{
+			break;
+		}
+		job.pass=4+retry;
+		result=rescuepass(&job,RESCUESTATUS_BAD,1,false,RESCUESTATUS_BAD);
+	}
+	rescuemap_save(mapfilename,&map);
+	memutils::myfree("rescuedrivesectors",job.buffer);
+#if defined(LINUX) || defined(DARWIN)
+	close (handle);
+	chmod(outputfilename->c_str(),0664);
+#endif
+#ifdef WINDOWS
+	CloseHandle(handle);
+#endif
+	if (result!=0)
+	{
+		if ((message!=NULL)&&(result==RESCUE_WRITEERROR))
+		{
+			sprintf(message,"Cannot write to the image file, rescue stopped");
+		}
+		return result;
+	}
+	unsigned long badsectors=rescuemap_count(&map,RESCUESTATUS_BAD);
+	if (message!=NULL)
+	{
+		sprintf(message,"Rescue finished, %ld bad sectors",badsectors);
+	}
+	if (badsectors>0)
+	{
+		return RESCUE_BADSECTORS;
+	}
+	return RESCUE_COMPLETE;
+}
+
+int hd24utils::rescuedriveimage(hd24fs* currenthd24,string* imagefilename,string* mapfilename,int retries,char* message,int* cancel) {
+	unsigned long firstsector=0;
+	int lastsecerror=0;
+	unsigned long endsector=currenthd24->getlastsectornum(&lastsecerror);
+	return rescuedrivesectors(currenthd24,imagefilename,mapfilename,firstsector,endsector,retries,message,cancel);
+}
+
+typedef struct
+{
+	unsigned long start;
+	unsigned long count;
+} convertrange;
+
+struct hd24convertjob
+{
+	FSHANDLE sourcehandle;
+	FSHANDLE targethandle;
+	hd24driveimage* sourceimage;	/* NULL for plain images */
+	hd24driveimage* targetimage;	/* NULL for plain images */
+	unsigned long endsector;
+	vector<convertrange>* ranges;
+	vector<__uint64>* hashes;
+	__uint32 nextrange;
+	__uint32 rangesdone;
+	bool verifying;
+	int result;
+	char* message;
+	int* cancel;
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_t joblock;
+	pthread_mutex_t sourcelock;
+	pthread_mutex_t targetlock;
+#endif
+};
+
+static void convertlock(hd24convertjob* job,int which)
+{
+#if defined(LINUX) || defined(DARWIN)
+	switch (which)
+	{
+		case 0: pthread_mutex_lock(&job->joblock); break;
+		case 1: pthread_mutex_lock(&job->sourcelock); break;
+		default: pthread_mutex_lock(&job->targetlock); break;
+	}
+#endif
+}
+
+static void convertunlock(hd24convertjob* job,int which)
+{
+#if defined(LINUX) || defined(DARWIN)
+	switch (which)
+	{
+		case 0: pthread_mutex_unlock(&job->joblock); break;
+		case 1: pthread_mutex_unlock(&job->sourcelock); break;
+		default: pthread_mutex_unlock(&job->targetlock); break;
+	}
+#endif
+}
+
+static bool convertio(hd24convertjob* job,bool ontarget,bool writing,unsigned long sector,unsigned char* buffer,__uint32 sectors)
+{
+	/* Reads or writes sectors of the source or target image.
+	   Plain images are accessed directly (positional I/O needs no 
+	   locking), smart images keep state and are accessed one 
+	   thread at a time. */
+	hd24driveimage* image=(ontarget)?(job->targetimage):(job->sourceimage);
+	FSHANDLE handle=(ontarget)?(job->targethandle):(job->sourcehandle);
+	int which=(ontarget)?2:1;
+	if (image!=NULL)
+	{
+		long done=0;
+		convertlock(job,which);
+		try
+		{
+			if (writing)
+			{
+				done=image->content_writesectors(sector,buffer,sectors);
+			} else {
+				done=image->content_readsectors(sector,buffer,sectors);
+			}
+		}
+		catch (int e)
+		{
+			done=0;
+		}
+		convertunlock(job,which);
+		return (done==(long)sectors);
+	}
+	__uint64 offset=(__uint64)sector*SECTORSIZE;
+	__uint32 bytes=sectors*SECTORSIZE;
+	/* A plain image need not end on a sector boundary; 
+	   the missing part of its last sector reads as zeroes. */
+	bool lastsector=((!writing)&&(!ontarget)&&((sector+sectors-1)==job->endsector));
+	if (lastsector)
+	{
+		memset(buffer,0,bytes);
+	}
+#if defined(LINUX) || defined(DARWIN)
+	ssize_t done;
+	if (writing)
+	{
+		done=pwrite64(handle,buffer,bytes,offset);
+	} else {
+		done=pread64(handle,buffer,bytes,offset);
+	}
+	if ((lastsector)&&(done>(ssize_t)(bytes-SECTORSIZE)))
+	{
+		return true;
+	}
+	return (done==(ssize_t)bytes);
+#endif
+#ifdef WINDOWS
+	LARGE_INTEGER li;
+	li.QuadPart=offset;
+	SetFilePointerEx(handle,li,NULL,FILE_BEGIN);
+	DWORD done=0;
+	BOOL ok;
+	if (writing)
+	{
+		ok=WriteFile(handle,buffer,bytes,&done,NULL);
+	} else {
+		ok=ReadFile(handle,buffer,bytes,&done,NULL);
+	}
+	if ((ok)&&(lastsector)&&(done>(bytes-SECTORSIZE)))
+	{
+		return true;
+	}
+	return (ok && (done==bytes));
+#endif
+}
+
+static bool convertstore(hd24convertjob* job,unsigned long sector,unsigned char* buffer,__uint32 sectors,unsigned char* packbuffer)
+{
+	/* Writes a piece to the target. Full clusters that go into a
+	   compressed smart image are packed before taking the target
+	   lock, so that the threads do the packing in parallel. */
+	hd24driveimage* image=job->targetimage;
+	if ((image==NULL)||(packbuffer==NULL)
+	   ||((sector%IMGCLUSTERSECTORS)!=0)||(sectors!=IMGCLUSTERSECTORS))
+	{
+		return convertio(job,true,true,sector,buffer,sectors);
+	}
+	__uint32 recordsectors=hd24driveimage::packcluster(image->compression(),buffer,packbuffer);
+	long done=0;
+	convertlock(job,2);
+	try
+	{
+		done=image->content_writecluster(sector/IMGCLUSTERSECTORS,buffer,packbuffer,recordsectors);
+	}
+	catch (int e)
+	{
+		done=0;
+	}
+	convertunlock(job,2);
+	return (done==(long)sectors);
+}
+
+static void* convertworker(void* jobptr)
+{
+	/* Takes pieces of work from the job until there are none left.
+	   While copying, the hash of every piece is remembered; while
+	   verifying, the target is read back and compared against it. */
+	hd24convertjob* job=(hd24convertjob*)jobptr;
+	unsigned char* buffer=(unsigned char*)memutils::mymalloc("convertworker",CONVERT_CHUNKSECTORS,SECTORSIZE);
+	unsigned char* packbuffer=NULL;
+	if ((!job->verifying)&&(job->targetimage!=NULL)
+	   &&(job->targetimage->compression()!=IMGCODEC_NONE))
+	{
+		/* If this fails, packing is left to the image (under the lock). */
+		packbuffer=(unsigned char*)memutils::mymalloc("convertworker",IMGPACKBUFFERSECTORS,SECTORSIZE);
+	}
+	int result=0;
+	if (buffer==NULL)
+	{
+		result=hd24utils::CONVERT_IOERROR;
+	}
+	while (result==0)
+	{
+		convertlock(job,0);
+		if (job->result!=0)
+		{
+			convertunlock(job,0);
+			break;
+		}
+		if (job->cancel!=NULL)
+		{
+			if (*(job->cancel)!=0)
+			{
+				job->result=hd24utils::CONVERT_CANCELLED;
+				convertunlock(job,0);
+				break;
+			}
+		}
+		__uint32 rangenum=job->nextrange;
+		if (rangenum>=job->ranges->size())
+		{
+			convertunlock(job,0);
+			break;
+		}
+		job->nextrange++;
+		convertunlock(job,0);
+
+		convertrange r=(*job->ranges)[rangenum];
+		if (!convertio(job,job->verifying,false,r.start,buffer,r.count))
+		{
+			result=hd24utils::CONVERT_IOERROR;
+			break;
+		}
+		__uint64 hash=hd24utils::hashbuffer(buffer,r.count*SECTORSIZE);
+		if (job->verifying)
+		{
+			if (hash!=(*job->hashes)[rangenum])
+			{
+				result=hd24utils::CONVERT_VERIFYFAILED;
+				break;
+			}
+		} else {
+			(*job->hashes)[rangenum]=hash;
+			if (!convertstore(job,r.start,buffer,r.count,packbuffer))
+			{
+				result=hd24utils::CONVERT_IOERROR;
+				break;
+			}
+		}
+
+		convertlock(job,0);
+		job->rangesdone++;
+		if ((job->message!=NULL)&&((job->rangesdone%64)==0))
+		{
+			sprintf(job->message,"%s: %ld of %ld MB",
+				(job->verifying)?"Verifying":"Converting",
+				(long)(job->rangesdone*(CONVERT_CHUNKSECTORS/2048)),
+				(long)(job->ranges->size()*(CONVERT_CHUNKSECTORS/2048)));
+		}
+		convertunlock(job,0);
+	}
+	if (buffer!=NULL)
+	{
+		memutils::myfree("convertworker",buffer);
+	}
+	if (packbuffer!=NULL)
+	{
+		memutils::myfree("convertworker",packbuffer);
+	}
+	if (result!=0)
+	{
+		convertlock(job,0);
+		if (job->result==0)
+		{
+			job->result=result;
+		}
+		convertunlock(job,0);
+	}
+	return NULL;
+}
+
+static void convertrun(hd24convertjob* job,int threads)
+{
+	/* Runs the workers and waits for them to finish. The calling
+	   thread does its share of the work as well. */
+	job->nextrange=0;
+	job->rangesdone=0;
+#if defined(LINUX) || defined(DARWIN)
+	vector<pthread_t> workers;
+	for (int i=1;i<threads;i++)
+	{
+		pthread_t worker;
+		if (pthread_create(&worker,NULL,convertworker,(void*)job)==0)
+		{
+			workers.push_back(worker);
+		}
+	}
+	convertworker((void*)job);
+	for (unsigned int i=0;i<workers.size();i++)
+	{
+		pthread_join(workers[i],NULL);
+	}
+#endif
+#ifdef WINDOWS
+	/* No worker threads here; just do all the work ourselves. */
+	convertworker((void*)job);
+#endif
+}
+
+static void convertaddrange(vector<convertrange>* ranges,unsigned long start,unsigned long count)
+{
+	/* Adds sectors to the work list, merging with the previous range
+	   where possible and splitting up at cluster boundaries. */
+	while (count>0)
+	{
+		if (ranges->size()>0)
+		{
+			convertrange* last=&((*ranges)[ranges->size()-1]);
+			if (((last->start+last->count)==start)
+			   &&((start%CONVERT_CHUNKSECTORS)!=0))
+			{
+				unsigned long extra=CONVERT_CHUNKSECTORS-(start%CONVERT_CHUNKSECTORS);
+				if (extra>count) extra=count;
+				last->count+=extra;
+				start+=extra;
+				count-=extra;
+				continue;
+			}
+		}
+		convertrange r;
+		r.start=start;
+		r.count=CONVERT_CHUNKSECTORS-(start%CONVERT_CHUNKSECTORS);
+		if (r.count>count) r.count=count;
+		ranges->push_back(r);
+		start+=r.count;
+		count-=r.count;
+	}
+}
+
+void hd24utils::convertliveranges(hd24convertjob* job,string* sourcefilename,unsigned long endsector)
+{
+	/* Finds out which sectors of the source need copying. If the
+	   source holds an HD24 file system, free clusters are left out;
+	   everything outside the cluster area (superblock, song tables,
+	   backup superblock) is always copied. Otherwise all sectors 
+	   are copied. */
+	hd24fs* fs=new hd24fs((const char*)NULL,hd24fs::MODE_RDONLY,sourcefilename,false);
+	unsigned char* usage=NULL;
+	__uint32 clusters=0;
+	if (fs->isOpen())
+	{
+		clusters=fs->clustercount();
+		if (clusters>0)
+		{
+			usage=fs->getcopyofusagetable();
+		}
+	}
+	if (usage==NULL)
+	{
+		convertaddrange(job->ranges,0,endsector+1);
+		delete fs;
+		return;
+	}
+	unsigned long datastart=fs->cluster2sector(0);
+	unsigned long clustersectors=fs->cluster2sector(1)-datastart;
+	unsigned long dataend=fs->cluster2sector(clusters);
+	if (dataend>endsector+1)
+	{
+		dataend=endsector+1;
+	}
+	convertaddrange(job->ranges,0,datastart);
+	for (__uint32 i=0;i<clusters;i++)
+	{
+		if (fs->isfreecluster(i,usage))
+		{
+			continue;
+		}
+		unsigned long start=datastart+(i*clustersectors);
+		if (start>=dataend) break;
+		unsigned long count=clustersectors;
+		if (start+count>dataend) count=dataend-start;
+		convertaddrange(job->ranges,start,count);
+	}
+	if (dataend<=endsector)
+	{
+		convertaddrange(job->ranges,dataend,(endsector-dataend)+1);
+	}
+	memutils::myfree("copyusagetable",usage);
+	delete fs;
+}
+
+int hd24utils::convertdriveimage(string* sourcefilename,string* targetfilename,int threads,bool compress,bool verify,char* message,int* cancel)
+{
+	/* Converts a plain drive image into a smart drive image or the
+	   other way around, depending on what the source is. 
+	   Sectors that are not in use end up as zeroes in the target. */
+	if (threads<1) threads=1;
+	if (threads>CONVERT_MAXTHREADS) threads=CONVERT_MAXTHREADS;
+	hd24convertjob job;
+	job.sourceimage=NULL;
+	job.targetimage=NULL;
+	job.targethandle=FSHANDLE_INVALID;
+	job.message=message;
+	job.cancel=cancel;
+	job.result=0;
+	job.verifying=false;
+	job.endsector=0;
+#if defined(LINUX) || defined(DARWIN)
+	job.sourcehandle=open64(sourcefilename->c_str(),O_RDONLY);
+#endif
+#ifdef WINDOWS
+	job.sourcehandle=CreateFile(sourcefilename->c_str(),GENERIC_READ,
+              FILE_SHARE_READ|FILE_SHARE_WRITE,
+              NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+#endif
+	if (hd24fs::isinvalidhandle(job.sourcehandle)) 
+	{
+		return CONVERT_CANNOTOPEN;
+	}
+
+	/* Find out what we are converting from and how large it is. */
+	unsigned char superblock[SECTORSIZE];
+	memset(superblock,0,SECTORSIZE);
+	convertio(&job,false,false,0,superblock,1);
+	unsigned long endsector=0;
+	bool fromsmart=hd24driveimage::issmartimage(superblock);
+	try
+	{
+		if (fromsmart)
+		{
+			job.sourceimage=new hd24driveimage();
+			job.sourceimage->handle(job.sourcehandle);
+			if (job.sourceimage->supported())
+			{
+				endsector=job.sourceimage->getcontentlastsectornum();
+			}
+		} else {
+			hd24driveimage sizer;
+			sizer.handle(job.sourcehandle);
+			endsector=sizer.getcontainerlastsectornum();
+		}
+	}
+	catch (int e)
+	{
+		endsector=0;
+	}
+
+	job.endsector=endsector;
+	int result=CONVERT_COMPLETE;
+	if (endsector==0)
+	{
+		result=CONVERT_CANNOTOPEN;
+	}
+
+	/* Create the target. */
+	if ((result==0)&&(fromsmart))
+	{
+#if defined(LINUX) || defined(DARWIN)
+		job.targethandle=open64(targetfilename->c_str(),O_RDWR|O_CREAT|O_TRUNC,0664);
+		if (!hd24fs::isinvalidhandle(job.targethandle))
+		{
+			if (ftruncate(job.targethandle,((__uint64)endsector+1)*SECTORSIZE)!=0)
+			{
+				result=CONVERT_CANNOTOPEN;
+			}
+		}
+#endif
+#ifdef WINDOWS
+		job.targethandle=CreateFile(targetfilename->c_str(),GENERIC_WRITE|GENERIC_READ,
+		      FILE_SHARE_READ,
+		      NULL,CREATE_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+		if (!hd24fs::isinvalidhandle(job.targethandle))
+		{
+			LARGE_INTEGER li;
+			li.QuadPart=((__uint64)endsector+1)*SECTORSIZE;
+			if (!(SetFilePointerEx(job.targethandle,li,NULL,FILE_BEGIN)
+			     &&SetEndOfFile(job.targethandle)))
+			{
+				result=CONVERT_CANNOTOPEN;
+			}
+		}
+#endif
+	}
+	if ((result==0)&&(!fromsmart))
+	{
+		job.targetimage=new hd24driveimage();
+		try
+		{
+			if (job.targetimage->initimage(targetfilename,endsector)!=0)
+			{
+				result=CONVERT_CANNOTOPEN;
+			}
+		}
+		catch (int e)
+		{
+			result=CONVERT_CANNOTOPEN;
+		}
+		job.targethandle=job.targetimage->handle();
+		if (compress)
+		{
+			job.targetimage->compression(IMGCODEC_DELTA24);
+		}
+	}
+	if ((result==0)&&(hd24fs::isinvalidhandle(job.targethandle)))
+	{
+		result=CONVERT_CANNOTOPEN;
+	}
+
+	vector<convertrange> ranges;
+	vector<__uint64> hashes;
+	if (result==0)
+	{
+		job.ranges=&ranges;
+		convertliveranges(&job,sourcefilename,endsector);
+		hashes.resize(ranges.size(),0);
+		job.hashes=&hashes;
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_init(&job.joblock,NULL);
+		pthread_mutex_init(&job.sourcelock,NULL);
+		pthread_mutex_init(&job.targetlock,NULL);
+#endif
+		convertrun(&job,threads);
+		if ((job.result==0)&&(verify))
+		{
+			job.verifying=true;
+			convertrun(&job,threads);
+		}
+		result=job.result;
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_destroy(&job.joblock);
+		pthread_mutex_destroy(&job.sourcelock);
+		pthread_mutex_destroy(&job.targetlock);
+#endif
+	}
+
+	if (job.sourceimage!=NULL)
+	{
+		delete job.sourceimage;
+	}
+	if (job.targetimage!=NULL)
+	{
+		delete job.targetimage;
+	}
+#if defined(LINUX) || defined(DARWIN)
+	close(job.sourcehandle);
+	if (!hd24fs::isinvalidhandle(job.targethandle))
+	{
+		close(job.targethandle);
+	}
+#endif
+#ifdef WINDOWS
+	CloseHandle(job.sourcehandle);
+	if (!hd24fs::isinvalidhandle(job.targethandle))
+	{
+		CloseHandle(job.targethandle);
+	}
+#endif
+	if ((message!=NULL)&&(result==CONVERT_COMPLETE))
+	{
+		__uint64 copied=0;
+		for (unsigned int i=0;i<ranges.size();i++)
+		{
+			copied+=ranges[i].count;
+		}
+		sprintf(message,"Converted to %s image, %ld of %ld MB in use%s",
+			(fromsmart)?"plain":"smart",
+			(long)(copied/2048),(long)(((__uint64)endsector+1)/2048),
+			(verify)?", verified":"");
+	}
+	return result;
+}
+
+__uint64 hd24utils::hashbuffer(unsigned char* buffer,__uint32 bytes)
+{
+	/* Fast non-cryptographic 64 bit hash (FNV-1a, taking 8 bytes 
+	   at a time), good enough to tell whether two blocks of data
+	   are the same. */
+	__uint64 hash=0xcbf29ce484222325ULL;
+	__uint32 words=bytes/8;
+	for (__uint32 i=0;i<words;i++)
+	{
+		__uint64 word;
+		memcpy(&word,&buffer[i*8],8);
+		hash^=word;
+		hash*=0x100000001b3ULL;
+	}
+	for (__uint32 i=words*8;i<bytes;i++)
+	{
+		hash^=buffer[i];
+		hash*=0x100000001b3ULL;
+	}
+	hash^=(hash>>32);
+	return hash;
+}
+
+struct hd24scanjob
+{
+	hd24fs* fs;
+	unsigned char* pattern;
+	__uint32 patternlen;
+	__uint32 skip[256];		/* Boyer-Moore-Horspool shift table */
+	unsigned long firstsector;
+	unsigned long endsector;	/* exclusive */
+	unsigned long nextsector;
+	__uint64 bytesdone;
+	__uint64 firstmatch;
+	bool findall;
+	vector<__uint64>* matches;
+	int* cancel;
+	void (*progress)(__uint64 bytesdone,__uint64 bytestotal);
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_t joblock;
+	pthread_mutex_t fslock;
+#endif
+};
+
+typedef struct 
+{
+	hd24scanjob* job;
+	int workernum;
+} hd24scanworker;
+
+long hd24utils::lockedreadsectors(hd24fs* fs,void* fslock,unsigned long sectornum,unsigned char* buffer,__uint32 sectors)
+{
+	/* Reads sectors from a drive or image on behalf of a worker thread.
+	   Plain devices and images are read with positional reads, which
+	   don't interfere with each other. Smart images are not 
+	   thread-safe, so reads from those are done one at a time. */
+	bool mustlock=(fs->smartimage!=NULL);
+#if defined(LINUX) || defined(DARWIN)
+	if (mustlock) pthread_mutex_lock((pthread_mutex_t*)fslock);
+#endif
+	long bytesread=fs->readsectors(fs->devhd24,sectornum,buffer,sectors);
+#if defined(LINUX) || defined(DARWIN)
+	if (mustlock) pthread_mutex_unlock((pthread_mutex_t*)fslock);
+#endif
+	if (bytesread<0) bytesread=0;
+	return bytesread;
+}
+
+void* hd24utils::scanworker(void* workerptr)
+{
+	hd24scanworker* worker=(hd24scanworker*)workerptr;
+	hd24scanjob* job=worker->job;
+	__uint32 overlapsectors=(job->patternlen+SECTORSIZE-2)/SECTORSIZE;
+	unsigned char* buffer=(unsigned char*)memutils::mymalloc("scanworker",SCAN_CHUNKSECTORS+overlapsectors,SECTORSIZE);
+	if (buffer==NULL)
+	{
+		return NULL;
+	}
+	__uint32 last=job->patternlen-1;
+	unsigned char lastbyte=job->pattern[last];
+	__uint64 total=(__uint64)(job->endsector-job->firstsector)*SECTORSIZE;
+	while (true)
+	{
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_lock(&job->joblock);
+#endif
+		unsigned long chunkstart=job->nextsector;
+		bool stop=(chunkstart>=job->endsector);
+		if ((!job->findall)&&((__uint64)chunkstart*SECTORSIZE>=job->firstmatch))
+		{
+			/* Someone already found a match before this chunk. */
+			stop=true;
+		}
+		if (job->cancel!=NULL)
+		{
+			if (*(job->cancel)!=0) stop=true;
+		}
+		job->nextsector+=SCAN_CHUNKSECTORS;
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_unlock(&job->joblock);
+#endif
+		if (stop) break;
+
+		__uint32 chunksectors=SCAN_CHUNKSECTORS;
+		if ((job->endsector-chunkstart)<chunksectors)
+		{
+			chunksectors=job->endsector-chunkstart;
+		}
+		/* Matches may start anywhere in the chunk, but need not
+		   end inside it. */
+		long validbytes=lockedreadsectors(job->fs,&job->fslock,chunkstart,buffer,chunksectors+overlapsectors);
+		if (validbytes<(long)(chunksectors*SECTORSIZE))
+		{
+			/* Reading with overlap past the end of the drive fails; 
+			   retry without. */
+			validbytes=lockedreadsectors(job->fs,&job->fslock,chunkstart,buffer,chunksectors);
+		}
+		__uint64 chunkoffset=(__uint64)chunkstart*SECTORSIZE;
+		__uint32 startlimit=chunksectors*SECTORSIZE;
+		__uint32 pos=0;
+		while ((pos<startlimit)&&((long)(pos+job->patternlen)<=validbytes))
+		{
+			unsigned char c=buffer[pos+last];
+			if (c==lastbyte)
+			{
+				if (memcmp(&buffer[pos],job->pattern,last)==0)
+				{
+					__uint64 found=chunkoffset+pos;
+#if defined(LINUX) || defined(DARWIN)
+					pthread_mutex_lock(&job->joblock);
+#endif
+					if (job->findall)
+					{
+						job->matches->push_back(found);
+					} else {
+						if (found<job->firstmatch) job->firstmatch=found;
+					}
+#if defined(LINUX) || defined(DARWIN)
+					pthread_mutex_unlock(&job->joblock);
+#endif
+					if (!job->findall) break;
+				}
+			}
+			pos+=job->skip[c];
+		}
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_lock(&job->joblock);
+#endif
+		job->bytesdone+=chunksectors*SECTORSIZE;
+		__uint64 done=job->bytesdone;
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_unlock(&job->joblock);
+#endif
+		if ((worker->workernum==0)&&(job->progress!=NULL))
+		{
+			job->progress(done,total);
+		}
+	}
+	memutils::myfree("scanworker",buffer);
+	return NULL;
+}
+
+__uint32 hd24utils::findpattern(hd24fs* fs,unsigned char* pattern,__uint32 patternlen,unsigned long firstsector,unsigned long endsector,bool findall,int threads,vector<__uint64>* matches,int* cancel,void (*progress)(__uint64 bytesdone,__uint64 bytestotal))
+{
+	/* Scans sectors firstsector..endsector-1 for the given byte pattern
+	   and puts the byte offsets of matches in 'matches', in ascending
+	   order. Unless findall is set, only the first match is reported.
+	   Returns the number of matches found. */
+	if ((fs==NULL)||(patternlen==0)||(matches==NULL))
+	{
+		return 0;
+	}
+	int lastsecerror=0;
+	unsigned long lastsector=fs->getlastsectornum(&lastsecerror);
+	if (endsector>lastsector+1) endsector=lastsector+1;
+	if (firstsector>=endsector)
+	{
+		return 0;
+	}
+	if (threads<1) threads=1;
+	if (threads>SCAN_MAXTHREADS) threads=SCAN_MAXTHREADS;
+
+	hd24scanjob job;
+	job.fs=fs;
+	job.pattern=pattern;
+	job.patternlen=patternlen;
+	for (int i=0;i<256;i++)
+	{
+		job.skip[i]=patternlen;
+	}
+	for (__uint32 i=0;i<patternlen-1;i++)
+	{
+		job.skip[pattern[i]]=(patternlen-1)-i;
+	}
+	job.firstsector=firstsector;
+	job.endsector=endsector;
+	job.nextsector=firstsector;
+	job.bytesdone=0;
+	job.firstmatch=SCAN_NOMATCH;
+	job.findall=findall;
+	job.matches=matches;
+	job.cancel=cancel;
+	job.progress=progress;
+
+	hd24scanworker workers[SCAN_MAXTHREADS];
+	for (int i=0;i<threads;i++)
+	{
+		workers[i].job=&job;
+		workers[i].workernum=i;
+	}
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_init(&job.joblock,NULL);
+	pthread_mutex_init(&job.fslock,NULL);
+	vector<pthread_t> threadids;
+	for (int i=1;i<threads;i++)
+	{
+		pthread_t threadid;
+		if (pthread_create(&threadid,NULL,scanworker,(void*)&workers[i])==0)
+		{
+			threadids.push_back(threadid);
+		}
+	}
+	scanworker((void*)&workers[0]);
+	for (unsigned int i=0;i<threadids.size();i++)
+	{
+		pthread_join(threadids[i],NULL);
+	}
+	pthread_mutex_destroy(&job.joblock);
+	pthread_mutex_destroy(&job.fslock);
+#endif
+#ifdef WINDOWS
+	scanworker((void*)&workers[0]);
+#endif
+	if (findall)
+	{
+		sort(matches->begin(),matches->end());
+		return matches->size();
+	}
+	if (job.firstmatch==SCAN_NOMATCH)
+	{
+		return 0;
+	}
+	matches->push_back(job.firstmatch);
+	return 1;
+}
+
+struct hd24diffjob
+{
+	hd24fs* fs[2];			/* second one is NULL when hashing */
+	unsigned long firstsector[2];
+	unsigned long sectors;
+	unsigned long chunks;
+	unsigned char* buffer[2][2];	/* [slot][source] */
+	long bytesread[2][2];
+	bool full[2];
+	bool stop;
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+#endif
+};
+
+static __uint32 diffchunksectors(hd24diffjob* job,unsigned long chunk)
+{
+	unsigned long left=job->sectors-(chunk*DIFF_CHUNKSECTORS);
+	if (left>DIFF_CHUNKSECTORS) return DIFF_CHUNKSECTORS;
+	return left;
+}
+
+void hd24utils::diffreadchunk(hd24diffjob* job,unsigned long chunk)
+{
+	int slot=chunk%2;
+	__uint32 sectors=diffchunksectors(job,chunk);
+	for (int src=0;src<2;src++)
+	{
+		if (job->fs[src]==NULL) continue;
+		unsigned long sectornum=job->firstsector[src]+(chunk*DIFF_CHUNKSECTORS);
+		long bytesread=job->fs[src]->readsectors(job->fs[src]->devhd24,sectornum,job->buffer[slot][src],sectors);
+		if (bytesread<0) bytesread=0;
+		job->bytesread[slot][src]=bytesread;
+	}
+}
+
+void* hd24utils::diffreader(void* jobptr)
+{
+	/* Background reader: fills the free buffer slot with the next
+	   chunk while the other slot is being processed. */
+	hd24diffjob* job=(hd24diffjob*)jobptr;
+	for (unsigned long chunk=0;chunk<job->chunks;chunk++)
+	{
+		int slot=chunk%2;
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_lock(&job->lock);
+		while ((job->full[slot])&&(!job->stop))
+		{
+			pthread_cond_wait(&job->changed,&job->lock);
+		}
+		bool stop=job->stop;
+		pthread_mutex_unlock(&job->lock);
+		if (stop) break;
+#endif
+		diffreadchunk(job,chunk);
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_lock(&job->lock);
+		job->full[slot]=true;
+		pthread_cond_broadcast(&job->changed);
+		pthread_mutex_unlock(&job->lock);
+#endif
+	}
+	return NULL;
+}
+
+static bool diffstart(hd24diffjob* job)
+{
+	job->chunks=(job->sectors+DIFF_CHUNKSECTORS-1)/DIFF_CHUNKSECTORS;
+	job->stop=false;
+	for (int slot=0;slot<2;slot++)
+	{
+		job->full[slot]=false;
+		for (int src=0;src<2;src++)
+		{
+			job->buffer[slot][src]=NULL;
+			job->bytesread[slot][src]=0;
+			if (job->fs[src]==NULL) continue;
+			job->buffer[slot][src]=(unsigned char*)memutils::mymalloc("diffstart",DIFF_CHUNKSECTORS,SECTORSIZE);
+			if (job->buffer[slot][src]==NULL) return false;
+		}
+	}
+	return true;
+}
+
+static void diffend(hd24diffjob* job)
+{
+	for (int slot=0;slot<2;slot++)
+	{
+		for (int src=0;src<2;src++)
+		{
+			if (job->buffer[slot][src]!=NULL)
+			{
+				memutils::myfree("diffstart",job->buffer[slot][src]);
+				job->buffer[slot][src]=NULL;
+			}
+		}
+	}
+}
+
+int hd24utils::diffrun(hd24diffjob* job,vector<hd24diffrange>* diffs,__uint64* result,int* cancel,void (*progress)(__uint64 bytesdone,__uint64 bytestotal))
+{
+	/* Reads the range(s) of the job chunk by chunk (with read-ahead 
+	   on a background thread) and either hashes them (one source) 
+	   or compares them (two sources). Differences are collected as
+	   runs of differing bytes. Returns DIFF_COMPLETE, or 
+	   DIFF_CANCELLED when cancelled (result then only covers the
+	   chunks done so far). */
+	__uint64 hash=0xcbf29ce484222325ULL;
+	__uint64 difbytes=0;
+	__uint64 total=(__uint64)job->sectors*SECTORSIZE;
+	int status=DIFF_COMPLETE;
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_init(&job->lock,NULL);
+	pthread_cond_init(&job->changed,NULL);
+	pthread_t reader;
+	bool haveReader=(pthread_create(&reader,NULL,diffreader,(void*)job)==0);
+#endif
+	for (unsigned long chunk=0;chunk<job->chunks;chunk++)
+	{
+		int slot=chunk%2;
+		if (cancel!=NULL)
+		{
+			if (*cancel!=0)
+			{
+				status=DIFF_CANCELLED;
+				break;
+			}
+		}
+#if defined(LINUX) || defined(DARWIN)
+		if (haveReader)
+		{
+			pthread_mutex_lock(&job->lock);
+			while (!job->full[slot])
+			{
+				pthread_cond_wait(&job->changed,&job->lock);
+			}
+			pthread_mutex_unlock(&job->lock);
+		} else {
+			diffreadchunk(job,chunk);
+		}
+#endif
+#ifdef WINDOWS
+		diffreadchunk(job,chunk);
+#endif
+		__uint32 bytes=diffchunksectors(job,chunk)*SECTORSIZE;
+		__uint64 chunkoffset=(__uint64)chunk*DIFF_CHUNKSECTORS*SECTORSIZE;
+		unsigned char* a=job->buffer[slot][0];
+		long valid=job->bytesread[slot][0];
+		if (valid>(long)bytes) valid=bytes;
+		if (job->fs[1]==NULL)
+		{
+			/* Unreadable parts hash as zeroes. */
+			if (valid<(long)bytes) memset(&a[valid],0,bytes-valid);
+			hash^=hashbuffer(a,bytes);
+			hash*=0x100000001b3ULL;
+		} else {
+			unsigned char* b=job->buffer[slot][1];
+			if (job->bytesread[slot][1]<valid) valid=job->bytesread[slot][1];
+			if (valid<0) valid=0;
+			__uint32 pos=0;
+			while (pos<(__uint32)valid)
+			{
+				/* Skip equal data 64 bytes at a time, then find 
+				   the exact differing bytes. */
+				__uint32 len=64;
+				if (pos+len>(__uint32)valid) len=valid-pos;
+				if (memcmp(&a[pos],&b[pos],len)==0)
+				{
+					pos+=len;
+					continue;
+				}
+				for (__uint32 i=pos;i<pos+len;i++)
+				{
+					if (a[i]==b[i]) continue;
+					difbytes++;
+					if (diffs==NULL) continue;
+					__uint64 offset=chunkoffset+i;
+					if (diffs->size()>0)
+					{
+						hd24diffrange* last=&((*diffs)[diffs->size()-1]);
+						if (last->offset+last->length==offset)
+						{
+							last->length++;
+							continue;
+						}
+					}
+					hd24diffrange r;
+					r.offset=offset;
+					r.length=1;
+					diffs->push_back(r);
+				}
+				pos+=len;
+			}
+			if (valid<(long)bytes)
+			{
+				/* Data that could not be read on either side 
+				   counts as different. */
+				difbytes+=bytes-valid;
+				if (diffs!=NULL)
+				{
+					hd24diffrange r;
+					r.offset=chunkoffset+valid;
+					r.length=bytes-valid;
+					if ((diffs->size()>0)&&((*diffs)[diffs->size()-1].offset+(*diffs)[diffs->size()-1].length==r.offset))
+					{
+						(*diffs)[diffs->size()-1].length+=r.length;
+					} else {
+						diffs->push_back(r);
+					}
+				}
+			}
+		}
+#if defined(LINUX) || defined(DARWIN)
+		pthread_mutex_lock(&job->lock);
+		job->full[slot]=false;
+		pthread_cond_broadcast(&job->changed);
+		pthread_mutex_unlock(&job->lock);
+#endif
+		if (progress!=NULL)
+		{
+			progress(chunkoffset+bytes,total);
+		}
+	}
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_lock(&job->lock);
+	job->stop=true;
+	pthread_cond_broadcast(&job->changed);
+	pthread_mutex_unlock(&job->lock);
+	if (haveReader)
+	{
+		pthread_join(reader,NULL);
+	}
+	pthread_cond_destroy(&job->changed);
+	pthread_mutex_destroy(&job->lock);
+#endif
+	if (result!=NULL)
+	{
+		*result=(job->fs[1]==NULL)?hash:difbytes;
+	}
+	return status;
+}
+
+int hd24utils::hashsectors(hd24fs* fs,unsigned long firstsector,unsigned long endsector,__uint64* hash,int* cancel,void (*progress)(__uint64 bytesdone,__uint64 bytestotal))
+{
+	/* Puts a 64 bit hash of sectors firstsector..endsector-1 in hash,
+	   suitable for telling whether two ranges hold the same data.
+	   The hash is computed per 1M chunk, so ranges can only be 
+	   compared with hashes of ranges of the same size. 
+	   Returns DIFF_COMPLETE, DIFF_CANCELLED or DIFF_NOMEMORY; 
+	   the hash is only meaningful if complete. */
+	*hash=0;
+	if ((fs==NULL)||(endsector<=firstsector))
+	{
+		return DIFF_COMPLETE;
+	}
+	hd24diffjob job;
+	job.fs[0]=fs;
+	job.fs[1]=NULL;
+	job.firstsector[0]=firstsector;
+	job.firstsector[1]=0;
+	job.sectors=endsector-firstsector;
+	int status=DIFF_NOMEMORY;
+	if (diffstart(&job))
+	{
+		status=diffrun(&job,NULL,hash,cancel,progress);
+	}
+	diffend(&job);
+	return status;
+}
+
+int hd24utils::diffsectors(hd24fs* fs1,unsigned long firstsector1,hd24fs* fs2,unsigned long firstsector2,unsigned long sectors,__uint64* difbytes,vector<hd24diffrange>* diffs,int* cancel,void (*progress)(__uint64 bytesdone,__uint64 bytestotal))
+{
+	/* Compares 'sectors' sectors of fs1 starting at firstsector1 with 
+	   the same number of sectors of fs2 starting at firstsector2. 
+	   fs1 and fs2 may be the same drive. Runs of differing bytes are 
+	   added to 'diffs' (if not NULL), with offsets relative to the
+	   start of the ranges; the number of differing bytes is put in
+	   difbytes. Returns DIFF_COMPLETE, DIFF_CANCELLED (difbytes and 
+	   diffs then only cover the part compared so far) or 
+	   DIFF_NOMEMORY. */
+	*difbytes=0;
+	if ((fs1==NULL)||(fs2==NULL)||(sectors==0))
+	{
+		return DIFF_COMPLETE;
+	}
+	hd24diffjob job;
+	job.fs[0]=fs1;
+	job.fs[1]=fs2;
+	job.firstsector[0]=firstsector1;
+	job.firstsector[1]=firstsector2;
+	job.sectors=sectors;
+	int status=DIFF_NOMEMORY;
+	if (diffstart(&job))
+	{
+		status=diffrun(&job,diffs,difbytes,cancel,progress);
+	}
+	diffend(&job);
+	return status;
+}
+
+int hd24utils::savedriveimage(hd24fs* currenthd24,string* imagefilename,char* message,int* cancel) {
+	unsigned long firstsector=0;
+	int lastsecerror=0;
+	unsigned long endsector=currenthd24->getlastsectornum(&lastsecerror);
+	return savedrivesectors(currenthd24,imagefilename,firstsector,endsector,message,cancel);
+}
+
+int hd24utils::newdriveimage(string* imagefilename,__uint32 endsector,char* message,int* cancel) {
+	if (endsector<1353963)
+	{
+		// min. number of sectors is 1353964
+		// this makes the min. end sector at least 1353963
+		// requested drive size is less than possible minimum size
+		if (message!=NULL)
+		{
+			strcpy(message,"Requested drive image is smaller than minimum of 1353964 sectors");
+		}
+		return -1;
+	}
+	
+	unsigned long firstsector=0;
+#if (UTILDEBUG==1)
+cout << "about to save drive sectors" <<endl;
+#endif
+	int result=savedrivesectors(NULL,imagefilename,firstsector,endsector,message,cancel);
+	if (result!=0)
+	{
+		return result;
+	}
+#if (UTILDEBUG==1)
+cout << "saved drive sectors, creating new fs object to format" <<endl;
+#endif
+	hd24fs* newfs=new hd24fs((const char*)NULL,hd24fs::MODE_RDWR,imagefilename,true);
+#if (UTILDEBUG==1)
+	cout << "Last sectornum of newly created fs=" << newfs->getlastsectornum() << endl
+ << "write enabling fs" <<endl;
+#endif
+	newfs->write_enable();
+#if (UTILDEBUG==1)
+cout << "quickformatting fs" <<endl;
+#endif
+	newfs->quickformat(message);
+#if (UTILDEBUG==1)
+	cout << "format result=" << *message << endl
+ << "deleting format fs object" <<endl;
+#endif
+	delete newfs;
+#if (UTILDEBUG==1)
+cout << "destructed fs object" <<endl;
+#endif	
+	return 0;
+}
+
+void hd24utils::dumpsector(const char* buffer)
+{
+	for (int i=0;i<512;i+=16) {
+		string* dummy=Convert::int32tohex(i);
+	       	cout << *dummy	<< "  "; // PRAGMA allowed
+		delete dummy; dummy=NULL;
+		for (int j=0;j<16;j++) {
+			string* dummy= Convert::byte2hex(buffer[i+j]);
+			cout << *dummy; // PRAGMA allowed, dumpsector
+			if (j==7) {
+				cout << "-" ; // PRAGMA allowed, dumpsector
+			} else {
+				cout << " " ; // PRAGMA allowed, dumpsector
+			}
+			delete dummy; dummy=NULL;
+		}
+		cout << " "; // PRAGMA allowed, dumpsector
+		for (int j=0;j<16;j++) {
+			cout << Convert::safebyte(buffer[i+j]); // PRAGMA allowed, dumpsector
+		}
+		cout << "" << endl; // PRAGMA allowed, dumpsector
+	}
+}
+int hd24utils::saveheader(hd24fs* currenthd24,string* headerfilename) {
+	return savedrivesectors(currenthd24,headerfilename,0,0x700,NULL,NULL);
+	// TODO: 0x700 sectors is arbitrary. First song entry is at 0x77,
+	// total of 99*99 songs of 7 sectors each puts actual required length 
+	// at 0x10c76. However, this has served fine so far.
+
+}
+
+void hd24utils::findfile(const char* rawname,const char* path,char* result) 
+{
+	string* strpath=new string(path);
+#ifdef WINDOWS
+	string* pathsep=new string(";");
+#else
+	string* pathsep=new string(":");
+#endif
+	int last=0;	
+	string* exename;
+	string* exepath;	
+#if (UTILDEBUG==1)
+	cout << "search path for exe " << endl;
+#endif
+	while (last==0)
+	{
+		size_t idx=strpath->find(pathsep->c_str());
+		if (idx==string::npos) {
+			last=1;
+			exepath=new string(strpath->c_str());
+			exename=new string(strpath->c_str());
+			*strpath="";
+		} else {
+			exepath=new string(strpath->substr(0,idx));
+			exename=new string(strpath->substr(0,idx));
+			*strpath=strpath->substr(idx+1);
+		}
+#if (UTILDEBUG==1)
+		cout << "exepath= " << *exepath << endl;
+#endif
+		if (exepath->substr(exepath->length()-1,1)!=PATHSLASH) {
+		     *exepath+=PATHSLASH;
+		}	
+		if (exename->substr(exename->length()-1,1)!=PATHSLASH) {
+		     *exename+=PATHSLASH;
+		}	
+
+		*exename+=rawname;
+#if (UTILDEBUG==1)
+		cout << "test if file " << exename->c_str() << " exists" << endl;
+#endif
+		if (hd24utils::fileExists(exename->c_str())) {
+			strncpy(result,exepath->c_str(),2048);
+			if (exename!=NULL) {
+				delete exename;
+				exename=NULL;
+			}
+			if (exepath!=NULL) {
+				delete exepath;
+				exepath=NULL;
+			}
+			if (strpath!=NULL) {		
+				delete strpath;
+				strpath=NULL;
+			}
+			if (pathsep!=NULL) {
+				delete pathsep;
+				pathsep=NULL;
+			}
+			return ;
+		}
+		if (exename!=NULL) {
+			delete exename;
+			exename=NULL;
+		}
+		if (exepath!=NULL) {
+			delete exepath;
+			exepath=NULL;
+		}		
+	}	
+
+	if (strpath!=NULL) {		
+		delete strpath;
+		strpath=NULL;
+	}
+	if (pathsep!=NULL) {
+		delete pathsep;
+		pathsep=NULL;
+	}
+
+	result[0]=(char)0;
+	return;
+}
+
+bool hd24utils::fileExists(const char* strFilename) {
+	struct stat stFileInfo;
+ 	int intStat;
+
+	// Attempt to get the file attributes
+	intStat = stat(strFilename,&stFileInfo);
+	if(intStat == 0) 
+	{
+		// We were able to get the file attributes
+		// so the file obviously exists.
+		return true;
+	}
+	// We were not able to get the file attributes.
+	// This may mean that we don't have permission to
+	// access the folder which contains this file. If you
+	// need to do that level of checking, lookup the
+	// return values of stat which will give you
 	// more details on why stat failed.
 	return false;
 }
@@ -1151,6 +2778,34 @@ bool hd24utils::insafemode()
     return hd24safemode;
 }
 
+double hd24utils::monotonicseconds()
+{
+	/* Seconds since an arbitrary point, from a clock that does not
+	   jump when the system time is changed. Only useful for measuring
+	   elapsed time. */
+#ifdef WINDOWS
+	LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart/(double)freq.QuadPart;
+#endif
+#ifdef DARWIN
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom==0)
+	{
+		mach_timebase_info(&timebase);
+	}
+	return ((double)mach_absolute_time()*(double)timebase.numer)
+		/((double)timebase.denom*1000000000.0);
+#endif
+#ifdef LINUX
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (double)now.tv_sec+(double)now.tv_nsec/1000000000.0;
+#endif
+}
+
 bool hd24utils::wavefix(SoundFileWrapper* sndfile, const char* filetofix)
 {
 #define HEADERSIZE 44
@@ -21,6 +21,7 @@
 #include <config.h>
 #include <stdio.h>
 #include <string>
+#include <vector>
 #include <FL/FLTKstuff.H>
 #include "convertlib.h"
 #include "memutils.h"
@@ -39,6 +40,16 @@ using namespace std;
 class hd24fs;
 class hd24project;
 class hd24song;
+struct hd24rescuejob;
+struct hd24convertjob;
+struct hd24scanjob;
+struct hd24diffjob;
+
+typedef struct 
+{
+	__uint64 offset;	/* relative to the start of the compared ranges */
+	__uint64 length;
+} hd24diffrange;
 
 class hd24utils 
 {	
@@ -65,6 +76,21 @@ class hd24utils
 						int locmode);
 		static void getprogdir(const char* currpath,const char* callpath,char* result);
 		static int isabsolutepath(const char* pathname);
+		static int rescuepass(hd24rescuejob* job,char fromstatus,
+					unsigned long readsize,bool skipahead,
+					char failstatus);
+		static void convertliveranges(hd24convertjob* job,
+					string* sourcefilename,
+					unsigned long endsector);
+		static long lockedreadsectors(hd24fs* fs,void* fslock,
+					unsigned long sectornum,
+					unsigned char* buffer,__uint32 sectors);
+		static void* scanworker(void* workerptr);
+		static void diffreadchunk(hd24diffjob* job,unsigned long chunk);
+		static void* diffreader(void* jobptr);
+		static int diffrun(hd24diffjob* job,vector<hd24diffrange>* diffs,
+					__uint64* result,int* cancel,
+					void (*progress)(__uint64 bytesdone,__uint64 bytestotal));
 
 	public:
 		static const int LOCMODE_NONE;
@@ -93,7 +119,29 @@ class hd24utils
 		static int savedriveimage(hd24fs* currenthd24,string* imagefilename, char* message,int* cancel);
 		static int newdriveimage(string* imagefilename,__uint32 endsector,char* message,int* cancel);
 		static int savedrivesectors(hd24fs* currenthd24,string* imagefilename,unsigned long startsector,unsigned long endsector,char* message,int* cancel);
+		static const int RESCUE_COMPLETE;
+		static const int RESCUE_CANNOTOPEN;
+		static const int RESCUE_CANCELLED;
+		static const int RESCUE_BADSECTORS;
+		static const int RESCUE_WRITEERROR;
+		static int rescuedrivesectors(hd24fs* currenthd24,string* imagefilename,string* mapfilename,unsigned long startsector,unsigned long endsector,int retries,char* message,int* cancel);
+		static int rescuedriveimage(hd24fs* currenthd24,string* imagefilename,string* mapfilename,int retries,char* message,int* cancel);
+		static const int CONVERT_COMPLETE;
+		static const int CONVERT_CANNOTOPEN;
+		static const int CONVERT_CANCELLED;
+		static const int CONVERT_IOERROR;
+		static const int CONVERT_VERIFYFAILED;
+		static int convertdriveimage(string* sourcefilename,string* targetfilename,int threads,bool compress,bool verify,char* message,int* cancel);
+		static __uint64 hashbuffer(unsigned char* buffer,__uint32 bytes);
+		static const int DIFF_COMPLETE;
+		static const int DIFF_CANCELLED;
+		static const int DIFF_NOMEMORY;
+		static int hashsectors(hd24fs* fs,unsigned long firstsector,unsigned long endsector,__uint64* hash,int* cancel,void (*progress)(__uint64 bytesdone,__uint64 bytestotal));
+		static int diffsectors(hd24fs* fs1,unsigned long firstsector1,hd24fs* fs2,unsigned long firstsector2,unsigned long sectors,__uint64* difbytes,vector<hd24diffrange>* diffs,int* cancel,void (*progress)(__uint64 bytesdone,__uint64 bytestotal));
+		static __uint32 findpattern(hd24fs* fs,unsigned char* pattern,__uint32 patternlen,unsigned long firstsector,unsigned long endsector,bool findall,int threads,vector<__uint64>* matches,int* cancel,void (*progress)(__uint64 bytesdone,__uint64 bytestotal));
 		static void interlacetobuffer(unsigned char* sourcebuf,unsigned char* targetbuf, __uint32 totbytes,__uint32 bytespersam,__uint32 trackwithingroup,__uint32 trackspergroup);
+		static bool findaudio(unsigned char* samples,__uint32 samcount,__uint32 threshold,__uint32* firstsam,__uint32* lastsam);
+		static double monotonicseconds();
 		static bool isdir(const char * name);
 		static bool isfile(const char * name);
 #ifdef WINDOWS
@@ -1,6 +1,14 @@
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include "memutils.h"
+#if defined(LINUX) || defined(DARWIN)
+#	include <pthread.h>
+#endif
+#ifdef LINUX
+#	include <sys/mman.h>
+#endif
+
 void* memutils::mymalloc(const char* wherefrom,__uint32 elcount,__uint32 elsize)
 {
 	void* q=calloc(elcount,elsize);
@@ -24,3 +32,308 @@ void memutils::myfree(const char* wherefrom,void* freewhat)
 	free(freewhat);
 }
 
+/* Audio block buffers.
+
+   Songs, transfers and peak generation each need a few buffers of
+   one audio block (getbytesperaudioblock(), some 590 KB), and get
+   and release them over and over during batch transfers. blockalloc
+   hands out such buffers from a pool instead, so that they are not
+   returned to the system (and faulted in again) every time.
+
+   Buffers are aligned to BLOCKALIGN bytes and carry a reference
+   count, which starts at 1. A buffer that is handed on to another
+   stage can be kept alive with blockref; blockfree drops a reference
+   and puts the buffer back in the pool when the last one is gone.
+   Buffers from blockalloc must be released with blockfree, never
+   with myfree.
+
+   Idle buffers are kept up to the pool limit (blockpoollimit) and
+   given back to the system beyond that, or on blocktrim. With
+   blockhugepages (Linux only) new buffers are carved from arenas of
+   transparent huge pages instead; those are never given back, but
+   are reused through the pool like any other buffer. */
+
+#define BLOCKALIGN	64
+#define BLOCKHEADER	64	/* room for memblockheader, keeps data aligned */
+#define BLOCKMAGIC	0x68643234
+#define BLOCKARENA	(32*1024*1024)
+#define HUGEPAGESIZE	(2*1024*1024)
+
+typedef struct memblockheader
+{
+	__uint32 magic;
+	__uint32 bytes;
+	volatile __uint32 refs;
+	__uint32 inarena;
+	void* base;	/* what to free, for buffers not in an arena */
+	struct memblockheader* next;	/* next idle buffer in the pool */
+} memblockheader;
+
+static memblockheader* blockpool=NULL;
+static __uint64 poollimit=64*1024*1024;
+static bool usehugepages=false;
+#ifdef LINUX
+static unsigned char* arenanext=NULL;
+static __uint64 arenaleft=0;
+#endif
+static memblockstats blockcounters;
+#if defined(LINUX) || defined(DARWIN)
+static pthread_mutex_t blocklock=PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void lockblocks()
+{
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_lock(&blocklock);
+#endif
+}
+
+static void unlockblocks()
+{
+#if defined(LINUX) || defined(DARWIN)
+	pthread_mutex_unlock(&blocklock);
+#endif
+}
+
+static memblockheader* blockheader(void* block)
+{
+	if (block==NULL)
+	{
+		return NULL;
+	}
+	memblockheader* header=(memblockheader*)((unsigned char*)block-BLOCKHEADER);
+	if (header->magic!=BLOCKMAGIC)
+	{
+		return NULL;
+	}
+	return header;
+}
+
+static unsigned char* arenaalloc(__uint32 bytes)
+{
+	/* Carves a buffer from the current hugepage arena; called with
+	   the pool locked. Returns NULL if no arena can be had. */
+#ifdef LINUX
+	__uint64 needed=((__uint64)bytes+BLOCKHEADER+BLOCKALIGN-1)&~(__uint64)(BLOCKALIGN-1);
+	if (needed>arenaleft)
+	{
+		__uint64 arenasize=BLOCKARENA;
+		if (needed>arenasize)
+		{
+			arenasize=(needed+HUGEPAGESIZE-1)&~(__uint64)(HUGEPAGESIZE-1);
+		}
+		// over-allocate so the arena can start on a huge page boundary
+		void* map=mmap(NULL,arenasize+HUGEPAGESIZE,PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+		if (map==MAP_FAILED)
+		{
+			return NULL;
+		}
+		unsigned long start=((unsigned long)map+HUGEPAGESIZE-1)&~(unsigned long)(HUGEPAGESIZE-1);
+#ifdef MADV_HUGEPAGE
+		madvise((void*)start,arenasize,MADV_HUGEPAGE);
+#endif
+		arenanext=(unsigned char*)start;
+		arenaleft=arenasize;
+		blockcounters.arenabytes+=arenasize;
+	}
+	unsigned char* buf=arenanext;
+	arenanext+=needed;
+	arenaleft-=needed;
+	return buf;
+#else
+	bytes=0;
+	return NULL;
+#endif
+}
+
+void* memutils::blockalloc(const char* wherefrom,__uint32 bytes,bool clear)
+{
+	/* Returns a buffer of the given size, cleared unless clear is
+	   false (buffers that are always filled before use need not
+	   be). */
+	memblockheader* header=NULL;
+	lockblocks();
+	blockcounters.allocations++;
+	memblockheader** link=&blockpool;
+	while (*link!=NULL)
+	{
+		if ((*link)->bytes==bytes)
+		{
+			header=*link;
+			*link=header->next;
+			blockcounters.reuses++;
+			blockcounters.pooled--;
+			blockcounters.pooledbytes-=bytes;
+			break;
+		}
+		link=&((*link)->next);
+	}
+	bool fresh=false;
+	if ((header==NULL)&&(usehugepages))
+	{
+		unsigned char* buf=arenaalloc(bytes);
+		if (buf!=NULL)
+		{
+			header=(memblockheader*)buf;
+			header->base=NULL;
+			header->inarena=1;
+			fresh=true;	// arena memory starts out cleared
+		}
+	}
+	unlockblocks();
+
+	if (header==NULL)
+	{
+		void* base=calloc(1,(size_t)bytes+BLOCKHEADER+BLOCKALIGN-1);
+		if (base==NULL)
+		{
+			return NULL;
+		}
+		unsigned long start=((unsigned long)base+BLOCKALIGN-1)&~(unsigned long)(BLOCKALIGN-1);
+		header=(memblockheader*)start;
+		header->base=base;
+		header->inarena=0;
+		fresh=true;
+	}
+	header->magic=BLOCKMAGIC;
+	header->bytes=bytes;
+	header->refs=1;
+	header->next=NULL;
+	unsigned char* block=(unsigned char*)header+BLOCKHEADER;
+	if ((clear)&&(!fresh))
+	{
+		memset(block,0,bytes);
+	}
+
+	lockblocks();
+	blockcounters.buffers++;
+	blockcounters.bytesinuse+=bytes;
+	if (blockcounters.bytesinuse>blockcounters.peakbytes)
+	{
+		blockcounters.peakbytes=blockcounters.bytesinuse;
+	}
+	unlockblocks();
+#if (MEMDEBUG==1)
+	cout	<< "BLOCKALLOC: " << wherefrom
+		<< " allocated " << bytes << " bytes at " << (void*)block << endl;
+#else
+	wherefrom=NULL;
+#endif
+	return (void*)block;
+}
+
+void* memutils::blockref(void* block)
+{
+	memblockheader* header=blockheader(block);
+	if (header!=NULL)
+	{
+		__sync_fetch_and_add(&header->refs,1);
+	}
+	return block;
+}
+
+__uint32 memutils::blockrefs(void* block)
+{
+	memblockheader* header=blockheader(block);
+	if (header==NULL)
+	{
+		return 0;
+	}
+	return header->refs;
+}
+
+void memutils::blockfree(const char* wherefrom,void* block)
+{
+#if (MEMDEBUG==1)
+	cout << "BLOCKFREE: " << wherefrom << " free bytes at " << block << endl;
+#else
+	wherefrom=NULL;
+#endif
+	memblockheader* header=blockheader(block);
+	if (header==NULL)
+	{
+		return;
+	}
+	if (__sync_sub_and_fetch(&header->refs,1)!=0)
+	{
+		return;
+	}
+	void* release=NULL;
+	lockblocks();
+	blockcounters.buffers--;
+	blockcounters.bytesinuse-=header->bytes;
+	if ((header->inarena==1)
+	  ||(blockcounters.pooledbytes+header->bytes<=poollimit))
+	{
+		header->next=blockpool;
+		blockpool=header;
+		blockcounters.pooled++;
+		blockcounters.pooledbytes+=header->bytes;
+	} else {
+		header->magic=0;
+		release=header->base;
+		blockcounters.releases++;
+	}
+	unlockblocks();
+	if (release!=NULL)
+	{
+		free(release);
+	}
+}
+
+void memutils::blockpoollimit(__uint64 bytes)
+{
+	/* Most idle memory to keep in the pool, not counting arenas. */
+	lockblocks();
+	poollimit=bytes;
+	unlockblocks();
+}
+
+bool memutils::blockhugepages(bool enable)
+{
+	/* Takes new buffers from hugepage arenas or not. Returns false
+	   if hugepage arenas are not supported here. */
+#ifdef LINUX
+	lockblocks();
+	usehugepages=enable;
+	unlockblocks();
+	return true;
+#else
+	usehugepages=false;
+	return (!enable);
+#endif
+}
+
+void memutils::blocktrim()
+{
+	/* Gives all idle buffers back to the system (arena buffers stay). */
+	lockblocks();
+	memblockheader* keep=NULL;
+	memblockheader* header=blockpool;
+	while (header!=NULL)
+	{
+		memblockheader* next=header->next;
+		if (header->inarena==1)
+		{
+			header->next=keep;
+			keep=header;
+		} else {
+			blockcounters.pooled--;
+			blockcounters.pooledbytes-=header->bytes;
+			blockcounters.releases++;
+			header->magic=0;
+			free(header->base);
+		}
+		header=next;
+	}
+	blockpool=keep;
+	unlockblocks();
+}
+
+void memutils::blockstats(memblockstats* stats)
+{
+	lockblocks();
+	*stats=blockcounters;
+	unlockblocks();
+}
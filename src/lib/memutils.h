@@ -4,12 +4,34 @@
 using namespace std;
 #include "config.h"
 
+typedef struct
+{
+	__uint64 allocations;	/* blockalloc calls */
+	__uint64 reuses;	/* ...of which served from the pool */
+	__uint64 releases;	/* buffers given back to the system */
+	__uint32 buffers;	/* buffers handed out now */
+	__uint32 pooled;	/* idle buffers kept for reuse */
+	__uint64 bytesinuse;
+	__uint64 peakbytes;
+	__uint64 pooledbytes;
+	__uint64 arenabytes;	/* hugepage arena memory, see blockhugepages */
+} memblockstats;
+
 class memutils
 {
 public:
 		static void* mymalloc(const char* wherefrom,__uint32 elcount,__uint32 elsize);
 		static void myfree(const char* wherefrom,void* freewhat);
+
+		/* Pooled, aligned buffers for audio blocks; see memutils.cpp */
+		static void* blockalloc(const char* wherefrom,__uint32 bytes,bool clear=true);
+		static void* blockref(void* block);
+		static void blockfree(const char* wherefrom,void* block);
+		static __uint32 blockrefs(void* block);
+		static void blockpoollimit(__uint64 bytes);
+		static bool blockhugepages(bool enable);
+		static void blocktrim();
+		static void blockstats(memblockstats* stats);
 };
 
 #endif
-
@@ -229,11 +229,13 @@ void PortAudioWrapper::define_functions(LIBHANDLE_T* handle)
 	libloaded=true;
 }
 
-SoundFileWrapper::SoundFileWrapper(char* absprogpath)
+SoundFileWrapper::SoundFileWrapper(char* absprogpath,bool p_showerrors)
 {
 	sf_open=NULL;
 	sf_close=NULL;
 	libloaded=false;
+	libhandle=NULL;
+	showerrors=p_showerrors;
 
 	char result[2048];
 //	TODO: Was there a reason why this said PORTAUDIO?
@@ -244,13 +246,13 @@ SoundFileWrapper::SoundFileWrapper(char* absprogpath)
 	abslib+=result;
 	abslib+=LIBFILE_SNDFILE;
 	LIBHANDLE_T* handle=dlopen(abslib.c_str(),RTLD_NOW);
-	if (handle==NULL) {
+	if ((handle==NULL)&&(showerrors)) {
 		fl_message("%s",dlerror()); 
 	}
 	if (handle==NULL) {
 		handle=dlopen(LIBFILE_SNDFILE,RTLD_NOW);
 		if (handle==NULL) {
-			fl_message("%s",dlerror()); 
+			if (showerrors) fl_message("%s",dlerror()); 
 		} else {
 			define_functions(handle);
 		}
@@ -274,7 +276,7 @@ void SoundFileWrapper::define_functions(LIBHANDLE_T* handle)
 	libhandle=handle;
 	// Given a handle to a dynamic library, define functions that are in it.
 	sf_open=(SNDFILE*(*)(const char*,int,SF_INFO*))dlsym(handle,"sf_open");
-	if (sf_open==NULL) {
+	if ((sf_open==NULL)&&(showerrors)) {
 		fl_message("Unable to load libsndfile, file transfers won't work.");
 	}
 	sf_close=(int(*)(SNDFILE*))dlsym(handle,"sf_close");
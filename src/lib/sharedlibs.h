@@ -57,10 +57,11 @@ public:
 	sf_count_t (*sf_write_raw)(SNDFILE*,const void*,sf_count_t);
 	sf_count_t (*sf_write_float)(SNDFILE*,const void*,sf_count_t);
 	void define_functions(LIBHANDLE_T* handle);
-	SoundFileWrapper(char* absprogpath);
+	SoundFileWrapper(char* absprogpath,bool showerrors=true);
 	~SoundFileWrapper();
 	int libloaded;
 	void* libhandle;
+	bool showerrors;	/* false for programs without a window */
 };
 
 class JackWrapper:SmartLoader
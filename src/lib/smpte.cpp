@@ -1,15 +1,18 @@
+#include <string.h>
 #include "smpte.h"
 #include "memutils.h"
+#include "hd24fs.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 SMPTEgenerator::SMPTEgenerator(__uint32 p_samplerate)
 {
 #if (SMPTE_DEBUG==1)
 	cout << "Construct SMPTE generator with samrate=" << p_samplerate << endl;
 #endif
-//	this->lastframe=-1;
-	this->prevbitnum=-1;
-	this->prevhalfbit=-1;
-	this->haveframe=0;
-	this->prevoutval=0;
+	this->haveframe=false;
+	this->currentframe=0;
+	this->framelevels=NULL;
 	this->framerate=30; // 30 is default for HD24.
 	this->bitsperframe=80;
 	this->nondrop=1;
@@ -44,6 +47,11 @@ SMPTEgenerator::~SMPTEgenerator()
 	{
 		return;
 	}
+	if (framelevels!=NULL)
+	{
+		memutils::myfree("SMPTE framelevels",framelevels);
+		framelevels=NULL;
+	}
 	if (smpteword==NULL)
 	{
 		return;
@@ -55,7 +63,21 @@ void SMPTEgenerator::recalcrates()
 {
 
 	this->bitspersecond=bitsperframe*framerate;
+	this->samplesperframe=(int)((this->samplerate)/framerate);
 
+	/* Spread the samples of a frame over its bits. When the frame 
+	   length is not a multiple of the bit count (such as at 44.1 kHz)
+	   some bits are one sample longer than others. */
+	for (int i=0;i<=bitsperframe;i++)
+	{
+		this->bitstart[i]=(i*samplesperframe)/bitsperframe;
+	}
+	if (framelevels!=NULL)
+	{
+		memutils::myfree("SMPTE framelevels",framelevels);
+	}
+	this->framelevels=(unsigned char*)memutils::mymalloc("SMPTE framelevels",samplesperframe,1);
+	this->haveframe=false;
 }
 
 void SMPTEgenerator::setsamplerate(__uint32 p_samplerate)
@@ -177,48 +199,441 @@ void SMPTEgenerator::fillword(int hour,int minute,int second,int frame)
 	return;
 
 }
-int SMPTEgenerator::modulate(int currbitval,int bitnum,int halfbit)
+void SMPTEgenerator::renderframe(__uint32 second,__uint32 frame)
 {
-	if ((bitnum!=this->prevbitnum) || ((halfbit!=this->prevhalfbit) && (currbitval==1)))
+	/* Renders the biphase mark waveform of a full frame: the level
+	   changes at the start of every bit, and halfway for '1' bits. 
+	   The parity bit keeps the number of changes per frame even, so 
+	   every frame starts at the same level. */
+	__uint32 hour=second/3600;
+	second-=3600*hour;
+	__uint32 minute=second/60;
+	second-=60*minute;
+	this->fillword(hour,minute,second,frame);
+
+	unsigned char level=0;
+	for (int bit=0;bit<bitsperframe;bit++)
+	{
+		int start=bitstart[bit];
+		int len=bitstart[bit+1]-start;
+		level^=1;
+		if (smpteword[bit]==0)
+		{
+			memset(&framelevels[start],level,len);
+			continue;
+		}
+		int half=len/2;
+		memset(&framelevels[start],level,half);
+		level^=1;
+		memset(&framelevels[start+half],level,len-half);
+	}
+}
+
+void SMPTEgenerator::getbits(__uint32 firstsamnum,__uint32 samples,unsigned char* bits)
+{
+	/* Fills bits[] with the LTC signal level (0 or 1) of 'samples'
+	   samples starting at sample firstsamnum. Frames are rendered 
+	   once and then copied, so this costs next to nothing per sample. */
+	if (framelevels==NULL)
+	{
+		return;
+	}
+	__uint32 samnum=firstsamnum;
+	while (samples>0)
 	{
-		this->prevoutval=1-(this->prevoutval);
+		__uint32 sampleinsecond=samnum % this->samplerate;
+		__uint32 second=samnum / this->samplerate;
+		__uint32 frame=sampleinsecond / this->samplesperframe;
+		__uint32 sampleinframe=sampleinsecond-(frame*this->samplesperframe);
+		/* (frame may equal framerate for the last few samples of a 
+		   second if the sample rate is not a multiple of it) */
+		__uint32 framenum=(second*(framerate+1))+frame;
+		if ((!haveframe) || (framenum!=currentframe))
+		{
+			this->renderframe(second,frame);
+			this->currentframe=framenum;
+			this->haveframe=true;
+		}
+		__uint32 count=this->samplesperframe-sampleinframe;
+		if (count>samples)
+		{
+			count=samples;
+		}
+		memcpy(bits,&framelevels[sampleinframe],count);
+		bits+=count;
+		samnum+=count;
+		samples-=count;
 	}
-	this->prevbitnum=bitnum;
-	this->prevhalfbit=halfbit;
-	return this->prevoutval;
 }
 
 int SMPTEgenerator::getbit(__uint32 insamnum)
 {
+	unsigned char bit=0;
+	this->getbits(insamnum,1,&bit);
+	return bit;
+}
 
-	this->samplesperbit=(int)((this->samplerate)/this->bitspersecond);
-	this->samplesperframe=(int)((this->samplerate)/framerate);
+SMPTEdecoder::SMPTEdecoder(__uint32 p_samplerate)
+{
+	/* signbits[x] holds the sign bits of the 4 samples of which
+	   x holds the byte signs (bits 2, 5, 8 and 11) */
+	for (int i=0;i<4096;i++)
+	{
+		signbits[i]=((i>>2)&1)|((i>>4)&2)|((i>>6)&4)|((i>>8)&8);
+	}
+	this->reset(p_samplerate);
+}
+
+SMPTEdecoder::~SMPTEdecoder()
+{
+	frames.clear();
+}
+
+void SMPTEdecoder::reset(__uint32 p_samplerate)
+{
+	this->samplerate=p_samplerate;
+	this->reset();
+}
+
+void SMPTEdecoder::reset()
+{
+	// Start out expecting 30 fps (80 bits per frame).
+	this->bitlength=(samplerate<<8)/2400;
+	this->samnum=0;
+	this->lastsign=0;
+	this->lastedge=0;
+	this->haveedge=false;
+	this->halfbit=false;
+	this->halfbitstart=0;
+	this->wordlow=0;
+	this->wordhigh=0;
+	this->bitcount=0;
+	frames.clear();
+}
+
+void SMPTEdecoder::decodeword()
+{
+	int frameunits=(int)(wordlow & 0xF);
+	int frametens=(int)((wordlow>>8) & 0x3);
+	int secondsunits=(int)((wordlow>>16) & 0xF);
+	int secondstens=(int)((wordlow>>24) & 0x7);
+	int minuteunits=(int)((wordlow>>32) & 0xF);
+	int minutetens=(int)((wordlow>>40) & 0x7);
+	int hourunits=(int)((wordlow>>48) & 0xF);
+	int hourtens=(int)((wordlow>>56) & 0x3);
+	if ((frameunits>9)||(secondsunits>9)||(minuteunits>9)||(hourunits>9)
+	  ||(secondstens>5)||(minutetens>5))
+	{
+		// not a valid timecode, probably noise that happened to
+		// look like a sync word.
+		return;
+	}
+	SMPTEframe tc;
+	tc.samnum=bitstarts[bitcount%80];
+	tc.hour=hourtens*10+hourunits;
+	tc.minute=minutetens*10+minuteunits;
+	tc.second=secondstens*10+secondsunits;
+	tc.frame=frametens*10+frameunits;
+#if (SMPTE_DEBUG==1)
+	cout << "LTC frame at " << tc.samnum << ": " 
+	<< tc.hour << ":" << tc.minute << ":" << tc.second << "." << tc.frame << endl;
+#endif
+	frames.push_back(tc);
+}
+
+void SMPTEdecoder::pushbit(int bit,__uint32 startsam)
+{
+	/* Bits arrive least significant first; after 80 bits the first
+	   one has been shifted down to bit 0 of wordlow. */
+	wordlow=(wordlow>>1)|(((__uint64)(wordhigh&1))<<63);
+	wordhigh=(wordhigh>>1)|(((__uint32)bit)<<15);
+	bitstarts[bitcount%80]=startsam;
+	bitcount++;
+	if ((bitcount>=80) && (wordhigh==0xBFFC))
+	{
+		// sync word 0011111111111101 completes a frame
+		this->decodeword();
+	}
+}
+
+void SMPTEdecoder::edge(__uint32 edgesam)
+{
+	/* In biphase mark code the level changes at the start of every 
+	   bit, and halfway for '1' bits. So a full bit length between 
+	   changes is a '0', two half bit lengths are a '1'. */
+	if (!haveedge)
+	{
+		haveedge=true;
+		lastedge=edgesam;
+		halfbit=false;
+		return;
+	}
+	__uint32 interval=(edgesam-lastedge)<<8;
+	if (interval<(bitlength/4))
+	{
+		// too short to be LTC, ignore as a glitch
+		return;
+	}
+	__uint32 start=lastedge;
+	lastedge=edgesam;
+	if (interval>(bitlength*2))
+	{
+		// signal lost, start over
+		halfbit=false;
+		return;
+	}
+	if (interval<((bitlength*3)/4))
+	{
+		if (!halfbit)
+		{
+			halfbit=true;
+			halfbitstart=start;
+			return;
+		}
+		halfbit=false;
+		interval=(edgesam-halfbitstart)<<8;
+		start=halfbitstart;
+		this->pushbit(1,start);
+	} else {
+		// a lone half bit means we were out of step
+		halfbit=false;
+		this->pushbit(0,start);
+	}
+	// follow the actual bit rate (frame rate, varispeed)
+	bitlength=(bitlength*7+interval)/8;
+	__uint32 minlength=(samplerate<<8)/3000;
+	__uint32 maxlength=(samplerate<<8)/1600;
+	if (bitlength<minlength)
+	{
+		bitlength=minlength;
+	}
+	if (bitlength>maxlength)
+	{
+		bitlength=maxlength;
+	}
+}
+
+void SMPTEdecoder::signchanges(unsigned int changes,__uint32 firstsam)
+{
+	while (changes!=0)
+	{
+#if defined(__GNUC__)
+		int i=__builtin_ctz(changes);
+#else
+		int i=0;
+		while (((changes>>i)&1)==0)
+		{
+			i++;
+		}
+#endif
+		this->edge(firstsam+i);
+		changes&=(changes-1);
+	}
+}
+
+void SMPTEdecoder::decode(unsigned char* samples,__uint32 count)
+{
+	/* Decodes 'count' 24 bit little endian samples, following 
+	   the ones of the previous call. Only the sign of each sample
+	   is used. */
+	__uint32 i=0;
+	for (;i+16<=count;i+=16)
+	{
+		unsigned char* sam=&samples[i*3];
+#if defined(__SSE2__)
+		/* Take the top bit of all 48 bytes at once, then pick the 
+		   most significant byte of each sample from those. */
+		__uint64 bytesigns=
+			((__uint64)(unsigned int)_mm_movemask_epi8(_mm_loadu_si128((__m128i*)&sam[0])))
+			|(((__uint64)(unsigned int)_mm_movemask_epi8(_mm_loadu_si128((__m128i*)&sam[16])))<<16)
+			|(((__uint64)(unsigned int)_mm_movemask_epi8(_mm_loadu_si128((__m128i*)&sam[32])))<<32);
+		unsigned int signs=signbits[bytesigns & 0xFFF]
+			|(signbits[(bytesigns>>12) & 0xFFF]<<4)
+			|(signbits[(bytesigns>>24) & 0xFFF]<<8)
+			|(signbits[(bytesigns>>36) & 0xFFF]<<12);
+#else
+		unsigned int signs=0;
+		for (int j=0;j<16;j++)
+		{
+			signs|=((unsigned int)(sam[j*3+2]>>7))<<j;
+		}
+#endif
+		unsigned int changes=(signs^((signs<<1)|lastsign)) & 0xFFFF;
+		lastsign=(signs>>15);
+		if (changes!=0)
+		{
+			this->signchanges(changes,samnum+i);
+		}
+	}
+	for (;i<count;i++)
+	{
+		int sign=samples[i*3+2]>>7;
+		if (sign!=lastsign)
+		{
+			this->edge(samnum+i);
+		}
+		lastsign=sign;
+	}
+	samnum+=count;
+}
 
-	__uint32 sampleinsecond=insamnum % this->samplerate;
-	__uint32 currentsecond=(insamnum-sampleinsecond)/(this->samplerate);
-	__uint32 currenthour=int(currentsecond/3600);
-	currentsecond-=3600*currenthour;
-	__uint32 currentminute=int(currentsecond/60);
-	currentsecond-=60*currentminute;
+__uint32 SMPTEdecoder::scansong(hd24song* song,__uint32 tracknum,int* cancel)
+{
+	/* Builds the timecode map of a whole song from the given track 
+	   (1-based). Only that track is read from disk, a block at a 
+	   time. Returns the number of frames found. */
+	this->reset(song->samplerate());
+	if ((tracknum<1)||(tracknum>song->logical_channels()))
+	{
+		return 0;
+	}
+	hd24fs* fs=song->fs();
+	if (fs==NULL)
+	{
+		return 0;
+	}
+	__uint32 blocksize=fs->getbytesperaudioblock();
+	__uint32 bytespersam=song->bitdepth()/8;
+	__uint32 logical_channels=song->logical_channels();
+	__uint32 samplesperlogicalchannel=(blocksize/logical_channels)/bytespersam;
+	__uint32 songlen=song->songlength_in_wamples()*song->chanmult();
+	bool mustdeinterlace=(song->chanmult()>1);
 
-	__uint32 currentframe=(int)(sampleinsecond/this->samplesperframe);
-	__uint32 sampleinframe=sampleinsecond-(currentframe*this->samplesperframe);
-	__uint32 bitinframe=(int)(sampleinframe/this->samplesperbit);
-	__uint32 subbit=(int)(sampleinframe-(bitinframe*this->samplesperbit));
-	__uint32 halfbit=(this->samplesperbit/2);
-	if ((bitinframe==0)&&(subbit==0))
-	{	
-		this->haveframe=0;
+	unsigned char* audiodata=(unsigned char*)memutils::mymalloc("SMPTEdecoder::scansong",blocksize,1);
+	unsigned char* deinterlacedata=NULL;
+	if (mustdeinterlace)
+	{
+		deinterlacedata=(unsigned char*)memutils::mymalloc("SMPTEdecoder::scansong",blocksize,1);
 	}
-	if (this->haveframe==0)
+	if ((audiodata==NULL)||((mustdeinterlace)&&(deinterlacedata==NULL)))
 	{
-		this->fillword(currenthour,currentminute,currentsecond,currentframe);
-		this->haveframe=1;
+		if (audiodata!=NULL) memutils::myfree("SMPTEdecoder::scansong",audiodata);
+		if (deinterlacedata!=NULL) memutils::myfree("SMPTEdecoder::scansong",deinterlacedata);
+		return 0;
 	}
 
-	if (subbit<halfbit) {
-		return this->modulate(smpteword[bitinframe],bitinframe,0);
+	for (__uint32 i=1;i<=logical_channels;i++)
+	{
+		song->readenabletrack(i,(i==tracknum));
+	}
+	__uint32 trackoffset=(tracknum-1)*samplesperlogicalchannel*bytespersam;
+	for (__uint32 samplenum=0;samplenum<songlen;samplenum+=samplesperlogicalchannel)
+	{
+		if (cancel!=NULL)
+		{
+			if (*cancel==1)
+			{
+				break;
+			}
+		}
+		__uint32 samsincurrblock=samplesperlogicalchannel;
+		if (samplenum+samsincurrblock>songlen)
+		{
+			samsincurrblock=songlen-samplenum;
+		}
+		song->getmtrackaudiodata(samplenum,samsincurrblock,audiodata,hd24song::READMODE_COPY);
+		unsigned char* trackdata=&audiodata[trackoffset];
+		if (mustdeinterlace)
+		{
+			song->deinterlaceblock(audiodata,deinterlacedata);
+			trackdata=&deinterlacedata[trackoffset];
+		}
+		this->decode(trackdata,samsincurrblock);
+	}
+	for (__uint32 i=1;i<=logical_channels;i++)
+	{
+		song->readenabletrack(i,true);
 	}
-	return this->modulate(smpteword[bitinframe],bitinframe,1);
+	memutils::myfree("SMPTEdecoder::scansong",audiodata);
+	if (deinterlacedata!=NULL)
+	{
+		memutils::myfree("SMPTEdecoder::scansong",deinterlacedata);
+	}
+	return this->framecount();
+}
+
+__uint32 SMPTEdecoder::framecount()
+{
+	return frames.size();
 }
 
+SMPTEframe* SMPTEdecoder::getframe(__uint32 framenum)
+{
+	if (framenum>=frames.size())
+	{
+		return NULL;
+	}
+	return &frames[framenum];
+}
+
+SMPTEframe* SMPTEdecoder::framefor(__uint32 p_samnum)
+{
+	/* Returns the frame that sample p_samnum is part of, or NULL 
+	   if there was no timecode at that point. */
+	__uint32 count=frames.size();
+	if ((count==0)||(p_samnum<frames[0].samnum))
+	{
+		return NULL;
+	}
+	__uint32 low=0;
+	__uint32 high=count-1;
+	while (low<high)
+	{
+		__uint32 mid=(low+high+1)/2;
+		if (frames[mid].samnum<=p_samnum)
+		{
+			low=mid;
+		} else {
+			high=mid-1;
+		}
+	}
+	// no frame is longer than 1/24 second
+	if ((p_samnum-frames[low].samnum)>=(__uint32)(samplerate/24)+1)
+	{
+		return NULL;
+	}
+	return &frames[low];
+}
+
+bool SMPTEdecoder::findtimecode(int hour,int minute,int second,int frame,__uint32* p_samnum)
+{
+	/* Finds the sample at which the given timecode starts. If that
+	   frame itself was not decoded, its position is extrapolated 
+	   from the decoded frame closest to it. */
+	__uint32 count=frames.size();
+	if (count==0)
+	{
+		return false;
+	}
+	int fps=1;
+	for (__uint32 i=0;i<count;i++)
+	{
+		if (frames[i].frame>=fps)
+		{
+			fps=frames[i].frame+1;
+		}
+	}
+	__sint64 target=((((__sint64)hour*60)+minute)*60+second)*fps+frame;
+	__uint32 nearest=0;
+	__sint64 nearestdist=0;
+	for (__uint32 i=0;i<count;i++)
+	{
+		__sint64 framenum=((((__sint64)frames[i].hour*60)+frames[i].minute)*60+frames[i].second)*fps+frames[i].frame;
+		__sint64 dist=target-framenum;
+		__sint64 absdist=(dist<0)?-dist:dist;
+		__sint64 absnearest=(nearestdist<0)?-nearestdist:nearestdist;
+		if ((i==0)||(absdist<absnearest))
+		{
+			nearest=i;
+			nearestdist=dist;
+			if (dist==0) break;
+		}
+	}
+	__sint64 sam=(__sint64)frames[nearest].samnum+(nearestdist*samplerate)/fps;
+	if (sam<0)
+	{
+		return false;
+	}
+	*p_samnum=(__uint32)sam;
+	return true;
+}
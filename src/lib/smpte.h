@@ -5,37 +5,89 @@ using namespace std;
 #include "config.h"
 #include <string>
 #include <iostream>
+#include <vector>
+
+class hd24song;
 
 class SMPTEgenerator
 {
 	private:		
 
 		short* smpteword;
-		int prevbitnum;
-		int prevhalfbit;
-		int prevoutval;
 		int framerate;
 		int nondrop;
-		int haveframe; // indicates if a new frame word must be generated
 		int samplerate;
 
 		/* These are pre-calculated: */
 		int bitsperframe;
 		int bitspersecond;
-		int samplesperbit;
 		int samplesperframe;
+		int bitstart[81];	// first sample of each bit within a frame
+		unsigned char* framelevels; // waveform of the current frame
+		__uint32 currentframe;	// frame number held in framelevels
+		bool haveframe;
 		void recalcrates();
 		void fillword(int hour,int min,int sec,int frame);
+		void renderframe(__uint32 second,__uint32 frame);
 
 		void setsamplerate(__uint32 p_samplerate);
 		void setframerate(__uint32 p_samplerate);
 
-		int modulate(int currbitval,int bitnum,int halfbit);
 	public:
 		SMPTEgenerator(__uint32 p_samplerate);
 		~SMPTEgenerator();
 		int getbit(__uint32 insamnum);
+		void getbits(__uint32 firstsamnum,__uint32 samples,unsigned char* bits);
+
+};
+
+typedef struct
+{
+	__uint32 samnum;	// first sample of the frame
+	int hour;
+	int minute;
+	int second;
+	int frame;
+} SMPTEframe;
 
+class SMPTEdecoder
+{
+	/* Reads LTC back from audio. Level changes are found from the
+	   sign of the samples, the intervals between them are decoded as
+	   biphase mark bits and every frame that ends in a valid sync 
+	   word is added to a sample-to-timecode map. */
+	private:
+		int samplerate;
+		__uint32 bitlength;	// measured bit length, in 1/256 samples
+		__uint32 samnum;	// sample number of the next input sample
+		int lastsign;
+		__uint32 lastedge;	// sample of the last level change
+		bool haveedge;
+		bool halfbit;		// first half of a '1' bit seen
+		__uint32 halfbitstart;
+		__uint64 wordlow;	// bits 0..63 of the last 80 bits received
+		__uint32 wordhigh;	// bits 64..79
+		__uint32 bitcount;
+		__uint32 bitstarts[80];	// first sample of the last 80 bits
+		unsigned char signbits[4096];
+		vector<SMPTEframe> frames;
+
+		void edge(__uint32 edgesam);
+		void pushbit(int bit,__uint32 startsam);
+		void decodeword();
+		void signchanges(unsigned int changes,__uint32 firstsam);
+
+	public:
+		SMPTEdecoder(__uint32 p_samplerate);
+		~SMPTEdecoder();
+		void reset();
+		void reset(__uint32 p_samplerate);
+		void decode(unsigned char* samples,__uint32 count);
+		__uint32 scansong(hd24song* song,__uint32 tracknum,int* cancel);
+		__uint32 framecount();
+		SMPTEframe* getframe(__uint32 framenum);
+		SMPTEframe* framefor(__uint32 samnum);
+		bool findtimecode(int hour,int minute,int second,int frame,__uint32* samnum);
 };
 
 #endif
@@ -0,0 +1,444 @@
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef WINDOWS
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#include <convertlib.h>
+#include <memutils.h>
+#include <hd24fs.h>
+#include <hd24utils.h>
+#include <hd24sndfile.h>
+#include <smpte.h>
+#include <ui_mixer.h>
+
+/* Microbenchmark for the inner loops that every transfer goes through.
+   Each kernel runs on synthetic data until it has been busy for the
+   given time, after which time per sample and throughput are reported.
+   Throughput counts the bytes each kernel reads per call (for the
+   timecode generator: the bytes of signal it produces).
+
+   The song kernels (deinterlace/interlace of high sample rate blocks)
+   need a song on a drive, so a scratch drive image of the minimum size
+   (about 700 MB) is created for them and removed afterwards. Before
+   timing them, their output is checked against plain byte by byte
+   copies; on a mismatch kernelbench exits with a non-zero status. */
+
+using namespace std;
+
+#define BENCH_SAMPLES	(1024*1024)	/* samples per call for the buffer kernels */
+
+string scratchfilename;
+double mintime=0.5;
+bool songkernels=true;
+volatile __uint32 sink;		/* keeps results of the read kernels alive */
+
+void showusage()
+{
+	cout << "Usage: kernelbench [options]" << endl
+	     << "Options:" << endl
+	     << "  --time=<ms>       minimum run time per kernel (default 500)" << endl
+	     << "  --scratch=<file>  scratch drive image for the song kernels" << endl
+	     << "                    (default: kernelbench.h24 in the temp dir)" << endl
+	     << "  --nosong          skip the song kernels (no scratch image)" << endl;
+}
+
+int parsecommandline(int argc, char **argv)
+{
+	int invalid = 0;
+
+	for (int c = 1; c < argc; c++) {
+		string arg = argv[c];
+
+		if (arg.substr(0,strlen("--time=")) == "--time=") {
+			mintime = (double)Convert::str2long(arg.substr(strlen("--time=")))/1000.0;
+			if (mintime <= 0) {
+				invalid = 1;
+			}
+			continue;
+		}
+
+		if (arg.substr(0,strlen("--scratch=")) == "--scratch=") {
+			scratchfilename = arg.substr(strlen("--scratch="));
+			continue;
+		}
+
+		if (arg == "--nosong") {
+			songkernels = false;
+			continue;
+		}
+
+		cout << "Invalid argument: " << arg << endl;
+		invalid = 1;
+	}
+	return invalid;
+}
+
+double seconds()
+{
+#ifdef WINDOWS
+	LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart/(double)freq.QuadPart;
+#else
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return (double)tv.tv_sec+(double)tv.tv_usec/1000000.0;
+#endif
+}
+
+void report(const char* kernel,double elapsed,__uint64 samples,__uint64 bytes)
+{
+	double nspersample=(elapsed*1000000000.0)/(double)samples;
+	double gbpersec=((double)bytes/elapsed)/1000000000.0;
+	printf("%-34s %10.3f ns/sample %8.3f GB/s\n",kernel,nspersample,gbpersec);
+	fflush(stdout);
+}
+
+/* Each kernel below is called once per round, rounds are repeated
+   until mintime has passed. */
+
+typedef struct
+{
+	unsigned char* source;
+	unsigned char* target;
+	__uint32 samples;		// per call
+	__uint32 bytes;			// per call
+	hd24song* song;
+	hd24sndfile* sndfile;
+	SMPTEgenerator* smpte;
+	MixerChannelControl* channel;
+	double* filterdata;
+	__uint32 samnum;
+} benchdata;
+
+void kernel_getint24(benchdata* d)
+{
+	__uint32 sum=0;
+	__uint32 bytes=d->samples*3;
+	for (__uint32 i=0;i<bytes;i+=3)
+	{
+		sum+=Convert::getint24(d->source,i);
+	}
+	sink+=sum;
+}
+
+void kernel_getint32(benchdata* d)
+{
+	__uint32 sum=0;
+	__uint32 bytes=d->samples*4;
+	for (__uint32 i=0;i<bytes;i+=4)
+	{
+		sum+=Convert::getint32(d->source,i);
+	}
+	sink+=sum;
+}
+
+void kernel_fstfix(benchdata* d)
+{
+	// swaps in place; the data stays as random as it was
+	hd24fs::fstfix(d->source,d->bytes);
+}
+
+void kernel_deinterlaceblock(benchdata* d)
+{
+	d->song->deinterlaceblock(d->source,d->target);
+}
+
+void kernel_interlaceblock(benchdata* d)
+{
+	d->song->interlaceblock(d->source,d->target);
+}
+
+void kernel_interlacetobuffer(benchdata* d)
+{
+	// one stereo pair: both tracks of the group
+	hd24utils::interlacetobuffer(d->source,d->target,d->bytes/2,3,0,2);
+	hd24utils::interlacetobuffer(d->source+d->bytes/2,d->target,d->bytes/2,3,1,2);
+}
+
+void kernel_aiffbyteswap(benchdata* d)
+{
+	// no file handle: writerawbuf only swaps the byte order
+	d->sndfile->writerawbuf(d->source,d->bytes);
+}
+
+void kernel_filtercell(benchdata* d)
+{
+	double* buf=d->filterdata;
+	for (__uint32 i=0;i<d->samples;i++)
+	{
+		buf[i]=d->channel->FilterCell(0,buf[i],1600,1,6,7);
+	}
+}
+
+void kernel_smptegetbit(benchdata* d)
+{
+	__uint32 sum=0;
+	for (__uint32 i=0;i<d->samples;i++)
+	{
+		sum+=d->smpte->getbit(d->samnum+i);
+	}
+	d->samnum+=d->samples;
+	sink+=sum;
+}
+
+void kernel_smptegetbits(benchdata* d)
+{
+	d->smpte->getbits(d->samnum,d->samples,d->target);
+	d->samnum+=d->samples;
+}
+
+void runbench(const char* kernel,void (*run)(benchdata*),benchdata* d)
+{
+	run(d); // warm up caches and lazily initialized state
+	__uint64 rounds=0;
+	double start=seconds();
+	double elapsed=0;
+	do {
+		run(d);
+		rounds++;
+		elapsed=seconds()-start;
+	} while (elapsed<mintime);
+	report(kernel,elapsed,rounds*d->samples,rounds*d->bytes);
+}
+
+void fillbuffer(unsigned char* buf,__uint32 bytes)
+{
+	__uint32 seed=12345;
+	for (__uint32 i=0;i<bytes;i++)
+	{
+		seed=seed*1103515245+12345;
+		buf[i]=(unsigned char)(seed>>16);
+	}
+}
+
+string defaultscratchname()
+{
+#ifdef WINDOWS
+	const char* dir=getenv("TEMP");
+	char slash='\\';
+#else
+	const char* dir=getenv("TMPDIR");
+	char slash='/';
+	if (dir==NULL)
+	{
+		dir="/tmp";
+	}
+#endif
+	string name="";
+	if (dir!=NULL)
+	{
+		name=dir;
+		if ((name.length()>0)&&(name[name.length()-1]!=slash))
+		{
+			name+=slash;
+		}
+	}
+	name+="kernelbench.h24";
+	return name;
+}
+
+/* Reference versions of the song kernels, one byte at a time */
+
+void reference_deinterlace(hd24song* song,unsigned char* source,unsigned char* target,
+			__uint32 blockbytes)
+{
+	__uint32 doubleblock=blockbytes/song->logical_channels();
+	__uint32 halfblock=blockbytes/song->physical_channels();
+	__uint32 bps=song->bitdepth()/8;
+	for (__uint32 ch=0;ch<song->logical_channels();ch++)
+	{
+		__uint32 choffset=ch*doubleblock;
+		for (__uint32 i=0;i<halfblock/bps;i++)
+		{
+			for (__uint32 j=0;j<bps;j++)
+			{
+				target[2*i*bps+choffset+j]=source[i*bps+choffset+j];
+				target[2*i*bps+choffset+j+bps]=source[i*bps+choffset+j+halfblock];
+			}
+		}
+	}
+}
+
+void reference_interlace(hd24song* song,unsigned char* source,unsigned char* target,
+			__uint32 blockbytes)
+{
+	__uint32 doubleblock=blockbytes/song->logical_channels();
+	__uint32 halfblock=blockbytes/song->physical_channels();
+	__uint32 bps=song->bitdepth()/8;
+	for (__uint32 ch=0;ch<song->logical_channels();ch++)
+	{
+		__uint32 choffset=ch*doubleblock;
+		for (__uint32 i=0;i<halfblock/bps;i++)
+		{
+			for (__uint32 j=0;j<bps;j++)
+			{
+				target[i*bps+choffset+j]=source[2*i*bps+choffset+j];
+				target[i*bps+choffset+j+halfblock]=source[2*i*bps+choffset+j+bps];
+			}
+		}
+	}
+}
+
+bool checksongkernels(hd24song* song,unsigned char* source,unsigned char* target,
+			__uint32 blockbytes)
+{
+	unsigned char* expect=(unsigned char*)memutils::mymalloc("kernelbench",blockbytes,1);
+	if (expect==NULL)
+	{
+		return false;
+	}
+	bool ok=true;
+	memset(target,0,blockbytes);
+	memset(expect,0,blockbytes);
+	song->deinterlaceblock(source,target);
+	reference_deinterlace(song,source,expect,blockbytes);
+	if (memcmp(target,expect,blockbytes)!=0)
+	{
+		cout << "hd24song::deinterlaceblock output differs from the reference" << endl;
+		ok=false;
+	}
+	memset(target,0,blockbytes);
+	memset(expect,0,blockbytes);
+	song->interlaceblock(source,target);
+	reference_interlace(song,source,expect,blockbytes);
+	if (memcmp(target,expect,blockbytes)!=0)
+	{
+		cout << "hd24song::interlaceblock output differs from the reference" << endl;
+		ok=false;
+	}
+	memutils::myfree("kernelbench",expect);
+	return ok;
+}
+
+bool benchsongkernels(benchdata* d,__uint32 samplerate,__uint32 tracks)
+{
+	bool ok=true;
+	char message[2048];
+	message[0]='\0';
+	int cancel=0;
+	if (hd24utils::newdriveimage(&scratchfilename,1353963,message,&cancel)!=0)
+	{
+		cout << "Cannot create scratch drive image " << scratchfilename << endl;
+		return true;
+	}
+	hd24fs* fs=new hd24fs((const char*)NULL,hd24fs::MODE_RDWR,&scratchfilename,true);
+	fs->nohostcache();
+	fs->write_enable();
+	hd24project* project=fs->getproject(1);
+	hd24song* song=NULL;
+	if (project!=NULL)
+	{
+		song=project->createsong("Bench",tracks,samplerate);
+	}
+	if (song==NULL)
+	{
+		cout << "Cannot create a song on the scratch drive image" << endl;
+	} else {
+		__uint32 blockbytes=fs->getbytesperaudioblock();
+		unsigned char* source=(unsigned char*)memutils::mymalloc("kernelbench",blockbytes,1);
+		unsigned char* target=(unsigned char*)memutils::mymalloc("kernelbench",blockbytes,1);
+		if ((source!=NULL)&&(target!=NULL))
+		{
+			fillbuffer(source,blockbytes);
+			benchdata sd=*d;
+			sd.song=song;
+			sd.source=source;
+			sd.target=target;
+			sd.bytes=blockbytes;
+			sd.samples=blockbytes/3;
+			ok=checksongkernels(song,source,target,blockbytes)&&ok;
+			char name[80];
+			sprintf(name,"hd24song::deinterlaceblock %lu",(unsigned long)samplerate);
+			runbench(name,kernel_deinterlaceblock,&sd);
+			sprintf(name,"hd24song::interlaceblock %lu",(unsigned long)samplerate);
+			runbench(name,kernel_interlaceblock,&sd);
+		}
+		memutils::myfree("kernelbench",source);
+		memutils::myfree("kernelbench",target);
+		delete song;
+	}
+	if (project!=NULL)
+	{
+		delete project;
+	}
+	delete fs; // commits to the scratch image, which is thrown away
+	remove(scratchfilename.c_str());
+	return ok;
+}
+
+int main (int argc, char **argv)
+{
+	int invalid = parsecommandline(argc, argv);
+	if (invalid != 0) {
+		showusage();
+		return invalid;
+	}
+	if (scratchfilename == "") {
+		scratchfilename = defaultscratchname();
+	}
+
+	__uint32 maxbytes=BENCH_SAMPLES*4;
+	benchdata d;
+	d.source=(unsigned char*)memutils::mymalloc("kernelbench",maxbytes,1);
+	d.target=(unsigned char*)memutils::mymalloc("kernelbench",2*maxbytes,1);
+	d.filterdata=(double*)memutils::mymalloc("kernelbench",BENCH_SAMPLES,sizeof(double));
+	if ((d.source==NULL)||(d.target==NULL)||(d.filterdata==NULL))
+	{
+		cout << "Out of memory" << endl;
+		return 1;
+	}
+	fillbuffer(d.source,maxbytes);
+	for (__uint32 i=0;i<BENCH_SAMPLES;i++)
+	{
+		d.filterdata[i]=(double)((int)(i%200)-100)/100.0;
+	}
+	d.song=NULL;
+	d.samnum=0;
+	d.sndfile=new hd24sndfile(SF_FORMAT_AIFF|SF_FORMAT_PCM_24,NULL);
+	d.smpte=new SMPTEgenerator(48000);
+	d.channel=new MixerChannelControl();
+	d.channel->samplerate(48000);
+
+	d.samples=BENCH_SAMPLES;
+
+	d.bytes=BENCH_SAMPLES*3;
+	runbench("Convert::getint24",kernel_getint24,&d);
+	d.bytes=BENCH_SAMPLES*4;
+	runbench("Convert::getint32",kernel_getint32,&d);
+	runbench("hd24fs::fstfix",kernel_fstfix,&d);
+	d.bytes=BENCH_SAMPLES*3;
+	runbench("hd24utils::interlacetobuffer",kernel_interlacetobuffer,&d);
+	runbench("hd24sndfile::writerawbuf (AIFF)",kernel_aiffbyteswap,&d);
+	d.bytes=BENCH_SAMPLES*sizeof(double);
+	runbench("MixerChannelControl::FilterCell",kernel_filtercell,&d);
+	d.bytes=BENCH_SAMPLES;
+	runbench("SMPTEgenerator::getbit",kernel_smptegetbit,&d);
+	d.samnum=0;
+	runbench("SMPTEgenerator::getbits",kernel_smptegetbits,&d);
+
+	int result=0;
+	if (songkernels)
+	{
+		if (!benchsongkernels(&d,96000,12))
+		{
+			result=1;
+		}
+	}
+
+	delete d.sndfile;
+	delete d.smpte;
+	// d.channel is left to the OS: without the reverb module
+	// its delay buffer is never set up, so it cannot be deleted.
+	memutils::myfree("kernelbench",d.source);
+	memutils::myfree("kernelbench",d.target);
+	memutils::myfree("kernelbench",d.filterdata);
+	return result;
+}
@@ -0,0 +1,733 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <convertlib.h>
+#include <memutils.h>
+#include <hd24fs.h>
+#include <hd24utils.h>
+#include <hd24sndfile.h>
+#include <hd24transferengine.h>
+#include <sharedlibs.h>
+#include <xplat_dlfcn.h>
+#include <ui_mixer.h>
+
+/* End-to-end transfer benchmark.
+   Creates a drive image, fills it with songs of synthetic audio at
+   several sample rates and track counts, then times exports to the
+   PC in all channel layouts (and as mixdown), imports back to the
+   drive, commits and catalog generation. Results are written as JSON,
+   so numbers from different machines and builds can be compared.
+
+   Everything runs without a display. Stereo, multi channel, mixdown
+   and import need libsndfile; without it those runs are reported as
+   skipped.
+
+   With --iotrace the sector I/O of the whole run is traced; the
+   results then get an "io" section with totals and latency histograms
+   per caller, and the events are written as a Chrome trace.
+
+   The "blocks" section counts the audio block buffers handed out by
+   memutils::blockalloc and how many of them came from the pool. */
+
+using namespace std;
+
+#define MB 1000000.0
+#define TRACEEVENTS 262144
+
+typedef struct
+{
+	__uint32 rate;
+	__uint32 tracks;
+} benchsong;
+
+/* Songs to put on the image; high sample rates allow up to 12 tracks. */
+benchsong benchsongs[]=
+{
+	{ 44100, 24 },
+	{ 48000, 24 },
+	{ 48000,  8 },
+	{ 88200, 12 },
+	{ 96000, 12 },
+	{ 96000,  4 },
+	{     0,  0 }
+};
+
+/* Export formats as listed by the transfer engine. */
+#define FORMAT_WAVMONO		0
+#define FORMAT_WAVSTEREO	1
+#define FORMAT_WAVMULTI		2
+
+string workdir;
+string outputfilename;
+__uint32 songseconds=30;
+__uint32 imagesectors=4000000;
+bool smartimage=false;
+bool keepfiles=false;
+bool showstats=false;
+bool hugepages=false;
+string iotracefilename;
+vector<string> results;
+vector<string> ioresults;
+
+void showusage()
+{
+	cout << "Usage: transferbench [options]" << endl
+	     << "Options:" << endl
+	     << "  --dir=<dir>        work directory for the drive image and exported" << endl
+	     << "                     files (default: hd24bench in the temp dir)" << endl
+	     << "  --seconds=<n>      length of each song in seconds (default 30)" << endl
+	     << "  --sectors=<n>      size of the drive image in sectors (default 4000000)" << endl
+	     << "  --smart            run on a smart drive image instead of a plain one" << endl
+	     << "  --output=<file>    write the JSON results to a file instead of stdout" << endl
+	     << "  --keep             keep the drive image and exported files" << endl
+	     << "  --stats            add the time per transfer stage to each transfer" << endl
+	     << "  --iotrace=<file>   trace sector I/O and write it to a Chrome trace file" << endl
+	     << "  --hugepages        take audio block buffers from hugepage arenas" << endl;
+}
+
+int parsecommandline(int argc, char **argv)
+{
+	int invalid = 0;
+
+	for (int c = 1; c < argc; c++) {
+		string arg = argv[c];
+
+		if (arg.substr(0,strlen("--dir=")) == "--dir=") {
+			workdir = arg.substr(strlen("--dir="));
+			continue;
+		}
+
+		if (arg.substr(0,strlen("--seconds=")) == "--seconds=") {
+			songseconds = Convert::str2long(arg.substr(strlen("--seconds=")));
+			if (songseconds == 0) {
+				invalid = 1;
+			}
+			continue;
+		}
+
+		if (arg.substr(0,strlen("--sectors=")) == "--sectors=") {
+			imagesectors = Convert::str2long(arg.substr(strlen("--sectors=")));
+			continue;
+		}
+
+		if (arg.substr(0,strlen("--output=")) == "--output=") {
+			outputfilename = arg.substr(strlen("--output="));
+			continue;
+		}
+
+		if (arg == "--smart") {
+			smartimage = true;
+			continue;
+		}
+
+		if (arg == "--keep") {
+			keepfiles = true;
+			continue;
+		}
+
+		if (arg.substr(0,strlen("--iotrace=")) == "--iotrace=") {
+			iotracefilename = arg.substr(strlen("--iotrace="));
+			continue;
+		}
+
+		if (arg == "--stats") {
+			showstats = true;
+			continue;
+		}
+
+		if (arg == "--hugepages") {
+			hugepages = true;
+			continue;
+		}
+
+		cout << "Invalid argument: " << arg << endl;
+		invalid = 1;
+	}
+	return invalid;
+}
+
+double seconds()
+{
+	return hd24utils::monotonicseconds();
+}
+
+void progress(const char* message)
+{
+	// JSON may go to stdout, so progress goes to stderr.
+	cerr << message << endl;
+}
+
+void addresult(const char* stage,const char* format,__uint32 rate,__uint32 tracks,
+		__uint64 bytes,double elapsed,hd24transferstats* stats)
+{
+	char entry[512];
+	double mbpersec=0;
+	if (elapsed>0)
+	{
+		mbpersec=((double)bytes/MB)/elapsed;
+	}
+	sprintf(entry,"{ \"stage\": \"%s\", \"format\": \"%s\", \"rate\": %lu, \"tracks\": %lu, "
+		"\"bytes\": %llu, \"seconds\": %.6f, \"mb_per_sec\": %.3f",
+		stage,format,(unsigned long)rate,(unsigned long)tracks,
+		(unsigned long long)bytes,elapsed,mbpersec);
+	string result=entry;
+	if ((showstats)&&(stats!=NULL))
+	{
+		// where the time of this transfer went, per stage
+		result+=", \"stages\": {";
+		for (int i=0;i<TRANSFERSTAGES;i++)
+		{
+			sprintf(entry,"%s \"%s\": { \"bytes\": %llu, \"calls\": %llu, \"seconds\": %.6f }",
+				(i==0)?(""):(","),hd24transferstats::stagename(i),
+				(unsigned long long)stats->bytes[i],
+				(unsigned long long)stats->calls[i],stats->seconds[i]);
+			result+=entry;
+		}
+		sprintf(entry," }, \"engine_seconds\": %.6f",stats->totalseconds);
+		result+=entry;
+	}
+	result+=" }";
+	results.push_back(result);
+}
+
+void addskipped(const char* stage,const char* format,__uint32 rate,__uint32 tracks,
+		const char* reason)
+{
+	char entry[512];
+	sprintf(entry,"{ \"stage\": \"%s\", \"format\": \"%s\", \"rate\": %lu, \"tracks\": %lu, "
+		"\"skipped\": \"%s\" }",
+		stage,format,(unsigned long)rate,(unsigned long)tracks,reason);
+	results.push_back(entry);
+}
+
+void addioresults(hd24iotrace* trace)
+{
+	/* Totals and latency histograms per caller and layer. */
+	char entry[512];
+	for (int tag=0;tag<IOTRACE_TAGS;tag++)
+	{
+		for (int layer=0;layer<IOTRACE_LAYERS;layer++)
+		{
+			hd24iosummary sum;
+			trace->summary(tag,layer,&sum);
+			if (sum.requests==0)
+			{
+				continue;
+			}
+			double seqratio=(double)sum.sequential/(double)sum.requests;
+			double avgseek=(double)sum.seekdistance/(double)sum.requests;
+			sprintf(entry,"{ \"tag\": \"%s\", \"layer\": \"%s\", \"requests\": %lu, "
+				"\"sectors\": %llu, \"seconds\": %.6f, \"sequential\": %.3f, "
+				"\"avg_seek_sectors\": %.1f",
+				hd24iotrace::tagname(tag),
+				(layer==hd24iotrace::LAYER_IMAGE)?("image"):("drive"),
+				(unsigned long)sum.requests,(unsigned long long)sum.sectors,
+				sum.seconds,seqratio,avgseek);
+			string result=entry;
+			for (int op=0;op<IOTRACE_OPS;op++)
+			{
+				result+=(op==hd24iotrace::OP_READ)?
+					(", \"read_latency_us\": {"):(", \"write_latency_us\": {");
+				bool first=true;
+				for (int b=0;b<IOTRACE_BUCKETS;b++)
+				{
+					__uint32 count=trace->latencyhistogram(tag,layer,op,b);
+					if (count==0)
+					{
+						continue;
+					}
+					// keyed by bucket upper limit; the last one has none
+					if (b==IOTRACE_BUCKETS-1)
+					{
+						sprintf(entry,"%s \"more\": %lu",(first)?(""):(","),
+							(unsigned long)count);
+					} else {
+						sprintf(entry,"%s \"<%.0f\": %lu",(first)?(""):(","),
+							hd24iotrace::bucketlimit(b)*1000000.0,
+							(unsigned long)count);
+					}
+					result+=entry;
+					first=false;
+				}
+				result+=" }";
+			}
+			result+=" }";
+			ioresults.push_back(result);
+		}
+	}
+}
+
+void writejson(FILE* out,double createseconds)
+{
+	fprintf(out,"{\n");
+	fprintf(out,"  \"benchmark\": \"transferbench\",\n");
+	fprintf(out,"  \"image\": { \"type\": \"%s\", \"sectors\": %lu, \"create_seconds\": %.6f },\n",
+		(smartimage)?("smart"):("plain"),(unsigned long)imagesectors,createseconds);
+	fprintf(out,"  \"song_seconds\": %lu,\n",(unsigned long)songseconds);
+	memblockstats blocks;
+	memutils::blockstats(&blocks);
+	fprintf(out,"  \"blocks\": { \"hugepages\": %s, \"allocations\": %llu, \"reuses\": %llu, "
+		"\"releases\": %llu, \"peak_bytes\": %llu, \"pooled_bytes\": %llu, "
+		"\"arena_bytes\": %llu },\n",
+		(hugepages)?("true"):("false"),
+		(unsigned long long)blocks.allocations,(unsigned long long)blocks.reuses,
+		(unsigned long long)blocks.releases,(unsigned long long)blocks.peakbytes,
+		(unsigned long long)blocks.pooledbytes,(unsigned long long)blocks.arenabytes);
+	fprintf(out,"  \"results\": [\n");
+	for (__uint32 i=0;i<results.size();i++)
+	{
+		fprintf(out,"    %s%s\n",results[i].c_str(),(i+1<results.size())?(","):(""));
+	}
+	fprintf(out,"  ]%s\n",(ioresults.size()>0)?(","):(""));
+	if (ioresults.size()>0)
+	{
+		fprintf(out,"  \"io\": [\n");
+		for (__uint32 i=0;i<ioresults.size();i++)
+		{
+			fprintf(out,"    %s%s\n",ioresults[i].c_str(),(i+1<ioresults.size())?(","):(""));
+		}
+		fprintf(out,"  ]\n");
+	}
+	fprintf(out,"}\n");
+}
+
+__uint64 songbytes(hd24song* song)
+{
+	// audio bytes in the song, all tracks together
+	return (__uint64)song->songlength_in_wamples()*song->chanmult()
+		*(song->bitdepth()/8)*song->logical_channels();
+}
+
+void fillbuffer(unsigned char* buf,__uint32 bytes,__uint32 seed)
+{
+	for (__uint32 i=0;i<bytes;i++)
+	{
+		seed=seed*1103515245+12345;
+		buf[i]=(unsigned char)(seed>>16);
+	}
+}
+
+bool populatesong(hd24fs* fs,hd24song* song)
+{
+	/* Lengthens the song and writes synthetic audio to all its tracks. */
+	__uint32 rate=song->samplerate();
+	__uint32 tracks=song->logical_channels();
+	__uint32 chanmult=song->chanmult();
+	__uint32 wamples=(songseconds*rate)/chanmult;
+	char message[2048];
+	message[0]='\0';
+	int cancel=0;
+	double start=seconds();
+	if (song->songlength_in_wamples(wamples,false,message,&cancel)!=wamples)
+	{
+		return false;
+	}
+	song->save();
+	addresult("allocate","",rate,tracks,songbytes(song),seconds()-start,NULL);
+
+	__uint32 blockbytes=fs->getbytesperaudioblock();
+	__uint32 wamplesperblock=((blockbytes/tracks)/3)/chanmult;
+	unsigned char* audiodata=(unsigned char*)memutils::mymalloc("transferbench",blockbytes,1);
+	if (audiodata==NULL)
+	{
+		return false;
+	}
+	fillbuffer(audiodata,blockbytes,rate+tracks);
+	for (__uint32 tracknum=1;tracknum<=tracks;tracknum++)
+	{
+		song->trackarmed(tracknum,true);
+	}
+	start=seconds();
+	song->golocatepos(0);
+	song->startrecord(hd24song::WRITEMODE_COPY);
+	for (__uint32 wamplenum=0;wamplenum<wamples;wamplenum+=wamplesperblock)
+	{
+		__uint32 wamsinblock=wamplesperblock;
+		if (wamplenum+wamsinblock>wamples)
+		{
+			wamsinblock=wamples-wamplenum;
+		}
+		song->putmtrackaudiodata(wamplenum,wamsinblock,audiodata,hd24song::WRITEMODE_COPY);
+	}
+	song->stoprecord();
+	song->unarmalltracks();
+	addresult("populate","",rate,tracks,songbytes(song),seconds()-start,NULL);
+	memutils::myfree("transferbench",audiodata);
+	return true;
+}
+
+hd24transferengine* newengine(hd24song* song,SoundFileWrapper* soundfile)
+{
+	hd24transferengine* transeng=new hd24transferengine();
+	transeng->soundfile=soundfile;
+	transeng->projectdir(workdir.c_str());
+	string filenameformat="<sn>-Track<t#>";
+	transeng->filenameformat(&filenameformat);
+	transeng->sourcesong(song);
+	for (__uint32 tracknum=0;tracknum<song->logical_channels();tracknum++)
+	{
+		transeng->trackselected(tracknum,true);
+	}
+	transeng->startoffset(0);
+	transeng->endoffset(song->songlength_in_wamples());
+	return transeng;
+}
+
+void removeexports(hd24transferengine* transeng,hd24song* song)
+{
+	if (keepfiles)
+	{
+		return;
+	}
+	for (__uint32 tracknum=0;tracknum<song->logical_channels();tracknum++)
+	{
+		string* fname=transeng->generate_filename(tracknum,0,0);
+		if (fname!=NULL)
+		{
+			remove(fname->c_str());
+			delete fname;
+		}
+	}
+}
+
+void benchexport(hd24song* song,int format,const char* formatname,
+		SoundFileWrapper* soundfile)
+{
+	__uint32 rate=song->samplerate();
+	__uint32 tracks=song->logical_channels();
+	if ((format!=FORMAT_WAVMONO)&&(soundfile==NULL))
+	{
+		addskipped("transfer_to_pc",formatname,rate,tracks,"libsndfile not available");
+		return;
+	}
+	if ((format==FORMAT_WAVSTEREO)&&((tracks%2)!=0))
+	{
+		addskipped("transfer_to_pc",formatname,rate,tracks,"odd track count");
+		return;
+	}
+	hd24transferengine* transeng=newengine(song,soundfile);
+	transeng->selectedformat(format);
+	transeng->prepare_transfer_to_pc(1,1,songbytes(song),0,0,0);
+	double start=seconds();
+	__sint64 bytes=transeng->transfer_to_pc();
+	double elapsed=seconds()-start;
+	if (bytes==0)
+	{
+		addskipped("transfer_to_pc",formatname,rate,tracks,"transfer failed");
+	} else {
+		addresult("transfer_to_pc",formatname,rate,tracks,bytes,elapsed,
+			transeng->transferstats());
+	}
+	removeexports(transeng,song);
+	delete transeng;
+}
+
+void benchmixdown(hd24fs* fs,hd24song* song,SoundFileWrapper* soundfile,MixerUI* mixerui)
+{
+	__uint32 rate=song->samplerate();
+	__uint32 tracks=song->logical_channels();
+	if (soundfile==NULL)
+	{
+		addskipped("transfer_to_pc","mixdown",rate,tracks,"libsndfile not available");
+		return;
+	}
+	// the mixer handles at most 20480 frames per block
+	__uint32 framesperblock=(fs->getbytesperaudioblock()/tracks)/3;
+	if (framesperblock>20480)
+	{
+		addskipped("transfer_to_pc","mixdown",rate,tracks,"too few tracks for the mixer block size");
+		return;
+	}
+	hd24transferengine* transeng=newengine(song,soundfile);
+	transeng->mixer(mixerui->control);
+	transeng->mixleft(true);
+	transeng->mixright(true);
+	transeng->prepare_transfer_to_pc(1,1,songbytes(song),0,0,0);
+	double start=seconds();
+	__sint64 bytes=transeng->transfer_to_pc();
+	double elapsed=seconds()-start;
+	if (bytes==0)
+	{
+		addskipped("transfer_to_pc","mixdown",rate,tracks,"transfer failed");
+	} else {
+		addresult("transfer_to_pc","mixdown",rate,tracks,bytes,elapsed,
+			transeng->transferstats());
+	}
+	if (!keepfiles)
+	{
+		string* songname=song->songname();
+		string mixdownname=workdir+*songname+"_mixdown.wav";
+		delete songname;
+		remove(mixdownname.c_str());
+	}
+	delete transeng;
+}
+
+void benchimport(hd24fs* fs,hd24project* project,hd24song* song,SoundFileWrapper* soundfile)
+{
+	/* Exports the song as mono files, then imports those into
+	   a new song with the same layout. */
+	__uint32 rate=song->samplerate();
+	__uint32 tracks=song->logical_channels();
+	if (soundfile==NULL)
+	{
+		addskipped("transfer_to_hd24","mono",rate,tracks,"libsndfile not available");
+		return;
+	}
+	hd24transferengine* exporteng=newengine(song,soundfile);
+	exporteng->selectedformat(FORMAT_WAVMONO);
+	exporteng->prepare_transfer_to_pc(1,1,songbytes(song),0,0,0);
+	if (exporteng->transfer_to_pc()==0)
+	{
+		addskipped("transfer_to_hd24","mono",rate,tracks,"export failed");
+		delete exporteng;
+		return;
+	}
+
+	hd24song* target=project->createsong("Import",tracks,rate);
+	if (target==NULL)
+	{
+		addskipped("transfer_to_hd24","mono",rate,tracks,"cannot create song");
+		removeexports(exporteng,song);
+		delete exporteng;
+		return;
+	}
+	hd24transferengine* importeng=new hd24transferengine();
+	importeng->soundfile=soundfile;
+	importeng->targetsong(target);
+	for (__uint32 tracknum=1;tracknum<=tracks;tracknum++)
+	{
+		string* fname=exporteng->generate_filename(tracknum-1,0,0);
+		importeng->sourcefilename(tracknum,fname->c_str());
+		importeng->trackaction(tracknum,2); // mono
+		target->trackarmed(tracknum,true);
+		delete fname;
+	}
+	double start=seconds();
+	__sint64 bytes=importeng->transfer_to_hd24();
+	double elapsed=seconds()-start;
+	if (bytes==0)
+	{
+		addskipped("transfer_to_hd24","mono",rate,tracks,"transfer failed");
+	} else {
+		addresult("transfer_to_hd24","mono",rate,tracks,(__uint64)bytes*tracks,elapsed,
+			importeng->transferstats());
+	}
+	removeexports(exporteng,song);
+	delete importeng;
+	delete exporteng;
+	delete target;
+}
+
+void benchcommit(hd24fs* fs,const char* what)
+{
+	double start=seconds();
+	fs->commit();
+	addresult("commit",what,0,0,0,seconds()-start,NULL);
+}
+
+void benchcatalog(hd24fs* fs)
+{
+	string* catalog=new string("");
+	double start=seconds();
+	hd24utils::gencatalog(fs,catalog);
+	double elapsed=seconds()-start;
+	addresult("catalog","",0,0,catalog->length(),elapsed,NULL);
+	delete catalog;
+}
+
+string defaultworkdir()
+{
+#ifdef WINDOWS
+	const char* dir=getenv("TEMP");
+	char slash='\\';
+#else
+	const char* dir=getenv("TMPDIR");
+	char slash='/';
+	if (dir==NULL)
+	{
+		dir="/tmp";
+	}
+#endif
+	string name="";
+	if (dir!=NULL)
+	{
+		name=dir;
+		if ((name.length()>0)&&(name[name.length()-1]!=slash))
+		{
+			name+=slash;
+		}
+	}
+	name+="hd24bench";
+	return name;
+}
+
+SoundFileWrapper* loadsoundfile(char* absprogpath)
+{
+	/* The wrapper reports a missing library with a dialog, which
+	   cannot be shown here- so only use it when loading works. */
+	LIBHANDLE_T* handle=dlopen(LIBFILE_SNDFILE,RTLD_NOW);
+	if (handle==NULL)
+	{
+		return NULL;
+	}
+	dlclose(handle);
+	SoundFileWrapper* soundfile=new SoundFileWrapper(absprogpath);
+	if (!(soundfile->libloaded))
+	{
+		return NULL;
+	}
+	return soundfile;
+}
+
+int main (int argc, char **argv)
+{
+	int invalid = parsecommandline(argc, argv);
+	if (invalid != 0) {
+		showusage();
+		return invalid;
+	}
+	if (workdir == "") {
+		workdir = defaultworkdir();
+	}
+	if ((hugepages) && (!memutils::blockhugepages(true))) {
+		cout << "Hugepage arenas are not supported on this system" << endl;
+		return 1;
+	}
+	if (workdir.substr(workdir.length()-1,1) != "/") {
+		workdir += "/";
+	}
+	string imagefilename = workdir+"bench.h24";
+	if (!hd24utils::guaranteefiledirexists(&imagefilename)) {
+		cout << "Cannot create work directory " << workdir << endl;
+		return 1;
+	}
+
+	char absprogpath[2048];
+	hd24utils::getmyabsolutepath((const char**)argv,(char*)&absprogpath);
+	SoundFileWrapper* soundfile=loadsoundfile(absprogpath);
+
+	char message[2048];
+	message[0]='\0';
+	int cancel=0;
+	progress("Creating drive image...");
+	double start=seconds();
+	if (hd24utils::newdriveimage(&imagefilename,imagesectors-1,message,&cancel)!=0)
+	{
+		cout << "Cannot create drive image: " << message << endl;
+		return 1;
+	}
+	if (smartimage)
+	{
+		string plainfilename=imagefilename;
+		imagefilename=workdir+"bench.h24s";
+		int result=hd24utils::convertdriveimage(&plainfilename,&imagefilename,
+					4,false,false,message,&cancel);
+		remove(plainfilename.c_str());
+		if (result!=hd24utils::CONVERT_COMPLETE)
+		{
+			cout << "Cannot create smart drive image" << endl;
+			return 1;
+		}
+	}
+	double createseconds=seconds()-start;
+
+	hd24fs* fs=new hd24fs((const char*)NULL,hd24fs::MODE_RDWR,&imagefilename,true);
+	if (!(fs->isOpen()))
+	{
+		cout << "Cannot open drive image " << imagefilename << endl;
+		return 1;
+	}
+	fs->write_enable();
+	if (iotracefilename!="")
+	{
+		fs->startiotrace(TRACEEVENTS);
+	}
+	hd24project* project=fs->getproject(1);
+	if (project==NULL)
+	{
+		cout << "Drive image has no project" << endl;
+		return 1;
+	}
+
+	vector<hd24song*> songs;
+	for (__uint32 i=0;benchsongs[i].rate!=0;i++)
+	{
+		char songname[64];
+		sprintf(songname,"Bench %lu-%lu",(unsigned long)benchsongs[i].rate,
+			(unsigned long)benchsongs[i].tracks);
+		progress(songname);
+		hd24song* song=project->createsong(songname,benchsongs[i].tracks,benchsongs[i].rate);
+		if (song==NULL)
+		{
+			addskipped("populate","",benchsongs[i].rate,benchsongs[i].tracks,
+				"cannot create song");
+			continue;
+		}
+		if (!populatesong(fs,song))
+		{
+			addskipped("populate","",benchsongs[i].rate,benchsongs[i].tracks,
+				"not enough space on the drive image");
+			delete song;
+			continue;
+		}
+		songs.push_back(song);
+	}
+	benchcommit(fs,"after populate");
+	benchcatalog(fs);
+
+	// the mixer is never shown, but transfers need its channels.
+	MixerUI* mixerui=new MixerUI(0,0,605,456);
+	for (__uint32 i=0;i<songs.size();i++)
+	{
+		hd24song* song=songs[i];
+		string* songname=song->songname();
+		progress(songname->c_str());
+		delete songname;
+		benchexport(song,FORMAT_WAVMONO,"mono",soundfile);
+		benchexport(song,FORMAT_WAVSTEREO,"stereo",soundfile);
+		benchexport(song,FORMAT_WAVMULTI,"multi",soundfile);
+		benchmixdown(fs,song,soundfile,mixerui);
+		benchimport(fs,project,song,soundfile);
+	}
+	benchcommit(fs,"after import");
+
+	for (__uint32 i=0;i<songs.size();i++)
+	{
+		delete songs[i];
+	}
+	delete project;
+	if (fs->iotrace()!=NULL)
+	{
+		addioresults(fs->iotrace());
+		if (!(fs->iotrace()->writechrometrace(iotracefilename.c_str())))
+		{
+			cout << "Cannot write " << iotracefilename << endl;
+		}
+	}
+	delete fs;
+	if (!keepfiles)
+	{
+		remove(imagefilename.c_str());
+	}
+
+	FILE* out=stdout;
+	if (outputfilename!="")
+	{
+		out=fopen(outputfilename.c_str(),"w");
+		if (out==NULL)
+		{
+			cout << "Cannot write " << outputfilename << endl;
+			return 1;
+		}
+	}
+	writejson(out,createseconds);
+	if (out!=stdout)
+	{
+		fclose(out);
+	}
+	return 0;
+}
@@ -0,0 +1,256 @@
+/* Regression check for hd24wavefix.
+
+   hd24wavefix repairs audio in chunks on a pool of threads. Its output
+   should be the same as that of the original program, which pushed the
+   file through a buffer of two blocks of SAMPLES_IN_HALF_BUF samples,
+   whatever the chunk size or number of threads. This check repairs
+   synthetic damaged audio both ways and compares the results.
+
+   The chunk size is made small here, so that many chunk boundaries
+   are crossed. The reference is the original repair code with two
+   differences that are on purpose:
+   - Its filter weights start out as they are after the first block.
+     The original code divided by a weight that was still 0 there.
+   - The mask has no bits above bit 14. The original code scored
+     candidates from bit 15 with an overflowing distance.
+   Exits with a non-zero status when the outputs differ. */
+
+#include <math.h>
+#define CHUNKSAMPLES (8*256)
+#define main hd24wavefix_main
+#include "../hd24wavefix.cpp"
+#undef main
+
+#define CHECKMASK "0100100001000000"
+
+unsigned char refbuf[BYTES_IN_FULL_BUF];
+float refweight[FILTERBUFSIZE];
+int* refmaskperm;
+int refpermutations;
+
+void refmaskpermutations(int mask)
+{
+	int bitpos[16];
+	int maskones=0;
+	for (int i=0;i<16;i++)
+	{
+		if ((mask & (1<<i)) !=0)
+		{
+			bitpos[maskones]=i;
+			maskones++;
+		}
+	}
+	refpermutations=(1<<maskones);
+	refmaskperm=(int*)malloc(refpermutations*sizeof(int));
+	for (int permu=0; permu< refpermutations; permu++)
+	{
+		int maskval=0;
+		for (int bitnum=0;bitnum<maskones;bitnum++)
+		{
+			if ((permu & (1<<bitnum)) !=0) {
+				maskval+=(1<<bitpos[bitnum]);
+			}
+		}
+		refmaskperm[permu]=maskval;
+	}
+}
+
+int refgetsam(int samnum)
+{
+	int bufpos=(samnum*3)+BYTES_IN_HALF_BUF;
+	int samval=refbuf[bufpos+0]
+	          +(refbuf[bufpos+1]<<8)
+		  +(refbuf[bufpos+2]<<16);
+	return samval & 0xffffff;
+}
+
+void refsetsam(int samnum,int samval)
+{
+	int bufpos=(samnum*3)+BYTES_IN_HALF_BUF;
+	refbuf[bufpos+0]=(unsigned char)(samval);
+	refbuf[bufpos+1]=(unsigned char)(samval>>8);
+	refbuf[bufpos+2]=(unsigned char)(samval>>16);
+}
+
+int refnearest(int pass,int refsam,int damagedsam)
+{
+	int distance=MAXDIST;
+	int winningsam=damagedsam;
+	for (int perm=0;perm<refpermutations;perm++)
+	{
+		int testsam=damagedsam^((pass==2)?(refmaskperm[perm]<<8):refmaskperm[perm]);
+		if (testsam>0x7fffff) testsam-=0x1000000;
+		int srefsam=refsam;
+		int sdamsam=testsam;
+		if (srefsam>0x7fffff) srefsam-=0x1000000;
+		if (sdamsam>0x7fffff) sdamsam-=0x1000000;
+		__uint32 diff=(srefsam>sdamsam)?srefsam-sdamsam:sdamsam-srefsam;
+		if ((long long)diff<(long long)distance)
+		{
+			winningsam=testsam;
+			distance=diff;
+		}
+	}
+	return winningsam;
+}
+
+void referencerepair(unsigned char* data,__uint32 bytes)
+{
+	/* The repair of the original hd24wavefix (simplecopyaudio with
+	   three passes), on a buffer instead of a file. */
+	memset(refbuf,0,sizeof(refbuf));
+	refweight[0]=1;
+	for (int j=1;j<FILTERBUFSIZE;j++) {
+		refweight[j]=refweight[j-1]*WEIGHTMULT;
+	}
+	__uint32 refsams[FILTERBUFSIZE];
+	for (__uint32 offset=0;offset<bytes;offset+=BYTES_IN_HALF_BUF) {
+		memcpy(&refbuf[0],&refbuf[BYTES_IN_HALF_BUF],BYTES_IN_HALF_BUF);
+		memset(&refbuf[BYTES_IN_HALF_BUF],0,BYTES_IN_HALF_BUF);
+		__uint32 readcount=bytes-offset;
+		if (readcount>BYTES_IN_HALF_BUF) readcount=BYTES_IN_HALF_BUF;
+		memcpy(&refbuf[BYTES_IN_HALF_BUF],&data[offset],readcount);
+
+		/* ------------- step 1 ----------------*/
+		for (int i=0; i<SAMPLES_IN_HALF_BUF-1;i+=2) {
+			refsams[0]=refgetsam(i); refweight[0]=1;
+			int newstart=1;
+			if ((i+2)<SAMPLES_IN_HALF_BUF)
+			{
+				refsams[1]=refgetsam(i+2);
+				refweight[1]=1.2;
+				newstart=2;
+			}
+			if ((i+4)<SAMPLES_IN_HALF_BUF)
+			{
+				refsams[2]=refgetsam(i+4);
+				refweight[1]=1.5;
+				newstart=3;
+			}
+			for (int j=newstart;j<FILTERBUFSIZE;j++) {
+				refsams[j]=refgetsam(i-j);
+				refweight[j]=refweight[j-1]*WEIGHTMULT;
+			}
+			int damagedsam=refgetsam(i+1);
+			int distance=MAXDIST;
+			int winningsam=damagedsam;
+			for (int perm=0;perm<refpermutations;perm++)
+			{
+				int testsam=damagedsam^(refmaskperm[perm]<<16);
+				if (testsam>0x7fffff) testsam-=0x1000000;
+				long long diff=0;
+				for (int j=0;j<FILTERBUFSIZE;j++) {
+					int srefsam=refsams[j];
+					if (srefsam>0x7fffff) srefsam-=0x1000000;
+					int dist=(srefsam>testsam)?srefsam-testsam:testsam-srefsam;
+					diff+=(int)(dist/refweight[j]);
+				}
+				if ((long long)diff<(long long)distance)
+				{
+					winningsam=testsam;
+					distance=diff;
+				}
+			}
+			refsetsam(i+1,winningsam);
+		}
+		/* ------------- step 2 ----------------*/
+		for (int i=0; i<SAMPLES_IN_HALF_BUF-1;i+=2) {
+			refsetsam(i,refnearest(2,refgetsam(i+1),refgetsam(i)));
+		}
+		/* ------------- step 3 ----------------*/
+		for (int i=0; i<SAMPLES_IN_HALF_BUF-1;i+=2) {
+			refsetsam(i+1,refnearest(3,refgetsam(i),refgetsam(i+1)));
+		}
+		memcpy(&data[offset],&refbuf[BYTES_IN_HALF_BUF],readcount);
+	}
+}
+
+void makedamagedaudio(unsigned char* data,__uint32 samples,int mask)
+{
+	/* A tone with some noise; about half of the odd samples have
+	   some of the mask bits flipped in one of their bytes. */
+	__uint32 seed=1;
+	for (__uint32 i=0;i<samples;i++)
+	{
+		seed=seed*1103515245+12345;
+		int samval=(int)(3000000*sin(i*0.01))+(int)((seed>>16)%8000001)-4000000;
+		seed=seed*1103515245+12345;
+		if (((i%2)==1)&&(((seed>>16)%2)==0))
+		{
+			int flip=(seed>>8)&mask;
+			samval^=flip<<(8*((seed>>20)%3));
+		}
+		data[3*i+0]=(unsigned char)(samval);
+		data[3*i+1]=(unsigned char)(samval>>8);
+		data[3*i+2]=(unsigned char)(samval>>16);
+	}
+}
+
+bool checkwavefix(__uint32 samples,int threadcount)
+{
+	int mask=0;
+	for (int i=0;i<16;i++)
+	{
+		if (CHECKMASK[i]=='1') mask+=1<<(15-i);
+	}
+	__uint32 bytes=samples*BYTES_PER_SAM;
+	unsigned char* data=(unsigned char*)malloc(bytes);
+	unsigned char* expected=(unsigned char*)malloc(bytes);
+	unsigned char* result=(unsigned char*)malloc(bytes);
+	makedamagedaudio(data,samples,mask);
+	memcpy(expected,data,bytes);
+	refmaskpermutations(mask);
+	referencerepair(expected,bytes);
+	free(refmaskperm);
+
+	FILE* in=tmpfile();
+	FILE* out=tmpfile();
+	unsigned char header[HEADERSIZE];
+	memset(header,0,HEADERSIZE);
+	fwrite(header,1,HEADERSIZE,in);
+	fwrite(data,1,bytes,in);
+	fflush(in);
+	maskbin=CHECKMASK;
+	threads=threadcount;
+	passes=3;
+	initspreadbits();
+	findmask(in);
+	fixaudio(in,out,NULL);
+	freemask(&filemask);
+	fflush(out);
+	wavefixseek(out,0);
+	size_t readcount=fread(result,1,bytes,out);
+	fclose(in);
+	fclose(out);
+
+	__uint32 differences=0;
+	__uint32 firstdiff=0;
+	for (__uint32 i=0;i<samples;i++)
+	{
+		if ((i>=readcount/BYTES_PER_SAM)||(memcmp(&result[3*i],&expected[3*i],3)!=0))
+		{
+			if (differences==0) firstdiff=i;
+			differences++;
+		}
+	}
+	cout << endl << samples << " samples, " << threadcount << " threads: ";
+	if (differences==0)
+	{
+		cout << "same as the original" << endl;
+	} else {
+		cout << differences << " samples differ from the original, the first is " << firstdiff << endl;
+	}
+	free(data);
+	free(expected);
+	free(result);
+	return (differences==0);
+}
+
+int main (int argc, char **argv)
+{
+	bool ok=true;
+	ok=checkwavefix(100001,1)&&ok;
+	ok=checkwavefix(1000001,4)&&ok;
+	ok=checkwavefix(98304,3)&&ok;
+	return (ok)?0:1;
+}